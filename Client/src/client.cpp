@@ -1,9 +1,8 @@
 #include <format>
 #include "client.h"
-#include <lz4.h>
 #include <filesystem>
+#include <climits>
 
-#define RECVBUFLENGTH 1000000
 /**
  * @brief Runs the client program.
  *
@@ -15,8 +14,6 @@
  * the connection or an error occurs.
  */
 void Client::run() {
-    bool isCopyFrom = false;
-
 start:
     while (true) {
         // Clears the strings
@@ -33,11 +30,30 @@ start:
         }
 
         // Checks if the typed command is copy_from, due to it needing different procedure
-        if(strncmp(command.c_str(), "copy_from ", 10) == 0)
-            isCopyFrom = true;
+        bool isCopyFrom = strncmp(command.c_str(), "copy_from ", 10) == 0;
+
+        // `-r` moves a directory as an archive, which servers that don't know the codec handshake can't take part in
+        bool tree = command.starts_with("copy_to -r ") || command.starts_with("copy_from -r ");
+        if(tree && !resumable) {
+            std::cout << "The server can't send or receive directories" << std::endl;
+            log << "The server can't send or receive directories" << std::endl;
+            continue;
+        }
+
+        // `-c` resumes the transfer from its checkpoint, the command is sent with the checkpoint in place of it,
+        // `-d` sends the file as a delta against the copy on the other side
+        std::string request = resumeRequest(command);
+        if(request == command)
+            request = deltaRequest(ConnectSocket, command);
+        // `-p` only names the file, its byte ranges are moved over the data connections
+        if(request == command)
+            request = parallelRequest(command);
+        bool resume = request.compare(0, 13, "copy_from -c ") == 0;
+        bool delta = request.compare(0, 13, "copy_from -d ") == 0;
+        bool parallel = request.compare(0, 11, "copy_to -p ") == 0 || request.compare(0, 13, "copy_from -p ") == 0;
 
         // send command to server
-        int iSendResult = sendData(ConnectSocket, command);
+        int iSendResult = sendData(ConnectSocket, request);
         if(iSendResult == -1) {
             std::string errorMessage = "Failed to send data, error: " + std::to_string(WSAGetLastError());
             log << errorMessage << std::endl;
@@ -45,55 +61,32 @@ start:
             goto start;
         }
 
-        if(isCopyFrom) {
+        if(isCopyFrom && !parallel) {
             shiftStrLeft(command, 10);
 
-            std::ifstream input(command);
-            if(!input) {
-                std::string errorMessage = "Failed to open file";
-                std::cerr << errorMessage << std::endl;
-                log << errorMessage << std::endl;
-                goto start;
+            // The server names its checkpoint first, the file is sent from there if the window in front of it matches
+            uint64_t start = 0;
+            if(resume) {
+                unsigned long long offset = 0;
+                unsigned checksum = 0;
+                uint32_t own;
+                std::string reply = recvData(ConnectSocket, None);
+                if(sscanf(reply.c_str(), "resume %llu %x", &offset, &checksum) == 2 && offset > 0
+                   && TransferCheckpoint::windowChecksum(command, offset, own) && own == checksum)
+                    start = offset;
             }
 
-            // Sends the file send sequence
-            std::string file_contents;
-            char c;
-            while(input.get(c))
-                file_contents += c;
-
-            input.close();
-
-            // Checks if the file is bigger than 1MB, if yes it's getting compressed before getting sent
-            std::filesystem::path file{command};
-            size_t originalSize = file_contents.size();
-
-            if(std::filesystem::file_size(file) > 1000000) {
-                int maxCompressedSize = LZ4_compressBound(static_cast<int>(originalSize));
-                char *compressed = new char[maxCompressedSize];
-                int compressedSize = LZ4_compress_default(file_contents.c_str(), compressed, static_cast<int>(file_contents.size()), maxCompressedSize);
-
-                if(compressedSize < 0) {
-                    free(compressed);
-                    std::cerr << "Error in compressing file" << std::endl;
-                    log << "Error in compressing file" << std::endl;
-                    goto start;
-                }
-
-                file_contents.clear();
-                file_contents += "\r";
-                file_contents += std::string(reinterpret_cast<char*>(&originalSize), sizeof(originalSize)); // Add original size
-                file_contents += std::string(reinterpret_cast<char*>(&compressedSize), sizeof(compressedSize)); // Add compressed size
-                file_contents.append(compressed, compressed + compressedSize); // Add compressed data
-
-                free(compressed);
+            // The server answers with the signature of its copy, a signature that can't be read gets the whole file
+            std::shared_ptr<DeltaSignature> signature;
+            if(delta) {
+                signature = std::make_shared<DeltaSignature>();
+                if(recvSignature(ConnectSocket, *signature) == -1)
+                    signature.reset();
             }
 
-            file_contents.insert(0, "\v\v");
-            file_contents += '\f';
-
-            iSendResult = send(ConnectSocket, file_contents.c_str(), (int) file_contents.length(), 0);
-            if(iSendResult == SOCKET_ERROR) {
+            int sent = tree ? sendTree(ConnectSocket, command.substr(3))
+                            : sendFile(ConnectSocket, command, resumable ? TransferCheckpoint::idOf(command) : 0, start, signature);
+            if(sent == -1) {
                 std::string errormsg = std::format("Failed to send file contents, error: {}", std::to_string(WSAGetLastError()));
                 std::cerr << errormsg << std::endl;
                 log << errormsg << std::endl;
@@ -102,7 +95,7 @@ start:
         }
 
         // read response from server
-        std::string response = recvData(ConnectSocket, command);
+        std::string response = parallel ? parallelTransfer(command) : recvData(ConnectSocket, command);
         if (response.empty()) {
             std::string errorMessage = "Failed to receive data, error: " + std::to_string(WSAGetLastError());
             log << errorMessage << std::endl;
@@ -120,6 +113,18 @@ start:
             std::cout << response << std::endl;
             log << response << std::endl;
         }
+
+        if(command == "stats") {
+            std::string uploads = "Uploads:\n" + link.describe();
+            std::cout << uploads << std::endl;
+            log << uploads << std::endl;
+        }
+
+        if(!transferSummary.empty()) {
+            std::cout << "Transferred " << transferSummary << std::endl;
+            log << "Transferred " << transferSummary << std::endl;
+            transferSummary.clear();
+        }
     }
 
     // shut down the connection
@@ -130,6 +135,129 @@ start:
     }
 }
 
+/**
+ * @brief Turns a `copy_to -c` / `copy_from -c` command into the request that resumes the transfer.
+ *
+ * @details
+ * `copy_to -c NAME` names the checkpoint of the temporary file of NAME together with the checksum of the window in
+ * front of it (transfer_checkpoint.h), `copy_from -c NAME` the ID of the transfer of NAME, whose checkpoint the
+ * server answers with. Without a checkpoint, or with a server that doesn't know the codec handshake and so can't
+ * resume, the plain command is sent. The `-c` is removed from the command in any case.
+ *
+ * @param command The command that has been typed.
+ * @return The command to send to the server.
+ */
+std::string Client::resumeRequest(std::string& command) {
+    const bool copyTo = command.starts_with("copy_to -c ");
+    if(!copyTo && !command.starts_with("copy_from -c "))
+        return command;
+
+    const std::string name = command.substr(copyTo ? 11 : 13);
+    command = (copyTo ? "copy_to " : "copy_from ") + name;
+    if(!resumable) {
+        std::cout << "The server can't resume transfers, the file is sent from the start" << std::endl;
+        log << "The server can't resume transfers, the file is sent from the start" << std::endl;
+        return command;
+    }
+
+    if(!copyTo) {
+        const uint64_t id = TransferCheckpoint::idOf(name);
+        return id == 0 ? command : std::format("copy_from -c {:x} {}", id, name);
+    }
+
+    TransferCheckpoint checkpoint;
+    uint32_t checksum;
+    const std::filesystem::path part = name + ".part";
+    if(!checkpoint.load(part) || !TransferCheckpoint::windowChecksum(part, checkpoint.offset, checksum))
+        return command;
+    return std::format("copy_to -c {:x} {} {:x} {}", checkpoint.id, checkpoint.offset, checksum, name);
+}
+
+/**
+ * @brief Turns a `copy_to -d` / `copy_from -d` command into the request that sends the file as a delta.
+ *
+ * @details
+ * For `copy_to -d NAME` the signature of the local copy of NAME (delta_transfer.h) is sent in Signature frames in
+ * front of the request; without a local copy there is nothing to refer to and the plain command is sent.
+ * `copy_from -d NAME` is sent as it is, the server answers it with the signature of its copy. A server that doesn't
+ * know the codec handshake can't take part, it gets the plain command. The `-d` is removed from the command in any
+ * case.
+ *
+ * @param clientSocket The socket connected to the server.
+ * @param command The command that has been typed.
+ * @return The command to send to the server.
+ */
+std::string Client::deltaRequest(SOCKET clientSocket, std::string& command) {
+    const bool copyTo = command.starts_with("copy_to -d ");
+    if(!copyTo && !command.starts_with("copy_from -d "))
+        return command;
+
+    const std::string name = command.substr(copyTo ? 11 : 13);
+    command = (copyTo ? "copy_to " : "copy_from ") + name;
+    if(!resumable) {
+        std::cout << "The server can't send deltas, the whole file is sent" << std::endl;
+        log << "The server can't send deltas, the whole file is sent" << std::endl;
+        return command;
+    }
+
+    if(!copyTo)
+        return "copy_from -d " + name;
+
+    DeltaSignature signature;
+    if(!signature.compute(name) || signature.blocks.empty() || sendSignature(clientSocket, signature) == -1)
+        return command;
+    log << "Sent the signature of " << name << ", " << signature.blocks.size() << " blocks of " << signature.blockSize << " bytes" << std::endl;
+    return "copy_to -d " + name;
+}
+
+/**
+ * @brief Sends the signature of a file in Signature frames.
+ *
+ * @param clientSocket The socket connected to the server.
+ * @param signature The signature to send.
+ * @return 0 if the signature has been sent, -1 on a send error.
+ */
+int Client::sendSignature(SOCKET clientSocket, const DeltaSignature& signature) {
+    const std::string encoded = signature.encode();
+    for(size_t offset = 0; offset < encoded.size(); offset += DeltaSignature::FRAME_BYTES) {
+        const size_t length = std::min(DeltaSignature::FRAME_BYTES, encoded.size() - offset);
+        const uint16_t flags = offset + length < encoded.size() ? FRAME_MORE : 0;
+        if(sendFrame(clientSocket, FrameType::Signature, flags, encoded.substr(offset, length)) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receives the signature the server sends in reply to `copy_from -d`.
+ *
+ * @details
+ * The Signature frames are received up to the one without FRAME_MORE, even if the signature turns out to be too
+ * large, so the next reply isn't taken for a part of it.
+ *
+ * @param clientSocket The socket connected to the server.
+ * @param signature Receives the signature.
+ * @return 0 if the signature has been received, -1 if it couldn't be received or decoded.
+ */
+int Client::recvSignature(SOCKET clientSocket, DeltaSignature& signature) {
+    std::string encoded;
+    bool fits = true;
+    FrameHeader header;
+    do {
+        if(reader.read(clientSocket, header, payload) <= 0 || header.type != FrameType::Signature)
+            return -1;
+        fits = fits && encoded.size() + payload.size() <= DeltaSignature::MAX_ENCODED;
+        if(fits)
+            encoded += payload;
+    } while(header.flags & FRAME_MORE);
+
+    if(!fits || !signature.decode(encoded)) {
+        log << "Received an invalid signature" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * @brief Initialize the Winsock library.
  *
@@ -177,13 +305,19 @@ void Client::initServerConnection(const char *server_name) {
         throw std::runtime_error("unable to connect to server");
     }
 
-    // Authentication
-    std::string iSendString = std::format("auth: {} {}", username, password);
+    // Authentication, the server answers with the codecs both sides support
+    std::string iSendString = std::format("auth: {} {} codecs={}", username, password, CodecRegistry::format(CodecRegistry::all()));
     sendData(ConnectSocket, iSendString);
 
     std::string valid = recvData(ConnectSocket, None);
-    if(valid != "valid")
+    if(valid != "valid" && !valid.starts_with("valid codecs="))
         throw std::runtime_error("Credentials are invalid");
+
+    CodecSet agreed = valid == "valid" ? CodecRegistry::legacy() : CodecRegistry::parse(std::string_view(valid).substr(13));
+    codecs = CodecChoice::from(agreed);
+    resumable = valid != "valid";
+    link.setCodecs(codecs);
+    log << "Codecs: " << CodecRegistry::format(agreed) << std::endl;
 }
 
 /**
@@ -200,21 +334,24 @@ void Client::initServerConnection(const char *server_name) {
  */
 SOCKET Client::createAndConnectSocket() {
     for (ptr = result; ptr != NULL; ptr = ptr->ai_next) {
-        ConnectSocket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-        if (ConnectSocket == INVALID_SOCKET) {
+        SOCKET sock = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+        if (sock == INVALID_SOCKET) {
             printf("socket failed with error: %d\n", WSAGetLastError());
             WSACleanup();
             exit(1);
         }
 
         // Connect to server.
-        iResult = connect(ConnectSocket, ptr->ai_addr, (int) ptr->ai_addrlen);
+        iResult = connect(sock, ptr->ai_addr, (int) ptr->ai_addrlen);
         if (iResult == SOCKET_ERROR) {
-            closesocket(ConnectSocket);
-            ConnectSocket = INVALID_SOCKET;
+            closesocket(sock);
             continue;
         }
-        return ConnectSocket; // return the socket if connection is successful
+
+        // Every frame is written with a single send, Nagle would only hold back its tail
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+        return sock; // return the socket if connection is successful
     }
     return INVALID_SOCKET;  // return invalid socket if no connection was successful
 }
@@ -251,7 +388,7 @@ int Client::shiftStrLeft(std::string &str, int num) {
  * @brief Sends data to the server.
  *
  * @details
- * This function sends the specified command to the server using the given client socket.
+ * This function sends the specified command to the server in a Command frame using the given client socket.
  *
  * @param clientSocket The socket to send the data through.
  * @param cmd The command to send.
@@ -260,10 +397,9 @@ int Client::shiftStrLeft(std::string &str, int num) {
 int Client::sendData(SOCKET clientSocket, std::string cmd)
 {
     log << cmd << std::endl;
-    cmd += '\f';
 
-    int iSendResult = send(clientSocket, cmd.c_str(), (int) cmd.length(), 0);
-    if(iSendResult == SOCKET_ERROR)
+    int iSendResult = sendFrame(clientSocket, FrameType::Command, 0, cmd);
+    if(iSendResult == -1)
     {
         std::cout << "Error in sending command to server. Error: " << WSAGetLastError() << std::endl;
         log << "Error in sending command to server. Error: " << WSAGetLastError() << std::endl;
@@ -274,114 +410,623 @@ int Client::sendData(SOCKET clientSocket, std::string cmd)
 }
 
 /**
-  * @brief Receives data from a client socket and stores it in a file.
+ * @brief Sends a frame to the server.
+ *
+ * @param clientSocket The socket to send the frame through.
+ * @param type The type of the frame.
+ * @param flags The flags of the frame.
+ * @param payload The payload of the frame.
+ * @return 0 if the frame is successfully sent, -1 otherwise.
+ */
+int Client::sendFrame(SOCKET clientSocket, FrameType type, uint16_t flags, const std::string& payload) {
+    if(payload.size() > FRAME_MAX_LENGTH)
+        return -1;
+
+    FrameHeader header{type, flags, static_cast<uint32_t>(payload.size())};
+
+    // Small frames go out in one send, so the payload isn't held back behind the header
+    if(payload.size() <= SMALL_FRAME) {
+        std::string frame = header.encode() + payload;
+        return sendAll(clientSocket, frame.data(), frame.size());
+    }
+
+    std::string rawHeader = header.encode();
+    if(sendAll(clientSocket, rawHeader.data(), rawHeader.size()) == -1)
+        return -1;
+
+    return sendAll(clientSocket, payload.data(), payload.size());
+}
+
+/**
+ * @brief Uploads a file for copy_from.
+ *
+ * @details
+ * The file is announced with a FRAME_SIZE frame and sent in chunks of FILE_CHUNK bytes, every chunk in a File
+ * frame of its own, so the file is never held in memory as a whole; the chunks are read, compressed and sent in a
+ * transfer pipeline (streamUpload). Whether and how hard the file is compressed is decided from
+ * samples of its contents (compression_policy.h); chunks that look compressed already or don't shrink are sent as
+ * they are. A file that can't be read is terminated with FRAME_ABORTED, the server
+ * answers it with an error.
+ *
+ * With the signature of the server's copy the chunks hold delta instructions instead (FRAME_DELTA, see
+ * delta_transfer.h), the blocks the copy has already are referred to rather than sent.
+ *
+ * @param clientSocket The socket to send the file through.
+ * @param path The file to upload.
+ * @param id The ID of the transfer, announced with the size so the server can resume it, 0 for none.
+ * @param start The file is sent from here on, the server has everything in front of it.
+ * @param signature The signature of the server's copy of the file for a delta, nullptr to send the contents.
+ * @return 0 if the file has been sent or aborted, -1 on a send error.
+ */
+int Client::sendFile(SOCKET clientSocket, const std::string& path, uint64_t id, uint64_t start,
+                     std::shared_ptr<const DeltaSignature> signature) {
+    auto upload = std::make_shared<Upload>();
+    upload->stats.codecs = codecs;
+
+    upload->input.open(path, std::ios::in | std::ios::binary);
+    std::error_code ec;
+    upload->remaining = upload->input ? std::filesystem::file_size(path, ec) : 0;
+    if(!upload->input || ec) {
+        std::string errorMessage = "Failed to open file";
+        std::cerr << errorMessage << std::endl;
+        log << errorMessage << std::endl;
+        return sendFrame(clientSocket, FrameType::File, FRAME_ABORTED, "");
+    }
+
+    // Files that are compressed already aren't compressed again, the others as hard as the link makes worthwhile
+    double ratio = 1.0;
+    CompressionLevel content = CompressionPolicy::forFile(upload->input, upload->remaining, &ratio);
+    const uint64_t size = upload->remaining;
+    if(start > 0) {
+        upload->input.seekg(static_cast<std::streamoff>(start));
+        upload->remaining -= start;
+    }
+    LinkEstimate::Decision decision = link.choose(content, ratio, upload->remaining, codecThreads.size());
+    upload->level = decision.level;
+    if(signature && !signature->blocks.empty() && start == 0)
+        upload->delta = std::make_unique<DeltaEncoder>(std::move(signature), upload->input);
+
+    std::string line = std::format("copy_from {}: {} ({})", std::filesystem::path(path).filename().string(), link.name(decision.level), decision.reason);
+    log << line << std::endl;
+    link.record(std::move(line));
+
+    // With an ID the server can resume the upload, it learns where the file is sent from as well
+    std::string announce((id != 0 ? 3 : 1) * sizeof(uint64_t), '\0');
+    encodeSize(announce.data(), size);
+    if(id != 0) {
+        encodeSize(announce.data() + sizeof(uint64_t), id);
+        encodeSize(announce.data() + 2 * sizeof(uint64_t), start);
+    }
+    if(sendFrame(clientSocket, FrameType::File, FRAME_SIZE | FRAME_MORE, announce) == -1)
+        return -1;
+
+    return streamUpload(clientSocket, upload);
+}
+
+/**
+ * @brief Uploads a directory for `copy_from -r`.
+ *
+ * @details
+ * The tree is walked by a few threads at once and sent as an archive (tree_archive.h): the blocks of the archive take
+ * the place of the chunks of a file, so small files share a block and are compressed together. The size of the tree
+ * isn't known up front, so there is no FRAME_SIZE frame. A path that isn't a directory is terminated with
+ * FRAME_ABORTED, the server answers it with an error.
+ *
+ * @param clientSocket The socket to send the tree through.
+ * @param path The directory to upload.
+ * @return 0 if the tree has been sent or aborted, -1 on a send error.
+ */
+int Client::sendTree(SOCKET clientSocket, const std::string& path) {
+    std::error_code ec;
+    if(!std::filesystem::is_directory(path, ec)) {
+        std::string errorMessage = "Not a directory";
+        std::cerr << errorMessage << std::endl;
+        log << errorMessage << std::endl;
+        return sendFrame(clientSocket, FrameType::File, FRAME_ABORTED, "");
+    }
+
+    auto upload = std::make_shared<Upload>();
+    upload->stats.codecs = codecs;
+    upload->name = path;
+    upload->archive = std::make_unique<ArchiveWriter>(path);
+    const int res = streamUpload(clientSocket, upload);
+    if(upload->archive->skipped() > 0)
+        log << "copy_from -r " << path << ": skipped " << upload->archive->skipped() << " entries" << std::endl;
+    return res;
+}
+
+/**
+ * @brief Sends the chunks of an upload that has been set up by sendFile or sendTree.
+ *
+ * @details
+ * The chunks go through a transfer pipeline (transfer_pipeline.h): the disk thread reads the next chunks and the
+ * codec threads compress several of them at once while the socket thread sends the current one. Every frame is built
+ * in one buffer with room for the header in front, so it goes out with a single send. The statistics of the upload
+ * are kept for run to show.
+ *
+ * @param clientSocket The socket to send the chunks through.
+ * @param upload The upload, its source and the level chosen for it.
+ * @return 0 if everything has been sent or aborted, -1 on a send error.
+ */
+int Client::streamUpload(SOCKET clientSocket, std::shared_ptr<Upload> upload) {
+    auto pipeline = std::make_shared<TransferPipeline>(TransferPipeline::depthFor(codecThreads.size()));
+    pipeline->setStage(TransferPipeline::SOURCE, diskThread.executor(), [this, upload](TransferPipeline& pipeline) {
+        while(!upload->finished) {
+            TransferPipeline::Chunk* chunk = pipeline.acquire();
+            if(chunk == nullptr)
+                return;
+
+            // The instructions for the next part of the file, or the next block of the archive of a tree, take the
+            // place of its contents
+            if(upload->delta || upload->archive) {
+                chunk->raw.resize(FRAME_HEADER_SIZE);
+                const int more = upload->delta ? upload->delta->next(chunk->raw, FRAME_HEADER_SIZE + FILE_CHUNK)
+                                               : upload->archive->next(chunk->raw, FRAME_HEADER_SIZE + FILE_CHUNK);
+                chunk->length = chunk->raw.size() - FRAME_HEADER_SIZE;
+                chunk->flags = (upload->delta ? FRAME_DELTA : 0) | (more == 1 ? FRAME_MORE : 0);
+                if(more == -1) {
+                    std::cerr << "Failed to read file" << std::endl;
+                    log << "Failed to read file" << std::endl;
+                    chunk->failed = true;
+                }
+
+                // A tree mixes all kinds of files, the blocks that don't compress are found one by one (forBlock).
+                // The first block tells how well the others are expected to.
+                if(upload->archive && !upload->judged) {
+                    upload->judged = true;
+                    double ratio = 1.0;
+                    CompressionPolicy::forSamples(chunk->raw.data() + FRAME_HEADER_SIZE, chunk->length, &ratio);
+                    LinkEstimate::Decision decision = link.choose(CompressionLevel::Fast, ratio, chunk->length, codecThreads.size());
+                    upload->level = decision.level;
+
+                    std::string line = std::format("copy_from -r {}: {} ({})", upload->name, link.name(decision.level), decision.reason);
+                    log << line << std::endl;
+                    link.record(std::move(line));
+                }
+
+                upload->finished = more != 1;
+                chunk->last = upload->finished;
+                pipeline.submit(chunk);
+                continue;
+            }
+
+            const size_t len = static_cast<size_t>(std::min<uint64_t>(upload->remaining, FILE_CHUNK));
+            upload->remaining -= len;
+            chunk->length = len;
+            chunk->flags = upload->remaining > 0 ? FRAME_MORE : 0;
+
+            chunk->raw.resize(FRAME_HEADER_SIZE + len);
+            upload->input.read(chunk->raw.data() + FRAME_HEADER_SIZE, static_cast<std::streamsize>(len));
+            if(static_cast<size_t>(upload->input.gcount()) != len) {
+                std::cerr << "Failed to read file" << std::endl;
+                log << "Failed to read file" << std::endl;
+                chunk->failed = true;
+            }
+
+            upload->finished = chunk->failed || upload->remaining == 0;
+            chunk->last = upload->finished;
+            pipeline.submit(chunk);
+        }
+    });
+    pipeline->setParallelCodec(codecThreads.executor(), [this, upload](TransferPipeline::Chunk& chunk) {
+        if(chunk.failed || chunk.length == 0)
+            return;
+        const CompressionLevel level = CompressionPolicy::forBlock(upload->level, chunk.raw.data() + FRAME_HEADER_SIZE, chunk.length);
+        if(level == CompressionLevel::Raw)
+            return;
+
+        const CodecId id = codecs.forLevel(level);
+        Codec& codec = *CodecRegistry::local(id);
+        const Codec::Options options;
+        const auto start = std::chrono::steady_clock::now();
+        size_t frameSize = Codec::FAILED;
+        chunk.packed.resize_and_overwrite(FRAME_HEADER_SIZE + codec.compressBound(chunk.length, options), [&](char* packed, size_t size) {
+            frameSize = codec.compress(packed + FRAME_HEADER_SIZE, size - FRAME_HEADER_SIZE, chunk.raw.data() + FRAME_HEADER_SIZE, chunk.length, options);
+            return frameSize == Codec::FAILED ? 0 : FRAME_HEADER_SIZE + frameSize;
+        });
+        if(frameSize != Codec::FAILED)
+            link.addCodec(level, chunk.length, frameSize, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+        if(frameSize != Codec::FAILED && frameSize < chunk.length) {
+            chunk.flags |= FRAME_COMPRESSED | codecFlags(static_cast<uint8_t>(id));
+            chunk.level = static_cast<uint8_t>(level);
+        }
+    });
+    pipeline->setStage(TransferPipeline::SINK, socketThread.executor(), [clientSocket, upload](TransferPipeline& pipeline) {
+        while(TransferPipeline::Chunk* chunk = pipeline.nextToSink()) {
+            int res;
+            if(chunk->failed)
+                res = sendFrame(clientSocket, FrameType::File, FRAME_ABORTED, "");
+            else {
+                std::string& frame = chunk->flags & FRAME_COMPRESSED ? chunk->packed : chunk->raw;
+                FrameHeader{FrameType::File, chunk->flags, static_cast<uint32_t>(frame.size() - FRAME_HEADER_SIZE)}.encode(frame.data());
+                const auto start = std::chrono::steady_clock::now();
+                res = sendAll(clientSocket, frame.data(), frame.size());
+                upload->sendSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                upload->stats.add(static_cast<CompressionLevel>(chunk->level), chunk->length, frame.size() - FRAME_HEADER_SIZE);
+            }
+
+            const bool over = chunk->last || chunk->failed || res == -1;
+            upload->sendFailed = res == -1;
+            pipeline.release();
+            if(over) {
+                pipeline.cancel();
+                pipeline.finish();
+                return;
+            }
+        }
+    });
+
+    pipeline->start();
+    pipeline->wait();
+    if(upload->sendFailed)
+        return -1;
+    if(upload->delta) {
+        upload->stats.delta = true;
+        upload->stats.deltaMatched = upload->delta->matched;
+        upload->stats.fileBytes = upload->delta->matched + upload->delta->literal;
+    }
+    if(upload->archive)
+        upload->stats.files = upload->archive->files;
+
+    // Small uploads fit into the socket buffers, their send time says nothing about the link
+    if(upload->stats.wireBytes >= LINK_SAMPLE_MIN)
+        link.addLink(upload->stats.wireBytes, upload->sendSeconds);
+
+    transferSummary = upload->stats.summary();
+    return 0;
+}
+
+/**
+ * @brief Sends exactly len bytes, looping over short sends.
+ *
+ * @param clientSocket The socket to send the data through.
+ * @param data The data to send.
+ * @param len The number of bytes to send.
+ * @return 0 if everything has been sent, -1 on error.
+ */
+int Client::sendAll(SOCKET clientSocket, const char* data, size_t len) {
+    while(len > 0) {
+        int chunk = static_cast<int>(std::min<size_t>(len, INT_MAX));
+        int iSendResult = send(clientSocket, data, chunk, 0);
+        if(iSendResult == SOCKET_ERROR)
+            return -1;
+
+        data += iSendResult;
+        len -= iSendResult;
+    }
+
+    return 0;
+}
+
+/**
+  * @brief Receives a reply from the server.
   *
   * @details
-  * This function receives data from the specified client socket and stores it in a file,
-  * specified by the provided command string. If the received data is compressed, it will
-  * be decompressed before storing it in the file.
+  * This function reads one frame from the specified client socket with the buffered reader, after the Dictionary
+  * frame that may come in front of it. A Response frame
+  * is returned as is, unless it is compressed or more of the reply follows (see recvResponse). A File frame starts a file, which is stored in the file specified by the provided command
+  * string chunk by chunk until the frame without FRAME_MORE has been received, so the file is never held in
+  * memory as a whole. Compressed chunks are decompressed on the codec threads, several at once, and stored in order.
+  * Chunks with FRAME_DELTA are applied to the local copy of the file instead (delta_transfer.h), the chunks of
+  * `copy_to -r` are the archive of a tree, which is extracted into the directory (tree_archive.h).
+  * The statistics of a file that has been stored are kept for run to show.
   *
   * @param clientSocket The client socket to receive data from.
   * @param cmd The command string specifying the file to store the data in.
   * @return Returns a string indicating the status of the operation.
   *
-  * @note The function will continue to receive data until a '\f' character is received,
-  *       indicating the end of the data. If the connection is closed before the '\f'
-  *       character is received, the function will return "Connection closed". If an error
-  *       occurs during the receiving process, an empty string will be returned.
+  * @note If the connection is closed before the frame has been received completely, the function will
+  *       return "Connection closed". If an error occurs during the receiving process, an empty string
+  *       will be returned.
   */
 std::string Client::recvData(SOCKET clientSocket, std::string cmd) {
-    std::string ret;
-    std::string file_contents;
-    char recvChar;
-    bool isCompressed = false;
-    size_t originalSize = 0; // to store original size if it's compressed data
-    size_t compressedSize = 0;
-	char recvBuf[RECVBUFLENGTH];
+    FrameHeader header;
+    int res = reader.read(clientSocket, header, payload);
 
-    while(true) {
-        int bytes_recvd = recv(clientSocket, &recvChar, 1, 0);
-
-        if(bytes_recvd > 0) {
-            if(recvChar == '\f')
-                return ret;
-
-            if(recvChar == '\v') {
-                bytes_recvd = recv(clientSocket, &recvChar, 1, 0);
-                if(bytes_recvd > 0) {
-                    if(recvChar == '\v') {
-                        if(isCompressed) {
-                            // Read the sizes (original then compressed sizes)
-                            recv(clientSocket, reinterpret_cast<char *>(&originalSize), sizeof(originalSize), 0);
-                            recv(clientSocket, reinterpret_cast<char *>(&compressedSize), sizeof(compressedSize), 0);
-
-                            // Receive the compressed data
-                            char *compressedData = new char[compressedSize];
-                            recv(clientSocket, compressedData, compressedSize, 0);
-
-                            // Allocate a buffer for decompressed data
-                            char *decompressedData = new char[originalSize];
-
-                            // Decompress the data
-                            int decompressedSize = LZ4_decompress_safe(compressedData, decompressedData, compressedSize, originalSize);
-
-                            if(decompressedSize < 0) {
-                                delete[] compressedData;
-                                delete[] decompressedData;
-                                return "An error occurred during decompression."; // in case of decompression error
-                            }
-
-                            // Assign the decompressed data back to file_contents
-                            file_contents = std::string(decompressedData, decompressedData + decompressedSize);
-
-                            delete[] compressedData;
-                            delete[] decompressedData;
-                        }
-						else {
-							int nBytes = recv(clientSocket, recvBuf, RECVBUFLENGTH, 0); // receive if file less, then 1 Mb
-							file_contents.assign(recvBuf, nBytes -1); // -1 for removing \f
-						}
-						
-						std::string msg;
-                        if (cmd.compare(0, 8, "copy_to ") == 0) {
-							shiftStrLeft(cmd, 8);
-							msg = "copied";
-						}
-						else if (cmd.compare(0, 4, "cut ") == 0) {
-							shiftStrLeft(cmd, 4);
-							msg = "cut";
-						}
-
-						std::ofstream output(cmd, std::ios::out | std::ios::binary);
-						output << file_contents;
-						output.close();
-						std::string ret = std::format("File has been {} successfully!", msg);
-						return ret;
-                    }
-
-                    else if(recvChar == '\r') {
-                        isCompressed = true;
-                    }
+    // The reply dictionary comes in front of the first reply compressed against it
+    while(res > 0 && header.type == FrameType::Dictionary) {
+        try {
+            if(payload.size() < sizeof(uint64_t))
+                throw std::runtime_error("Invalid zstd dictionary");
+            const auto version = static_cast<uint32_t>(decodeSize(payload.data()));
+            dictionary = std::make_shared<const ZstdDictionary>(payload.substr(sizeof(uint64_t)), version);
+            log << "Received reply dictionary version " << version << std::endl;
+        }
+        catch(const std::runtime_error& e) {
+            log << e.what() << std::endl;
+        }
+        res = reader.read(clientSocket, header, payload);
+    }
+
+    if(res == 0)
+        return "Connection closed";
+    if(res == -2)
+        return "Unsupported protocol version";
+    if(res == -3)
+        return "Received an invalid frame";
+    if(res < 0)
+        return "";
+
+    if(header.type != FrameType::File) {
+        if(header.flags & (FRAME_COMPRESSED | FRAME_MORE))
+            return recvResponse(clientSocket, header);
+        return payload;
+    }
+
+    std::string msg;
+    if (cmd.compare(0, 8, "copy_to ") == 0) {
+        shiftStrLeft(cmd, 8);
+        msg = "copied";
+    }
+    else if (cmd.compare(0, 4, "cut ") == 0) {
+        shiftStrLeft(cmd, 4);
+        msg = "cut";
+    }
+
+    // `copy_to -r` receives the archive of a tree, which is extracted into the directory as it arrives
+    const bool tree = cmd.compare(0, 3, "-r ") == 0;
+    if (tree)
+        shiftStrLeft(cmd, 3);
+
+    // Shared by the stages, which may still be returning when the download is over
+    struct Download {
+        std::ofstream output;
+        std::filesystem::path part;     // the file is written here, it is renamed to the target once complete
+        std::string first;      // payload of the first frame, received above
+        uint16_t firstFlags = 0;
+        bool firstTaken = false;
+        bool finished = false;
+        uint64_t size = 0;      // announced by a FRAME_SIZE frame
+        bool sized = false;
+        uint64_t written = 0;   // offset in the file, the download may have been resumed
+        uint64_t id = 0;        // of a resumable transfer, announced with the size
+        uint64_t checkpoint = 0;    // the offset is recorded again from here on
+        int res = 1;            // result of the read that ended the download early
+        std::filesystem::path target;
+        std::unique_ptr<DeltaDecoder> delta;    // rebuilds a delta from the copy at the target
+        std::unique_ptr<ArchiveExtractor> archive;  // extracts the tree of `copy_to -r` into the target
+        std::string error;
+        TransferStats stats;
+    };
+    auto download = std::make_shared<Download>();
+    download->stats.codecs = codecs;
+    if(!tree)
+        download->part = cmd + ".part";
+    download->target = cmd;
+
+    // Servers that know the codec handshake announce the size of the file in front of it, the ID of the transfer
+    // and where it is sent from
+    uint64_t start = 0;
+    if(header.flags & FRAME_SIZE) {
+        if(payload.size() >= sizeof(uint64_t)) {
+            download->size = decodeSize(payload.data());
+            download->sized = true;
+        }
+        if(payload.size() == 3 * sizeof(uint64_t)) {
+            download->id = decodeSize(payload.data() + sizeof(uint64_t));
+            start = decodeSize(payload.data() + 2 * sizeof(uint64_t));
+        }
+        res = reader.read(clientSocket, header, payload);
+        if(res <= 0 || header.type != FrameType::File)
+            return res == 0 ? "Connection closed" : "";
+    }
+
+    // A resumed download is appended to the temporary file cut back to its checkpoint, every other one starts it over
+    std::error_code ec;
+    if(tree)
+        download->archive = std::make_unique<ArchiveExtractor>(download->target);
+    else if(start > 0) {
+        TransferCheckpoint checkpoint;
+        if(!checkpoint.load(download->part) || checkpoint.id != download->id || checkpoint.offset != start)
+            download->error = "The checkpoint of the file doesn't match the one the server resumed from.";
+        else {
+            std::filesystem::resize_file(download->part, start, ec);
+            download->output.open(download->part, std::ios::in | std::ios::out | std::ios::binary);
+            download->output.seekp(static_cast<std::streamoff>(start));
+            log << "Resuming " << cmd << " at " << start << std::endl;
+        }
+    }
+    else
+        download->output.open(download->part, std::ios::out | std::ios::binary | std::ios::trunc);
+    download->written = start;
+    download->checkpoint = start + TransferCheckpoint::INTERVAL;
+    download->first.swap(payload);
+    download->firstFlags = header.flags;
+
+    // After an error the rest of the file is still received, so the next reply isn't taken for a part of it
+    auto pipeline = std::make_shared<TransferPipeline>(TransferPipeline::depthFor(codecThreads.size()));
+    pipeline->setStage(TransferPipeline::SOURCE, socketThread.executor(), [this, clientSocket, download](TransferPipeline& pipeline) {
+        while(!download->finished) {
+            TransferPipeline::Chunk* chunk = pipeline.acquire();
+            if(chunk == nullptr)
+                return;
+
+            FrameHeader header;
+            if(!download->firstTaken) {
+                chunk->packed.swap(download->first);
+                header.flags = download->firstFlags;
+                download->firstTaken = true;
+            }
+            else {
+                download->res = reader.read(clientSocket, header, chunk->packed);
+                if(download->res <= 0 || header.type != FrameType::File) {
+                    download->res = download->res == 0 ? 0 : -1;
+                    chunk->failed = true;
                 }
             }
 
-            ret += recvChar;
+            chunk->flags = header.flags;
+            download->finished = chunk->failed || !(header.flags & FRAME_MORE);
+            chunk->last = download->finished;
+            pipeline.submit(chunk);
         }
+    });
+    pipeline->setParallelCodec(codecThreads.executor(), [](TransferPipeline::Chunk& chunk) {
+        if(chunk.failed || (chunk.flags & FRAME_ABORTED))
+            return;
 
-        else if (bytes_recvd == 0) {
-            return "Connection closed";
+        if(chunk.flags & FRAME_COMPRESSED) {
+            Codec* codec = CodecRegistry::local(static_cast<CodecId>(frameCodec(chunk.flags)));
+            if(codec == nullptr || codec->decompress(chunk.packed.data(), chunk.packed.size(), chunk.raw, FRAME_CHUNK_MAX) == -1)
+                chunk.failed = true; // in case of decompression error
         }
+        else
+            chunk.raw.swap(chunk.packed);
+    });
+    pipeline->setStage(TransferPipeline::SINK, diskThread.executor(), [download](TransferPipeline& pipeline) {
+        while(TransferPipeline::Chunk* chunk = pipeline.nextToSink()) {
+            if(chunk->flags & FRAME_ABORTED)
+                download->error = "The server couldn't read the file.";
+            else if(chunk->failed) {
+                // A chunk that wasn't received ends the download without an error of its own
+                if(download->error.empty() && download->res > 0)
+                    download->error = "An error occurred during decompression.";
+            }
+            else if(download->error.empty()) {
+                int64_t produced = static_cast<int64_t>(chunk->raw.size());
+                if(download->archive) {
+                    // Every file of the tree replaces its target on its own
+                    if(download->archive->apply(chunk->raw.data(), chunk->raw.size()) == -1)
+                        download->error = download->archive->error;
+                }
+                else if(chunk->flags & FRAME_DELTA) {
+                    // Rebuilt from the copy, which stays in place until the download is complete
+                    if(!download->delta)
+                        download->delta = std::make_unique<DeltaDecoder>(download->target);
+                    const uint64_t matched = download->delta->matched;
+                    produced = download->delta->apply(chunk->raw.data(), chunk->raw.size(), download->output);
+                    download->stats.delta = true;
+                    download->stats.deltaMatched += download->delta->matched - matched;
+                }
+                else
+                    download->output.write(chunk->raw.data(), static_cast<std::streamsize>(chunk->raw.size()));
+                if(produced == -1) {
+                    download->error = "The delta of the file doesn't fit the local copy.";
+                    produced = 0;
+                }
+                download->written += static_cast<uint64_t>(produced);
+
+                // Everything up to here has reached the file, a lost connection resumes from here
+                if(download->id != 0 && download->written >= download->checkpoint && download->output.flush()) {
+                    TransferCheckpoint{download->id, download->written}.save(download->part);
+                    download->checkpoint = download->written + TransferCheckpoint::INTERVAL;
+                }
+                // A received chunk counts as the level its codec is used for
+                const bool compressed = chunk->flags & FRAME_COMPRESSED;
+                const CompressionLevel level = compressed ? download->stats.codecs.levelOf(static_cast<CodecId>(frameCodec(chunk->flags))) : CompressionLevel::Raw;
+                download->stats.add(level, static_cast<uint64_t>(produced), compressed ? chunk->packed.size() : chunk->raw.size());
+            }
 
+            const bool last = chunk->last;
+            pipeline.release();
+            if(last) {
+                pipeline.cancel();
+                pipeline.finish();
+                return;
+            }
+        }
+    });
+
+    pipeline->start();
+    pipeline->wait();
+
+    download->output.close();
+    if(download->res <= 0) {
+        // Every chunk that arrived has been written, `copy_to -c` goes on from there
+        if(download->id != 0 && download->error.empty() && download->output)
+            TransferCheckpoint{download->id, download->written}.save(download->part);
+        else
+            std::filesystem::remove(download->part, ec);
+        return download->res == 0 ? "Connection closed" : "";
+    }
+    if(download->archive) {
+        if(download->error.empty() && !download->archive->finished())
+            download->error = "The tree has been received incompletely.";
+        if(!download->error.empty())
+            return download->error;
+        download->stats.files = download->archive->files;
+        transferSummary = download->stats.summary();
+        return "Directory has been copied successfully!";
+    }
+    if(download->error.empty() && download->sized && download->written != download->size)
+        download->error = "The file has been received incompletely.";
+    if(download->error.empty() && download->output)
+        std::filesystem::rename(download->part, cmd, ec);
+    if(!download->error.empty() || !download->output || ec) {
+        std::filesystem::remove(download->part, ec);
+        TransferCheckpoint::remove(download->part);
+        return download->error.empty() ? "Failed to write the file." : download->error;
+    }
+    TransferCheckpoint::remove(download->part);
+
+    transferSummary = download->stats.summary();
+    return std::format("File has been {} successfully!", msg);
+}
+
+/**
+ * @brief Receives a reply that the server has sent in chunks and decompresses them.
+ *
+ * @details
+ * The payload of the first frame has been read into payload already. Every compressed chunk is decompressed with
+ * the codec named in its flags (codec.h), a zstd frame that names a dictionary with the reply dictionary, and
+ * appended to the reply, until the frame without FRAME_MORE. After a
+ * chunk that can't be decompressed the rest of the reply is still received, so the next reply isn't taken for a
+ * part of it.
+ *
+ * @param clientSocket The socket to receive the rest of the reply from.
+ * @param first The header of the first frame of the reply.
+ * @return The reply, an error message if a chunk couldn't be decompressed, "Connection closed" or an empty string
+ *         like recvData.
+ */
+std::string Client::recvResponse(SOCKET clientSocket, const FrameHeader& first) {
+    std::string reply, chunk;
+    bool failed = false;
+    FrameHeader header = first;
+
+    while(true) {
+        if(!(header.flags & FRAME_COMPRESSED))
+            reply += payload;
         else {
-            return "";
+            const auto id = static_cast<CodecId>(frameCodec(header.flags));
+            const unsigned dictionaryId = id == CodecId::Zstd ? ZstdCodec::dictionaryId(payload.data(), payload.size()) : 0;
+            Codec* codec = CodecRegistry::local(id);
+            int res;
+            if(dictionaryId != 0)
+                res = dictionary && dictionary->id() == dictionaryId
+                    ? ZstdCodec::local().decompress(payload.data(), payload.size(), chunk, INT_MAX, dictionary->decompression())
+                    : -1;
+            else
+                res = codec == nullptr ? -1 : codec->decompress(payload.data(), payload.size(), chunk, INT_MAX);
+
+            if(res == -1)
+                failed = true;
+            else
+                reply += chunk;
         }
 
+        if(!(header.flags & FRAME_MORE))
+            break;
+
+        int res = reader.read(clientSocket, header, payload);
+        if(res == 0)
+            return "Connection closed";
+        if(res < 0)
+            return "";
     }
+
+    if(failed)
+        return "An error occurred during decompression of the reply.";
+    return reply;
 }
 
 void Client::closeConnection() {
     std::cout << "Closing connection..." << std::endl;
     log.close();
+    for(auto& connection : data) {
+        closesocket(connection->sock);
+        connection->sock = INVALID_SOCKET;
+    }
     closesocket(ConnectSocket);
     WSACleanup();
 }
@@ -12,7 +12,18 @@
 *  - ConnectSocket: A SOCKET object used to manage the connection to the server.
 *  - result and ptr: Pointers to an addrinfo structure used for obtaining address information.
 *  - hints: An addrinfo structure that is used in network communication setup.
-*  - recvbuf: A string buffer to store received data.
+*  - reader: Buffered reader the replies of the server are received with.
+*  - payload: Payload of the last received frame, reused between replies.
+*  - diskThread, codecThreads, socketThread: Threads the stages of a file transfer run on (see transfer_pipeline.h).
+*    There is a codec thread per core, the chunks of a file are compressed and decompressed in parallel.
+*  - transferSummary: Statistics of the last file transfer (compression_policy.h), shown after the reply.
+*  - codecs: The codecs the compression levels are sent with, agreed on with the server at authentication (codec.h).
+*  - resumable: The server took part in the codec handshake, so it announces and accepts transfer IDs and can
+*    resume transfers (transfer_checkpoint.h).
+*  - link: Throughput of the link and of the codec measured during uploads, the compression level of an upload is
+*    chosen from it. The `stats` command shows it after the estimate of the server.
+*  - dataConnections, data: How many extra data connections `copy_to -p` / `copy_from -p` move byte ranges of a file
+*    over (range_transfer.h), and the connections, authenticated like the main one once they are first needed.
 *  - log: An ofstream object to handle logging.
 *  - iResult: An integer used to store result values.
 *  - recvbuflen: An integer constant to store the receive buffer length.
@@ -22,11 +33,25 @@
 *  - initServerConnection: Function that initializes the server connection.
 *  - createAndConnectSocket: Function that creates and connects a socket.
 *  - shiftStrLeft: Helper utility function for string manipulation.
-*  - sendData: Function that sends data to the server.
-*  - recvData: Function that receives data from the server.
+*  - sendData: Function that sends a command to the server.
+*  - recvData: Function that receives a reply from the server.
+*  - recvResponse: Receives the rest of a reply that comes in compressed chunks and decompresses it.
+*  - dictionary: The zstd dictionary the server compresses short replies against, received once (codec.h).
+*  - sendFrame, sendAll: Write a frame (see protocol.h) and send exact byte counts.
+*  - sendFile: Uploads a file for copy_from in chunks, from an offset when the upload is resumed, or as a delta.
+*  - sendTree: Uploads a directory for `copy_from -r` as an archive of its tree (tree_archive.h), which recvData
+*    extracts for `copy_to -r`.
+*  - streamUpload: Reads, compresses and sends the chunks of an upload in a transfer pipeline.
+*  - resumeRequest: Turns `copy_to -c` / `copy_from -c` into the request that resumes the transfer.
+*  - deltaRequest, sendSignature, recvSignature: `copy_to -d` / `copy_from -d` send a file as a delta against the receiver's copy
+*    (delta_transfer.h): the signature of the copy is sent in front of the request, or received in reply to it.
+*  - parallelRequest, parallelTransfer, openDataConnections, downloadRange, uploadRange (client_ranges.cpp): `copy_to -p` /
+*    `copy_from -p` name the file on the main connection and move its byte ranges over the data connections, a thread
+*    per connection.
 *
 * Public member variables:
-*  - Constructor: Defines a constructor for the Client object which takes a server name and port as arguments.
+*  - Constructor: Defines a constructor for the Client object which takes a server name and port as arguments, and the
+*    number of data connections.
 *    It also initializes the Winsock and server connection and throws an exception if an error occurs.
 *  - Destructor: Cleans up the resources used by the Client object: closes the log file, the connect socket and cleans up the Winsock.
 *  - run: The main loop for the client operation. Engages in command/response interactions with the server.
@@ -37,16 +62,27 @@
 
 #define WIN32_LEAN_AND_MEAN
 
-#include <windows.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include "platform.h"
+#include "protocol.h"
+#include "frame_reader.h"
+#include "transfer_pipeline.h"
+#include "codec.h"
+#include "compression_policy.h"
+#include "transfer_checkpoint.h"
+#include "delta_transfer.h"
+#include "range_transfer.h"
+#include "tree_archive.h"
 #include <iostream>
 #include <string>
 #include <fstream>
 #include <utility>
+#include <vector>
 #include <stdio.h>
 
 #define DEFAULT_BUFLEN 512
+#define SMALL_FRAME 65536
+#define FILE_CHUNK (1 << 20)          // at most FRAME_CHUNK_MAX
+#define LINK_SAMPLE_MIN (8 << 20)     // smaller uploads don't update the link estimate
 
 class Client {
 private:
@@ -55,12 +91,72 @@ private:
     SOCKET createAndConnectSocket();
     static int shiftStrLeft(std::string &str, int num);
     int sendData(SOCKET clientSocket, std::string cmd);
-    static std::string recvData(SOCKET clientSocket, std::string cmd);
+    std::string recvData(SOCKET clientSocket, std::string cmd);
+    std::string recvResponse(SOCKET clientSocket, const FrameHeader& first);
+    static int sendFrame(SOCKET clientSocket, FrameType type, uint16_t flags, const std::string& payload);
+    static int sendAll(SOCKET clientSocket, const char* data, size_t len);
+    int sendFile(SOCKET clientSocket, const std::string& path, uint64_t id, uint64_t start,
+                 std::shared_ptr<const DeltaSignature> signature = nullptr);
+    int sendTree(SOCKET clientSocket, const std::string& path);
+
+    // An upload that is being sent, shared by the stages, which may still be returning when it is over
+    struct Upload {
+        std::ifstream input;
+        uint64_t remaining = 0;
+        bool finished = false;
+        CompressionLevel level = CompressionLevel::Raw;
+        bool sendFailed = false;
+        double sendSeconds = 0;         // spent in send, the socket thread waits there while the link is the bottleneck
+        std::unique_ptr<DeltaEncoder> delta;
+        std::unique_ptr<ArchiveWriter> archive;     // of a tree, read in place of the file
+        std::string name;               // of the tree
+        bool judged = false;            // the level of the tree has been chosen
+        TransferStats stats;
+    };
+
+    int streamUpload(SOCKET clientSocket, std::shared_ptr<Upload> upload);
+    std::string resumeRequest(std::string& command);
+    std::string deltaRequest(SOCKET clientSocket, std::string& command);
+    int recvSignature(SOCKET clientSocket, DeltaSignature& signature);
+    static int sendSignature(SOCKET clientSocket, const DeltaSignature& signature);
+
+    // An extra connection byte ranges are moved over, by a thread of its own while a file is moved
+    struct DataConnection {
+        SOCKET sock = INVALID_SOCKET;
+        FrameReader reader;
+        std::string payload;
+    };
+
+    // The file a parallel transfer moves, shared by the threads of the data connections
+    struct RangeFile {
+        std::filesystem::path local;    // the source of an upload, the temporary file of a download
+        std::string remote;             // absolute path on the server
+        uint64_t size = 0;
+        uint64_t id = 0;
+        CompressionLevel level = CompressionLevel::Raw;     // of an upload
+    };
+
+    std::string parallelRequest(std::string& command);
+    std::string parallelTransfer(const std::string& command);
+    size_t openDataConnections();
+    int downloadRange(DataConnection& connection, const RangeFile& file, ByteRange range, TransferStats& stats, std::string& error);
+    int uploadRange(DataConnection& connection, const RangeFile& file, ByteRange range, TransferStats& stats, std::string& error);
 
     WSADATA wsaData;
     SOCKET ConnectSocket;
     addrinfo *result, *ptr, hints;
-    std::string recvbuf;
+    FrameReader reader;
+    std::string payload;
+    CodecChoice codecs;
+    bool resumable = false;
+    std::shared_ptr<const ZstdDictionary> dictionary;
+    LinkEstimate link;
+    unsigned dataConnections = 0;
+    std::vector<std::unique_ptr<DataConnection>> data;
+    StageThreads diskThread;
+    StageThreads codecThreads{std::max(1u, std::thread::hardware_concurrency())};
+    StageThreads socketThread;
+    std::string transferSummary;
     std::ofstream log;
     int iResult;
     const static int recvbuflen = DEFAULT_BUFLEN;
@@ -68,17 +164,22 @@ private:
     std::string None;
 
 public:
-    Client(std::string ip, std::string port, std::string username, std::string password)
-        : ip(std::move(ip)), port(std::move(port)), username(std::move(username)), password(std::move(password)) {
+    Client(std::string ip, std::string port, std::string username, std::string password, unsigned dataConnections = 0)
+        : dataConnections(dataConnections), ip(std::move(ip)), port(std::move(port)), username(std::move(username)),
+          password(std::move(password)) {
         ConnectSocket = INVALID_SOCKET;
 
         log.open("log.txt");
         if (!log)
             throw std::runtime_error("Failed to open log file");
 
+        // Strong hashes of delta transfers
+        if (sodium_init() < 0)
+            throw std::runtime_error("Failed to initialize libsodium");
+
         try {
             initWinsock();
-            initServerConnection(ip.c_str());
+            initServerConnection(this->ip.c_str());
         } catch (const std::runtime_error &e) {
             throw e;
         }
@@ -87,6 +188,8 @@ public:
     ~Client() {
         // cleanup
         log.close();
+        for (auto& connection : data)
+            closesocket(connection->sock);
         closesocket(ConnectSocket);
         WSACleanup();
     }
@@ -0,0 +1,375 @@
+#include "client.h"
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <format>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief Turns a `copy_to -p` / `copy_from -p` command into the request that names the file on the main connection.
+ *
+ * @details
+ * The byte ranges of the file are moved over the data connections (range_transfer.h), which are opened when they are
+ * first needed. `copy_from -p NAME` announces the ID and the size of the local file, so the server can preallocate
+ * it. Without data connections, or with a server that doesn't know the codec handshake, the plain command is sent
+ * over the main connection. The `-p` is removed from the command in any case.
+ *
+ * @param command The command that has been typed.
+ * @return The command to send to the server.
+ */
+std::string Client::parallelRequest(std::string& command) {
+    const bool copyTo = command.starts_with("copy_to -p ");
+    if(!copyTo && !command.starts_with("copy_from -p "))
+        return command;
+
+    const std::string name = command.substr(copyTo ? 11 : 13);
+    command = (copyTo ? "copy_to " : "copy_from ") + name;
+    if(!resumable || dataConnections == 0 || openDataConnections() == 0) {
+        std::cout << "There are no data connections to the server, the file is sent over this one" << std::endl;
+        log << "There are no data connections to the server, the file is sent over this one" << std::endl;
+        return command;
+    }
+
+    if(copyTo)
+        return "copy_to -p " + name;
+
+    // A file that can't be read is reported by the plain copy_from
+    std::error_code ec;
+    const uint64_t size = std::filesystem::file_size(name, ec);
+    const uint64_t id = TransferCheckpoint::idOf(name);
+    if(ec || id == 0)
+        return command;
+    return std::format("copy_from -p {:x} {} {}", id, size, name);
+}
+
+/**
+ * @brief Moves a file in byte ranges over the data connections, once the main connection has named it.
+ *
+ * @details
+ * The server answers the request with `ranges SIZE ID PATH`. The file is split into ranges (RangeSet::split), and a
+ * thread per data connection moves the next range that hasn't been moved yet until none is left; a download writes
+ * every range at its offset into a temporary file that has been preallocated with the full size. A range whose
+ * connection failed is put back for another connection, the failed connection is closed and opened again for the next
+ * transfer. Any other error ends the transfer once the ranges on the way are done. The file is complete when the
+ * ranges that have arrived cover all of it: a download renames its temporary file then, the server renames the one of
+ * an upload when the last range arrives.
+ *
+ * @param command The command without `-p`, `copy_to NAME` or `copy_from NAME`.
+ * @return The reply to show, like the one of the plain command.
+ */
+std::string Client::parallelTransfer(const std::string& command) {
+    const bool upload = command.starts_with("copy_from ");
+    const std::string name = command.substr(upload ? 10 : 8);
+
+    std::string reply = recvData(ConnectSocket, None);
+    unsigned long long size, id;
+    int length = 0;
+    if(sscanf(reply.c_str(), "ranges %llu %llx %n", &size, &id, &length) != 2 || length == 0)
+        return reply;
+
+    RangeFile file;
+    file.remote = reply.substr(length);
+    file.size = size;
+    file.id = id;
+    std::error_code ec;
+    if(upload) {
+        // The file must still be the one that has been announced
+        file.local = name;
+        if(TransferCheckpoint::idOf(name) != file.id || std::filesystem::file_size(name, ec) != file.size || ec)
+            return "The file has changed since it has been announced.";
+
+        std::ifstream input(name, std::ios::in | std::ios::binary);
+        double ratio = 1.0;
+        CompressionLevel content = CompressionPolicy::forFile(input, file.size, &ratio);
+        LinkEstimate::Decision decision = link.choose(content, ratio, file.size, static_cast<unsigned>(data.size()));
+        file.level = decision.level;
+
+        std::string line = std::format("copy_from {}: {} ({}), {} connections", std::filesystem::path(name).filename().string(), link.name(decision.level), decision.reason, data.size());
+        log << line << std::endl;
+        link.record(std::move(line));
+    }
+    else {
+        // Preallocated, so every range can be written at its offset
+        file.local = name + ".part";
+        {
+            std::ofstream part(file.local, std::ios::out | std::ios::binary | std::ios::trunc);
+        }
+        std::filesystem::resize_file(file.local, file.size, ec);
+        if(ec) {
+            std::filesystem::remove(file.local, ec);
+            return "Failed to write the file.";
+        }
+    }
+
+    const std::vector<ByteRange> ranges = RangeSet::split(file.size, static_cast<unsigned>(data.size()));
+    std::deque<ByteRange> pending(ranges.begin(), ranges.end());
+    std::mutex mutex;
+    std::condition_variable moved;
+    size_t moving = 0;
+    RangeSet arrived;
+    bool complete = false;
+    std::string error;
+    TransferStats stats;
+    stats.codecs = codecs;
+
+    size_t count = 0;
+    std::vector<std::thread> threads;
+    for(auto& entry : data) {
+        if(entry->sock == INVALID_SOCKET)
+            continue;
+
+        threads.emplace_back([&, &connection = *entry] {
+            TransferStats own;
+            std::unique_lock<std::mutex> lock(mutex);
+            while(true) {
+                // A range that is still on its way may come back
+                moved.wait(lock, [&] { return !pending.empty() || moving == 0 || !error.empty(); });
+                if(pending.empty() || !error.empty())
+                    break;
+                const ByteRange range = pending.front();
+                pending.pop_front();
+                moving++;
+                lock.unlock();
+
+                std::string failure;
+                const int res = upload ? uploadRange(connection, file, range, own, failure) : downloadRange(connection, file, range, own, failure);
+                if(res < 0) {
+                    closesocket(connection.sock);
+                    connection.sock = INVALID_SOCKET;
+                }
+
+                lock.lock();
+                moving--;
+                if(res >= 0) {
+                    arrived.add(range);
+                    count++;
+                    complete = complete || res == 1;
+                }
+                else if(res == -1)
+                    pending.push_back(range);
+                else if(error.empty())
+                    error = failure;
+                moved.notify_all();
+                if(res < 0)
+                    break;
+            }
+            stats.add(own);
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+
+    log << "Moved " << count << " of " << ranges.size() << " ranges of " << name << " over " << threads.size() << " connections" << std::endl;
+    if(error.empty() && !arrived.covers(file.size))
+        error = "The data connections have been lost, the file has been moved incompletely.";
+
+    if(upload) {
+        if(error.empty() && !complete)
+            error = "The server hasn't completed the file.";
+        if(!error.empty())
+            return error;
+        transferSummary = stats.summary();
+        return "File has been received successfully";
+    }
+
+    if(error.empty())
+        std::filesystem::rename(file.local, name, ec);
+    if(!error.empty() || ec) {
+        std::filesystem::remove(file.local, ec);
+        return error.empty() ? "Failed to write the file." : error;
+    }
+    transferSummary = stats.summary();
+    return "File has been copied successfully!";
+}
+
+/**
+ * @brief Opens the data connections that aren't open, authenticated like the main connection.
+ *
+ * @details
+ * Data connections don't name zstd-dict, the short replies to the ranges are never compressed against a dictionary.
+ *
+ * @return The number of open data connections.
+ */
+size_t Client::openDataConnections() {
+    while(data.size() < dataConnections)
+        data.push_back(std::make_unique<DataConnection>());
+
+    size_t open = 0;
+    for(auto& connection : data) {
+        if(connection->sock == INVALID_SOCKET) {
+            // Nothing of what the reader has buffered belongs to the new connection
+            connection = std::make_unique<DataConnection>();
+            connection->sock = createAndConnectSocket();
+            if(connection->sock == INVALID_SOCKET)
+                continue;
+
+            // A connection that fails to authenticate is closed and tried again for the next transfer
+            FrameHeader header;
+            std::string iSendString = std::format("auth: {} {} codecs={}", username, password, CodecRegistry::format(CodecRegistry::defaults()));
+            if(sendFrame(connection->sock, FrameType::Command, 0, iSendString) == -1
+               || connection->reader.read(connection->sock, header, connection->payload) <= 0
+               || header.type != FrameType::Response || !connection->payload.starts_with("valid codecs=")) {
+                log << "Failed to open a data connection" << std::endl;
+                closesocket(connection->sock);
+                connection->sock = INVALID_SOCKET;
+                continue;
+            }
+        }
+        open++;
+    }
+    return open;
+}
+
+/**
+ * @brief Receives a byte range of a file over a data connection and writes it at its offset.
+ *
+ * @details
+ * `copy_to -R OFFSET LENGTH PATH` is answered like a plain copy_to: a FRAME_SIZE frame, which must name the file that
+ * has been announced and the offset of the range, followed by the chunks of the range in File frames.
+ *
+ * @param connection The data connection.
+ * @param file The file the range belongs to.
+ * @param range The range.
+ * @param stats Receives the statistics of the range.
+ * @param error Receives the reason a range failed.
+ * @return 0 if the range has been written, -1 if the connection failed and -2 if the range failed.
+ */
+int Client::downloadRange(DataConnection& connection, const RangeFile& file, ByteRange range, TransferStats& stats, std::string& error) {
+    if(sendFrame(connection.sock, FrameType::Command, 0, std::format("copy_to -R {} {} {}", range.offset, range.length, file.remote)) == -1)
+        return -1;
+
+    std::fstream output(file.local, std::ios::in | std::ios::out | std::ios::binary);
+    output.seekp(static_cast<std::streamoff>(range.offset));
+    FrameHeader header;
+    std::string& payload = connection.payload;
+    std::string raw;
+    uint64_t written = 0;
+    bool sized = false;
+    do {
+        if(connection.reader.read(connection.sock, header, payload) <= 0)
+            return -1;
+
+        if(header.type != FrameType::File) {
+            error = payload;
+            return -2;
+        }
+        if(header.flags & FRAME_SIZE) {
+            sized = payload.size() == 3 * sizeof(uint64_t) && decodeSize(payload.data()) == file.size
+                    && decodeSize(payload.data() + sizeof(uint64_t)) == file.id && decodeSize(payload.data() + 2 * sizeof(uint64_t)) == range.offset;
+            if(!sized) {
+                error = "The file has changed on the server during the transfer.";
+                return -2;
+            }
+            continue;
+        }
+        if(header.flags & FRAME_ABORTED) {
+            error = "The server couldn't read the file.";
+            return -2;
+        }
+
+        const bool compressed = header.flags & FRAME_COMPRESSED;
+        if(compressed) {
+            Codec* codec = CodecRegistry::local(static_cast<CodecId>(frameCodec(header.flags)));
+            if(codec == nullptr || codec->decompress(payload.data(), payload.size(), raw, FRAME_CHUNK_MAX) == -1) {
+                error = "An error occurred during decompression.";
+                return -2;
+            }
+        }
+        const std::string& chunk = compressed ? raw : payload;
+        if(chunk.size() > range.length - written) {
+            error = "The file has been received incompletely.";
+            return -2;
+        }
+
+        output.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+        written += chunk.size();
+        const CompressionLevel level = compressed ? codecs.levelOf(static_cast<CodecId>(frameCodec(header.flags))) : CompressionLevel::Raw;
+        stats.add(level, chunk.size(), payload.size());
+    } while(header.flags & (FRAME_MORE | FRAME_SIZE));
+
+    if(!sized || written != range.length) {
+        error = "The file has been received incompletely.";
+        return -2;
+    }
+    if(!output.flush()) {
+        error = "Failed to write the file.";
+        return -2;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends a byte range of a file over a data connection.
+ *
+ * @details
+ * `copy_from -R LENGTH PATH` is followed by a FRAME_SIZE frame with the size and the ID of the file and the offset of
+ * the range, and the range in chunks of FILE_CHUNK bytes. Every chunk is compressed at the level chosen for the file,
+ * unless it doesn't shrink. The server acknowledges the range once it has been written.
+ *
+ * @param connection The data connection.
+ * @param file The file the range belongs to.
+ * @param range The range.
+ * @param stats Receives the statistics of the range.
+ * @param error Receives the reason a range failed.
+ * @return 1 if the range has completed the file, 0 if it has been written, -1 if the connection failed and -2 if the
+ *         range failed.
+ */
+int Client::uploadRange(DataConnection& connection, const RangeFile& file, ByteRange range, TransferStats& stats, std::string& error) {
+    std::ifstream input(file.local, std::ios::in | std::ios::binary);
+    input.seekg(static_cast<std::streamoff>(range.offset));
+    if(sendFrame(connection.sock, FrameType::Command, 0, std::format("copy_from -R {} {}", range.length, file.remote)) == -1)
+        return -1;
+
+    std::string announce(3 * sizeof(uint64_t), '\0');
+    encodeSize(announce.data(), file.size);
+    encodeSize(announce.data() + sizeof(uint64_t), file.id);
+    encodeSize(announce.data() + 2 * sizeof(uint64_t), range.offset);
+    if(sendFrame(connection.sock, FrameType::File, FRAME_SIZE | FRAME_MORE, announce) == -1)
+        return -1;
+
+    const Codec::Options options;
+    std::string chunk, packed;
+    uint64_t remaining = range.length;
+    do {
+        const size_t len = static_cast<size_t>(std::min<uint64_t>(remaining, FILE_CHUNK));
+        remaining -= len;
+        chunk.resize(len);
+        input.read(chunk.data(), static_cast<std::streamsize>(len));
+        if(static_cast<size_t>(input.gcount()) != len) {
+            // The server answers the aborted range with an error
+            error = "Failed to read file";
+            return sendFrame(connection.sock, FrameType::File, FRAME_ABORTED, "") == -1 ? -1 : -2;
+        }
+
+        uint16_t flags = remaining > 0 ? FRAME_MORE : 0;
+        CompressionLevel level = CompressionPolicy::forBlock(file.level, chunk.data(), len);
+        if(level != CompressionLevel::Raw) {
+            const CodecId id = codecs.forLevel(level);
+            Codec& codec = *CodecRegistry::local(id);
+            packed.resize(codec.compressBound(len, options));
+            const size_t frameSize = codec.compress(packed.data(), packed.size(), chunk.data(), len, options);
+            if(frameSize != Codec::FAILED && frameSize < len) {
+                packed.resize(frameSize);
+                flags |= FRAME_COMPRESSED | codecFlags(static_cast<uint8_t>(id));
+            }
+            else
+                level = CompressionLevel::Raw;
+        }
+
+        const std::string& frame = flags & FRAME_COMPRESSED ? packed : chunk;
+        if(sendFrame(connection.sock, FrameType::File, flags, frame) == -1)
+            return -1;
+        stats.add(level, len, frame.size());
+    } while(remaining > 0);
+
+    FrameHeader header;
+    if(connection.reader.read(connection.sock, header, connection.payload) <= 0)
+        return -1;
+    if(connection.payload == "File has been received successfully")
+        return 1;
+    if(connection.payload == "Range has been received successfully")
+        return 0;
+    error = connection.payload;
+    return -2;
+}
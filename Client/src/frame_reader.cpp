@@ -0,0 +1,75 @@
+#include "frame_reader.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+/**
+ * @brief Reads the next frame.
+ *
+ * @details
+ * The header is taken from the buffer, which is refilled with one large recv when it holds less than a header.
+ * The payload is copied out of the buffer as far as it has been received already; the rest is received directly
+ * into `payload`, which keeps its capacity between calls when the caller reuses it.
+ *
+ * @param sock The socket connected to the server.
+ * @param header Receives the header of the frame.
+ * @param payload Receives the payload of the frame.
+ * @return 1 if a frame has been read, 0 if the connection was closed, -1 on a receive error, -2 if the frame
+ *         has an unknown version and -3 if it is a File or Signature frame longer than FRAME_CHUNK_MAX_LENGTH, which isn't
+ *         received. After -2 and -3 the connection can't be read any further.
+ */
+int FrameReader::read(SOCKET sock, FrameHeader& header, std::string& payload) {
+    while (tail - head < FRAME_HEADER_SIZE) {
+        int res = fill(sock);
+        if (res <= 0)
+            return res;
+    }
+
+    if (!header.decode(buffer.get() + head))
+        return -2;
+    if ((header.type == FrameType::File || header.type == FrameType::Signature) && header.length > FRAME_CHUNK_MAX_LENGTH)
+        return -3;
+    head += FRAME_HEADER_SIZE;
+
+    payload.resize(header.length);
+    size_t buffered = std::min<size_t>(tail - head, header.length);
+    memcpy(payload.data(), buffer.get() + head, buffered);
+    head += buffered;
+
+    // Receive the rest of a large payload in place
+    size_t received = buffered;
+    while (received < header.length) {
+        int chunk = static_cast<int>(std::min<size_t>(header.length - received, INT_MAX));
+        int res = recv(sock, payload.data() + received, chunk, 0);
+        if (res == 0)
+            return 0;
+        if (res < 0)
+            return -1;
+        received += res;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Receives as much as fits into the buffer.
+ *
+ * @details
+ * Unread bytes are moved to the front first, they are never more than a partial header.
+ *
+ * @param sock The socket connected to the server.
+ * @return The result of recv: > 0 on success, 0 if the connection was closed, -1 on error.
+ */
+int FrameReader::fill(SOCKET sock) {
+    if (head > 0) {
+        memmove(buffer.get(), buffer.get() + head, tail - head);
+        tail -= head;
+        head = 0;
+    }
+
+    int res = recv(sock, buffer.get() + tail, static_cast<int>(CAPACITY - tail), 0);
+    if (res > 0)
+        tail += res;
+
+    return res < 0 ? -1 : res;
+}
@@ -0,0 +1,36 @@
+/*
+ * Filename: frame_reader.h
+ *
+ * The `FrameReader` class reads frames (see protocol.h) from the connection to the server.
+ * It receives in large chunks into a heap-owned buffer that is reused for the whole connection,
+ * so small replies cost a single recv and several replies that arrive together cost one recv in
+ * total. Payloads larger than what is buffered are received straight into the caller's string.
+ */
+
+#ifndef DATATRANSMISSION_FRAME_READER_H
+#define DATATRANSMISSION_FRAME_READER_H
+
+#include "platform.h"
+#include "protocol.h"
+#include <memory>
+#include <string>
+
+class FrameReader {
+public:
+    static constexpr const size_t CAPACITY = 64 * 1024;
+
+    FrameReader() : buffer(new char[CAPACITY]) {}
+    FrameReader(const FrameReader&) = delete;
+    FrameReader& operator=(const FrameReader&) = delete;
+
+    int read(SOCKET sock, FrameHeader& header, std::string& payload);
+
+private:
+    std::unique_ptr<char[]> buffer;
+    size_t head = 0;
+    size_t tail = 0;
+
+    int fill(SOCKET sock);
+};
+
+#endif //DATATRANSMISSION_FRAME_READER_H
@@ -20,12 +20,15 @@ void print_usage() {
               << "  -p PORT          Defines the port number to connect on the server. Example: -p 9000.\n"
               << "  -u USERNAME      Uses a specific username when connecting to the server. Example: -u john.\n"
               << "  -w PASSWORD      Uses a specific password when connecting to the server. Example: -w password123.\n"
+              << "  -k CONNECTIONS   Opens that many extra data connections, `copy_to -p` and `copy_from -p` move a file\n"
+              << "                   in byte ranges over them in parallel. Example: -k 4.\n"
               << "  -h               Prints this usage message.\n"
               << "Example:\n"
               << "  ./Client.exe -s 192.168.1.100 -p 9000 -u john -w password123\n";
 }
 
 std::string ip, port, username, password;
+unsigned connections = 0;
 
 /**
  * @brief Parses command line arguments to get the flags and their values.
@@ -67,6 +70,16 @@ void get_flags(int argc, char **argv) {
             password = argv[i + 1];
             i++;
         }
+        if(strcmp(argv[i], "-k") == 0) {
+            if (i + 1 >= argc) { print_usage(); throw std::runtime_error("Incorrect usage"); }
+
+            char* end;
+            long count = strtol(argv[i + 1], &end, 10);
+            if (*end != '\0' || count < 0 || count > 64) { print_usage(); throw std::runtime_error("Incorrect usage"); }
+
+            connections = static_cast<unsigned>(count);
+            i++;
+        }
     }
 
     for(int i = 0, size = sizeof(check) / sizeof(bool); i < size; i++) {
@@ -98,7 +111,7 @@ int _cdecl main(int argc, char **argv)
 {
     try {
         get_flags(argc, argv);
-        client = std::make_unique<Client>(ip, port, username, password);
+        client = std::make_unique<Client>(ip, port, username, password, connections);
         client->run();
         return EXIT_SUCCESS;
     } catch (const std::runtime_error &e) {
@@ -16,11 +16,19 @@ void print_usage() {
     std::cout << "Usage: ./HostExec.exe [OPTION]...\n"
               << "Options:\n"
               << "  -p PORT                     specifies the port number for the server.\n"
+              << "  -t THREADS                  number of event loop threads (Linux, default 1).\n"
+              << "  -w WORKERS                  number of worker threads for blocking commands (Linux, default: one per core, 0 runs them inline).\n"
               << "  -n NAME PASSWORD            adds a user with the given name and password.\n"
               << "  -r NAME                     removes a user with the given name.\n"
               << "  -h                          prints this usage message.\n"
               << "  --set-cwd DIRECTORY PATH    sets the current directory.\n"
               << "  --set-startup               Boots the executable on server startup.\n"
+              << "  --io-uring                  uses the io_uring backend (Linux, falls back to epoll).\n"
+              << "  --lz4-checksum              adds a checksum to every block of the compressed files sent.\n"
+              << "  --codecs LIST               codecs offered to clients, e.g. lz4hc,lz4 (default zstd,lz4hc,lz4, add zstd-dict\n"
+              << "                              to compress short replies against a dictionary trained from them).\n"
+              << "  --compress-replies BYTES    compresses replies of at least BYTES bytes (default 65536, 0 never).\n"
+              << "  --max-range-upload BYTES    largest file copy_from -p may announce (default 0: the free space).\n"
               << "Example:\n"
               << "  ./HostExec.exe -p 9000 -n john password -r mary\n";
 }
@@ -37,6 +45,21 @@ bool set_startup = false;
 bool set_cwd = false;
 std::string cwd;
 
+bool io_uring = false;
+
+bool lz4_checksum = false;
+
+bool set_codecs = false;
+std::string codecs;
+
+long long reply_threshold = -1;
+
+long long max_range_upload = -1;
+
+int loop_threads = 1;
+
+int worker_threads = -1;
+
 /**
  * @brief Handles the command line arguments and assigns values to corresponding variables.
  *
@@ -58,6 +81,28 @@ void handle_args(int argc, char **argv, std::string &port) {
             i++;
         }
 
+        else if(strcmp(argv[i], "-t") == 0) {
+            if(i + 1 >= argc) { print_usage(); throw std::runtime_error("Incorrect usage"); }
+            try {
+                loop_threads = std::stoi(argv[i + 1]);
+            } catch (const std::exception &) {
+                print_usage();
+                throw std::runtime_error("Incorrect usage");
+            }
+            i++;
+        }
+
+        else if(strcmp(argv[i], "-w") == 0) {
+            if(i + 1 >= argc) { print_usage(); throw std::runtime_error("Incorrect usage"); }
+            try {
+                worker_threads = std::stoi(argv[i + 1]);
+            } catch (const std::exception &) {
+                print_usage();
+                throw std::runtime_error("Incorrect usage");
+            }
+            i++;
+        }
+
         else if(strcmp(argv[i], "-n") == 0) {
             if(i + 2 >= argc) { print_usage(); throw std::runtime_error("Incorrect usage"); }
             add = true;
@@ -77,6 +122,36 @@ void handle_args(int argc, char **argv, std::string &port) {
         }
         else if(strcmp(argv[i], "--set-startup") == 0)
             set_startup = true;
+        else if(strcmp(argv[i], "--io-uring") == 0)
+            io_uring = true;
+        else if(strcmp(argv[i], "--lz4-checksum") == 0)
+            lz4_checksum = true;
+        else if(strcmp(argv[i], "--codecs") == 0) {
+            if(i + 1 >= argc) { print_usage(); throw std::runtime_error("Incorrect usage"); }
+            set_codecs = true;
+            codecs = argv[i + 1];
+            i++;
+        }
+        else if(strcmp(argv[i], "--compress-replies") == 0) {
+            if(i + 1 >= argc) { print_usage(); throw std::runtime_error("Incorrect usage"); }
+            try {
+                reply_threshold = std::stoll(argv[i + 1]);
+            } catch (const std::exception &) {
+                print_usage();
+                throw std::runtime_error("Incorrect usage");
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--max-range-upload") == 0) {
+            if(i + 1 >= argc) { print_usage(); throw std::runtime_error("Incorrect usage"); }
+            try {
+                max_range_upload = std::stoll(argv[i + 1]);
+            } catch (const std::exception &) {
+                print_usage();
+                throw std::runtime_error("Incorrect usage");
+            }
+            i++;
+        }
         else if(strcmp(argv[i], "--set-cwd") == 0) {
             if(i + 1 >= argc) { print_usage(); throw std::runtime_error("Incorrect usage"); }
             set_cwd = true;
@@ -132,6 +207,39 @@ int _cdecl main(int argc, char **argv) {
         }
     }
 
+    if(server.setLoopThreads(loop_threads) == -1) {
+        std::cerr << "The number of event loop threads must be at least 1" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if(worker_threads != -1 && server.setWorkerThreads(worker_threads) == -1) {
+        std::cerr << "The number of worker threads can't be negative" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if(io_uring) {
+        if(server.enableIoUring() == -1)
+            std::cerr << "Server was built without io_uring support, using the default backend" << std::endl;
+    }
+
+    if(lz4_checksum)
+        server.enableBlockChecksums();
+
+    if(set_codecs && server.setCodecs(codecs) == -1) {
+        std::cerr << "Unknown codec in " << codecs << ", available: " << CodecRegistry::format(CodecRegistry::all()) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if(reply_threshold != -1 && server.setResponseThreshold(reply_threshold) == -1) {
+        std::cerr << "The size from which replies are compressed can't be negative" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if(max_range_upload != -1 && server.setMaxRangeUpload(max_range_upload) == -1) {
+        std::cerr << "The largest copy_from -p upload can't be negative" << std::endl;
+        return EXIT_FAILURE;
+    }
+
     try {
         int res = server.run();
 
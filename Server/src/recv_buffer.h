@@ -0,0 +1,110 @@
+/*
+ *  Filename: recv_buffer.h
+ *
+ *  The `RecvBuffer` class is the per-connection input buffer the event loops receive into and the
+ *  frame decoder reads from. It is a growable ring over one contiguous allocation: the loop writes
+ *  at the tail, the decoder consumes from the head, and the unread bytes are only moved back to the
+ *  front when the tail runs out of room. Frames are therefore always contiguous and the decoder
+ *  hands them to the handlers in place, without copying them or allocating per frame.
+ *
+ *  The memory is only allocated, moved or freed by `prepare`, which the loop calls right before it
+ *  receives. Everything else keeps pointers stable, so a receive request that is in flight on the
+ *  io_uring backend can't be invalidated by the decoder.
+ */
+
+#ifndef DATATRANSMISSION_RECV_BUFFER_H
+#define DATATRANSMISSION_RECV_BUFFER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+
+class RecvBuffer {
+public:
+    static constexpr const size_t MIN_CAPACITY = 16 * 1024;
+
+    RecvBuffer() = default;
+    RecvBuffer(const RecvBuffer&) = delete;
+    RecvBuffer& operator=(const RecvBuffer&) = delete;
+
+    // Unread bytes
+    char* data() { return buffer.get() + head; }
+    size_t size() const { return tail - head; }
+    bool empty() const { return head == tail; }
+
+    // Free room after the unread bytes
+    char* space() { return buffer.get() + tail; }
+    size_t spaceSize() const { return capacity == 0 ? 0 : capacity - 1 - tail; }
+
+    /**
+     * @brief Makes room for at least `minSpace` bytes after the unread bytes.
+     *
+     * @details
+     * Also makes room for the rest of the frame announced by expect(). One byte past the usable capacity is
+     * always kept free, so the decoder can terminate a frame that ends the buffer in place. A buffer that
+     * grew for a large frame is given back once it has been consumed.
+     *
+     * @param minSpace The minimum number of bytes to receive.
+     * @return Pointer to the free room.
+     */
+    char* prepare(size_t minSpace) {
+        const size_t unread = size();
+        const size_t needed = std::max(unread + minSpace, expected) + 1;
+
+        if (unread == 0)
+            head = tail = 0;
+
+        if (unread == 0 && capacity > SHRINK_ABOVE && needed <= MIN_CAPACITY) {
+            buffer.reset();
+            capacity = 0;
+        }
+
+        if (needed > capacity) {
+            size_t grown = std::max(MIN_CAPACITY, capacity);
+            while (grown < needed)
+                grown *= 2;
+
+            std::unique_ptr<char[]> larger(new char[grown]);
+            if (unread > 0)
+                memcpy(larger.get(), data(), unread);
+            buffer = std::move(larger);
+            capacity = grown;
+            head = 0;
+            tail = unread;
+        }
+        else if (head + needed > capacity) {
+            memmove(buffer.get(), data(), unread);
+            head = 0;
+            tail = unread;
+        }
+
+        return space();
+    }
+
+    // Marks `n` bytes written into space() as received
+    void commit(size_t n) { tail += n; }
+
+    // Drops `n` bytes from the front. The bytes behind them stay where they are, prepare() moves them.
+    void consume(size_t n) {
+        expected = 0;
+        head += n;
+    }
+
+    // Announces that the frame at the front is `frameSize` bytes long, so prepare() makes room for all of it
+    void expect(size_t frameSize) { expected = frameSize; }
+
+    // Drops every unread byte, keeping the room behind them like consume()
+    void clear() { head = tail; expected = 0; }
+
+private:
+    static constexpr const size_t SHRINK_ABOVE = 1 << 20;
+
+    std::unique_ptr<char[]> buffer;
+    size_t capacity = 0;
+    size_t head = 0;
+    size_t tail = 0;
+    size_t expected = 0;
+};
+
+#endif //DATATRANSMISSION_RECV_BUFFER_H
@@ -0,0 +1,104 @@
+/*
+ *  Filename: response_dictionary.h
+ *
+ *  The `ResponseDictionary` class keeps the zstd dictionary short replies are compressed against
+ *  (zstd-dict, see codec.h). Every reply the server sends adds a sample to a corpus of the most
+ *  recent ones; once FIRST_TRAINING samples have been gathered a dictionary is trained from the
+ *  corpus, and again after every RETRAIN_EVERY further samples, so it follows what the server is
+ *  used for. Every training gets the next version.
+ *
+ *  A session takes the current dictionary with its first short reply once one has been trained,
+ *  sends it to its client in front of that reply and keeps that version for its lifetime; until
+ *  then its short replies are sent raw. All users share the dictionary; commands run with the
+ *  rights of the server process, so a reply only holds what every authenticated user can read
+ *  anyway.
+ *
+ *  Thread-safe, replies are sampled on every event loop and worker thread.
+ */
+
+#ifndef DATATRANSMISSION_RESPONSE_DICTIONARY_H
+#define DATATRANSMISSION_RESPONSE_DICTIONARY_H
+
+#include "codec.h"
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class ResponseDictionary {
+public:
+    static constexpr const size_t MIN_REPLY = 32;               // shorter replies aren't compressed or sampled
+    static constexpr const size_t MAX_SAMPLE = 16 * 1024;       // longer replies are sampled from their start
+    static constexpr const size_t CORPUS_SIZE = 2 << 20;        // bytes of samples kept
+    static constexpr const size_t DICTIONARY_SIZE = 32 * 1024;
+    static constexpr const size_t FIRST_TRAINING = 512;         // samples
+    static constexpr const size_t RETRAIN_EVERY = 8192;         // samples
+
+    // Adds a reply to the corpus. Returns true when enough new samples have been gathered for a training, which
+    // the caller runs (train) wherever it likes; no other one is requested until it has finished.
+    bool sample(const std::string& reply) {
+        if (reply.size() < MIN_REPLY)
+            return false;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        samples.emplace_back(reply, 0, std::min(reply.size(), MAX_SAMPLE));
+        corpusSize += samples.back().size();
+        while (corpusSize > CORPUS_SIZE) {
+            corpusSize -= samples.front().size();
+            samples.pop_front();
+        }
+
+        newSamples++;
+        if (training || newSamples < (version == 0 ? FIRST_TRAINING : RETRAIN_EVERY))
+            return false;
+        training = true;
+        return true;
+    }
+
+    // Trains the next version from the corpus. Returns the new dictionary, or nullptr if none could be trained,
+    // in which case the current one stays.
+    std::shared_ptr<const ZstdDictionary> train() {
+        std::string corpus;
+        std::vector<size_t> sizes;
+        uint32_t next;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            corpus.reserve(corpusSize);
+            for (const auto& sample : samples) {
+                corpus += sample;
+                sizes.push_back(sample.size());
+            }
+            newSamples = 0;
+            next = version + 1;
+        }
+
+        // The corpus is copied, so replies are sampled on while the training runs
+        std::shared_ptr<const ZstdDictionary> trained = ZstdDictionary::train(corpus, sizes, DICTIONARY_SIZE, next);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        training = false;
+        if (trained) {
+            dictionary = trained;
+            version = next;
+        }
+        return trained;
+    }
+
+    // The dictionary new sessions get, nullptr until the first training
+    std::shared_ptr<const ZstdDictionary> current() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dictionary;
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::deque<std::string> samples;
+    size_t corpusSize = 0;
+    size_t newSamples = 0;
+    bool training = false;
+    uint32_t version = 0;
+    std::shared_ptr<const ZstdDictionary> dictionary;
+};
+
+#endif //DATATRANSMISSION_RESPONSE_DICTIONARY_H
@@ -1,5 +1,13 @@
 #include "server.h"
-#include <lz4.h>
+#include <climits>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <csignal>
+#endif
 
 /**
  * @brief Handles the command received from the client.
@@ -12,29 +20,41 @@
  *
  * @note It is assumed that the Server class has been properly initialized before calling this function.
  *
+ * @param session The session the command was received on, every reply goes back to it.
  * @param command The command received from the client.
  * @return An integer value representing the result of the command execution:
  *         - 0: The command was handled successfully.
  *         - 1: An error occurred while executing the command.
  *         - 2: The exit command was received.
  */
-bool STOP = false;
+std::atomic<bool> STOP = false;
+
+thread_local Server::Outbox* Server::outbox = nullptr;
+
+#ifdef __linux__
+thread_local Mailbox* Server::mailbox = nullptr;
+thread_local int Server::epollFd = -1;
+#endif
+
+#ifdef DATATRANSMISSION_IO_URING
+thread_local Server::UringBackend* Server::uring = nullptr;
+#endif
 
-int Server::handleCommand(char* command) {
+int Server::handleCommand(Session& session, char* command) {
     try {
         if (strncmp(command, "pwd", 3) == 0) {
-            if (handlePwdCommand() == -1) {
-                handleError("pwd");
+            if (handlePwdCommand(session) == -1) {
+                handleError(session, "pwd");
             }
             return 0;
         }
         else if (strncmp(command, "copy_from ", 10) == 0) {
-            int res = handleCopyFromCommand(command);
+            int res = handleCopyFromCommand(session, command);
             if (res == -1) {
-                handleError("copy_from");
+                handleError(session, "copy_from");
             }
             else if (res == -2) { // Time out return
-                handleTimeout();
+                handleTimeout(session);
             }
             return 0;
         }
@@ -43,83 +63,85 @@ int Server::handleCommand(char* command) {
             return 2;
         }
         else if (strncmp(command, "cd ", 3) == 0) {
-            if (handleChangeDirectoryCommand(command + 3) == -1) {
-                handleError("cd");
+            if (handleChangeDirectoryCommand(session, command + 3) == -1) {
+                handleError(session, "cd");
             }
             return 0;
         }
         else if (strncmp(command, "ls", 2) == 0) {
-            if (handleLsCommand(command) == -1) {
-                handleError("ls");
+            if (handleLsCommand(session, command) == -1) {
+                handleError(session, "ls");
             }
             return 0;
         }
         else if (strncmp(command, "mkdir ", 6) == 0) {
-            if (handleMakeDirectoryCommand(command) == -1) {
-                handleError("mkdir");
+            if (handleMakeDirectoryCommand(session, command) == -1) {
+                handleError(session, "mkdir");
             }
             return 0;
         }
         else if (strncmp(command, "touch ", 6) == 0) {
-            if (handleTouchFileCommand(command) == -1) {
-                handleError("touch");
+            if (handleTouchFileCommand(session, command) == -1) {
+                handleError(session, "touch");
             }
             return 0;
         }
         else if (strncmp(command, "rm ", 3) == 0) {
-            if (handleRemoveFileCommand(command) == -1) {
-                handleError("rm");
+            if (handleRemoveFileCommand(session, command) == -1) {
+                handleError(session, "rm");
             }
             return 0;
         }
         else if (strncmp(command, "rmdir ", 6) == 0) {
-            if (handleRemoveDirectoryCommand(command) == -1) {
-                handleError("rmdir");
+            if (handleRemoveDirectoryCommand(session, command) == -1) {
+                handleError(session, "rmdir");
             }
             return 0;
         }
         else if (strncmp(command, "run ", 4) == 0) {
-            if (handleRunCommand(command) == -1) {
-                handleError("run");
-            }
+            runOnWorker(session, [this, command = std::string(command)](Session& session) mutable {
+                if (handleRunCommand(session, command.data()) == -1) {
+                    handleError(session, "run");
+                }
+            });
             return 0;
         }
         else if (strncmp(command, "copy_to ", 8) == 0) {
             shiftStrLeft(command, 8);
-            if (handleCopyCommand(command) == -1) {
-                handleError("copy_pc");
+            if (handleCopyCommand(session, command) == -1) {
+                handleError(session, "copy_pc");
             }
             return 0;
         }
         else if (strncmp(command, "cat ", 4) == 0) {
-            if (handleCatCommand(command) == -1) {
-                handleError("cat");
+            if (handleCatCommand(session, command) == -1) {
+                handleError(session, "cat");
             }
             return 0;
         }
         else if (strncmp(command, "echo ", 5) == 0) {
-            if (handleEchoCommand(command) == -1) {
-                handleError("echo");
+            if (handleEchoCommand(session, command) == -1) {
+                handleError(session, "echo");
             }
             return 0;
         }
         else if (strcmp(command, "move_startup") == 0) {
-            int res = move_start();
+            int res = move_start(session);
             if (res == -1) {
-                handleError("move_startup");
+                handleError(session, "move_startup");
             }
             else if (res == -2) {
-                handleStartupError(1);
+                handleStartupError(session, 1);
             }
             return 0;
         }
         else if (strcmp(command, "remove_startup") == 0) {
-            int res = remove_start();
+            int res = remove_start(session);
             if (res == -1) {
-                handleError("remove_startup");
+                handleError(session, "remove_startup");
             }
             else if (res == -2) {
-                handleStartupError(2);
+                handleStartupError(session, 2);
             }
             return 0;
         }
@@ -141,41 +163,51 @@ int Server::handleCommand(char* command) {
             }
 
             if (space_counter != 2) {
-                handleError("mv");
+                handleError(session, "mv");
             }
-            if (handleMoveCommand(command) == -1) {
-                handleError("mv");
+            if (handleMoveCommand(session, command) == -1) {
+                handleError(session, "mv");
             }
             return 0;
         }
         else if (strncmp(command, "cp ", 3) == 0) {
-            if (handleCpCommand(command) == -1) {
-                handleError("cp");
+            if (handleCpCommand(session, command) == -1) {
+                handleError(session, "cp");
             }
             return 0;
         }
         else if (strncmp(command, "find ", 5) == 0) {
-            if (handleFindCommand(command) == -1) {
-                handleError("find");
-            }
+            runOnWorker(session, [this, command = std::string(command)](Session& session) mutable {
+                if (handleFindCommand(session, command.data()) == -1) {
+                    handleError(session, "find");
+                }
+            });
             return 0;
         }
         else if (strncmp(command, "grep ", 5) == 0) {
-            if (handleGrepCommand(command) == -1) {
-                handleError("grep");
+            runOnWorker(session, [this, command = std::string(command)](Session& session) mutable {
+                if (handleGrepCommand(session, command.data()) == -1) {
+                    handleError(session, "grep");
+                }
+            });
+            return 0;
+        }
+        else if (strcmp(command, "stats") == 0) {
+            if (handleStatsCommand(session) == -1) {
+                handleError(session, "stats");
             }
             return 0;
         }
         else if (strcmp(command, "check_startup") == 0) {
-            if (handleCheckInStartup() == -1) {
-                handleError("check_startup");
+            if (handleCheckInStartup(session) == -1) {
+                handleError(session, "check_startup");
             }
             return 0;
         }
         // Check for authentication
         else if (strncmp(command, "auth: ", 6) == 0) {
-            if (handleAuth(command) == -1) {
-                handleError("Auth");
+            if (handleAuth(session, command) == -1) {
+                handleError(session, "Auth");
             }
             return 0;
         }
@@ -193,14 +225,14 @@ int Server::handleCommand(char* command) {
             }
 
             if (space_counter != 1)
-                handleWrongUsage("add_user");
+                handleWrongUsage(session, "add_user");
 
             int ret = addUser(name, password);
             if (ret == -1)
-                handleError("add_user");
+                handleError(session, "add_user");
 
             else if (ret == -2) {
-                if (handleSend(std::format("{} already in database", name), LastSock) == -1)
+                if (handleSend(std::format("{} already in database", name), session) == -1)
                     throw std::runtime_error("failed to send message!");
             }
 
@@ -209,20 +241,20 @@ int Server::handleCommand(char* command) {
         else if (strncmp(command, "remove_user ", 12) == 0) {
             shiftStrLeft(command, 12);
             if (remUser(command) == -1)
-                handleError("remove_user");
+                handleError(session, "remove_user");
 
             return 0;
         }
         else if (strncmp(command, "cut ", 4) == 0) {
             shiftStrLeft(command, 4);
-            if (handleCutCommand(command) == -1) {
-                handleError("cut");
+            if (handleCutCommand(session, command) == -1) {
+                handleError(session, "cut");
             }
             return 0;
         }
         else {
-            if (sendCmdDoesntExist()) {
-                handleError("send");
+            if (sendCmdDoesntExist(session)) {
+                handleError(session, "send");
             }
             return 0;
         }
@@ -266,19 +298,9 @@ bool Server::setupPort() {
  * This function initializes the server by performing the following steps:
  * 1. Calls WSAStartup to initialize the Winsock library.
  * 2. Checks for any errors during the initialization process and returns false if there is an error.
- * 3. Sets up the server address and port using getaddrinfo.
- * 4. Checks for any errors in resolving the address and returns false if there is an error.
- * 5. Creates a socket for the server to listen for client connections.
- * 6. Checks for any errors in creating the socket and returns false if there is an error.
- * 7. Binds the socket to the server address and port.
- * 8. Checks for any errors in binding the socket and returns false if there is an error.
- * 9. Frees the memory allocated for the address information.
- * 10. Listens for client connections on the socket.
- * 11. Checks for any errors in listening for client connections and returns false if there is an error.
- * 12. Accepts a client socket.
- * 13. Checks for any errors in accepting the client socket and returns false if there is an error.
- * 14. Closes the listening socket.
- * 15. Returns true to indicate successful initialization.
+ * 3. Raises the open file limit on Linux so the event loops can hold thousands of sessions.
+ * 4. Creates the listening socket with openListenSocket.
+ * 5. Returns true to indicate successful initialization.
  *
  * @return bool - true if the server is successfully initialized, false otherwise.
  */
@@ -290,6 +312,36 @@ bool Server::initServer() {
         return false;
     }
 
+#ifdef __linux__
+    // Thousands of idle sessions need thousands of descriptors, so lift the soft limit to the hard one
+    rlimit fdLimit{};
+    if (getrlimit(RLIMIT_NOFILE, &fdLimit) == 0 && fdLimit.rlim_cur < fdLimit.rlim_max) {
+        fdLimit.rlim_cur = fdLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fdLimit);
+    }
+#endif
+
+    ListenSocket = openListenSocket();
+    return ListenSocket != INVALID_SOCKET;
+}
+
+/**
+ * @brief Creates a socket listening on the server port.
+ *
+ * @details
+ * This function performs the following steps:
+ * 1. Sets up the server address and port using getaddrinfo.
+ * 2. Creates a socket for the server to listen for client connections.
+ * 3. On Linux, enables SO_REUSEPORT so every event loop thread can bind its own listener to the
+ *    same port and the kernel spreads incoming connections across them.
+ * 4. Binds the socket to the server address and port.
+ * 5. Frees the memory allocated for the address information.
+ * 6. Listens for client connections on the socket.
+ * Any error is logged and INVALID_SOCKET is returned.
+ *
+ * @return The listening socket, INVALID_SOCKET on failure.
+ */
+SOCKET Server::openListenSocket() {
     ZeroMemory(&hints, sizeof(hints));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
@@ -297,57 +349,66 @@ bool Server::initServer() {
     hints.ai_flags = AI_PASSIVE;
 
     // Resolve the server address and port
-    iResult = getaddrinfo(NULL, port.c_str(), &hints, &result);
-    if (iResult != 0) {
-        std::cerr << "getaddrinfo failed with error: " << iResult << "\n";
-        log << "getaddrinfo failed with error: " << iResult << std::endl;
-        return false;
+    int res = getaddrinfo(NULL, port.c_str(), &hints, &result);
+    if (res != 0) {
+        std::cerr << "getaddrinfo failed with error: " << res << "\n";
+        log << "getaddrinfo failed with error: " << res << std::endl;
+        return INVALID_SOCKET;
     }
 
     // Create a SOCKET for the server to listen for client connections
-    ListenSocket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-    if (ListenSocket == INVALID_SOCKET) {
+    SOCKET sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (sock == INVALID_SOCKET) {
         std::cerr << "socket failed with error: " << WSAGetLastError() << "\n";
         log << "socket failed with error: " << WSAGetLastError() << std::endl;
-        return false;
+        freeaddrinfo(result);
+        result = nullptr;
+        return INVALID_SOCKET;
     }
 
+#ifdef __linux__
+    int enable = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == SOCKET_ERROR)
+        log << "setsockopt(SO_REUSEPORT) failed with error: " << WSAGetLastError() << std::endl;
+#endif
+
     // Set up the TCP listening socket
-    iResult = bind(ListenSocket, result->ai_addr, (int)result->ai_addrlen);
-    if (iResult == SOCKET_ERROR) {
+    res = bind(sock, result->ai_addr, (int)result->ai_addrlen);
+    freeaddrinfo(result);
+    result = nullptr;
+
+    if (res == SOCKET_ERROR) {
         std::cerr << "bind failed with error: " << WSAGetLastError() << "\n";
         log << "bind failed with error: " << WSAGetLastError() << std::endl;
-        closesocket(ListenSocket);
-        return false;
+        closesocket(sock);
+        return INVALID_SOCKET;
     }
 
-    freeaddrinfo(result);
-
-    iResult = listen(ListenSocket, SOMAXCONN);
-    if (iResult == SOCKET_ERROR) {
+    res = listen(sock, SOMAXCONN);
+    if (res == SOCKET_ERROR) {
         std::cerr << "listen failed with error: " << WSAGetLastError() << "\n";
         log << "listen failed with error: " << WSAGetLastError() << std::endl;
-        closesocket(ListenSocket);
-        return false;
+        closesocket(sock);
+        return INVALID_SOCKET;
     }
 
-    return true;
+    return sock;
 }
 
 /**
  * @brief Handle the "pwd" command by sending the current directory to the client.
  *
  * @details
- * The current directory on the server is obtained using std::filesystem::current_path().
+ * The current directory is the working directory of the client's session.
  * The current directory is then sent to the client through the socket connection.
  * If the send operation fails, an error message is printed and -1 is returned.
  *
  * @return 0 if the command is handled successfully, -1 otherwise.
  */
-int Server::handlePwdCommand() {
-    std::string cwd = std::filesystem::current_path().string();
+int Server::handlePwdCommand(Session& session) {
+    std::string cwd = session.cwd.string();
 
-    if (handleSend(cwd, LastSock) == -1)
+    if (handleSend(cwd, session) == -1)
         return -1;
 
     return 0;
@@ -369,7 +430,8 @@ void Server::handleExitCommand() {
  * @brief Changes the working directory of the server.
  *
  * @details
- * This function changes the current working directory of the server to the specified path.
+ * This function changes the working directory of the client's session to the specified path.
+ * Other sessions keep their own working directory.
  * If the path is valid and the directory is successfully changed, a success message is sent
  * back to the client. If an error occurs while changing the directory, an error message is
  * sent back to the client.
@@ -377,10 +439,14 @@ void Server::handleExitCommand() {
  * @param path The path of the directory to change to.
  * @return 0 if the directory was successfully changed, -1 otherwise.
  */
-int Server::handleChangeDirectoryCommand(const char* path) {
+int Server::handleChangeDirectoryCommand(Session& session, const char* path) {
     try {
-        std::filesystem::current_path(path);
-        std::string cwd = std::filesystem::current_path().string();
+        std::filesystem::path target = std::filesystem::canonical(resolvePath(session, path));
+        if (!std::filesystem::is_directory(target))
+            throw std::filesystem::filesystem_error("Not a directory", target, std::make_error_code(std::errc::not_a_directory));
+
+        session.cwd = target;
+        std::string cwd = session.cwd.string();
 
         char sendBuf[DEFAULT_BUFLEN];
         int n = snprintf(sendBuf, DEFAULT_BUFLEN, "Changed working directory to %s", cwd.c_str());
@@ -390,7 +456,7 @@ int Server::handleChangeDirectoryCommand(const char* path) {
             return -1;
         }
 
-        if (handleSend(sendBuf, LastSock) == -1)
+        if (handleSend(sendBuf, session) == -1)
             return -1;
 
         return 0;
@@ -399,7 +465,7 @@ int Server::handleChangeDirectoryCommand(const char* path) {
         char sendBuf[DEFAULT_BUFLEN];
         snprintf(sendBuf, DEFAULT_BUFLEN, "Error changing directory: %s\n", e.what());
 
-        if (handleSend(sendBuf, LastSock) == -1)
+        if (handleSend(sendBuf, session) == -1)
             return -1;
 
         return 0;
@@ -420,25 +486,20 @@ int Server::handleChangeDirectoryCommand(const char* path) {
  * @note The function assumes that the command parameter is either "ls" or "ls <directory>".
  *       If the command is "ls", the function will list the contents of the current directory.
  *       If the command is "ls <directory>", the function will list the contents of the specified directory.
- *       The function uses the ClientSocket member variable to send data to the client.
+ *       The function sends the listing to the session the command came from.
  *       The function also uses the log member variable to log success or failure of the operation.
  *       The function relies on the shiftStrLeft function to remove the "ls " prefix from the command.
  *       The function uses the std::filesystem library to perform directory operations.
  */
-int Server::handleLsCommand(char* command) {
-    std::string prevDirectory;
+int Server::handleLsCommand(Session& session, char* command) {
     std::string cwd;
-    bool thisDirectory = false;
 
     if (strcmp(command, "ls") == 0)
-        cwd = std::filesystem::current_path().string();
+        cwd = session.cwd.string();
     else {
         try {
             shiftStrLeft(command, 3);
-            prevDirectory = std::filesystem::current_path().string();
-            std::filesystem::current_path(command);
-            cwd = std::filesystem::current_path().string();
-            thisDirectory = true;
+            cwd = std::filesystem::canonical(resolvePath(session, command)).string();
         }
         catch (const std::exception& e) {
             std::cerr << "Error in handleLS not current directory, error code: " << e.what() << std::endl;
@@ -453,12 +514,9 @@ int Server::handleLsCommand(char* command) {
             directoryContents += entry.path().filename().string() + "\n";
         }
 
-        if (handleSend(directoryContents, LastSock) == -1)
+        if (handleSend(directoryContents, session) == -1)
             return -1;
 
-        if (thisDirectory)
-            std::filesystem::current_path(prevDirectory);
-
         log << "SUCCESS!" << std::endl;
         return 0;
 
@@ -467,7 +525,7 @@ int Server::handleLsCommand(char* command) {
         char sendBuf[DEFAULT_BUFLEN];
         snprintf(sendBuf, DEFAULT_BUFLEN, "Error executing ls: %s", e.what());
 
-        if (handleSend(sendBuf, LastSock) == -1)
+        if (handleSend(sendBuf, session) == -1)
             return -1;
 
         return 0;
@@ -483,9 +541,9 @@ int Server::handleLsCommand(char* command) {
  *
  * @return int - Returns 0 if the error message is successfully sent, -1 otherwise.
  */
-int Server::sendCmdDoesntExist() {
+int Server::sendCmdDoesntExist(Session& session) {
     std::string sendBuf = "The command doesn't exist";
-    if (handleSend(sendBuf, LastSock) == -1)
+    if (handleSend(sendBuf, session) == -1)
         return -1;
 
     return 0;
@@ -505,18 +563,20 @@ int Server::sendCmdDoesntExist() {
  * @note The path parameter should be a valid null-terminated C string.
  *       The function assumes that the initial 6 characters of the path are to be ignored.
  *       If the CreateDirectory function call fails, the function returns -1.
- *       Otherwise, it sends a success message to the client using the ClientSocket
+ *       Otherwise, it sends a success message to the client using its session
  *       and logs the success message to the log file.
  */
-int Server::handleMakeDirectoryCommand(char* path) {
+int Server::handleMakeDirectoryCommand(Session& session, char* path) {
     shiftStrLeft(path, 6);
 
     // Creates a directory if it doesn't exist already
-    if (CreateDirectory(reinterpret_cast<LPCSTR>(LPCWSTR(path)), NULL) || ERROR_ALREADY_EXISTS == GetLastError())
+    std::error_code ec;
+    std::filesystem::create_directory(resolvePath(session, path), ec);
+    if (!ec)
     {
         std::string sendSuc = std::format("Directory {} was successfully created!", path);
 
-        if (handleSend(sendSuc, LastSock) == -1)
+        if (handleSend(sendSuc, session) == -1)
             return -1;
 
         return 0;
@@ -538,10 +598,10 @@ int Server::handleMakeDirectoryCommand(char* path) {
  * @returns 0 if the file is successfully created and the success message is sent to the client,
  *          -1 if there is an error while creating the file or sending the success message.
  */
-int Server::handleTouchFileCommand(char* fileName) {
+int Server::handleTouchFileCommand(Session& session, char* fileName) {
     shiftStrLeft(fileName, 6);
 
-    std::ofstream file(fileName);
+    std::ofstream file(resolvePath(session, fileName));
     if (!file)
     {
         std::cerr << "Error in opening " << fileName << std::endl;
@@ -550,7 +610,7 @@ int Server::handleTouchFileCommand(char* fileName) {
 
     std::string sendSuc = std::format("{} was successfully created!", fileName);
 
-    if (handleSend(sendSuc, LastSock) == -1) {
+    if (handleSend(sendSuc, session) == -1) {
         file.close();
         return -1;
     }
@@ -566,7 +626,7 @@ int Server::handleTouchFileCommand(char* fileName) {
  * This function removes a directory and all the files inside it recursively.
  * It first shifts the given path to remove the command prefix. Then it attempts
  * to remove the directory using std::filesystem::remove_all. If the removal
- * is successful, it sends a success message to the client using the ClientSocket.
+ * is successful, it sends a success message to the client using its session.
  * If an error occurs during the removal or sending the success message, an error
  * is printed to stderr and the function returns -1. Otherwise, it logs the
  * successful removal and returns 0.
@@ -575,15 +635,15 @@ int Server::handleTouchFileCommand(char* fileName) {
  *
  * @return 0 if the removal is successful, -1 otherwise.
  */
-int Server::handleRemoveDirectoryCommand(char* path) {
+int Server::handleRemoveDirectoryCommand(Session& session, char* path) {
     shiftStrLeft(path, 6);
 
     // Removes folder + all files inside of it recursively
     try {
-        std::filesystem::remove_all(path);
+        std::filesystem::remove_all(resolvePath(session, path));
         std::string sendSuc = std::format("Directory {} was successfully removed!", path);
 
-        if (handleSend(sendSuc, LastSock) == -1)
+        if (handleSend(sendSuc, session) == -1)
             return -1;
 
     }
@@ -608,15 +668,15 @@ int Server::handleRemoveDirectoryCommand(char* path) {
  *
  * @returns 0 if the file is successfully removed, -1 if there is an error.
  */
-int Server::handleRemoveFileCommand(char* fileName) {
+int Server::handleRemoveFileCommand(Session& session, char* fileName) {
     shiftStrLeft(fileName, 3);
 
     // Removes specified file
     try {
-        if (std::filesystem::remove(fileName)) {
+        if (std::filesystem::remove(resolvePath(session, fileName))) {
             std::string sendSuc = std::format("{} was successfully removed!", fileName);
 
-            if (handleSend(sendSuc, LastSock) == -1)
+            if (handleSend(sendSuc, session) == -1)
                 return -1;
         }
         else {
@@ -636,65 +696,441 @@ int Server::handleRemoveFileCommand(char* fileName) {
  * @brief Handles the copy command.
  *
  * @details
- * This function handles the copy command by copying the contents of the specified file to the client.
- * If the file is larger than 1MB, it compresses the contents before sending.
+ * This function starts streaming the specified file to the client through a transfer pipeline: the worker pool
+ * opens and reads the file (readDownload) and compresses the chunks (compressDownload), while the event loop
+ * sends the chunks that are ready (sendDownload). The level of the file is chosen once it has been opened, from
+ * samples of its contents (CompressionPolicy::forFile) and from what the link and the codec have achieved so far
+ * (LinkEstimate::choose); it may be raw. Every block is checked again before it is compressed
+ * (CompressionPolicy::forBlock), and a block that looks compressed already or doesn't shrink is sent raw. The
+ * chunks are compressed on several workers at once and sent in order. The session stays busy until the last
+ * chunk has been queued. Runs on the event loop.
+ *
+ * `copy_to -c ID OFFSET CHECKSUM NAME` resumes a download the client has a checkpoint of (transfer_checkpoint.h):
+ * if the file is still the one with that ID and the window in front of OFFSET has that checksum, it is sent from
+ * OFFSET on, otherwise from the start. `copy_to -d NAME` sends the file as a delta against the client's copy, whose
+ * signature the client sent in front of the command (delta_transfer.h).
+ *
+ * `copy_to -p NAME` only names a file that the client moves in ranges over its data connections (handleRangesCommand),
+ * `copy_to -R OFFSET LENGTH NAME` sends one of them: LENGTH bytes from OFFSET on (range_transfer.h).
+ *
+ * `copy_to -r NAME` sends the directory NAME with everything in it, as an archive that is streamed like the contents
+ * of a file (tree_archive.h).
  *
  * @param fileName The name of the file to copy.
- * @return 0 on success, -1 on failure.
+ * @param removeSource Remove the file once it has been sent (cut).
+ * @return 0, a file that can't be opened is reported once the worker pool has tried.
  */
-int Server::handleCopyCommand(char* fileName) {
-    std::ifstream input(fileName, std::ios::in | std::ios::binary);
-    if (!input)
-        return -1;
+int Server::handleCopyCommand(Session& session, char* fileName, bool removeSource) {
+    auto reader = std::make_shared<DownloadReader>();
+    unsigned long long id, offset, rangeLength;
+    unsigned checksum;
+    int length = 0;
+    if (!removeSource && strncmp(fileName, "-p ", 3) == 0)
+        return handleRangesCommand(session, fileName + 3, false);
+    if (!removeSource && sscanf(fileName, "-R %llu %llu %n", &offset, &rangeLength, &length) == 2 && length > 0) {
+        reader->ranged = true;
+        reader->range = ByteRange{offset, rangeLength};
+        fileName += length;
+    }
+    else if (!removeSource && sscanf(fileName, "-c %llx %llu %x %n", &id, &offset, &checksum, &length) == 3 && length > 0) {
+        reader->resume = TransferCheckpoint{id, offset};
+        reader->resumeChecksum = checksum;
+        fileName += length;
+    }
+    else if (!removeSource && strncmp(fileName, "-r ", 3) == 0) {
+        reader->tree = true;
+        fileName += 3;
+    }
+    else if (!removeSource && strncmp(fileName, "-d ", 3) == 0) {
+        // The signature of the client's copy came in front of the command
+        fileName += 3;
+        auto signature = std::make_shared<DeltaSignature>();
+        if (session.signatureComplete && signature->decode(session.signature))
+            reader->signature = std::move(signature);
+        session.signature.clear();
+        session.signatureComplete = false;
+    }
+
+    reader->path = resolvePath(session, fileName);
+    reader->command = removeSource ? "cut" : "copy_pc";
+    reader->link = session.link;
+    reader->codecThreads = workers ? workers->size() : 1;
+    reader->codecs = session.codecs;
+#ifdef __linux__
+    // The send requests of the io_uring backend can only send from memory
+    reader->zeroCopy = true;
+#ifdef DATATRANSMISSION_IO_URING
+    reader->zeroCopy = uring == nullptr;
+#endif
+#endif
+
+    auto pipeline = std::make_shared<TransferPipeline>(TransferPipeline::depthFor(workers ? workers->size() : 1));
+    pipeline->setStage(TransferPipeline::SOURCE, poolExecutor(), [this, reader](TransferPipeline& pipeline) {
+        readDownload(pipeline, *reader);
+    });
+    pipeline->setParallelCodec(poolExecutor(), [this, reader](TransferPipeline::Chunk& chunk) {
+        compressDownload(chunk, *reader);
+    });
+    pipeline->setStage(TransferPipeline::SINK, loopExecutor(session), [this, &session, reader](TransferPipeline& pipeline) {
+        sendDownload(session, pipeline, *reader);
+    });
+
+    session.download = std::make_unique<Session::Download>();
+    session.download->pipeline = pipeline;
+    session.download->path = reader->path;
+    session.download->command = reader->command;
+    session.download->stats.codecs = session.codecs;
+    session.download->removeSource = removeSource;
+    session.busy = true;
+
+    pipeline->start();
+    return 0;
+}
 
-    std::string file_contents;
+/**
+ * @brief SOURCE stage of a download: reads the next chunks of the file.
+ *
+ * @details
+ * The first run opens the file. Every free chunk of the pipeline is filled with the next STREAM_CHUNK bytes and
+ * handed on to the codec. On Linux chunks that aren't going to be compressed aren't read at all: they refer to
+ * their range of the file, which flushOutput sends with sendfile. With --io-uring the chunks are read through the
+ * file ring of the worker thread instead, all free chunks with one submission (uringReadChunks). A file that can't
+ * be opened or read to the end yields a failed chunk, which ends the download. The chunks of a tree are blocks of its archive, which a few threads
+ * of its own walk the tree for (tree_archive.h). Runs on the worker pool.
+ *
+ * @param pipeline The pipeline of the download.
+ * @param reader The file the download reads from.
+ */
+void Server::readDownload(TransferPipeline& pipeline, DownloadReader& reader) {
+    // The walk of a tree starts right away, its level is chosen once the first block of its archive has been read
+    if (!reader.opened && reader.tree) {
+        reader.opened = true;
+        std::error_code ec;
+        const bool directory = std::filesystem::is_directory(reader.path, ec);
+        reader.error = ec ? ec.value() : directory ? 0 : ENOTDIR;
+        if (directory)
+            reader.archive = std::make_unique<ArchiveWriter>(reader.path);
+    }
+
+    if (!reader.opened) {
+        reader.opened = true;
+
+        std::error_code ec;
+        reader.remaining = std::filesystem::file_size(reader.path, ec);
+        reader.size = reader.remaining;
+        reader.id = TransferCheckpoint::idOf(reader.path);
+        if (!ec)
+            reader.file.open(reader.path, std::ios::in | std::ios::binary);
+        // Reported from the event loop, whose thread has an error code of its own
+        reader.error = ec ? ec.value() : reader.file.is_open() ? 0 : errno;
+
+        // Decided from samples of the contents and from what the link and the codec have achieved so far
+        if (reader.file.is_open()) {
+            double ratio = 1.0;
+            CompressionLevel content = CompressionPolicy::forFile(reader.file, reader.remaining, &ratio);
+
+            // The client's copy in front of the checkpoint is still the same as the file, it only needs the rest
+            uint32_t checksum;
+            if (reader.resume.offset > 0 && reader.resume.id == reader.id && reader.resume.offset <= reader.size
+                && TransferCheckpoint::windowChecksum(reader.path, reader.resume.offset, checksum) && checksum == reader.resumeChecksum) {
+                reader.start = reader.offset = reader.resume.offset;
+                reader.remaining -= reader.start;
+                reader.file.seekg(static_cast<std::streamoff>(reader.start));
+                log << reader.command << " " << reader.path.string() << ": resumed at " << reader.start << std::endl;
+            }
+            // A range past the end of the file is cut short, the client finds out from the announced size
+            else if (reader.ranged) {
+                reader.start = reader.offset = std::min(reader.range.offset, reader.size);
+                reader.remaining = std::min(reader.range.length, reader.size - reader.start);
+                reader.file.seekg(static_cast<std::streamoff>(reader.start));
+            }
 
-    char c;
-    while (input.get(c))
-    {
-        file_contents += c;
-    }
-
-    // Checks if the file is bigger than 1MB, if yes it's getting compressed before getting sent
-    std::filesystem::path file{ fileName };
-    bool comp = false;
-    size_t originalSize = file_contents.size();
-
-    if (std::filesystem::file_size(file) > 1000000) {
-        int maxCompressedSize = LZ4_compressBound(static_cast<int>(originalSize));
-        char* compressed = new char[maxCompressedSize];
-        int compressedSize = LZ4_compress_default(file_contents.c_str(), compressed, static_cast<int>(file_contents.size()), maxCompressedSize);
-        if (compressedSize < 0) {
-            // handle compression error
-            free(compressed);
-            input.close();
-            std::cerr << "Error in compressing file" << std::endl;
-            log << "Error in compressing file" << std::endl;
-            return -1;
+            LinkEstimate::Decision decision = reader.link->choose(content, ratio, reader.remaining, reader.codecThreads);
+            reader.level = decision.level;
+
+            std::string line = std::format("{} {}: {} ({})", reader.command, reader.path.filename().string(), reader.link->name(decision.level), decision.reason);
+            log << line << std::endl;
+            reader.link->record(std::move(line));
+
+            if (reader.signature)
+                reader.delta = std::make_unique<DeltaEncoder>(reader.signature, reader.file);
+        }
+
+#ifdef __linux__
+        // Small files are cheaper to copy than to send with an extra syscall, a delta is never sent from the file
+        if (reader.file.is_open() && reader.zeroCopy && !reader.delta && reader.remaining >= ZERO_COPY_MIN) {
+            int fd = open(reader.path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd != -1)
+                reader.source = std::make_shared<FileSource>(fd);
+        }
+#endif
+#ifdef DATATRANSMISSION_IO_URING
+        // The chunks that are read are read through the file ring of the worker, a delta reads the file itself
+        if (reader.file.is_open() && ioUring && !reader.delta) {
+            int fd = open(reader.path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd != -1)
+                reader.ringSource = std::make_unique<FileSource>(fd);
+        }
+#endif
+    }
+
+    std::vector<TransferPipeline::Chunk*> batch;    // read through the file ring once every free chunk has been taken
+    while (!reader.finished) {
+        TransferPipeline::Chunk* chunk = pipeline.acquire();
+        if (chunk == nullptr)
+            break;
+
+        const size_t len = static_cast<size_t>(std::min<uint64_t>(reader.remaining, STREAM_CHUNK));
+        chunk->offset = reader.offset;
+        chunk->length = len;
+        chunk->flags = reader.remaining > len ? FRAME_MORE : 0;
+
+        if (reader.archive) {
+            // Small files share a block, which is compressed as a whole
+            chunk->raw.clear();
+            const int more = reader.archive->next(chunk->raw, STREAM_CHUNK);
+            chunk->length = chunk->raw.size();
+            chunk->flags = more == 1 ? FRAME_MORE : 0;
+            chunk->failed = more == -1;
+            reader.finished = more != 1;
+
+            // A tree mixes all kinds of files, the blocks that don't compress are found one by one (forBlock). The
+            // first block tells how well the others are expected to.
+            if (reader.offset == 0) {
+                double ratio = 1.0;
+                CompressionPolicy::forSamples(chunk->raw.data(), chunk->length, &ratio);
+                LinkEstimate::Decision decision = reader.link->choose(CompressionLevel::Fast, ratio, chunk->length, reader.codecThreads);
+                reader.level = decision.level;
+
+                std::string line = std::format("{} -r {}: {} ({})", reader.command, reader.path.filename().string(), reader.link->name(decision.level), decision.reason);
+                log << line << std::endl;
+                reader.link->record(std::move(line));
+            }
+            reader.offset += chunk->length;
+        }
+        else if (!reader.file.is_open())
+            chunk->failed = true;
+        else if (reader.delta) {
+            // The instructions for the next part of the file take the place of its contents
+            chunk->raw.clear();
+            const int more = reader.delta->next(chunk->raw, STREAM_CHUNK);
+            chunk->length = chunk->raw.size();
+            chunk->flags = FRAME_DELTA | (more == 1 ? FRAME_MORE : 0);
+            chunk->failed = more == -1;
+            reader.finished = more != 1;
+        }
+#ifdef __linux__
+        else if (reader.source && reader.level == CompressionLevel::Raw)
+            chunk->inFile = true;
+#endif
+#ifdef DATATRANSMISSION_IO_URING
+        else if (reader.ringSource) {
+            chunk->raw.resize(len);
+            batch.push_back(chunk);
+        }
+#endif
+        else {
+            chunk->raw.resize(len);
+            reader.file.read(chunk->raw.data(), static_cast<std::streamsize>(len));
+            if (static_cast<size_t>(reader.file.gcount()) != len) {
+                std::cerr << "Failed to read " << reader.path << std::endl;
+                log << "Failed to read " << reader.path << std::endl;
+                chunk->failed = true;
+            }
         }
 
-        comp = true;
+        if (!reader.delta && !reader.archive) {
+            reader.offset += len;
+            reader.remaining -= len;
+            reader.finished = reader.remaining == 0;
+        }
+        reader.finished = reader.finished || chunk->failed;
+        chunk->last = reader.finished;
 
-        // Now we will prepend our file_contents with the necessary data
-        file_contents.clear();
-        file_contents += "\v\v\r";
-        file_contents += std::string(reinterpret_cast<char*>(&originalSize), sizeof(originalSize)); // Add original size
-        file_contents += std::string(reinterpret_cast<char*>(&compressedSize), sizeof(compressedSize)); // Add compressed size
-        file_contents.append(compressed, compressed + compressedSize); // Add compressed data
+        // Closed as soon as possible, the source of a cut is removed once the last chunk has been sent
+        if (reader.finished)
+            reader.file.close();
 
-        free(compressed);
+        if (batch.empty())
+            pipeline.submit(chunk);
     }
 
-    if (!comp)
-        file_contents.insert(0, "\v\v");
+#ifdef DATATRANSMISSION_IO_URING
+    if (batch.empty())
+        return;
 
-    if (handleSend(file_contents, LastSock) == -1) {
-        input.close();
-        return -1;
+    // The chunks behind one that couldn't be read are never sent, the failed one ends the download
+    const size_t read = uringReadChunks(reader.ringSource->fd, batch);
+    if (read < batch.size()) {
+        std::cerr << "Failed to read " << reader.path << std::endl;
+        log << "Failed to read " << reader.path << std::endl;
+        batch[read]->failed = batch[read]->last = true;
+        batch.resize(read + 1);
+        reader.finished = true;
+    }
+    if (reader.finished)
+        reader.ringSource.reset();
+    for (TransferPipeline::Chunk* chunk : batch)
+        pipeline.submit(chunk);
+#endif
+}
+
+/**
+ * @brief CODEC stage of a download: compresses a chunk that has been read.
+ *
+ * @details
+ * Every chunk is compressed into a frame of its own, with the codec of the worker thread, so the chunks of a file
+ * are compressed on several workers at once and the client can decompress them the same way. The level is the one
+ * chosen for the file, unless the chunk looks compressed already (compression_policy.h); a chunk that doesn't shrink
+ * is sent as it is as well. The codec of the level is the one agreed on with the client (codec.h), its id goes into
+ * the flags of the frame. Runs on the worker pool.
+ *
+ * @param chunk The chunk to compress.
+ * @param reader The file the download reads from.
+ */
+void Server::compressDownload(TransferPipeline::Chunk& chunk, DownloadReader& reader) {
+    if (chunk.failed || chunk.inFile || chunk.length == 0)
+        return;
+    const CompressionLevel level = CompressionPolicy::forBlock(reader.level, chunk.raw.data(), chunk.length);
+    if (level == CompressionLevel::Raw)
+        return;
+
+    // The packed buffer is reused from chunk to chunk, it is written without being cleared first
+    const CodecId id = reader.codecs.forLevel(level);
+    Codec& codec = *CodecRegistry::local(id);
+    const auto start = std::chrono::steady_clock::now();
+    size_t frameSize = Codec::FAILED;
+    chunk.packed.resize_and_overwrite(codec.compressBound(chunk.length, codecOptions), [&](char* packed, size_t size) {
+        frameSize = codec.compress(packed, size, chunk.raw.data(), chunk.length, codecOptions);
+        return frameSize == Codec::FAILED ? 0 : frameSize;
+    });
+    if (frameSize != Codec::FAILED)
+        reader.link->addCodec(level, chunk.length, frameSize, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    if (frameSize == Codec::FAILED) {
+        // handle compression error
+        std::cerr << "Error in compressing file" << std::endl;
+        log << "Error in compressing file" << std::endl;
+        chunk.failed = true;
+    }
+    else if (frameSize < chunk.length) {
+        chunk.flags |= FRAME_COMPRESSED | codecFlags(static_cast<uint8_t>(id));
+        chunk.level = static_cast<uint8_t>(level);
     }
+}
 
-    input.close();
-    return 0;
+/**
+ * @brief SINK stage of a download: sends the chunks that are ready.
+ *
+ * @details
+ * Every chunk is sent in a File frame of its own, the chunks that are ready are written together; clients that took
+ * part in the codec handshake get a FRAME_SIZE frame in front of the first one. Once the output
+ * queue is above the high watermark the remaining chunks wait, dispatchInput wakes the stage up again when it has
+ * gone down to the low watermark. A file that couldn't be opened is answered with an error, one that couldn't be
+ * read to the end is terminated with FRAME_ABORTED. The source of a cut is removed once its last chunk has been
+ * queued, and the statistics of the download are logged. Runs on the event loop.
+ *
+ * @param session The session the download belongs to.
+ * @param pipeline The pipeline of the download.
+ * @param reader The file the download reads from.
+ */
+void Server::sendDownload(Session& session, TransferPipeline& pipeline, const DownloadReader& reader) {
+    if (!session.download || session.download->pipeline.get() != &pipeline)
+        return;
+    Session::Download& download = *session.download;
+    bool queued = false;
+
+    while (TransferPipeline::Chunk* chunk = pipeline.nextToSink()) {
+        if (session.throttled) {
+            download.stalled = true;
+            break;
+        }
+
+        if (chunk->failed) {
+            pipeline.release();
+            try {
+                if (download.started)
+                    queued |= queueFrame(session, FrameType::File, FRAME_ABORTED, std::string()) == 0;
+                else {
+                    WSASetLastError(reader.error);
+                    handleError(session, download.command);
+                }
+            }
+            catch (const std::runtime_error& e) {
+                log << e.what() << std::endl;
+            }
+            finishDownload(session);
+            break;
+        }
+
+        // A client that took part in the handshake gets the size of the file first, so it can check it got all of it,
+        // and where the file is sent from, so it can resume it. The size of a tree isn't known up front.
+        if (!download.started && session.compressResponses && !reader.tree) {
+            std::string size(3 * sizeof(uint64_t), '\0');
+            encodeSize(size.data(), reader.size);
+            encodeSize(size.data() + sizeof(uint64_t), reader.id);
+            encodeSize(size.data() + 2 * sizeof(uint64_t), reader.start);
+            queued |= queueFrame(session, FrameType::File, FRAME_SIZE | FRAME_MORE, std::move(size)) == 0;
+        }
+
+        // A chunk in memory is queued as it is and goes back to the pipeline once it has been sent
+        const uint16_t flags = chunk->flags;
+        const bool last = chunk->last;
+        download.stats.add(static_cast<CompressionLevel>(chunk->level), chunk->length, flags & FRAME_COMPRESSED ? chunk->packed.size() : chunk->length);
+#ifdef __linux__
+        if (chunk->inFile) {
+            OutBuffer range(reader.source, static_cast<off_t>(chunk->offset), chunk->length);
+            pipeline.release();
+            queued |= queueFrame(session, FrameType::File, flags, std::move(range)) == 0;
+        }
+        else
+#endif
+            queued |= queueFrame(session, FrameType::File, flags, pipeline.lend(flags & FRAME_COMPRESSED ? &TransferPipeline::Chunk::packed : &TransferPipeline::Chunk::raw)) == 0;
+        download.started = true;
+
+        if (last) {
+            if (reader.delta) {
+                download.stats.delta = true;
+                download.stats.deltaMatched = reader.delta->matched;
+                download.stats.fileBytes = reader.delta->matched + reader.delta->literal;
+            }
+            if (reader.archive) {
+                download.stats.files = reader.archive->files;
+                if (reader.archive->skipped() > 0)
+                    log << download.command << " " << download.path.string() << ": skipped " << reader.archive->skipped() << " entries" << std::endl;
+            }
+            log << download.command << " " << download.path.string() << ": " << download.stats.summary() << std::endl;
+            if (download.removeSource) {
+                std::error_code ec;
+                if (!std::filesystem::remove(download.path, ec))
+                    handleSend(std::format("Failed to remove file {}", download.path.filename().string()), session);
+                else {
+                    std::string success = std::format("Successfully cut {}", download.path.filename().string());
+                    std::cout << success << std::endl;
+                    log << success << std::endl;
+                }
+            }
+            finishDownload(session);
+            break;
+        }
+    }
+
+    // Everything that was ready goes out with one write
+    if (queued && writeOutput(session) == -1) {
+        log << "Failed to send message!" << std::endl;
+        if (session.download)
+            finishDownload(session);
+    }
+}
+
+/**
+ * @brief Ends the download of a session and lets the commands behind it go on. Runs on the event loop.
+ *
+ * @param session The session the download belongs to.
+ */
+void Server::finishDownload(Session& session) {
+    session.download->pipeline->cancel();
+    session.download.reset();
+    session.busy = false;
 }
 
 /**
@@ -710,19 +1146,14 @@ int Server::handleCopyCommand(char* fileName) {
  *       If an error occurs during the send operation, -1 will be returned.
  *       If the file does not exist, 1 will be returned.
  */
-int Server::handleCatCommand(char* command) {
+int Server::handleCatCommand(Session& session, char* command) {
     shiftStrLeft(command, 4);
 
-    std::ifstream input(command);
-    if (!input)
-        return 1;
-
     std::string file_contents;
-    char c;
-    while (input.get(c))
-        file_contents += c;
+    if (readFile(resolvePath(session, command), file_contents) == -1)
+        return 1;
 
-    if (handleSend(file_contents, LastSock) == -1)
+    if (handleSend(file_contents, session) == -1)
         return -1;
 
     return 0;
@@ -755,6 +1186,56 @@ int Server::shiftStrLeft(char* str, int num) {
         return 1;
 }
 
+/**
+ * @brief Resolves a path given in a command against the working directory of a session.
+ *
+ * @details
+ * Relative paths are interpreted relative to the session's working directory, absolute paths are
+ * returned unchanged. The working directory of the server process is never consulted, so sessions
+ * don't affect each other.
+ *
+ * @param session The session the command came from.
+ * @param path The path given in the command.
+ * @return The resolved path.
+ */
+std::filesystem::path Server::resolvePath(const Session& session, const char* path) {
+    return session.cwd / path;
+}
+
+/**
+ * @brief Reads a whole file into memory.
+ *
+ * @details
+ * The file is read with a single bulk read sized from the file system instead of extracting it
+ * character by character. While the io_uring backend is running, the read is split into chunks
+ * that are handed to the kernel in one batched submission.
+ *
+ * @param fileName The name of the file to read.
+ * @param contents Receives the contents of the file.
+ * @return 0 on success, -1 if the file couldn't be opened or read.
+ */
+int Server::readFile(const std::filesystem::path& fileName, std::string& contents) {
+    std::error_code ec;
+    auto size = std::filesystem::file_size(fileName, ec);
+    if (ec || size > contents.max_size())
+        return -1;
+
+#ifdef DATATRANSMISSION_IO_URING
+    if (uring)
+        return uringReadFile(fileName, size, contents);
+#endif
+
+    std::ifstream input(fileName, std::ios::in | std::ios::binary);
+    if (!input)
+        return -1;
+
+    contents.resize(size);
+    input.read(contents.data(), static_cast<std::streamsize>(size));
+    contents.resize(static_cast<size_t>(input.gcount()));
+
+    return 0;
+}
+
 /**
  * @brief Handle error that occurred during command execution.
  *
@@ -765,11 +1246,11 @@ int Server::shiftStrLeft(char* str, int num) {
  *
  * @param command The command that caused the error.
  */
-void Server::handleError(const char* command) {
+void Server::handleError(Session& session, const char* command) {
     std::string message = std::format("Error in performing {} with error code: {}", command, WSAGetLastError());
     std::cerr << message << std::endl;
 
-    if (handleSend(message, LastSock) == -1)
+    if (handleSend(message, session) == -1)
         throw std::runtime_error("unable to send message!");
 
     throw std::runtime_error(message);
@@ -779,11 +1260,29 @@ void Server::handleError(const char* command) {
  * @brief Receives the command "exit" from std::cin to stop server
  *
  * @details
- * Runs in its own thread and closes all connected sockets
+ * Runs in its own thread and closes all connected sockets. On Linux the event loops own the sockets,
+ * so the thread only raises STOP and wakes the loops up through an eventfd they all wait on.
  *
  * @param master The set of file descriptors (in this case the socket is treated as a file). This set is used by select function to check socket for readability.
+ * @param wakeFd (Linux) The eventfd the event loops are waiting on.
  */
+#ifdef __linux__
+void stop_serv(int wakeFd) {
+    std::string str;
+    std::cin >> str;
+    if (str.rfind("exit", 0) == 0)
+    {
+        STOP = true;
+        std::cout << "Closing server" << std::endl;
 
+        // Wake up every event loop, they close their client sockets themselves. The eventfd is never
+        // read, so it stays readable for all of them
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) == -1)
+            std::cerr << "Failed to wake up the event loop" << std::endl;
+    }
+}
+#else
 void stop_serv(fd_set* master) {
     std::string str;
     std::cin >> str;
@@ -797,152 +1296,807 @@ void stop_serv(fd_set* master) {
         WSACleanup();
     }
 }
+#endif
 
 /**
- * @brief Runs the server and continuously receives and handles commands from the client or receives new clients.
+ * @brief Receives data from a client socket and dispatches it as a command.
  *
  * @details
- * The run() function is responsible for running the server and continuously receiving and handling commands from the client.
- * It uses a infinity while loop to keep receiving commands until we manually stop it with command "exit". Also here we make a new thread only for receiving 
- * the command "exit" and stop server.
+ * Shared by the readiness based event loops (epoll and select). The data is received straight into the
+ * input buffer of the session and handed on to dispatchInput.
+ *
+ * @param session The session whose socket is ready for reading.
+ * @param flags Flags passed on to recv (MSG_DONTWAIT while draining an edge-triggered socket).
+ * @return The result of recv: > 0 if data was handled, 0 if the client disconnected, SOCKET_ERROR on failure.
  */
+int Server::handleClientData(Session& session, int flags) {
+    char* space = session.input.prepare(Session::RECV_BUFLEN);
+    int res = recv(session.sock, space, (int)std::min<size_t>(session.input.spaceSize(), INT_MAX), flags);
+    if (res <= 0)
+        return res;
+
+    dispatchReceived(session, res);
+    return res;
+}
 
-int Server::run() {
-    int res;
-    fd_set master, read_fds;
-    FD_ZERO(&master);
-    FD_ZERO(&read_fds);
-    SOCKET newfd;
+/**
+ * @brief Dispatches data that has been received into the free room of the input buffer of a session.
+ *
+ * @details
+ * Completion based backends receive into the buffer themselves and call this directly.
+ *
+ * @param session The session the data was received on.
+ * @param len The number of bytes received.
+ */
+void Server::dispatchReceived(Session& session, size_t len) {
+    session.input.commit(len);
+    dispatchInput(session);
+}
 
-    FD_SET(ListenSocket, &master);
+/**
+ * @brief Decodes and dispatches every complete frame in the input buffer of a session.
+ *
+ * @details
+ * Frames are handed to dispatchFrame in place and dropped from the buffer afterwards, so decoding costs no
+ * copies and no allocations. An incomplete frame stays in the buffer, which is told how large it is going to
+ * be. While a command of the session runs on the worker pool, or its output queue is above the high watermark,
+ * nothing is dispatched; the loop calls this again once the session can go on. A download whose chunks wait for the
+ * output queue is woken up from here as well, as soon as the queue is down to the low watermark, and a chunk of an
+ * upload waits until the pipeline of the upload has a free chunk for it. The session is paused meanwhile, and the
+ * event loop is told to receive again once it goes on. A frame acceptsFrame refuses drops the connection right after
+ * its header, before room is made for its payload; the stream can't be trusted anymore after it.
+ *
+ * @param session The session whose input is dispatched.
+ */
+void Server::dispatchInput(Session& session) {
+    RecvBuffer& input = session.input;
+    const bool paused = session.paused;
+    session.paused = false;
 
-    //std::thread(stop_serv, std::ref(master)).detach();
-	
-	CreateThread(
-    NULL,                   // default security attributes
-    0,                      // use default stack size  
-    (LPTHREAD_START_ROUTINE)stop_serv,       // thread function name
-    (LPVOID)&master,          // argument to thread function 
-    0,                      // use default creation flags 
-    nullptr);   // returns the thread identifier
+    while (true) {
+        // A download goes on once its output has drained, the commands behind it keep waiting
+        if (session.download && session.download->stalled && session.outBytes <= Session::OUT_LOW_WATERMARK) {
+            session.download->stalled = false;
+            session.download->pipeline->wake(TransferPipeline::SINK);
+        }
 
-    while (true)
-    {
-        read_fds = master;
-        if (select(0, &read_fds, nullptr, nullptr, nullptr) == SOCKET_ERROR) {
-            if (STOP) break;
-            std::cout << "select error: " << WSAGetLastError() << std::endl;
-            log << "select error: " << WSAGetLastError() << std::endl;
-            return 1;
+        // and reads on once the chunks it lent to the output queue have been sent
+        if (session.download)
+            session.download->pipeline->refill();
+
+        if (session.busy || session.throttled) {
+            session.paused = true;
+            break;
         }
-        else {
-            if (STOP) break;
-            for (int i = 0; i < read_fds.fd_count; ++i) {
-                if (FD_ISSET(read_fds.fd_array[i], &read_fds)) { // got smth to read from one of socket
-                    if (read_fds.fd_array[i] == ListenSocket) { // on listenSock, so trying to accept new client
-                        newfd = accept(ListenSocket, NULL, NULL);
-                        if (newfd == INVALID_SOCKET)
-                        {
-                            std::cout << "Accepted invalid socket" << std::endl;
-                            log << "Accepted invalid socket" << std::endl;
-                        }
-                        else {
-                            FD_SET(newfd, &master);
-                            LastSock = newfd;
-                        }
-                    }
-                    else { // on client, so receiving data from client
-                        LastSock = read_fds.fd_array[i];
-                        memset(recvbuf, 0, sizeof(recvbuf));
-                        iResult = recv(read_fds.fd_array[i], recvbuf, recvbuflen, 0);
-                        if (iResult > 0) {
-
-                            // Strips the \f
-                            if (recvbuf != nullptr) {
-                                const unsigned int length = strlen(recvbuf);
-                                if ((length > 0) && (recvbuf[length - 1] == '\f')) recvbuf[length - 1] = '\0';
-                            }
 
-                            log << recvbuf << std::endl;
+        if (input.size() < FRAME_HEADER_SIZE)
+            break;
 
-                            try {
-                                res = handleCommand(recvbuf);
-                            }
-                            catch (const std::runtime_error& e) {
-                                log << e.what() << std::endl;
-                            }
-                        }
-                        else if (iResult == 0)
-                        {
-                            std::cout << "User " << userMap[read_fds.fd_array[i]] << " has disconnected" << std::endl;
-							log << "User " << userMap[read_fds.fd_array[i]] << " has disconnected" << std::endl;
-                            closesocket(read_fds.fd_array[i]);
-                            FD_CLR(read_fds.fd_array[i], &master);
-                        }
-                        else {
-                            std::cout << "recv failed with error: " << WSAGetLastError() << std::endl;
-                            log << "recv failed with error: " << WSAGetLastError() << std::endl; 
-                            closesocket(read_fds.fd_array[i]);
-                        }
-                    }
-                }
-            }
+        FrameHeader header;
+        if (!header.decode(input.data()) || !acceptsFrame(session, header)) {
+            std::cout << "Received an invalid frame, closing the connection" << std::endl;
+            log << "Received an invalid frame, closing the connection" << std::endl;
+            input.clear();
+            shutdown(session.sock, SD_BOTH);
+            return;
+        }
+
+        const size_t frameSize = FRAME_HEADER_SIZE + header.length;
+        if (input.size() < frameSize) {
+            input.expect(frameSize);
+            break;
         }
+
+        // Freeing a chunk wakes the loop up again, see handleCopyFromCommand
+        if (header.type == FrameType::File && session.upload.active && !session.upload.pipeline->canAcquire()) {
+            session.paused = true;
+            break;
+        }
+
+        dispatchFrame(session, header, input.data() + FRAME_HEADER_SIZE);
+        input.consume(frameSize);
     }
+
+    // What the client sent while the session was paused is still waiting in the socket
+    if (paused && !session.paused)
+        resumeInput(session);
 }
 
 /**
- * @brief Handles the echo command received from the client.
+ * @brief Lets the event loop that owns a session receive from it again after it has been paused.
  *
  * @details
- * This function trims the "echo " prefix from the command, prints the command to the console,
- * writes the command to the log file, and sends a response to the client that the command has been echoed.
+ * The epoll registration of the socket is modified, which reports it again if it has become readable in the
+ * meantime, edge-triggered or not. The io_uring backend arms a new receive request.
  *
- * @param command The command received from the client.
- * @return Returns 0 on success, -1 if the send operation fails.
+ * @param session The session that goes on.
  */
-int Server::handleEchoCommand(char* command) {
-    shiftStrLeft(command, 5);
-    std::cout << command << std::endl;
-    log << command << std::endl;
-
-    std::string sendMes = std::format("{} has been echoed", command);
+void Server::resumeInput(Session& session) {
+#ifdef __linux__
+    if (session.closed)
+        return;
 
-    if (handleSend(sendMes, LastSock) == -1)
-        return -1;
+#ifdef DATATRANSMISSION_IO_URING
+    if (uring) {
+        uringResume(session);
+        return;
+    }
+#endif
 
-    return 0;
+    if (epollFd != -1) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = session.sock;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, session.sock, &ev);
+    }
+#else
+    (void)session;
+#endif
 }
 
 /**
- * @function handleMoveCommand
- * @brief Handles the move command from the client.
+ * @brief Checks the header of a frame a client sent before the frame is received.
  *
  * @details
- * This function is responsible for handling a "move" command from a client. It takes a command in
- * the form of a character array, extracts the desired source and destination file paths, and then
- * attempts to move the file from the source path to the destination path.
- *
- * The move operation is achieved by first copying the file from the source path to the destination
- * path using `std::filesystem::copy`. Then the function tries to remove the original file
- * at the source path using `std::filesystem::remove`. If any of these operations fail, a
- * `std::runtime_error` is thrown with a message explaining the error.
- *
- * After successfully moving the file, a confirmation message is sent back to the client.
- * If the send operation fails, an error message is printed to stderr and the function returns -1.
- *
- * @param command A character array containing the move command from the client.
+ * Clients only send Command, File and Signature frames, and nothing but commands before they have authenticated. A
+ * File frame holds at most FRAME_CHUNK_MAX_LENGTH bytes, every other frame MAX_COMMAND_LENGTH, so the input buffer
+ * of a session never grows beyond one chunk.
  *
- * @return Returns 0 if the move command was successfully executed and the confirmation message
- * was sent back to the client. If there was an error in sending the confirmation message, the
- * function returns -1.
- *
- * @exception std::runtime_error If either the copy or remove operations fail, a
- * std::runtime_error is thrown with a message explaining the error.
+ * @param session The session the frame is received on.
+ * @param header The decoded header.
+ * @return true if the frame may be received, false if the connection has to be dropped.
  */
-int Server::handleMoveCommand(char* command) {
-    shiftStrLeft(command, 3);
-    std::string first_arg;
+bool Server::acceptsFrame(const Session& session, const FrameHeader& header) {
+    switch (header.type) {
+        case FrameType::Command:
+            return header.length <= MAX_COMMAND_LENGTH;
+        case FrameType::Signature:
+            return !session.user.empty() && header.length <= MAX_COMMAND_LENGTH;
+        case FrameType::File:
+            return !session.user.empty() && header.length <= FRAME_CHUNK_MAX_LENGTH;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Handles a single complete frame.
+ *
+ * @details
+ * Command frames are logged and passed on to handleCommand, File frames complete a copy_from upload. Signature
+ * frames are kept for the `copy_to -d` behind them.
+ * A command is terminated in place: the byte following it (the next frame, or the spare byte the input
+ * buffer always keeps) is saved and restored afterwards. Errors thrown by the command handlers are logged
+ * and swallowed so a single failing command never takes the loop down.
+ *
+ * @param session The session the frame was received on.
+ * @param header The header of the frame.
+ * @param payload The payload of the frame, header.length bytes inside the input buffer of the session.
+ */
+void Server::dispatchFrame(Session& session, const FrameHeader& header, char* payload) {
+    const char saved = payload[header.length];
+
+    try {
+        switch (header.type) {
+            case FrameType::Command:
+                payload[header.length] = '\0';
+                log << std::string_view(payload, header.length) << std::endl;
+                handleCommand(session, payload);
+                break;
+
+            case FrameType::File:
+                if (receiveUpload(session, header, payload) == -1) {
+                    std::cout << "File transfer failed" << std::endl;
+                    log << "File transfer failed" << std::endl;
+                    handleError(session, "copy_from");
+                }
+                break;
+
+            case FrameType::Signature:
+                // A signature that grows beyond the largest one there is fails to decode
+                if (session.signatureComplete)
+                    session.signature.clear();
+                if (session.signature.size() + header.length <= DeltaSignature::MAX_ENCODED)
+                    session.signature.append(payload, header.length);
+                else
+                    session.signature.clear();
+                session.signatureComplete = !(header.flags & FRAME_MORE);
+                break;
+
+            default:
+                log << "Ignoring frame of unknown type " << static_cast<int>(header.type) << std::endl;
+                break;
+        }
+    }
+    catch (const std::runtime_error& e) {
+        log << e.what() << std::endl;
+    }
+
+    payload[header.length] = saved;
+}
+
+/**
+ * @brief Closes the socket of a session and forgets the user that was authenticated on it.
+ *
+ * @param session The session to close.
+ */
+void Server::closeClient(Session& session) {
+    session.closed = true;
+    forgetClient(session);
+    closesocket(session.sock);
+}
+
+/**
+ * @brief Logs the disconnect of the user of a session and abandons its unfinished transfers.
+ *
+ * @param session The session of the client that disconnected.
+ */
+void Server::forgetClient(Session& session) {
+    std::cout << "User " << session.user << " has disconnected" << std::endl;
+    log << "User " << session.user << " has disconnected" << std::endl;
+    if (session.download)
+        session.download->pipeline->cancel();
+    dropUpload(session);
+    expireRanges(&session);
+}
+
+/**
+ * @brief Runs a blocking command handler on the worker pool.
+ *
+ * @details
+ * The session is marked busy, so commands it sends in the meantime wait until the handler is done.
+ * Replies the handler sends are collected and posted back to the event loop that owns the session
+ * together with the `done` continuation, both run there by finishJob. The session state the replies
+ * change, the reply dictionary, is collected with them and only applied there as well. Without a worker
+ * pool (select loop, or no worker threads configured) everything runs inline.
+ *
+ * @param session The session the command was received on.
+ * @param work The part of the command that may block. It must not touch session state other than reading it.
+ * @param done Optional continuation run on the event loop after the replies of `work` have been sent.
+ */
+void Server::runOnWorker(Session& session, Job work, Job done) {
+#ifdef __linux__
+    if (workers && mailbox) {
+        std::shared_ptr<Session> owner = session.shared_from_this();
+        Mailbox* home = mailbox;
+        session.busy = true;
+
+        // Read here, the loop is the only thread that changes it
+        auto dictionary = session.dictionary;
+
+        workers->submit([this, owner, home, dictionary, work = std::move(work), done = std::move(done)]() mutable {
+            Outbox result;
+            result.dictionary = std::move(dictionary);
+            outbox = &result;
+            try {
+                work(*owner);
+            }
+            catch (const std::runtime_error& e) {
+                log << e.what() << std::endl;
+            }
+            outbox = nullptr;
+
+            home->post([this, owner, result = std::move(result), done = std::move(done)]() mutable {
+                finishJob(*owner, result, done);
+            });
+        });
+        return;
+    }
+#endif
+
+    work(session);
+    completeJob(session, done);
+}
+
+/**
+ * @brief Completes a command that ran on the worker pool. Runs on the event loop that owns the session.
+ *
+ * @details
+ * Takes over the reply dictionary the replies of the command were compressed against, sends the replies, runs the
+ * continuation of the command and dispatches everything the client sent while the command was running. Nothing is
+ * done if the session has been closed in the meantime.
+ *
+ * @param session The session the command was received on.
+ * @param result The encoded frames the command sent and the dictionary state they leave the session with.
+ * @param done Optional continuation of the command.
+ */
+void Server::finishJob(Session& session, Outbox& result, Job& done) {
+    if (session.closed)
+        return;
+
+    session.dictionary = std::move(result.dictionary);
+    session.dictionaryStats.add(result.dictionaryStats);
+
+    try {
+        for (auto& buffer : result.replies)
+            session.queueOutput(std::move(buffer));
+        if (!result.replies.empty() && writeOutput(session) == -1)
+            log << "Failed to send message!" << std::endl;
+    }
+    catch (const std::runtime_error& e) {
+        log << e.what() << std::endl;
+    }
+
+    completeJob(session, done);
+    dispatchInput(session);
+}
+
+/**
+ * @brief Runs the continuation of a command once its replies have been queued and lets the session go on.
+ *
+ * @param session The session the command was received on.
+ * @param done Optional continuation of the command.
+ */
+void Server::completeJob(Session& session, Job& done) {
+    try {
+        if (done)
+            done(session);
+    }
+    catch (const std::runtime_error& e) {
+        log << e.what() << std::endl;
+    }
+
+    session.busy = false;
+}
+
+/**
+ * @brief Returns the executor of the transfer pipeline stages that belong on the event loop of a session.
+ *
+ * @details
+ * With a worker pool a stage is posted to the mailbox of the loop that owns the session. It doesn't run if the
+ * session has been closed in the meantime, and the input of the session is dispatched afterwards, since the stage
+ * may have let it go on. Without one every stage runs inline on the loop, which dispatches the input by itself.
+ *
+ * @param session The session the transfer belongs to.
+ * @return The executor.
+ */
+TransferPipeline::Executor Server::loopExecutor(Session& session) {
+#ifdef __linux__
+    if (workers && mailbox) {
+        std::weak_ptr<Session> target = session.weak_from_this();
+        Mailbox* home = mailbox;
+        return [this, target, home](TransferPipeline::Task task) {
+            home->post([this, target, task = std::move(task)] {
+                std::shared_ptr<Session> session = target.lock();
+                if (!session || session->closed)
+                    return;
+
+                try {
+                    task();
+                }
+                catch (const std::runtime_error& e) {
+                    log << e.what() << std::endl;
+                }
+                dispatchInput(*session);
+            });
+        };
+    }
+#endif
+
+    return [](TransferPipeline::Task task) { task(); };
+}
+
+/**
+ * @brief Returns the executor of the transfer pipeline stages that do disk and codec work.
+ *
+ * @details
+ * They run on the worker pool, or inline where runOnWorker runs handlers inline.
+ *
+ * @return The executor.
+ */
+TransferPipeline::Executor Server::poolExecutor() {
+#ifdef __linux__
+    if (workers && mailbox)
+        return [this](TransferPipeline::Task task) { workers->submit(std::move(task)); };
+#endif
+
+    return [](TransferPipeline::Task task) { task(); };
+}
+
+/**
+ * @brief Runs the server and continuously receives and handles commands from the client or receives new clients.
+ *
+ * @details
+ * The run() function is responsible for running the server and continuously receiving and handling commands from the client.
+ * On Linux it starts loopThreads event loops. Every loop owns its own SO_REUSEPORT listener, so the kernel spreads new
+ * connections across the loops and a session stays on the loop that accepted it. The calling thread runs the first loop.
+ * Every other platform runs a single select() loop. Blocking command handlers run on a pool of workerThreads threads
+ * shared by all loops. All loops keep running until we manually stop the server with the command "exit", which is read
+ * by a separate thread.
+ *
+ * @return 0 when the server was stopped, 1 if an event loop failed.
+ */
+int Server::run() {
+#ifdef __linux__
+    // sendfile has no MSG_NOSIGNAL, a client that went away must not take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+
+    int wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd == -1) {
+        std::cout << "eventfd error: " << errno << std::endl;
+        log << "eventfd error: " << errno << std::endl;
+        return 1;
+    }
+
+    std::vector<SOCKET> listeners{ ListenSocket };
+    for (int i = 1; i < loopThreads; ++i) {
+        SOCKET sock = openListenSocket();
+        if (sock == INVALID_SOCKET)
+            break;
+        listeners.push_back(sock);
+    }
+
+    if ((int)listeners.size() < loopThreads)
+        log << "Could only open " << listeners.size() << " listeners, running as many event loops" << std::endl;
+
+    // Created before the loops start and destroyed after they have stopped, workers post into them
+    std::vector<std::unique_ptr<Mailbox>> mailboxes;
+    for (size_t i = 0; i < listeners.size(); ++i)
+        mailboxes.push_back(std::make_unique<Mailbox>());
+
+    if (workerThreads > 0)
+        workers = std::make_unique<WorkerPool>(workerThreads);
+
+    std::atomic<int> status = 0;
+
+    // A failing loop takes the others down with it instead of leaving run() waiting on them forever
+    auto runAndStop = [this, wakeFd, &status](SOCKET sock, Mailbox* box) {
+        mailbox = box;
+        if (runLoop(sock, wakeFd) != 0) {
+            status = 1;
+            STOP = true;
+            uint64_t one = 1;
+            if (write(wakeFd, &one, sizeof(one)) == -1)
+                log << "Failed to wake up the event loops" << std::endl;
+        }
+    };
+
+    std::vector<std::thread> loops;
+    for (size_t i = 1; i < listeners.size(); ++i)
+        loops.emplace_back(runAndStop, listeners[i], mailboxes[i].get());
+
+    std::thread(stop_serv, wakeFd).detach();
+    runAndStop(ListenSocket, mailboxes[0].get());
+
+    for (size_t i = 0; i < loops.size(); ++i) {
+        loops[i].join();
+        closesocket(listeners[i + 1]);
+    }
+
+    workers.reset();
+    expireRanges(nullptr);
+
+    // wakeFd is left open on purpose: the detached stop_serv thread may still write to it
+    return status;
+#else
+    const int status = runSelect();
+    expireRanges(nullptr);
+    return status;
+#endif
+}
+
+#ifdef __linux__
+/**
+ * @brief Runs one event loop on the given listener.
+ *
+ * @details
+ * Uses the io_uring backend if it has been enabled and the kernel supports it, the epoll loop otherwise.
+ *
+ * @param listenSock The listening socket owned by this loop.
+ * @param wakeFd The eventfd stop_serv uses to wake the loops up.
+ * @return 0 when the server was stopped, 1 if the event loop failed.
+ */
+int Server::runLoop(SOCKET listenSock, int wakeFd) {
+#ifdef DATATRANSMISSION_IO_URING
+    if (ioUring) {
+        int res = runUring(listenSock, wakeFd);
+        if (res != URING_UNAVAILABLE)
+            return res;
+
+        std::cout << "io_uring is not available, falling back to epoll" << std::endl;
+        log << "io_uring is not available, falling back to epoll" << std::endl;
+    }
+#endif
+    return runEpoll(listenSock, wakeFd);
+}
+
+/**
+ * @brief Edge-triggered epoll event loop.
+ *
+ * @details
+ * The listening socket is non-blocking and registered edge-triggered, so every wakeup accepts until the backlog
+ * is empty. Client sockets are non-blocking and registered edge-triggered for reading and writing: every wakeup
+ * first flushes the output queue of the session and then drains the socket until recv reports EAGAIN. A paused
+ * session, one that is busy or whose output queue is above the high watermark, isn't drained until it goes on again
+ * (see resumeInput). Idle sessions cost nothing per wakeup: epoll only reports
+ * the sockets that actually changed state, so there is no per-iteration rebuild of the interest set and no
+ * FD_SETSIZE cap. The eventfd shared with stop_serv lets it wake the loop up for shutdown, the mailbox of the
+ * loop delivers the results of commands that ran on the worker pool.
+ *
+ * @param listenSock The listening socket owned by this loop.
+ * @param wakeFd The eventfd stop_serv uses to wake the loops up.
+ * @return 0 when the server was stopped, 1 if epoll failed.
+ */
+int Server::runEpoll(SOCKET listenSock, int wakeFd) {
+    constexpr int MAX_EVENTS = 128;
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1) {
+        std::cout << "epoll_create1 error: " << errno << std::endl;
+        log << "epoll_create1 error: " << errno << std::endl;
+        return 1;
+    }
+
+    fcntl(listenSock, F_SETFL, fcntl(listenSock, F_GETFL) | O_NONBLOCK);
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listenSock;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSock, &ev);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = mailbox->fd();
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, mailbox->fd(), &ev);
+
+    std::unordered_map<SOCKET, std::shared_ptr<Session>> sessions;
+
+    epoll_event events[MAX_EVENTS];
+    int ret = 0;
+
+    while (!STOP)
+    {
+        int n = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            std::cout << "epoll_wait error: " << errno << std::endl;
+            log << "epoll_wait error: " << errno << std::endl;
+            ret = 1;
+            break;
+        }
+
+        for (int i = 0; i < n && !STOP; ++i) {
+            SOCKET fd = events[i].data.fd;
+
+            if (fd == wakeFd)
+                continue;
+
+            if (fd == mailbox->fd()) { // results of commands that ran on the worker pool
+                mailbox->drain();
+                continue;
+            }
+
+            if (fd == listenSock) { // on listenSock, so accepting every pending client
+                while (true) {
+                    SOCKET newfd = accept4(listenSock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (newfd == INVALID_SOCKET) {
+                        if (errno == EINTR) continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            std::cout << "Accepted invalid socket" << std::endl;
+                            log << "Accepted invalid socket" << std::endl;
+                        }
+                        break;
+                    }
+
+                    // Frames are coalesced by flushOutput already, Nagle would only hold back the tail of a sendfile range
+                    int one = 1;
+                    setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    ev.data.fd = newfd;
+                    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, newfd, &ev) == -1) {
+                        log << "epoll_ctl failed for new client: " << errno << std::endl;
+                        closesocket(newfd);
+                        continue;
+                    }
+
+                    sessions.emplace(newfd, std::make_shared<Session>(newfd, std::filesystem::current_path()));
+                }
+                continue;
+            }
+
+            auto it = sessions.find(fd);
+            if (it == sessions.end())
+                continue;
+            Session& session = *it->second;
+
+            // on client, so writing what is queued for it first, which may lift its throttle
+            if (flushOutput(session) == -1) {
+                std::cout << "send failed with error: " << errno << std::endl;
+                log << "send failed with error: " << errno << std::endl;
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+                closeClient(session);
+                sessions.erase(it);
+                continue;
+            }
+            dispatchInput(session);
+
+            // then draining everything it has sent since the last edge, unless it can't go on with it
+            while (!session.throttled && !session.paused) {
+                int res = handleClientData(session, MSG_DONTWAIT);
+                if (res > 0)
+                    continue;
+
+                if (res == SOCKET_ERROR) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        break;
+                    if (errno == EINTR)
+                        continue;
+                    std::cout << "recv failed with error: " << errno << std::endl;
+                    log << "recv failed with error: " << errno << std::endl;
+                }
+
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+                closeClient(session);
+                sessions.erase(it);
+                break;
+            }
+        }
+    }
+
+    // Like a disconnect, so the temporary files of unfinished uploads are removed
+    for (auto& [sock, session] : sessions)
+        closeClient(*session);
+
+    close(epollFd);
+    epollFd = -1;
+    return ret;
+}
+#else
+/**
+ * @brief select() based event loop used on platforms without epoll.
+ *
+ * @return 0 when the server was stopped, 1 if select failed.
+ */
+int Server::runSelect() {
+    fd_set master, read_fds;
+    FD_ZERO(&master);
+    FD_ZERO(&read_fds);
+    SOCKET newfd;
+
+    FD_SET(ListenSocket, &master);
+
+    std::unordered_map<SOCKET, std::shared_ptr<Session>> sessions;
+
+    CreateThread(
+    NULL,                   // default security attributes
+    0,                      // use default stack size
+    (LPTHREAD_START_ROUTINE)stop_serv,       // thread function name
+    (LPVOID)&master,          // argument to thread function
+    0,                      // use default creation flags
+    nullptr);   // returns the thread identifier
+
+    while (true)
+    {
+        read_fds = master;
+        if (select(0, &read_fds, nullptr, nullptr, nullptr) == SOCKET_ERROR) {
+            if (STOP) break;
+            std::cout << "select error: " << WSAGetLastError() << std::endl;
+            log << "select error: " << WSAGetLastError() << std::endl;
+            return 1;
+        }
+        else {
+            if (STOP) break;
+            for (int i = 0; i < read_fds.fd_count; ++i) {
+                if (FD_ISSET(read_fds.fd_array[i], &read_fds)) { // got smth to read from one of socket
+                    if (read_fds.fd_array[i] == ListenSocket) { // on listenSock, so trying to accept new client
+                        newfd = accept(ListenSocket, NULL, NULL);
+                        if (newfd == INVALID_SOCKET)
+                        {
+                            std::cout << "Accepted invalid socket" << std::endl;
+                            log << "Accepted invalid socket" << std::endl;
+                        }
+                        else {
+                            FD_SET(newfd, &master);
+                            sessions.emplace(newfd, std::make_shared<Session>(newfd, std::filesystem::current_path()));
+                        }
+                    }
+                    else { // on client, so receiving data from client
+                        SOCKET sock = read_fds.fd_array[i];
+                        auto it = sessions.find(sock);
+                        if (it == sessions.end())
+                            continue;
+                        int res = handleClientData(*it->second, 0);
+                        if (res <= 0) {
+                            if (res == SOCKET_ERROR) {
+                                std::cout << "recv failed with error: " << WSAGetLastError() << std::endl;
+                                log << "recv failed with error: " << WSAGetLastError() << std::endl;
+                            }
+                            FD_CLR(sock, &master);
+                            closeClient(*it->second);
+                            sessions.erase(it);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Like a disconnect, so the temporary files of unfinished uploads are removed
+    for (auto& [sock, session] : sessions)
+        closeClient(*session);
+
+    return 0;
+}
+#endif
+
+/**
+ * @brief Handles the stats command: replies with what the session knows about its link.
+ *
+ * @details
+ * The reply lists the throughput the link achieved while it held up the output of the session, the speed and ratio
+ * of every compression level, the levels the recent downloads were sent with and why, and what the reply dictionary
+ * has saved if the session uses one.
+ *
+ * @return 0 on success, -1 if the send operation fails.
+ */
+int Server::handleStatsCommand(Session& session) {
+    std::string stats = session.link->describe();
+    if (session.dictionary)
+        stats += std::format("\nReply dictionary: version {} ({}), {}", session.dictionary->getVersion(),
+                             TransferStats::formatSize(session.dictionary->data().size()), session.dictionaryStats.summary());
+
+    if (handleSend(stats, session) == -1)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @brief Handles the echo command received from the client.
+ *
+ * @details
+ * This function trims the "echo " prefix from the command, prints the command to the console,
+ * writes the command to the log file, and sends a response to the client that the command has been echoed.
+ *
+ * @param command The command received from the client.
+ * @return Returns 0 on success, -1 if the send operation fails.
+ */
+int Server::handleEchoCommand(Session& session, char* command) {
+    shiftStrLeft(command, 5);
+    std::cout << command << std::endl;
+    log << command << std::endl;
+
+    std::string sendMes = std::format("{} has been echoed", command);
+
+    if (handleSend(sendMes, session) == -1)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @function handleMoveCommand
+ * @brief Handles the move command from the client.
+ *
+ * @details
+ * This function is responsible for handling a "move" command from a client. It takes a command in
+ * the form of a character array, extracts the desired source and destination file paths, and then
+ * attempts to move the file from the source path to the destination path.
+ *
+ * The move operation is achieved by first copying the file from the source path to the destination
+ * path using `std::filesystem::copy`. Then the function tries to remove the original file
+ * at the source path using `std::filesystem::remove`. If any of these operations fail, a
+ * `std::runtime_error` is thrown with a message explaining the error.
+ *
+ * After successfully moving the file, a confirmation message is sent back to the client.
+ * If the send operation fails, an error message is printed to stderr and the function returns -1.
+ *
+ * @param command A character array containing the move command from the client.
+ *
+ * @return Returns 0 if the move command was successfully executed and the confirmation message
+ * was sent back to the client. If there was an error in sending the confirmation message, the
+ * function returns -1.
+ *
+ * @exception std::runtime_error If either the copy or remove operations fail, a
+ * std::runtime_error is thrown with a message explaining the error.
+ */
+int Server::handleMoveCommand(Session& session, char* command) {
+    shiftStrLeft(command, 3);
+    std::string first_arg;
     std::string second_arg;
     bool second = false;
 
@@ -959,20 +2113,20 @@ int Server::handleMoveCommand(char* command) {
     }
 
     try {
-        std::filesystem::copy(first_arg, second_arg);
+        std::filesystem::copy(resolvePath(session, first_arg.c_str()), resolvePath(session, second_arg.c_str()));
     }
     catch (std::filesystem::filesystem_error& e) {
         throw std::runtime_error(e.what());
     }
     try {
-        std::filesystem::remove(first_arg);
+        std::filesystem::remove(resolvePath(session, first_arg.c_str()));
     }
     catch (std::filesystem::filesystem_error& e) {
         throw std::runtime_error(e.what());
     }
 
     std::string message = std::format("{} has successfully been moved to {}", first_arg, second_arg);
-    if (handleSend(message, LastSock) == -1)
+    if (handleSend(message, session) == -1)
         return -1;
 
     return 0;
@@ -989,7 +2143,7 @@ int Server::handleMoveCommand(char* command) {
  * it throws a std::runtime_error with the error message.
  *
  * After successful copying, it writes a log entry with the source and destination file paths.
- * Finally, it sends a success message to the client using the ClientSocket.
+ * Finally, it sends a success message to the client over the socket of the session.
  *
  * @param command The command string received from the client.
  *
@@ -997,7 +2151,7 @@ int Server::handleMoveCommand(char* command) {
  *
  * @throws std::runtime_error if an error occurs during the file copying process.
  */
-int Server::handleCpCommand(char* command) {
+int Server::handleCpCommand(Session& session, char* command) {
     shiftStrLeft(command, 3);
     std::string first_arg;
     std::string second_arg;
@@ -1016,7 +2170,7 @@ int Server::handleCpCommand(char* command) {
     }
 
     try {
-        std::filesystem::copy(first_arg, second_arg);
+        std::filesystem::copy(resolvePath(session, first_arg.c_str()), resolvePath(session, second_arg.c_str()));
     }
     catch (std::filesystem::filesystem_error& e) {
         throw std::runtime_error(e.what());
@@ -1024,7 +2178,7 @@ int Server::handleCpCommand(char* command) {
 
     std::string message = std::format("{} has successfully been moved to {}", first_arg, second_arg);
 
-    if (handleSend(message, LastSock) == -1)
+    if (handleSend(message, session) == -1)
         return -1;
 
     return 0;
@@ -1034,19 +2188,19 @@ int Server::handleCpCommand(char* command) {
  * @brief Handles the "find" command.
  *
  * @details
- * This function searches for a file or directory in the current directory
+ * This function searches for a file or directory in the session's working directory
  * and sends a response with the search result to the client.
  *
  * @param command The command string received from the client.
  * @return 0 if the operation is successful, -1 if an error occurs during sending the response.
  */
-int Server::handleFindCommand(char* command) {
+int Server::handleFindCommand(Session& session, char* command) {
     shiftStrLeft(command, 5);
     std::string message;
     bool found = false;
 
     for (const auto& entry : std::filesystem::recursive_directory_iterator
-    (std::filesystem::current_path())) {
+    (session.cwd)) {
         if (entry.path().filename() == command) {
             message = std::format("{} is in {}", command, entry.path().string());
             found = true;
@@ -1054,10 +2208,10 @@ int Server::handleFindCommand(char* command) {
     }
 
     if (!found) {
-        message = std::format("{} has not been found in {}", command, std::filesystem::current_path().string());
+        message = std::format("{} has not been found in {}", command, session.cwd.string());
     }
 
-    if (handleSend(message, LastSock) == -1)
+    if (handleSend(message, session) == -1)
         return -1;
 
     return 0;
@@ -1075,7 +2229,7 @@ int Server::handleFindCommand(char* command) {
  *
  * @returns 0 on success, -1 on failure.
  */
-int Server::handleGrepCommand(char* command) {
+int Server::handleGrepCommand(Session& session, char* command) {
     std::string fileName;
     std::string pattern;
     bool second = false;
@@ -1093,7 +2247,7 @@ int Server::handleGrepCommand(char* command) {
             pattern += command[i];
     }
 
-    std::ifstream file(fileName);
+    std::ifstream file(resolvePath(session, fileName.c_str()));
     if (!file) {
         std::cerr << "Error in opening " << fileName << std::endl;
         return -1;
@@ -1114,108 +2268,574 @@ int Server::handleGrepCommand(char* command) {
         }
     }
 
-    if (handleSend(sendMessage, LastSock) == -1)
+    if (handleSend(sendMessage, session) == -1)
+        return -1;
+
+    return 0;
+}
+
+
+/**
+ * @brief Handles the copy_from command received from the client.
+ *
+ * @details
+ * This function starts the upload of a file from the client. The file content itself arrives in the File
+ * frames following the command, which the event loop feeds into the transfer pipeline of the upload (receiveUpload).
+ * The worker pool decompresses the chunks (decompressUpload) and writes them (writeUpload) while the loop already
+ * receives the next ones, so the loop never blocks on a single client while the file is on its way. The chunks are
+ * written to a temporary file next to the target, so a target that already exists stays intact until the upload is
+ * complete.
+ *
+ * An upload whose FRAME_SIZE frame names a transfer ID is resumable (transfer_checkpoint.h): its temporary file is
+ * named after the ID and kept, with its checkpoint, when the connection is lost. `copy_from -c ID NAME` asks for
+ * that checkpoint first; the reply `resume OFFSET CHECKSUM` (`resume 0 0` if there is none) lets the client check
+ * the window in front of OFFSET against its file and send the rest of it only.
+ *
+ * `copy_from -d NAME` answers with the signature of the target in Signature frames, the client sends the file as a
+ * delta against it (delta_transfer.h), which the writer rebuilds from the target.
+ *
+ * `copy_from -p ID SIZE NAME` only announces a file that the client sends in ranges over its data connections
+ * (handleRangesCommand). `copy_from -R LENGTH NAME` uploads one of them, its FRAME_SIZE frame names the offset; the
+ * range is written into the temporary file of the transfer, which the range that completes it renames.
+ *
+ * `copy_from -r NAME` uploads a directory: the chunks are an archive of the client's tree (tree_archive.h), whose
+ * files are extracted into NAME as they arrive.
+ *
+ * @param session The session the command came from, it owns the upload state.
+ * @param command The command received from the client.
+ * @return 0 if the upload has been started, -1 otherwise.
+ */
+int Server::handleCopyFromCommand(Session& session, char* command) {
+    // Remove the copy_from text from the command
+    shiftStrLeft(command, 10);
+    if (strncmp(command, "-p ", 3) == 0)
+        return handleRangesCommand(session, command + 3, true);
+
+    dropUpload(session);
+
+    unsigned long long id, rangeLength;
+    int length = 0;
+    const bool resume = sscanf(command, "-c %llx %n", &id, &length) == 1 && length > 0;
+    if (resume)
+        command += length;
+    const bool ranged = !resume && sscanf(command, "-R %llu %n", &rangeLength, &length) == 1 && length > 0;
+    if (ranged)
+        command += length;
+    const bool delta = strncmp(command, "-d ", 3) == 0;
+    if (delta)
+        command += 3;
+    const bool tree = !delta && strncmp(command, "-r ", 3) == 0;
+    if (tree)
+        command += 3;
+
+    // Opened by the writer, which learns from the FRAME_SIZE frame whether the upload is resumable. A range is
+    // written into the temporary file of its transfer, which the session doesn't own.
+    auto writer = std::make_shared<UploadWriter>();
+    writer->path = resolvePath(session, command);
+    writer->ranged = ranged;
+    writer->range.length = ranged ? rangeLength : 0;
+    if (tree)
+        writer->archive = std::make_unique<ArchiveExtractor>(writer->path);
+    else if (!ranged) {
+        writer->partPath = writer->path;
+        writer->partPath += std::format(".{}.part", session.sock);
+    }
+
+    if (resume) {
+        TransferCheckpoint checkpoint;
+        uint32_t checksum = 0;
+        if (!checkpoint.load(resumablePart(writer->path, id)) || checkpoint.id != id
+            || !TransferCheckpoint::windowChecksum(resumablePart(writer->path, id), checkpoint.offset, checksum))
+            checkpoint.offset = 0;
+        if (handleSend(std::format("resume {} {:x}", checkpoint.offset, checkpoint.offset ? checksum : 0), session) == -1)
+            return -1;
+    }
+
+    // The signature of the target is computed on the worker pool, the chunks wait until the client has it
+    if (delta) {
+        runOnWorker(session, [this, target = writer->path](Session& session) {
+            DeltaSignature signature;
+            if (!signature.compute(target))
+                signature.blocks.clear();
+            const std::string encoded = signature.encode();
+            for (size_t offset = 0; offset < encoded.size(); offset += DeltaSignature::FRAME_BYTES) {
+                const size_t length = std::min(DeltaSignature::FRAME_BYTES, encoded.size() - offset);
+                const uint16_t flags = offset + length < encoded.size() ? FRAME_MORE : 0;
+                if (sendFrame(session, FrameType::Signature, flags, encoded.substr(offset, length)) == -1)
+                    return;
+            }
+        });
+    }
+
+    TransferPipeline::Executor loop = loopExecutor(session);
+    writer->done = [this, loop, &session](bool received, bool complete) {
+        loop([this, &session, received, complete] { finishUpload(session, received, complete); });
+    };
+
+    // The loop is the source: a File frame that found no free chunk waits in the input buffer, the executor
+    // dispatches it once the writer has given a chunk back
+    auto pipeline = std::make_shared<TransferPipeline>(TransferPipeline::depthFor(workers ? workers->size() : 1));
+    pipeline->setStage(TransferPipeline::SOURCE, loop, [](TransferPipeline&) {});
+    pipeline->setParallelCodec(poolExecutor(), decompressUpload);
+    pipeline->setStage(TransferPipeline::SINK, poolExecutor(), [this, writer](TransferPipeline& pipeline) {
+        writeUpload(pipeline, *writer);
+    });
+
+    Session::Upload& upload = session.upload;
+    upload.active = true;
+    upload.partPath = writer->partPath;
+    upload.tree = tree;
+    upload.pipeline = std::move(pipeline);
+
+    return 0;
+}
+
+/**
+ * @brief SOURCE stage of a copy_from upload: hands a File frame to the pipeline of the upload.
+ *
+ * @details
+ * The payload is copied into a free chunk, dispatchInput only dispatches File frames while there is one. Once the
+ * last frame is in the session is busy until the writer has completed the upload. Runs on the event loop.
+ *
+ * @param session The session the frame was received on.
+ * @param header The header of the File frame.
+ * @param payload The payload of the File frame.
+ * @return 0 if the frame has been handled, -1 if there is no upload.
+ */
+int Server::receiveUpload(Session& session, const FrameHeader& header, const char* payload) {
+    Session::Upload& upload = session.upload;
+    if (!upload.active)
+        return -1;
+
+    TransferPipeline::Chunk* chunk = upload.pipeline->acquire();
+    chunk->packed.assign(payload, header.length);
+    chunk->flags = header.flags;
+    chunk->last = !(header.flags & FRAME_MORE);
+
+    // The reply and the commands behind the upload wait for the writer
+    if (chunk->last)
+        session.busy = true;
+
+    upload.pipeline->submit(chunk);
+    return 0;
+}
+
+/**
+ * @brief CODEC stage of a copy_from upload: decompresses a chunk that has been received.
+ *
+ * @details
+ * With FRAME_COMPRESSED the payload is a frame of the codec named in its flags (codec.h), which is decompressed with
+ * the codec of the worker thread; the chunks of an upload are decompressed on several workers at once. Otherwise it
+ * is the raw chunk. A codec that isn't registered fails the chunk. Runs on the worker pool.
+ *
+ * @param chunk The chunk to decompress.
+ */
+void Server::decompressUpload(TransferPipeline::Chunk& chunk) {
+    if (chunk.flags & FRAME_COMPRESSED) {
+        Codec* codec = CodecRegistry::local(static_cast<CodecId>(frameCodec(chunk.flags)));
+        if (codec == nullptr || codec->decompress(chunk.packed.data(), chunk.packed.size(), chunk.raw, FRAME_CHUNK_MAX) == -1)
+            chunk.failed = true;  // decompression error
+    }
+    else if (!(chunk.flags & FRAME_SIZE))
+        chunk.raw.swap(chunk.packed);
+}
+
+/**
+ * @brief SINK stage of a copy_from upload: writes the chunks to the temporary file.
+ *
+ * @details
+ * A FRAME_SIZE frame preallocates the temporary file, every other chunk is appended to it. Once something went wrong
+ * the rest of the stream is only drained. The last chunk completes the upload: the temporary file replaces the target
+ * with a rename, so the target is either the old or the complete new file, and the result is posted back to the
+ * event loop. The last chunk of a range only completes the file once every other range is in as well (finishRange).
+ * The chunks of a tree are extracted instead, every file of it replaces its target on its own. Runs on the worker pool.
+ *
+ * @param pipeline The pipeline of the upload.
+ * @param writer The temporary file of the upload.
+ */
+void Server::writeUpload(TransferPipeline& pipeline, UploadWriter& writer) {
+    while (TransferPipeline::Chunk* chunk = pipeline.nextToSink()) {
+        // Once the upload has failed the rest of the stream is only drained
+        if (!writer.failed) {
+            if (chunk->failed || (chunk->flags & FRAME_ABORTED))
+                writer.failed = true;
+            else if (writer.archive)
+                writer.failed = writer.archive->apply(chunk->raw.data(), chunk->raw.size()) == -1;
+            else if (chunk->flags & FRAME_SIZE)
+                writer.failed = openUpload(writer, chunk->packed) == -1;
+            else {
+                // Clients that don't announce the size start with the contents
+                if (!writer.file.is_open())
+                    writer.file.open(writer.partPath, std::ios::out | std::ios::binary | std::ios::trunc);
+                if (chunk->flags & FRAME_DELTA) {
+                    // Rebuilt from the target, which stays in place until the upload is complete
+                    if (!writer.delta)
+                        writer.delta = std::make_unique<DeltaDecoder>(writer.path);
+                    const int64_t rebuilt = writer.delta->apply(chunk->raw.data(), chunk->raw.size(), writer.file);
+                    writer.failed = rebuilt == -1;
+                    writer.written += writer.failed ? 0 : static_cast<uint64_t>(rebuilt);
+                }
+                else {
+                    writer.file.write(chunk->raw.data(), static_cast<std::streamsize>(chunk->raw.size()));
+                    writer.written += chunk->raw.size();
+                }
+                writer.failed = writer.failed || !writer.file;
+
+                // Everything up to here has reached the file, a lost connection resumes from here
+                if (writer.id != 0 && !writer.ranged && writer.written >= writer.checkpoint && writer.file.flush()) {
+                    TransferCheckpoint{writer.id, writer.written}.save(writer.partPath);
+                    writer.checkpoint = writer.written + TransferCheckpoint::INTERVAL;
+                }
+            }
+        }
+
+        const bool last = chunk->last;
+        pipeline.release();
+        if (!last)
+            continue;
+
+        writer.file.close();
+        std::error_code ec;
+        if (writer.archive) {
+            const bool received = !writer.failed && writer.archive->finished();
+            if (!writer.archive->error.empty())
+                log << "copy_from -r " << writer.path.string() << ": " << writer.archive->error << std::endl;
+            log << "copy_from -r " << writer.path.string() << ": " << writer.archive->files << " files, "
+                << writer.archive->directories << " directories, " << TransferStats::formatSize(writer.archive->bytes) << std::endl;
+            writer.done(received, received);
+            return;
+        }
+        if (writer.ranged) {
+            const bool received = !writer.failed && writer.file && writer.sized && writer.written == writer.range.end();
+            writer.done(received, finishRange(writer, received));
+            return;
+        }
+
+        bool received = !writer.failed && writer.file && (!writer.sized || writer.written == writer.size);
+        if (received) {
+            std::filesystem::rename(writer.partPath, writer.path, ec);
+            received = !ec;
+        }
+        if (!received)
+            std::filesystem::remove(writer.partPath, ec);
+        TransferCheckpoint::remove(writer.partPath);
+
+        writer.done(received, received);
+        return;
+    }
+}
+
+/**
+ * @brief Opens the temporary file of a copy_from upload once its FRAME_SIZE frame has arrived.
+ *
+ * @details
+ * The payload is the size of the file, optionally followed by the ID of the transfer and the offset the client sends
+ * the file from. With an ID the temporary file is the resumable one of the transfer; with an offset its checkpoint
+ * must be at exactly that offset, the file is cut back to it and the chunks are appended. Without an ID it is the
+ * temporary file of the session. A range is written into the temporary file of its transfer from the offset on, the
+ * transfer must have been announced with `copy_from -p` and with the same size. The range holds the lease of the
+ * transfer until its writer is gone. Runs on the worker pool.
+ *
+ * @param writer The temporary file of the upload.
+ * @param payload The payload of the FRAME_SIZE frame.
+ * @return 0 if the file has been opened, -1 otherwise.
+ */
+int Server::openUpload(UploadWriter& writer, const std::string& payload) {
+    if (payload.size() != sizeof(uint64_t) && payload.size() != 3 * sizeof(uint64_t))
+        return -1;
+
+    writer.size = decodeSize(payload.data());
+    writer.sized = true;
+    uint64_t start = 0;
+    if (payload.size() > sizeof(uint64_t)) {
+        writer.id = decodeSize(payload.data() + sizeof(uint64_t));
+        start = decodeSize(payload.data() + 2 * sizeof(uint64_t));
+        writer.partPath = resumablePart(writer.path, writer.id);
+    }
+
+    // The temporary file of a range has been preallocated when the transfer was announced
+    if (writer.ranged) {
+        {
+            std::lock_guard<std::mutex> lock(rangeMutex);
+            auto it = rangeUploads.find(writer.partPath.string());
+            if (it == rangeUploads.end() || writer.size != it->second.size || writer.range.length > writer.size
+                || start > writer.size - writer.range.length)
+                return -1;
+            writer.lease = it->second.writers.lock();
+            if (!writer.lease) {
+                writer.lease = std::make_shared<char>();
+                it->second.writers = writer.lease;
+            }
+        }
+        writer.range.offset = start;
+        writer.file.open(writer.partPath, std::ios::in | std::ios::out | std::ios::binary);
+        writer.file.seekp(static_cast<std::streamoff>(start));
+        writer.written = start;
+        return writer.file ? 0 : -1;
+    }
+
+    std::error_code ec;
+    if (start > 0) {
+        TransferCheckpoint checkpoint;
+        if (!checkpoint.load(writer.partPath) || checkpoint.id != writer.id || checkpoint.offset != start || start > writer.size)
+            return -1;
+        std::filesystem::resize_file(writer.partPath, start, ec);
+        if (ec)
+            return -1;
+        writer.file.open(writer.partPath, std::ios::in | std::ios::out | std::ios::binary);
+        writer.file.seekp(static_cast<std::streamoff>(start));
+        log << "copy_from " << writer.path.string() << ": resumed at " << start << std::endl;
+    }
+    else
+        writer.file.open(writer.partPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!writer.file)
         return -1;
 
+    writer.written = start;
+    writer.checkpoint = start + TransferCheckpoint::INTERVAL;
+    preallocate(writer.partPath, writer.size);
     return 0;
 }
 
+/**
+ * @brief The temporary file of a resumable upload.
+ *
+ * @param path The target of the upload.
+ * @param id The ID of the transfer.
+ * @return The path of the temporary file.
+ */
+std::filesystem::path Server::resumablePart(const std::filesystem::path& path, uint64_t id) {
+    std::filesystem::path part = path;
+    part += std::format(".{:016x}.part", id);
+    return part;
+}
 
 /**
- * @brief Handles the copy_from command received from the client.
+ * @brief Announces a file that is moved in byte ranges over several connections.
  *
  * @details
- * This function is responsible for handling the copy_from command received from the client.
- * It receives the file content from the client and saves it to the specified file.
- * If the file is compressed, it decompresses the data before saving it.
- *
- * @param command The command received from the client.
- * @return 0 if the file has been received successfully, -1 otherwise.
+ * `copy_to -p NAME` answers with `ranges SIZE ID PATH`: the size of the file, the ID of the transfer
+ * (transfer_checkpoint.h), which every range announces again so the client notices a file that has changed in between,
+ * and the absolute path, which the data connections name whatever their working directory.
+ *
+ * `copy_from -p ID SIZE NAME` creates the temporary file of the transfer with its full size and starts recording its
+ * ranges, a transfer announced again starts over; not while ranges of it are still written (EBUSY), since that
+ * truncates the file under them. SIZE is refused if it is larger than maxRangeUpload (EFBIG) or than the free space
+ * (ENOSPC). The transfer belongs to the session, which gives it up when it closes (expireRanges). It is answered the
+ * same way. Runs on the event loop.
+ *
+ * @param session The session the command came from.
+ * @param command The command behind `-p`.
+ * @param upload `copy_from -p`.
+ * @return 0 if the file has been announced, -1 otherwise.
  */
-int Server::handleCopyFromCommand(char* command) {
-    // Remove the copy_from text from the command
-    shiftStrLeft(command, 10);
-
-    std::string filename = command;
-    std::string fileContent;
-    bool isCompressed = false;
-    size_t originalSize;
-    size_t compressedSize;
-    int bytes_recvd;
+int Server::handleRangesCommand(Session& session, char* command, bool upload) {
+    unsigned long long id = 0, size = 0;
+    int length = 0;
+    if (upload) {
+        if (sscanf(command, "%llx %llu %n", &id, &size, &length) != 2 || length == 0 || id == 0) {
+            handleWrongUsage(session, "copy_from -p ID SIZE NAME");
+            return 0;
+        }
+        command += length;
+    }
 
-    // buffer for storing file data
-    char buf;
+    std::error_code ec;
+    const std::filesystem::path path = std::filesystem::absolute(resolvePath(session, command), ec);
+    if (ec) {
+        WSASetLastError(ec.value());
+        return -1;
+    }
 
-    // Get the whole file content
-    while (true) {
-        // receive one character
-        bytes_recvd = recv(ClientSocket, &buf, 1, 0);
-        if (bytes_recvd == 0)
-            break;  // connection closed
-        if (bytes_recvd == SOCKET_ERROR) {
-            // handle error condition
+    if (!upload) {
+        size = std::filesystem::file_size(path, ec);
+        id = TransferCheckpoint::idOf(path);
+        if (ec || id == 0) {
+            WSASetLastError(ec ? ec.value() : ENOENT);
             return -1;
         }
-
-        if (buf == '\v') {
-            // end the file receive process
-            break;
+    }
+    else {
+        const std::filesystem::path part = resumablePart(path, id);
+        std::lock_guard<std::mutex> lock(rangeMutex);
+        // The temporary file is truncated, not while ranges are still written into it
+        auto it = rangeUploads.find(part.string());
+        if (it != rangeUploads.end() && !it->second.writers.expired()) {
+            WSASetLastError(EBUSY);
+            return -1;
         }
 
-        if (buf == '\r') {
-            isCompressed = true;
-            continue;
+        // Preallocated before a byte has arrived, so the size is only taken if the disk has room for it
+        uint64_t available = UINT64_MAX;
+        const std::filesystem::space_info space = std::filesystem::space(part.parent_path(), ec);
+        if (!ec) {
+            const uint64_t replaced = std::filesystem::file_size(part, ec);
+            available = space.available + (ec ? 0 : replaced);
         }
-
-        if (isCompressed) {
-            // collect data for original and compressed sizes
-            std::string sizeData;
-            for (int i = 0; i < sizeof(originalSize) + sizeof(compressedSize); ++i) {
-                recv(ClientSocket, &buf, 1, 0);
-                sizeData += buf;
+        if ((maxRangeUpload != 0 && size > maxRangeUpload) || size > available) {
+            WSASetLastError(size > available ? ENOSPC : EFBIG);
+            return -1;
+        }
+        {
+            std::ofstream file(part, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!file) {
+                WSASetLastError(errno);
+                return -1;
             }
+        }
+        preallocate(part, size);
+        std::filesystem::resize_file(part, size, ec);
+        if (ec) {
+            WSASetLastError(ec.value());
+            std::filesystem::remove(part, ec);
+            rangeUploads.erase(part.string());
+            return -1;
+        }
+        rangeUploads[part.string()] = RangeUpload{size, {}, {}, &session};
+        log << "copy_from " << path.string() << ": " << size << " bytes in ranges" << std::endl;
+    }
 
-            originalSize = *(size_t*)sizeData.substr(0, sizeof(originalSize)).data();
-            compressedSize = *(size_t*)sizeData.substr(sizeof(originalSize), sizeof(compressedSize)).data();
+    return handleSend(std::format("ranges {} {:x} {}", size, id, path.string()), session);
+}
 
-            // Compressed data
-            std::string compressedData;
-            for (int i = 0; i < compressedSize; ++i) {
-                recv(ClientSocket, &buf, 1, 0);
-                compressedData += buf;
-            }
+/**
+ * @brief Records a range of a `copy_from -p` upload that has been written, and completes the file with the last one.
+ *
+ * @details
+ * Once the ranges that have been written cover the whole file, the temporary file replaces the target and the
+ * transfer is forgotten. A range that failed leaves the temporary file alone, the other ranges are still written into
+ * it and the client sends the range again. Runs on the worker pool.
+ *
+ * @param writer The writer of the range.
+ * @param received The range has been written completely.
+ * @return true if the range completed the file.
+ */
+bool Server::finishRange(UploadWriter& writer, bool received) {
+    std::lock_guard<std::mutex> lock(rangeMutex);
+    auto it = rangeUploads.find(writer.partPath.string());
+    if (!received || it == rangeUploads.end())
+        return false;
 
-            // Allocate a buffer for decompressed data
-            char* decompressedData = new char[originalSize];
+    it->second.written.add(writer.range);
+    if (!it->second.written.covers(it->second.size))
+        return false;
 
-            // Decompress the data
-            int decompressedSize = LZ4_decompress_safe(compressedData.c_str(), decompressedData, compressedSize, originalSize);
-            if (decompressedSize < 0) {
-                delete[] decompressedData;
-                return -1;  // decompression error
-            }
+    rangeUploads.erase(it);
+    std::error_code ec;
+    std::filesystem::rename(writer.partPath, writer.path, ec);
+    if (ec) {
+        log << "Failed to rename " << writer.partPath << " with error: " << ec.value() << std::endl;
+        std::filesystem::remove(writer.partPath, ec);
+        return false;
+    }
+    return true;
+}
 
-            // Save the decompressed data back to fileContent
-            fileContent += std::string(decompressedData, decompressedData + decompressedSize);
-            delete[] decompressedData;
-            isCompressed = false;
+/**
+ * @brief Gives up the `copy_from -p` uploads that can't complete any more, and removes their temporary files.
+ *
+ * @details
+ * Nothing completes an upload once the session that announced it is gone. It is given up as soon as no range is
+ * written into its temporary file any more; one that still was is given up when the next session closes. Once the
+ * server has stopped every upload that is left is given up. Runs on the event loop.
+ *
+ * @param closing The session that closes, nullptr once the server has stopped.
+ */
+void Server::expireRanges(const Session* closing) {
+    std::lock_guard<std::mutex> lock(rangeMutex);
+    for (auto it = rangeUploads.begin(); it != rangeUploads.end();) {
+        RangeUpload& upload = it->second;
+        if (closing == nullptr || upload.owner == closing)
+            upload.owner = nullptr;
+        if (upload.owner != nullptr || !upload.writers.expired()) {
+            ++it;
+            continue;
         }
 
-        else {
-            fileContent += buf;
-        }
+        std::error_code ec;
+        std::filesystem::remove(it->first, ec);
+        log << "copy_from -p: gave up " << it->first << std::endl;
+        it = rangeUploads.erase(it);
     }
+}
 
-    // Write data into file
-    std::ofstream output(filename);
-    output << fileContent;
-    output.close();
+/**
+ * @brief Reports the result of a copy_from upload to the client and lets the session go on. Runs on the event loop.
+ *
+ * @details
+ * A range of a `copy_from -p` upload that doesn't complete the file is acknowledged as a range, the tree of a
+ * `copy_from -r` upload as a directory.
+ *
+ * @param session The session the upload belongs to.
+ * @param received The file, or the range, has been received completely.
+ * @param complete The file is complete and has replaced the target.
+ */
+void Server::finishUpload(Session& session, bool received, bool complete) {
+    const bool tree = session.upload.tree;
+    session.upload = Session::Upload{};
+    session.busy = false;
+
+    if (!received) {
+        std::cout << "File transfer failed" << std::endl;
+        log << "File transfer failed" << std::endl;
+        try {
+            handleError(session, "copy_from");
+        }
+        catch (const std::runtime_error& e) {
+            log << e.what() << std::endl;
+        }
+        return;
+    }
 
     // Inform of successful reception of file
-    std::cout << "File has been received successfully" << std::endl;
-    log << "File has been received successfully" << std::endl;
+    const char* message = tree ? "Directory has been received successfully"
+                        : complete ? "File has been received successfully" : "Range has been received successfully";
+    std::cout << message << std::endl;
+    log << message << std::endl;
 
-    return 0;
+    if (handleSend(message, session) == -1)
+        log << "Failed to send message!" << std::endl;
+}
+
+/**
+ * @brief Abandons the copy_from upload of a session, if there is one, and removes its temporary file.
+ *
+ * @param session The session whose upload is abandoned.
+ */
+void Server::dropUpload(Session& session) {
+    Session::Upload& upload = session.upload;
+    if (!upload.active)
+        return;
+
+    upload.pipeline->cancel();
+    std::error_code ec;
+    std::filesystem::remove(upload.partPath, ec);
+    session.upload = Session::Upload{};
+}
+
+/**
+ * @brief Allocates the disk space of a file that is going to be written up front.
+ *
+ * @details
+ * Lets the file system lay the file out in one piece and fails early when the disk is full. Only done on Linux,
+ * a file system that doesn't support it is simply written without.
+ *
+ * @param path The file to allocate.
+ * @param size The size the file is going to have.
+ */
+void Server::preallocate(const std::filesystem::path& path, uint64_t size) {
+#ifdef __linux__
+    if (size == 0)
+        return;
+
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+
+    if (fallocate(fd, 0, 0, static_cast<off_t>(size)) == -1 && errno != EOPNOTSUPP)
+        log << "fallocate failed for " << path << " with error: " << errno << std::endl;
+    close(fd);
+#endif
 }
 
 /**
@@ -1225,12 +2845,12 @@ int Server::handleCopyFromCommand(char* command) {
  * This function is invoked when the server receives a timeout event. It sends a failure message
  * to the client indicating that their request has timed out. The failure message is logged to the
  * log file and printed to the standard error output. The message is then sent to the client using
- * the ClientSocket. If the send operation encounters an error, an exception is thrown.
+ * the socket of the session. If the send operation encounters an error, an exception is thrown.
  */
-void Server::handleTimeout() {
+void Server::handleTimeout(Session& session) {
     std::string sendFail = "Your request timed out!";
 
-    if (handleSend(sendFail, LastSock) == -1)
+    if (handleSend(sendFail, session) == -1)
         throw std::runtime_error("Couldn't send message!");
 }
 
@@ -1245,7 +2865,7 @@ void Server::handleTimeout() {
  *
  * @return The exit status of the function. Returns 1 if the script execution fails, 0 otherwise.
  */
-int Server::move_start() {
+int Server::move_start(Session& session) {
     if (inStartup)
         return -2;
 	if(auto p = find_path(std::filesystem::current_path(), "scripts")) {
@@ -1262,7 +2882,7 @@ int Server::move_start() {
 
 		std::string message = "Successfully added Server.exe to startup!";
 
-		if (handleSend(message, LastSock) == -1)
+		if (handleSend(message, session) == -1)
 			return 1;
 
 		return 0;
@@ -1279,7 +2899,7 @@ int Server::move_start() {
  * @return  0 if the Server.exe is successfully removed from startup and the message is sent,
  *         -1 if there is an error sending the message and if there is an error executing the batch file
  */
-int Server::remove_start() {
+int Server::remove_start(Session& session) {
 	std::string path_to_bat;
 	
     if (!inStartup)
@@ -1305,7 +2925,7 @@ int Server::remove_start() {
 
     std::string message = "Successfully removed Server.exe from startup!";
 
-    if (handleSend(message, LastSock) == -1)
+    if (handleSend(message, session) == -1)
         return -1;
 
     return 0;
@@ -1316,7 +2936,8 @@ int Server::remove_start() {
  *
  * @details
  * This function runs a command that is provided as input.
- * It checks if the provided file name exists and then uses the system() function to run the command.
+ * It checks if the provided file name exists and then uses the system() function to run the command
+ * from the working directory of the session.
  * If the command execution is successful, the function returns 0.
  * If the file name does not exist or if the command execution fails, the function returns -1.
  *
@@ -1324,18 +2945,24 @@ int Server::remove_start() {
  *
  * @returns 0 if the command is executed successfully, -1 otherwise.
  */
-int Server::handleRunCommand(char* command) {
+int Server::handleRunCommand(Session& session, char* command) {
     shiftStrLeft(command, 4);
     // Check if file name exists
-    if (!std::filesystem::exists(command))
+    if (!std::filesystem::exists(resolvePath(session, command)))
         return -1;
 
-    if (system(command) != 0)
+    // Run it from the session's working directory
+#ifdef _WIN32
+    std::string line = std::format("cd /d \"{}\" && {}", session.cwd.string(), command);
+#else
+    std::string line = std::format("cd \"{}\" && {}", session.cwd.string(), command);
+#endif
+    if (system(line.c_str()) != 0)
         return -1;
 
     std::string message = std::format("Successfully ran {}!", command);
 
-    if (handleSend(message, LastSock) == -1)
+    if (handleSend(message, session) == -1)
         return -1;
 
     return 0;
@@ -1349,12 +2976,12 @@ int Server::handleRunCommand(char* command) {
  *. Otherwise, if `move` is neither `1` nor `2`, the function returns without doing anything.
  *
  * The function logs the message and appends a form feed character to the message. Then, it attempts to send
- * the message to the client using the `ClientSocket`. If the sending fails
+ * the message to the client using the socket of the session. If the sending fails
  *, an error message is logged and printed to the standard error stream.
  *
  * @param move An integer indicating the type of startup move.
  */
-void Server::handleStartupError(int move) {
+void Server::handleStartupError(Session& session, int move) {
     std::string message;
 
     // Handles already in startup
@@ -1365,7 +2992,7 @@ void Server::handleStartupError(int move) {
     else
         return;
 
-    handleSend(message, LastSock);
+    handleSend(message, session);
 }
 
 /**
@@ -1378,14 +3005,14 @@ void Server::handleStartupError(int move) {
  *
  * @return 0 if the message is sent successfully, -1 otherwise.
  */
-int Server::handleCheckInStartup() {
+int Server::handleCheckInStartup(Session& session) {
     std::string message;
     if (inStartup)
         message = "The exe file is in startup";
     else
         message = "The exe file is not in startup";
 
-    if (handleSend(message, LastSock) == -1)
+    if (handleSend(message, session) == -1)
         return -1;
 
     return 0;
@@ -1395,18 +3022,176 @@ int Server::handleCheckInStartup() {
  * @brief Sends a message to the connected client and logs the message.
  *
  * @details
- * This function sends a message to the connected client using the
- * ClientSocket. It also logs the message using the log file.
+ * The message is sent as a Response frame, see sendFrame. A message of responseThreshold bytes or more goes to a
+ * client that decodes compressed frames through the codec instead, see sendCompressedResponse.
  *
  * @param sen The message to be sent to the client.
+ * @param session The session of the client.
  * @return 0 on success, -1 on failure to send the message.
  */
+int Server::handleSend(std::string sen, Session& session) {
+    if (session.compressResponses && responseThreshold != 0 && sen.size() >= responseThreshold)
+        return sendCompressedResponse(session, sen);
+
+    if (codecs.dictionary && sen.size() >= ResponseDictionary::MIN_REPLY) {
+        if (responseDictionary.sample(sen))
+            trainResponseDictionary();
+        if (session.dictionaryMode)
+            return sendDictionaryResponse(session, sen);
+    }
+
+    return sendFrame(session, FrameType::Response, 0, std::move(sen));
+}
+
+/**
+ * @brief Sends a short reply compressed against the zstd dictionary.
+ *
+ * @details
+ * A session that has no dictionary yet takes the current one and sends it in a Dictionary frame first; a session
+ * keeps the version it has sent for its lifetime. Before the first training, or if the reply doesn't shrink, the
+ * reply is sent raw. What the dictionary saves is kept for the `stats` command. On the worker pool the dictionary and
+ * the statistics are kept in the outbox of the handler, finishJob hands them to the session on its event loop.
+ *
+ * @param session The session of the client, which named zstd-dict in the handshake.
+ * @param text The reply.
+ * @return 0 on success, -1 on failure to send the reply.
+ */
+int Server::sendDictionaryResponse(Session& session, std::string& text) {
+    std::shared_ptr<const ZstdDictionary>& current = outbox ? outbox->dictionary : session.dictionary;
+    TransferStats& stats = outbox ? outbox->dictionaryStats : session.dictionaryStats;
+
+    if (!current) {
+        current = responseDictionary.current();
+        if (current) {
+            const ZstdDictionary& dictionary = *current;
+            std::string payload(sizeof(uint64_t), '\0');
+            encodeSize(payload.data(), dictionary.getVersion());
+            payload += dictionary.data();
+            if (queueFrame(session, FrameType::Dictionary, 0, std::move(payload)) == -1)
+                return -1;
+        }
+    }
+
+    if (!current)
+        return sendFrame(session, FrameType::Response, 0, std::move(text));
+
+    std::string packed;
+    size_t frameSize = Codec::FAILED;
+    packed.resize_and_overwrite(ZSTD_compressBound(text.size()), [&](char* dst, size_t size) {
+        frameSize = ZstdCodec::local().compress(dst, size, text.data(), text.size(), current->compression());
+        return frameSize == Codec::FAILED ? 0 : frameSize;
+    });
+
+    if (frameSize == Codec::FAILED || frameSize >= text.size()) {
+        stats.add(CompressionLevel::Raw, text.size(), text.size());
+        return sendFrame(session, FrameType::Response, 0, std::move(text));
+    }
+    stats.add(CompressionLevel::High, text.size(), frameSize);
+    return sendFrame(session, FrameType::Response, FRAME_COMPRESSED | codecFlags(static_cast<uint8_t>(CodecId::Zstd)), std::move(packed));
+}
+
+/**
+ * @brief Trains the next version of the zstd dictionary, on the worker pool if there is one.
+ *
+ * @details
+ * Sessions that already have a dictionary keep theirs, the new version goes to the sessions that take one from now
+ * on.
+ */
+void Server::trainResponseDictionary() {
+    auto train = [this] {
+        std::shared_ptr<const ZstdDictionary> dictionary = responseDictionary.train();
+        if (dictionary)
+            log << "Trained reply dictionary version " << dictionary->getVersion() << ", " << TransferStats::formatSize(dictionary->data().size()) << std::endl;
+        else
+            log << "Failed to train a reply dictionary" << std::endl;
+    };
+
+    if (workers)
+        workers->submit(train);
+    else
+        train();
+}
+
+/**
+ * @brief Sends a large reply (ls of a big directory, grep over a log, ...) through the codec.
+ *
+ * @details
+ * The reply is split into chunks of STREAM_CHUNK bytes, which are sent as Response frames of their own, every one
+ * but the last with FRAME_MORE, so the client decompresses a chunk while the next one is on the way. The levels
+ * follow the files (compression_policy.h): a reply of up to HIGH_MAX_SIZE bytes is compressed with the high level,
+ * a larger one with the fast level, and a chunk that looks compressed already or doesn't shrink is sent raw. The
+ * statistics of the reply are logged.
+ *
+ * @param session The session of the client.
+ * @param text The reply.
+ * @return 0 on success, -1 on failure to send the reply.
+ */
+int Server::sendCompressedResponse(Session& session, const std::string& text) {
+    const CompressionLevel textLevel = text.size() <= CompressionPolicy::HIGH_MAX_SIZE ? CompressionLevel::High : CompressionLevel::Fast;
+    TransferStats stats;
+    stats.codecs = session.codecs;
+
+    for (size_t offset = 0; offset < text.size(); offset += STREAM_CHUNK) {
+        const size_t length = std::min(STREAM_CHUNK, text.size() - offset);
+        const char* data = text.data() + offset;
+        const bool last = offset + length == text.size();
+        uint16_t flags = last ? 0 : FRAME_MORE;
+
+        CompressionLevel level = CompressionPolicy::forBlock(textLevel, data, length);
+        std::string payload;
+        if (level != CompressionLevel::Raw) {
+            const CodecId id = session.codecs.forLevel(level);
+            Codec& codec = *CodecRegistry::local(id);
+            size_t frameSize = Codec::FAILED;
+            payload.resize_and_overwrite(codec.compressBound(length, codecOptions), [&](char* packed, size_t size) {
+                frameSize = codec.compress(packed, size, data, length, codecOptions);
+                return frameSize == Codec::FAILED ? 0 : frameSize;
+            });
+            if (frameSize == Codec::FAILED || frameSize >= length)
+                level = CompressionLevel::Raw;
+            else
+                flags |= FRAME_COMPRESSED | codecFlags(static_cast<uint8_t>(id));
+        }
+        if (level == CompressionLevel::Raw)
+            payload.assign(data, length);
+        stats.add(level, length, payload.size());
+
+        // The last chunk writes all of them
+        if (!last) {
+            if (queueFrame(session, FrameType::Response, flags, std::move(payload)) == -1)
+                return -1;
+            continue;
+        }
+        log << "response: " << stats.summary() << std::endl;
+        return sendFrame(session, FrameType::Response, flags, std::move(payload));
+    }
+    return 0;
+}
 
-int Server::handleSend(std::string sen, SOCKET sock) {
-    sen += '\f';
+/**
+ * @brief Sends a frame to the connected client.
+ *
+ * @details
+ * This function appends the header and the payload to the output queue of the session as two buffers,
+ * so the payload is never copied, and writes as much of the queue to the socket as it takes without
+ * blocking; the rest is written by the event loop once the socket is writable again. While the io_uring
+ * backend is running the queue is written by send requests on the ring instead. Handlers running on the
+ * worker pool hand their frames to the event loop of the session. On Linux the payload may be a range of
+ * a file, which is sent with sendfile.
+ *
+ * @param session The session of the client.
+ * @param type The type of the frame.
+ * @param flags The flags of the frame.
+ * @param payload The payload of the frame.
+ * @return 0 on success, -1 on failure to send the frame.
+ */
+int Server::sendFrame(Session& session, FrameType type, uint16_t flags, OutBuffer payload) {
+    if (queueFrame(session, type, flags, std::move(payload)) == -1)
+        return -1;
+    if (outbox)
+        return 0;
 
-    int iSendResult = send(sock, sen.c_str(), (int)sen.length(), 0);
-    if (iSendResult == SOCKET_ERROR) {
+    if (writeOutput(session) == -1) {
         log << "Failed to send message!";
         std::cerr << "failed to send message!" << std::endl;
         return -1;
@@ -1416,6 +3201,125 @@ int Server::handleSend(std::string sen, SOCKET sock) {
     return 0;
 }
 
+/**
+ * @brief Appends a frame to the output queue of a session without writing it yet.
+ *
+ * @details
+ * Lets a caller that sends several frames in a row write them with a single writeOutput. Handlers running on the
+ * worker pool hand their frames to the event loop of the session instead.
+ *
+ * @param session The session of the client.
+ * @param type The type of the frame.
+ * @param flags The flags of the frame.
+ * @param payload The payload of the frame.
+ * @return 0 on success, -1 if the payload doesn't fit into a frame.
+ */
+int Server::queueFrame(Session& session, FrameType type, uint16_t flags, OutBuffer payload) {
+    if (payload.size() > FRAME_MAX_LENGTH) {
+        log << "Payload of " << payload.size() << " bytes doesn't fit into a frame" << std::endl;
+        return -1;
+    }
+
+    std::string header = FrameHeader{ type, flags, static_cast<uint32_t>(payload.size()) }.encode();
+
+    if (outbox) {
+        outbox->replies.push_back(std::move(header));
+        if (!payload.empty())
+            outbox->replies.push_back(std::move(payload));
+        return 0;
+    }
+
+    session.queueOutput(std::move(header));
+    if (!payload.empty())
+        session.queueOutput(std::move(payload));
+    return 0;
+}
+
+/**
+ * @brief Starts writing the output queue of a session with the backend the loop runs on.
+ *
+ * @param session The session whose output queue is written.
+ * @return 0 on success, -1 on failure.
+ */
+int Server::writeOutput(Session& session) {
+#ifdef DATATRANSMISSION_IO_URING
+    if (uring)
+        return uringFlush(session);
+#endif
+
+    return flushOutput(session);
+}
+
+/**
+ * @brief Writes the output queue of a session to its socket.
+ *
+ * @details
+ * On Linux client sockets are non-blocking: the queue is written with sendmsg, which gathers up to MAX_IOV
+ * buffers per call, until it is empty or the socket buffer is full, and the epoll loop calls this again once
+ * the socket is writable. Gathering keeps the header and the payload of a frame in one segment. Buffers that stand
+ * for a range of a file are written with sendfile, straight from the page cache. Elsewhere the blocking socket
+ * is written until the queue is empty.
+ *
+ * @param session The session whose output queue is written.
+ * @return 0 if the queue has been written as far as possible, -1 on a send error.
+ */
+int Server::flushOutput(Session& session) {
+    while (!session.out.empty()) {
+#ifdef __linux__
+        const OutBuffer& front = session.out.front();
+        if (!front.inMemory()) {
+            off_t offset = front.offset + static_cast<off_t>(session.outOffset);
+            ssize_t res = sendfile(session.sock, front.file->fd, &offset, front.size() - session.outOffset);
+            if (res == SOCKET_ERROR) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    session.outputBlocked();
+                    return 0;
+                }
+                return -1;
+            }
+            if (res == 0) {
+                // The file has been truncated, the frame can't be completed anymore
+                log << "File shrank while it was being sent" << std::endl;
+                return -1;
+            }
+            session.consumeOutput(res);
+            continue;
+        }
+
+        iovec iov[MAX_IOV];
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = session.gatherOutput(iov, MAX_IOV);
+
+        // A frame header followed by a file range is held back until sendfile has added the payload
+        int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+        if (msg.msg_iovlen < session.out.size() && !session.out[msg.msg_iovlen].inMemory())
+            flags |= MSG_MORE;
+
+        ssize_t res = sendmsg(session.sock, &msg, flags);
+        if (res == SOCKET_ERROR) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                session.outputBlocked();
+                return 0;
+            }
+            return -1;
+        }
+#else
+        const OutBuffer& front = session.out.front();
+        int res = send(session.sock, front.bytes() + session.outOffset, (int)(front.size() - session.outOffset), 0);
+        if (res == SOCKET_ERROR)
+            return -1;
+#endif
+        session.consumeOutput(res);
+    }
+
+    return 0;
+}
+
 /**
  * Calculate the hash value of a given password.
  *
@@ -1752,13 +3656,30 @@ int Server::addStartup() {
  * @details
  * This function parses the authentication command received from the client and extracts the username and password.
  * It then calls the auth function to authenticate the user by checking the provided username and password against the USER table in the database.
- * If the authentication is successful, it sends a "valid" message to the client using the handleSend function.
+ * The password check is deliberately slow (Argon2), so it runs on the worker pool. Once it is done the user is
+ * attached to the session and a "valid" message is sent to the client using the handleSend function.
  *
+ * A client may name the codecs it decodes after the password, as in `auth: NAME PASSWORD codecs=zstd,lz4hc,lz4`.
+ * The session then compresses with the codecs both sides support, and the reply lists them:
+ * `valid codecs=zstd,lz4hc,lz4`. Clients that don't name any get the LZ4 codecs and the plain "valid" reply.
+ *
+ * @param session The session the command was received on.
  * @param command The authentication command received from the client.
- * @return 0 on successful authentication, -1 on error or authentication failure.
+ * @return 0 if the check has been started, -1 if the command is malformed.
  */
-int Server::handleAuth(char* command) {
+int Server::handleAuth(Session& session, char* command) {
     shiftStrLeft(command, 6);
+
+    // The codec list is cut off, the rest is parsed as before
+    bool negotiated = false;
+    CodecSet peerCodecs = CodecRegistry::legacy();
+    if (char* list = strstr(command, " codecs=")) {
+        negotiated = true;
+        peerCodecs = CodecRegistry::parse(list + 8);
+        *list = '\0';
+    }
+    const CodecSet agreed = peerCodecs & codecs;
+
     std::string username, password;
     int space_counter = 0;
     bool second_word = false;
@@ -1778,14 +3699,31 @@ int Server::handleAuth(char* command) {
 
     if (space_counter != 1) return -1;
 
-    int res = auth(username, password);
-    if (res == -1) return -1;
+    auto res = std::make_shared<int>(-1);
+
+    runOnWorker(session, [this, res, username, password](Session&) {
+        *res = auth(username, password);
+    }, [this, res, username, negotiated, agreed](Session& session) {
+        if (*res == -1) {
+            handleError(session, "Auth");
+            return;
+        }
+
+        session.user = username;
+        session.codecs = CodecChoice::from(agreed);
+        session.compressResponses = negotiated;
+        session.dictionaryStats.codecs = session.codecs;
+        session.link->setCodecs(session.codecs);
+        log << "Accepted new client. Username: " << username << ", codecs: " << CodecRegistry::format(agreed) << std::endl;
+        std::cout << "Accepted new client. Username: " << username << std::endl;
 
-    userMap[LastSock] = username;
-	log << "Accepted new client. Username: " << username << std::endl;
-    std::cout << "Accepted new client. Username: " << username << std::endl;
+        std::string reply = negotiated ? "valid codecs=" + CodecRegistry::format(agreed) : "valid";
+        if (handleSend(reply, session) != 0)
+            handleError(session, "Auth");
 
-    if (handleSend("valid", LastSock) != 0) return -1;
+        // From here on the short replies are compressed against the dictionary, which is sent with the first one
+        session.dictionaryMode = agreed.hasDictionary();
+    });
 
     return 0;
 }
@@ -1813,6 +3751,131 @@ int Server::setCwd(const std::string& path) {
     }
 }
 
+/**
+ * @brief Sets the number of event loop threads run() starts.
+ *
+ * @details
+ * Each thread owns its own listener and the sessions accepted on it. Only supported on Linux, every
+ * other platform keeps running a single select() loop.
+ *
+ * @param threads The number of event loop threads, at least 1.
+ * @return 0 on success, -1 if the number is invalid.
+ */
+int Server::setLoopThreads(int threads) {
+    if (threads < 1)
+        return -1;
+
+#ifndef __linux__
+    if (threads > 1)
+        log << "Multiple event loop threads are only supported on Linux" << std::endl;
+#endif
+
+    loopThreads = threads;
+    return 0;
+}
+
+/**
+ * @brief Sets the number of worker threads blocking command handlers run on.
+ *
+ * @details
+ * Defaults to the number of hardware threads. With 0 workers every handler runs inline on its event loop.
+ * Only used on Linux, the select() loop always runs the handlers inline.
+ *
+ * @param threads The number of worker threads, at least 0.
+ * @return 0 on success, -1 if the number is invalid.
+ */
+int Server::setWorkerThreads(int threads) {
+    if (threads < 0)
+        return -1;
+
+    workerThreads = threads;
+    return 0;
+}
+
+/**
+ * @brief Protects every block of the compressed chunks the server sends with a checksum.
+ *
+ * @details
+ * The receiver's LZ4 decoder then verifies every block before it is written. Costs 4 bytes and one xxHash32 pass
+ * per block. zstd frames get a checksum of their contents instead.
+ *
+ * @return 0.
+ */
+int Server::enableBlockChecksums() {
+    codecOptions.checksum = true;
+    return 0;
+}
+
+/**
+ * @brief Sets the size from which replies are compressed.
+ *
+ * @details
+ * Only clients that named their codecs in the `auth:` handshake get compressed replies, older ones get every reply
+ * raw.
+ *
+ * @param bytes Replies of this many bytes and more are compressed, 0 turns the compression of replies off.
+ * @return 0 on success, -1 if the size is negative.
+ */
+int Server::setResponseThreshold(long long bytes) {
+    if (bytes < 0)
+        return -1;
+
+    responseThreshold = static_cast<size_t>(bytes);
+    return 0;
+}
+
+/**
+ * @brief Sets the largest file a `copy_from -p` upload may announce.
+ *
+ * @details
+ * The temporary file of such an upload is preallocated with the full size before any range has arrived. A size
+ * above the free space of the disk is always refused.
+ *
+ * @param bytes The largest size in bytes, 0 only limits it by the free space.
+ * @return 0 on success, -1 if the size is negative.
+ */
+int Server::setMaxRangeUpload(long long bytes) {
+    if (bytes < 0)
+        return -1;
+
+    maxRangeUpload = static_cast<uint64_t>(bytes);
+    return 0;
+}
+
+/**
+ * @brief Restricts the codecs the server offers in the `auth:` handshake.
+ *
+ * @details
+ * LZ4 can't be turned off, clients that don't take part in the handshake only decode LZ4 frames.
+ *
+ * @param list Comma separated codec names (codec.h), e.g. "lz4hc,lz4".
+ * @return 0 on success, -1 if the list names a codec that isn't registered.
+ */
+int Server::setCodecs(const std::string& list) {
+    bool unknown = false;
+    CodecSet set = CodecRegistry::parse(list, &unknown);
+    if (unknown)
+        return -1;
+
+    codecs = set;
+    return 0;
+}
+
+/**
+ * @brief Selects the io_uring completion backend for run().
+ *
+ * @return 0 if the backend has been selected, -1 if the server was built without io_uring support.
+ */
+int Server::enableIoUring() {
+#ifdef DATATRANSMISSION_IO_URING
+    ioUring = true;
+    return 0;
+#else
+    log << "Server was built without io_uring support" << std::endl;
+    return -1;
+#endif
+}
+
 /**
  * @brief Handles wrong usage of a command.
  *
@@ -1827,37 +3890,27 @@ int Server::setCwd(const std::string& path) {
  * @throw std::runtime_error If an error occurs while sending the error message.
  * @throw std::runtime_error to indicate wrong usage.
  */
-void Server::handleWrongUsage(const char* command) {
+void Server::handleWrongUsage(Session& session, const char* command) {
     std::string message = std::format("Wrong usage in command {}", command);
     log << message << std::endl;
 
-    if (handleSend(message, LastSock) == -1)
+    if (handleSend(message, session) == -1)
         throw std::runtime_error("Unable to send message.");
 
     throw std::runtime_error(message);
 }
 
 /**
- * @brief Handles the cut command by copying the file and removing the original fil
+ * @brief Handles the cut command by copying the file and removing the original file once it has been sent.
  *
  * @param command The name of the file to cut.
  * @return 0 on success, -1 on failure.
  */
-int Server::handleCutCommand(char* command) {
-    if (handleCopyCommand(command) == -1) {
-        handleError("cut");
-        return -1;
-    }
-
-    if (remove(command) != 0) {
-        handleSend(std::format("Failed to remove file {}", command), LastSock);
+int Server::handleCutCommand(Session& session, char* command) {
+    if (handleCopyCommand(session, command, true) == -1) {
+        handleError(session, "cut");
         return -1;
     }
-    else {
-        std::string success = std::format("Successfully cut {}", command);
-        std::cout << success << std::endl;
-        log << success << std::endl;
-    }
 
     return 0;
 }
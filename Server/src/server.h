@@ -7,28 +7,69 @@
  *  functionality to manage network communication, command handling and error handling.
  *
  *  Private member variables:
- *  - DEFAULT_BUFLEN: Represents the default length for the receive buffer.
- *  - ClientSocket and ListenSocket: Used to manage connections.
- *  - log: Object to manage log file.
+ *  - DEFAULT_BUFLEN: Length of the buffers short replies are formatted into.
+ *  - ListenSocket: Used to accept connections. Each connection is represented by a Session.
+ *  - log: Object to manage log file, safe to use from every event loop thread.
  *  - wsaData: WSADATA object required for the use of Winsock2 library.
  *  - port: String to store the port for the server to listen on.
- *  - iResult: Integer used to store result values.
+ *  - iResult: Integer used to store result values during initialisation.
  *  - result and ptr: Pointers to addrinfo structure for network communication management.
  *  - hints: An addrinfo structure, which is used in network communication setup.
- *  - recvbuf: Character buffer to store received data.
- *  - recvbuflen: Integer to store the receive buffer length.
+ *  - loopThreads: Number of event loop threads run() starts (Linux, one SO_REUSEPORT listener each).
+ *  - workerThreads / workers: Size of the worker pool blocking command handlers run on, and the pool itself.
+ *  - codecOptions: Options of the frames the server compresses downloads into (codec.h).
+ *  - responseThreshold: Replies of this many bytes and more are compressed for clients that negotiated codecs, 0 never.
+ *  - codecs: Codecs the server offers in the `auth:` handshake, all registered ones unless restricted with setCodecs.
+ *    The zstd-dict mode is only offered when it is named.
+ *  - responseDictionary: Samples of the replies and the zstd dictionary trained from them (response_dictionary.h).
+ *  - rangeUploads: The announced size of every `copy_from -p` upload and its ranges that have been written, shared by
+ *    the sessions of the data connections that carry them and guarded by rangeMutex.
+ *  - maxRangeUpload: The largest file `copy_from -p` preallocates, besides the free space of the disk.
  *
  *  Private member methods:
  *  - handlePwdCommand, handleExitCommand, handleChangeDirectoryCommand, handleLsCommand,
  *    sendCmdDoesntExist, handleMakeDirectoryCommand, handleTouchFileCommand,
  *    handleRemoveDirectoryCommand, handleRemoveFileCommand, handleCopyCommand, handleCatCommand,
- *    handleEchoCommand, handleMoveCommand, handleCpCommand: These methods are implemented
- *    to handle specific commands sent from a client to the server.
+ *    handleEchoCommand, handleStatsCommand, handleMoveCommand, handleCpCommand: These methods are implemented
+ *    to handle specific commands sent from a client to the server. Every handler takes the
+ *    Session the command came from and replies to it.
+ *  - resolvePath: Resolves a path argument against the working directory of a session.
+ *  - receiveUpload, decompressUpload, writeUpload, finishUpload, dropUpload: The stages of the transfer pipeline
+ *    of a copy_from upload. The loop feeds the chunks carried by the File frames in, the worker pool decompresses
+ *    them (several at once) and writes them to a temporary file that replaces the target once complete. dropUpload abandons the upload.
+ *  - openUpload, resumablePart: Open the temporary file of an upload once its size has been announced; the one
+ *    of a resumable upload is named after the transfer and continued from its checkpoint (transfer_checkpoint.h).
+ *    The chunks of a `copy_from -r` upload are the archive of a tree (tree_archive.h), extracted as they are written.
+ *  - preallocate: Allocates the announced size of an upload up front (fallocate on Linux).
+ *  - handleRangesCommand, finishRange, expireRanges: `copy_to -p` / `copy_from -p` name a file that is moved in byte
+ *    ranges over several connections (range_transfer.h). Every range is a `copy_to -R` / `copy_from -R` of its own;
+ *    the ranges of an upload are written into one preallocated temporary file and recorded in rangeUploads, the range
+ *    that completes the file renames it. An upload whose announcing session is gone is given up with its file.
+ *  - readDownload, compressDownload, sendDownload, finishDownload: The stages of the transfer pipeline of a
+ *    copy_to / cut reply. The worker pool reads the file in chunks of STREAM_CHUNK bytes and compresses several
+ *    chunks at once, the loop sends them in order. Uncompressed chunks are sent with sendfile on Linux. `copy_to -r`
+ *    reads the archive of a tree instead of a file (tree_archive.h).
+ *  - loopExecutor, poolExecutor: Where the stages of a transfer pipeline run.
  *  - shiftStrLeft: Helper utility function for string manipulation.
  *  - handleError: Error handling methodology, encapsulated in a function.
  *  - handleCommand: Function to parse received commands and call respective command handlers.
  *  - initServer: Function to initialize server.
  *  - setupPort: Function to set up the port for the server to listen on.
+ *  - runLoop, runEpoll / runSelect: Platform specific event loops behind run(). Linux runs
+ *    loopThreads edge-triggered epoll loops, every other platform falls back to one select() loop.
+ *  - openListenSocket: Creates a bound, listening socket (SO_REUSEPORT on Linux).
+ *  - handleClientData, dispatchReceived, closeClient: Receive/dispatch and teardown shared by the event loops.
+ *  - resumeInput: Lets the event loop receive from a session again that stopped while it couldn't go on.
+ *  - dispatchInput, dispatchFrame, sendFrame, queueFrame: Decode the frames (protocol.h) in the input buffer of a
+ *    session in place and send frames.
+ *  - sendCompressedResponse: Sends a reply of responseThreshold bytes or more in compressed chunks.
+ *  - sendDictionaryResponse, trainResponseDictionary: Compress shorter replies against the trained zstd dictionary.
+ *  - flushOutput: Write the output queue of a session.
+ *  - runOnWorker, finishJob, completeJob: Run a handler on the worker pool and post its replies and the session
+ *    state they changed back to the loop of the session.
+ *  - runUring: Optional io_uring completion backend (DATATRANSMISSION_IO_URING builds), which
+ *    falls back to runEpoll at runtime when the kernel doesn't support io_uring. uringReadFile reads the file
+ *    of a `cat` on the loop, uringReadChunks the chunks of a `copy_to` / `cut` on the worker pool.
  *
  *  Public member variables:
  *  - Constructor: Defines a constructor for the Server object, which takes a port number as an argument.
@@ -42,13 +83,20 @@
 
 #define WIN32_LEAN_AND_MEAN
 
-#include <windows.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
+#include "platform.h"
 #include <cstdio>
 #include <fstream>
 #include "helper.h"
-#include <direct.h>
+#include "sync_log.h"
+#include "session.h"
+#include "response_dictionary.h"
+#include "worker_pool.h"
+#include "protocol.h"
+#include "codec.h"
+#include "transfer_checkpoint.h"
+#include "delta_transfer.h"
+#include "range_transfer.h"
+#include "tree_archive.h"
 #include <filesystem>
 #include <iostream>
 #include <format>
@@ -58,14 +106,23 @@
 #include <sqlite3.h>
 #include <unordered_map>
 #include <sodium.h>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <vector>
 
 class Server {
 private:
     static constexpr const int DEFAULT_BUFLEN = 512;
-    SOCKET ClientSocket = INVALID_SOCKET;
+    static constexpr const uint32_t MAX_COMMAND_LENGTH = 64 * 1024;     // of every frame but a File frame
+    static_assert(DeltaSignature::FRAME_BYTES <= MAX_COMMAND_LENGTH);
+    static constexpr const int MAX_IOV = 64;
+    static constexpr const size_t STREAM_CHUNK = 1 << 20;
+    static_assert(STREAM_CHUNK <= FRAME_CHUNK_MAX);
+    static constexpr const size_t ZERO_COPY_MIN = 64 * 1024;
     SOCKET ListenSocket = INVALID_SOCKET;
-    SOCKET LastSock = INVALID_SOCKET;
-    std::ofstream log;
+    SyncLog log;
     std::fstream settings;
     WSADATA wsaData;
     std::string port;
@@ -73,47 +130,187 @@ private:
     bool inStartup = false;
     int iResult;
     struct addrinfo* result = nullptr, * ptr = nullptr, hints;
-    char recvbuf[DEFAULT_BUFLEN];
-    int recvbuflen = DEFAULT_BUFLEN;
+    int loopThreads = 1;
+    int workerThreads = (int)std::max(1u, std::thread::hardware_concurrency());
+    ResponseDictionary responseDictionary;    // outlives the workers, which train it
+    std::unique_ptr<WorkerPool> workers;
+    Codec::Options codecOptions;
+    CodecSet codecs = CodecRegistry::defaults();
+    size_t responseThreshold = 64 * 1024;
+    // A `copy_from -p` upload
+    struct RangeUpload {
+        uint64_t size = 0;                    // announced with `copy_from -p`, every range must be of this file
+        RangeSet written;
+        std::weak_ptr<void> writers;          // held by every range that is being written into the temporary file
+        const Session* owner = nullptr;       // announced it, the upload is given up once it is gone
+    };
+    std::mutex rangeMutex;
+    std::unordered_map<std::string, RangeUpload> rangeUploads;   // by temporary file
+    uint64_t maxRangeUpload = 0;              // largest `copy_from -p` upload, 0 only limited by the free space
     std::string db_name = "users.db";
     sqlite3* DB;
-    std::unordered_map<SOCKET, std::string> userMap;
 
-    int handlePwdCommand();
+    // Disk side of a download, owned by its SOURCE and CODEC stages
+    struct DownloadReader {
+        std::filesystem::path path;
+        std::ifstream file;
+        uint64_t size = 0;                    // of the whole file
+        uint64_t offset = 0;                  // position of the next chunk in the file
+        uint64_t id = 0;                      // of the transfer (transfer_checkpoint.h)
+        uint64_t start = 0;                   // the file is sent from here on, past the client's checkpoint
+        TransferCheckpoint resume;            // checkpoint the client asked to resume from, offset 0 if none
+        uint32_t resumeChecksum = 0;          // of the window in front of it
+        std::shared_ptr<const DeltaSignature> signature;  // of the client's copy, the file is sent as a delta
+        std::unique_ptr<DeltaEncoder> delta;
+        bool ranged = false;                  // `copy_to -R`: only `range` of the file is sent
+        ByteRange range;
+        bool tree = false;                    // `copy_to -r`: the path is a directory, sent as an archive
+        std::unique_ptr<ArchiveWriter> archive;
+        uint64_t remaining = 0;               // bytes of the file that have not been read yet
+        bool opened = false;
+        int error = 0;                        // error code of a file that couldn't be opened
+        bool finished = false;                // the last chunk has been read
+        bool zeroCopy = false;                // uncompressed chunks may be sent with sendfile
+        CompressionLevel level = CompressionLevel::Raw;  // chosen by SOURCE when it opens the file
+        const char* command = nullptr;
+        std::shared_ptr<LinkEstimate> link;   // of the session, the level is chosen from it and the codec updates it
+        size_t codecThreads = 1;
+        CodecChoice codecs;                   // of the session
+#ifdef __linux__
+        std::shared_ptr<FileSource> source;
+#endif
+#ifdef DATATRANSMISSION_IO_URING
+        std::unique_ptr<FileSource> ringSource;  // --io-uring: the chunks are read through the file ring of the worker
+#endif
+    };
+
+    // Disk side of an upload, owned by its SINK stage
+    struct UploadWriter {
+        std::filesystem::path path;
+        std::filesystem::path partPath;
+        std::ofstream file;
+        uint64_t size = 0;                    // announced by a FRAME_SIZE frame
+        bool sized = false;
+        uint64_t written = 0;                 // offset in the file, the upload may have been resumed
+        uint64_t id = 0;                      // of a resumable transfer, announced with the size
+        uint64_t checkpoint = 0;              // the offset is recorded again from here on
+        std::unique_ptr<DeltaDecoder> delta;  // rebuilds FRAME_DELTA chunks from the target
+        bool ranged = false;                  // `copy_from -R`: a range of the file, at the offset announced with the size
+        ByteRange range;
+        std::shared_ptr<void> lease;          // of the RangeUpload, which can't be announced again while it is held
+        std::unique_ptr<ArchiveExtractor> archive;  // `copy_from -r`: the chunks are an archive extracted into the path
+        bool failed = false;                  // the rest of the stream is only drained
+        std::function<void(bool, bool)> done; // reports the result back to the event loop: received, and the file is complete
+    };
+
+    int handlePwdCommand(Session& session);
     static void handleExitCommand();
-    int handleChangeDirectoryCommand(const char* path);
-    int handleLsCommand(char* command);
-    int sendCmdDoesntExist();
-    int handleMakeDirectoryCommand(char* path);
-    int handleTouchFileCommand(char* fileName);
-    int handleRemoveDirectoryCommand(char* path);
-    int handleRemoveFileCommand(char* fileName);
-    int handleCopyCommand(char* fileName);
-    int handleCatCommand(char* command);
-    int handleEchoCommand(char* command);
-    int handleMoveCommand(char* command);
-    int handleCpCommand(char* command);
-    int handleFindCommand(char* command);
-    int handleGrepCommand(char* command);
-    int handleCopyFromCommand(char* command);
-    int handleRunCommand(char* command);
-    int handleCheckInStartup();
-    int handleCutCommand(char* command);
+    int handleChangeDirectoryCommand(Session& session, const char* path);
+    int handleLsCommand(Session& session, char* command);
+    int sendCmdDoesntExist(Session& session);
+    int handleMakeDirectoryCommand(Session& session, char* path);
+    int handleTouchFileCommand(Session& session, char* fileName);
+    int handleRemoveDirectoryCommand(Session& session, char* path);
+    int handleRemoveFileCommand(Session& session, char* fileName);
+    int handleCopyCommand(Session& session, char* fileName, bool removeSource = false);
+    void readDownload(TransferPipeline& pipeline, DownloadReader& reader);
+    void compressDownload(TransferPipeline::Chunk& chunk, DownloadReader& reader);
+    void sendDownload(Session& session, TransferPipeline& pipeline, const DownloadReader& reader);
+    void finishDownload(Session& session);
+    int handleCatCommand(Session& session, char* command);
+    int handleEchoCommand(Session& session, char* command);
+    int handleStatsCommand(Session& session);
+    int handleMoveCommand(Session& session, char* command);
+    int handleCpCommand(Session& session, char* command);
+    int handleFindCommand(Session& session, char* command);
+    int handleGrepCommand(Session& session, char* command);
+    int handleCopyFromCommand(Session& session, char* command);
+    int receiveUpload(Session& session, const FrameHeader& header, const char* payload);
+    static void decompressUpload(TransferPipeline::Chunk& chunk);
+    void writeUpload(TransferPipeline& pipeline, UploadWriter& writer);
+    int openUpload(UploadWriter& writer, const std::string& payload);
+    static std::filesystem::path resumablePart(const std::filesystem::path& path, uint64_t id);
+    int handleRangesCommand(Session& session, char* command, bool upload);
+    bool finishRange(UploadWriter& writer, bool received);
+    void expireRanges(const Session* closing);
+    void finishUpload(Session& session, bool received, bool complete);
+    void dropUpload(Session& session);
+    void preallocate(const std::filesystem::path& path, uint64_t size);
+    int handleRunCommand(Session& session, char* command);
+    int handleCheckInStartup(Session& session);
+    int handleCutCommand(Session& session, char* command);
 
     // Misc functions
     static int shiftStrLeft(char* str, int num);
-    int handleSend(std::string sen, SOCKET sock);
-    void handleError(const char* command);
-    int handleCommand(char* command);
-    void handleTimeout();
-    void handleStartupError(int move);
-    void handleWrongUsage(const char* command);
+    static std::filesystem::path resolvePath(const Session& session, const char* path);
+    int handleSend(std::string sen, Session& session);
+    int sendFrame(Session& session, FrameType type, uint16_t flags, OutBuffer payload);
+    int sendCompressedResponse(Session& session, const std::string& text);
+    int sendDictionaryResponse(Session& session, std::string& text);
+    void trainResponseDictionary();
+    int queueFrame(Session& session, FrameType type, uint16_t flags, OutBuffer payload);
+    int writeOutput(Session& session);
+    void handleError(Session& session, const char* command);
+    int handleCommand(Session& session, char* command);
+    void handleTimeout(Session& session);
+    void handleStartupError(Session& session, int move);
+    void handleWrongUsage(Session& session, const char* command);
+
+    // Event loop
+    int handleClientData(Session& session, int flags);
+    void dispatchReceived(Session& session, size_t len);
+    void dispatchInput(Session& session);
+    void dispatchFrame(Session& session, const FrameHeader& header, char* payload);
+    static bool acceptsFrame(const Session& session, const FrameHeader& header);
+    void resumeInput(Session& session);
+    int flushOutput(Session& session);
+    void closeClient(Session& session);
+    void forgetClient(Session& session);
+    int readFile(const std::filesystem::path& fileName, std::string& contents);
 
-    int move_start();
-    int remove_start();
+    // Worker pool
+    using Job = std::function<void(Session&)>;
+    // What a handler on the worker pool hands back to the event loop of its session: the frames it sent, and the
+    // reply dictionary and its statistics as the replies left them (sendDictionaryResponse)
+    struct Outbox {
+        std::vector<OutBuffer> replies;
+        std::shared_ptr<const ZstdDictionary> dictionary;
+        TransferStats dictionaryStats;
+    };
+    static thread_local Outbox* outbox;
+    void runOnWorker(Session& session, Job work, Job done = nullptr);
+    void finishJob(Session& session, Outbox& result, Job& done);
+    void completeJob(Session& session, Job& done);
+    TransferPipeline::Executor loopExecutor(Session& session);
+    TransferPipeline::Executor poolExecutor();
+#ifdef __linux__
+    static thread_local Mailbox* mailbox;
+    static thread_local int epollFd;
+    int runLoop(SOCKET listenSock, int wakeFd);
+    int runEpoll(SOCKET listenSock, int wakeFd);
+#else
+    int runSelect();
+#endif
+
+#ifdef DATATRANSMISSION_IO_URING
+    // io_uring completion backend (server_uring.cpp)
+    struct UringBackend;
+    static constexpr const int URING_UNAVAILABLE = -2;
+    static thread_local UringBackend* uring;
+    bool ioUring = false;
+    int runUring(SOCKET listenSock, int wakeFd);
+    int uringFlush(Session& session);
+    void uringResume(Session& session);
+    int uringReadFile(const std::filesystem::path& fileName, size_t size, std::string& contents);
+    static size_t uringReadChunks(int fd, const std::vector<TransferPipeline::Chunk*>& chunks);
+#endif
+
+    int move_start(Session& session);
+    int remove_start(Session& session);
 
     bool initServer();
     bool setupPort();
+    SOCKET openListenSocket();
 
     // Database
     int initDB();
@@ -166,7 +363,8 @@ public:
 
         settings.close();
 
-        int rc = sqlite3_open(db_name.c_str(), &DB);
+        // Serialized mode, the connection is shared by all event loop threads
+        int rc = sqlite3_open_v2(db_name.c_str(), &DB, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, nullptr);
 
         if (rc) {
             std::string message = std::format("Can't open database: {}", sqlite3_errmsg(DB));
@@ -197,21 +395,19 @@ public:
             throw std::runtime_error("Failed to init port");
         if (!initServer())
             throw std::runtime_error("Failed to start the server");
-
-        memset(recvbuf, 0, DEFAULT_BUFLEN);
     }
 
     /**
      * @brief Destructor for the Server class.
      *
      * This destructor will clean up all the resources used by the Server object.
-     * It closes the client socket, cleans up the Winsock API, frees the address info result,
+     * It closes the listening socket, cleans up the Winsock API, frees the address info result,
      * closes the log file, updates the settings file, and closes the SQLite database.
      *
      * @throws std::runtime_error if failed to open the settings file
      */
     ~Server() { // Destructor will clean up all the resources correctly
-        closesocket(ClientSocket);
+        closesocket(ListenSocket);
         WSACleanup();
         freeaddrinfo(result);
         log.close();
@@ -234,8 +430,15 @@ public:
     int remUser(const std::string& name);
     int addStartup();
     int setCwd(const std::string& path);
+    int enableIoUring();
+    int setLoopThreads(int threads);
+    int setWorkerThreads(int threads);
+    int enableBlockChecksums();
+    int setCodecs(const std::string& list);
+    int setResponseThreshold(long long bytes);
+    int setMaxRangeUpload(long long bytes);
 
-    int handleAuth(char* command);
+    int handleAuth(Session& session, char* command);
 };
 
 #endif //DATATRANSMISSION_SERVER_H
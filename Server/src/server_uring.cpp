@@ -0,0 +1,570 @@
+/*
+ *  Filename: server_uring.cpp
+ *
+ *  io_uring completion backend for Server::run. Only compiled into builds configured with
+ *  DATATRANSMISSION_IO_URING=ON (see Server/CMakeLists.txt).
+ *
+ *  Accepts and receives are armed once as multishot requests where the kernel supports them
+ *  (accept: 5.19, recv with a provided buffer ring: 6.0) and re-armed as single shot requests
+ *  otherwise. Every request that is prepared while handling a batch of completions is handed
+ *  to the kernel in a single io_uring_submit_and_wait call, which also waits for the next batch.
+ *  Replies are queued in the output queue of the session with at most one send in flight, so short
+ *  sends can be resumed without reordering the stream.
+ *
+ *  Files are read through rings of their own: the file of a `cat` through the file ring of the loop,
+ *  the chunks of a `copy_to` / `cut` through a file ring of the worker thread that reads them, every
+ *  free chunk of the transfer pipeline with one submission.
+ */
+
+#include "server.h"
+#include <liburing.h>
+#include <poll.h>
+#include <algorithm>
+#include <vector>
+
+extern std::atomic<bool> STOP;
+
+namespace {
+    constexpr unsigned RING_ENTRIES = 1024;
+    constexpr unsigned FILE_RING_ENTRIES = 64;
+    constexpr unsigned RECV_BUFFERS = 1024;
+    constexpr int RECV_BUFFER_GROUP = 0;
+    constexpr size_t FILE_CHUNK = 1 << 20;
+
+    enum class Op : uint64_t { Accept = 1, Recv, Send, Wake, Mailbox, Cancel };
+
+    uint64_t encode(Op op, SOCKET fd) {
+        return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+    }
+
+    Op opOf(uint64_t data) { return static_cast<Op>(data >> 32); }
+    SOCKET fdOf(uint64_t data) { return static_cast<SOCKET>(data & 0xffffffff); }
+
+    // Every free chunk of a download is read with one submission
+    static_assert(TransferPipeline::MAX_DEPTH <= FILE_RING_ENTRIES);
+
+    // The file ring of a worker thread, set up the first time it reads the chunks of a download
+    struct WorkerFileRing {
+        io_uring ring{};
+        bool ready = false;
+
+        WorkerFileRing() { ready = io_uring_queue_init(FILE_RING_ENTRIES, &ring, 0) == 0; }
+        ~WorkerFileRing() {
+            if (ready)
+                io_uring_queue_exit(&ring);
+        }
+    };
+}
+
+struct Server::UringBackend {
+    struct Conn {
+        bool sending = false;         // a sendmsg of the front of session->out is in flight
+        iovec iov[MAX_IOV];           // kept alive until the sendmsg completes
+        msghdr msg{};
+        bool receiving = false;
+        bool cancelling = false;      // the multishot recv is being cancelled, the session has been paused
+        bool closing = false;
+        std::shared_ptr<Session> session;  // its input buffer is the single shot recv target when there's no buffer ring
+    };
+
+    io_uring ring{};
+    io_uring fileRing{};
+    bool fileRingReady = false;
+    io_uring_buf_ring* bufRing = nullptr;
+    std::vector<char> bufMemory;
+    bool multishotAccept = true;
+    bool multishotRecv = false;
+    int wakeFd = -1;
+    int mailboxFd = -1;
+    std::unordered_map<SOCKET, Conn> conns;
+
+    // Statistics written to the log when the loop stops
+    uint64_t submits = 0;
+    uint64_t completions = 0;
+
+    io_uring_sqe* getSqe() {
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if (sqe == nullptr) { // submission queue is full, flush it and try again
+            io_uring_submit(&ring);
+            ++submits;
+            sqe = io_uring_get_sqe(&ring);
+        }
+        return sqe;
+    }
+
+    void armAccept(SOCKET listenSock) {
+        io_uring_sqe* sqe = getSqe();
+        if (multishotAccept)
+            io_uring_prep_multishot_accept(sqe, listenSock, nullptr, nullptr, SOCK_CLOEXEC);
+        else
+            io_uring_prep_accept(sqe, listenSock, nullptr, nullptr, SOCK_CLOEXEC);
+        io_uring_sqe_set_data64(sqe, encode(Op::Accept, listenSock));
+    }
+
+    void armRecv(SOCKET sock, Conn& conn) {
+        io_uring_sqe* sqe = getSqe();
+        if (multishotRecv) {
+            io_uring_prep_recv_multishot(sqe, sock, nullptr, 0, 0);
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = RECV_BUFFER_GROUP;
+        }
+        else {
+            RecvBuffer& input = conn.session->input;
+            io_uring_prep_recv(sqe, sock, input.prepare(Session::RECV_BUFLEN), input.spaceSize(), 0);
+        }
+        io_uring_sqe_set_data64(sqe, encode(Op::Recv, sock));
+        conn.receiving = true;
+    }
+
+    // A multishot recv goes on by itself, it is cancelled while the session is paused
+    void cancelRecv(SOCKET sock, Conn& conn) {
+        io_uring_sqe* sqe = getSqe();
+        io_uring_prep_cancel64(sqe, encode(Op::Recv, sock), 0);
+        io_uring_sqe_set_data64(sqe, encode(Op::Cancel, sock));
+        conn.cancelling = true;
+    }
+
+    void armSend(SOCKET sock, Conn& conn) {
+        conn.msg = msghdr{};
+        conn.msg.msg_iov = conn.iov;
+        conn.msg.msg_iovlen = conn.session->gatherOutput(conn.iov, MAX_IOV);
+        io_uring_sqe* sqe = getSqe();
+        io_uring_prep_sendmsg(sqe, sock, &conn.msg, MSG_NOSIGNAL);
+        io_uring_sqe_set_data64(sqe, encode(Op::Send, sock));
+        conn.sending = true;
+    }
+
+    // Polled rather than read, the eventfd is shared by every event loop
+    void armWake() {
+        io_uring_sqe* sqe = getSqe();
+        io_uring_prep_poll_add(sqe, wakeFd, POLLIN);
+        io_uring_sqe_set_data64(sqe, encode(Op::Wake, wakeFd));
+    }
+
+    void armMailbox() {
+        io_uring_sqe* sqe = getSqe();
+        io_uring_prep_poll_add(sqe, mailboxFd, POLLIN);
+        io_uring_sqe_set_data64(sqe, encode(Op::Mailbox, mailboxFd));
+    }
+
+    void returnBuffer(unsigned short bid) {
+        char* addr = bufMemory.data() + static_cast<size_t>(bid) * Session::RECV_BUFLEN;
+        io_uring_buf_ring_add(bufRing, addr, Session::RECV_BUFLEN, bid, io_uring_buf_ring_mask(RECV_BUFFERS), 0);
+        io_uring_buf_ring_advance(bufRing, 1);
+    }
+
+    // A connection is only forgotten once no request references it anymore
+    bool release(SOCKET sock) {
+        auto it = conns.find(sock);
+        if (it == conns.end() || it->second.sending || it->second.receiving)
+            return false;
+        conns.erase(it);
+        return true;
+    }
+};
+
+/**
+ * @brief io_uring completion based event loop.
+ *
+ * @details
+ * Sets up the ring, an optional provided buffer ring for multishot receives and a second small ring
+ * used by uringReadFile. Each iteration submits every request prepared during the previous batch and
+ * waits for at least one completion with a single io_uring_submit_and_wait call.
+ *
+ * @param listenSock The listening socket owned by this loop.
+ * @param wakeFd The eventfd stop_serv uses to wake the loops up.
+ * @return 0 when the server was stopped, 1 on a fatal ring error and URING_UNAVAILABLE if io_uring
+ *         can't be used on this kernel, in which case runLoop falls back to runEpoll.
+ */
+int Server::runUring(SOCKET listenSock, int wakeFd) {
+    UringBackend backend;
+
+    int ret = io_uring_queue_init(RING_ENTRIES, &backend.ring, 0);
+    if (ret < 0) {
+        log << "io_uring_queue_init failed with error: " << -ret << std::endl;
+        return URING_UNAVAILABLE;
+    }
+
+    backend.fileRingReady = io_uring_queue_init(FILE_RING_ENTRIES, &backend.fileRing, 0) == 0;
+
+    // Provided buffers are required for multishot receives (Linux 6.0+)
+    backend.bufMemory.resize(static_cast<size_t>(RECV_BUFFERS) * Session::RECV_BUFLEN);
+    backend.bufRing = io_uring_setup_buf_ring(&backend.ring, RECV_BUFFERS, RECV_BUFFER_GROUP, 0, &ret);
+    if (backend.bufRing != nullptr) {
+        for (unsigned short bid = 0; bid < RECV_BUFFERS; ++bid)
+            backend.returnBuffer(bid);
+        backend.multishotRecv = true;
+    }
+    else
+        log << "io_uring provided buffers unavailable, using single shot receives" << std::endl;
+
+    backend.wakeFd = wakeFd;
+    backend.mailboxFd = mailbox->fd();
+
+    uring = &backend;
+    backend.armAccept(listenSock);
+    backend.armWake();
+    backend.armMailbox();
+
+    int status = 0;
+    while (!STOP)
+    {
+        ret = io_uring_submit_and_wait(&backend.ring, 1);
+        ++backend.submits;
+        if (ret < 0 && ret != -EINTR) {
+            std::cout << "io_uring_submit_and_wait error: " << -ret << std::endl;
+            log << "io_uring_submit_and_wait error: " << -ret << std::endl;
+            status = 1;
+            break;
+        }
+
+        io_uring_cqe* cqe;
+        while (!STOP && io_uring_peek_cqe(&backend.ring, &cqe) == 0) {
+            const uint64_t data = io_uring_cqe_get_data64(cqe);
+            const int res = cqe->res;
+            const unsigned flags = cqe->flags;
+            io_uring_cqe_seen(&backend.ring, cqe);
+            ++backend.completions;
+
+            const SOCKET fd = fdOf(data);
+            switch (opOf(data)) {
+                case Op::Wake:
+                    if (!STOP)
+                        backend.armWake();
+                    break;
+
+                case Op::Mailbox: // results of commands that ran on the worker pool
+                    mailbox->drain();
+                    backend.armMailbox();
+                    break;
+
+                case Op::Cancel: // the recv it cancelled completes with -ECANCELED
+                    break;
+
+                case Op::Accept: {
+                    if (res == -EINVAL && backend.multishotAccept) {
+                        // Kernel older than 5.19, re-arm single shot accepts from now on
+                        backend.multishotAccept = false;
+                        backend.armAccept(listenSock);
+                        break;
+                    }
+
+                    if (res < 0) {
+                        std::cout << "Accepted invalid socket" << std::endl;
+                        log << "Accepted invalid socket" << std::endl;
+                    }
+                    else {
+                        auto& conn = backend.conns[res];
+                        conn.session = std::make_shared<Session>(res, std::filesystem::current_path());
+                        backend.armRecv(res, conn);
+                    }
+
+                    if (!(flags & IORING_CQE_F_MORE))
+                        backend.armAccept(listenSock);
+                    break;
+                }
+
+                case Op::Recv: {
+                    auto it = backend.conns.find(fd);
+                    if (it == backend.conns.end())
+                        break;
+                    auto& conn = it->second;
+                    if (!(flags & IORING_CQE_F_MORE)) {
+                        conn.receiving = false;
+                        conn.cancelling = false;
+                    }
+
+                    if (res == -ECANCELED) { // cancelled while paused, the session may have gone on since
+                        if (!conn.closing && !conn.session->paused && !conn.session->throttled)
+                            backend.armRecv(fd, conn);
+                        break;
+                    }
+
+                    if (res == -ENOBUFS) { // buffer ring ran dry, re-arm once buffers have been returned
+                        if (!conn.receiving && !conn.closing)
+                            backend.armRecv(fd, conn);
+                        break;
+                    }
+
+                    if (res == -EINVAL && backend.multishotRecv) {
+                        // Kernel older than 6.0, fall back to single shot receives
+                        backend.multishotRecv = false;
+                        backend.armRecv(fd, conn);
+                        break;
+                    }
+
+                    if (res <= 0) {
+                        if (res < 0) {
+                            std::cout << "recv failed with error: " << -res << std::endl;
+                            log << "recv failed with error: " << -res << std::endl;
+                        }
+                        conn.closing = true;
+                        conn.session->closed = true;
+                        forgetClient(*conn.session);
+                        if (!conn.sending) {
+                            closesocket(fd);
+                            backend.release(fd);
+                        }
+                        break;
+                    }
+
+                    if (flags & IORING_CQE_F_BUFFER) {
+                        auto bid = static_cast<unsigned short>(flags >> IORING_CQE_BUFFER_SHIFT);
+                        memcpy(conn.session->input.prepare(res), backend.bufMemory.data() + static_cast<size_t>(bid) * Session::RECV_BUFLEN, res);
+                        backend.returnBuffer(bid);
+                    }
+
+                    // Dispatched before re-arming, preparing the next single shot recv may move the input buffer
+                    dispatchReceived(*conn.session, res);
+
+                    // A paused session is re-armed by uringResume once it goes on, a throttled one once its output
+                    // queue has gone down
+                    if (conn.receiving) {
+                        if (conn.session->paused && !conn.cancelling)
+                            backend.cancelRecv(fd, conn);
+                    }
+                    else if (!conn.closing && !conn.session->paused && !conn.session->throttled)
+                        backend.armRecv(fd, conn);
+                    break;
+                }
+
+                case Op::Send: {
+                    auto it = backend.conns.find(fd);
+                    if (it == backend.conns.end())
+                        break;
+                    auto& conn = it->second;
+                    Session& session = *conn.session;
+                    conn.sending = false;
+
+                    if (res < 0) {
+                        log << "Failed to send message! Error: " << -res << std::endl;
+                        session.out.clear();
+                        session.outOffset = 0;
+                        session.outBytes = 0;
+                        session.throttled = false;
+                    }
+                    else
+                        session.consumeOutput(res);
+
+                    if (conn.closing) {
+                        closesocket(fd);
+                        session.out.clear();
+                        backend.release(fd);
+                        break;
+                    }
+
+                    // A send that left bytes behind found the socket buffer full
+                    if (!session.out.empty()) {
+                        if (res > 0)
+                            session.outputBlocked();
+                        backend.armSend(fd, conn);
+                    }
+
+                    // Went below the low watermark, run what has been received in the meantime
+                    dispatchInput(session);
+                    if (!conn.receiving && !session.paused && !session.throttled)
+                        backend.armRecv(fd, conn);
+                    break;
+                }
+            }
+        }
+    }
+
+    log << "io_uring: " << backend.submits << " submissions for " << backend.completions << " completions" << std::endl;
+
+    // Like a disconnect, so the temporary files of unfinished uploads are removed. A closing session has been
+    // forgotten already, its socket was only kept open for the send still in flight.
+    uring = nullptr;
+    for (auto& [sock, conn] : backend.conns) {
+        if (!conn.closing)
+            closeClient(*conn.session);
+        else
+            closesocket(sock);
+    }
+
+    if (backend.bufRing != nullptr)
+        io_uring_free_buf_ring(&backend.ring, backend.bufRing, RECV_BUFFERS, RECV_BUFFER_GROUP);
+    if (backend.fileRingReady)
+        io_uring_queue_exit(&backend.fileRing);
+    io_uring_queue_exit(&backend.ring);
+
+    return status;
+}
+
+/**
+ * @brief Writes the output queue of a session with send requests on the ring.
+ *
+ * @details
+ * A send request for the front of the output queue is prepared if none is in flight. The request is
+ * submitted together with everything else at the end of the current completion batch.
+ *
+ * @param session The session whose output queue is written.
+ * @return 0 if the queue is being written, -1 if the socket is unknown or closing.
+ */
+int Server::uringFlush(Session& session) {
+    const SOCKET sock = session.sock;
+    auto it = uring->conns.find(sock);
+    if (it == uring->conns.end() || it->second.closing)
+        return -1;
+
+    auto& conn = it->second;
+    if (!conn.sending && !session.out.empty())
+        uring->armSend(sock, conn);
+
+    return 0;
+}
+
+/**
+ * @brief Arms a receive request for a session that went on after it had been paused.
+ *
+ * @param session The session that goes on.
+ */
+void Server::uringResume(Session& session) {
+    auto it = uring->conns.find(session.sock);
+    if (it == uring->conns.end())
+        return;
+
+    auto& conn = it->second;
+    if (!conn.receiving && !conn.closing && !session.throttled)
+        uring->armRecv(session.sock, conn);
+}
+
+/**
+ * @brief Reads a whole file with batched io_uring reads.
+ *
+ * @details
+ * The file is split into 1 MB chunks; up to FILE_RING_ENTRIES chunk reads are prepared and handed to the
+ * kernel with one submission, so a file costs a handful of syscalls instead of one per read() call.
+ * Short reads are completed synchronously. Falls back to pread when the file ring couldn't be set up.
+ *
+ * @param fileName The path of the file to read.
+ * @param size The size of the file.
+ * @param contents Receives the contents of the file.
+ * @return 0 on success, -1 on failure.
+ */
+int Server::uringReadFile(const std::filesystem::path& fileName, size_t size, std::string& contents) {
+    int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    contents.resize(size);
+    size_t offset = 0;
+    int status = 0;
+
+    while (offset < size && status == 0) {
+        if (!uring->fileRingReady) {
+            ssize_t n = pread(fd, contents.data() + offset, size - offset, static_cast<off_t>(offset));
+            if (n <= 0) { contents.resize(offset); break; }
+            offset += n;
+            continue;
+        }
+
+        // Prepare one batch of chunk reads
+        unsigned queued = 0;
+        size_t batchOffset = offset;
+        while (queued < FILE_RING_ENTRIES && batchOffset < size) {
+            size_t len = std::min(FILE_CHUNK, size - batchOffset);
+            io_uring_sqe* sqe = io_uring_get_sqe(&uring->fileRing);
+            io_uring_prep_read(sqe, fd, contents.data() + batchOffset, static_cast<unsigned>(len), batchOffset);
+            io_uring_sqe_set_data64(sqe, batchOffset);
+            batchOffset += len;
+            ++queued;
+        }
+
+        if (io_uring_submit_and_wait(&uring->fileRing, queued) < 0) {
+            status = -1;
+            break;
+        }
+
+        for (unsigned i = 0; i < queued; ++i) {
+            io_uring_cqe* cqe;
+            if (io_uring_wait_cqe(&uring->fileRing, &cqe) < 0) {
+                status = -1;
+                break;
+            }
+
+            const size_t chunkOffset = io_uring_cqe_get_data64(cqe);
+            const size_t expected = std::min(FILE_CHUNK, size - chunkOffset);
+            int res = cqe->res;
+            io_uring_cqe_seen(&uring->fileRing, cqe);
+
+            if (res < 0) {
+                status = -1;
+                continue;
+            }
+
+            // Complete short reads synchronously
+            size_t done = res;
+            while (done < expected) {
+                ssize_t n = pread(fd, contents.data() + chunkOffset + done, expected - done, static_cast<off_t>(chunkOffset + done));
+                if (n <= 0) break;
+                done += n;
+            }
+            if (done < expected)
+                status = -1;
+        }
+
+        offset = batchOffset;
+    }
+
+    close(fd);
+    return status;
+}
+
+/**
+ * @brief Reads chunks of a download with one submission on the file ring of the worker thread.
+ *
+ * @details
+ * Every chunk is read at its offset into its raw buffer, which holds its length already; the reads are handed to the
+ * kernel with one io_uring_submit_and_wait call. The worker threads don't run an event loop, each one sets up a file
+ * ring of its own the first time it reads. Short reads are completed synchronously, and so is everything with pread
+ * when the ring couldn't be set up or failed to take the reads, in which case it isn't used again.
+ *
+ * @param fd The file to read from.
+ * @param chunks The chunks to read, at most TransferPipeline::MAX_DEPTH of them.
+ * @return The number of chunks in front of the first one that couldn't be read completely.
+ */
+size_t Server::uringReadChunks(int fd, const std::vector<TransferPipeline::Chunk*>& chunks) {
+    thread_local WorkerFileRing fileRing;
+
+    std::vector<size_t> done(chunks.size(), 0);
+    if (fileRing.ready) {
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            io_uring_sqe* sqe = io_uring_get_sqe(&fileRing.ring);
+            io_uring_prep_read(sqe, fd, chunks[i]->raw.data(), static_cast<unsigned>(chunks[i]->length), chunks[i]->offset);
+            io_uring_sqe_set_data64(sqe, i);
+        }
+
+        // Reads the ring still holds would be submitted with the next batch, into buffers that may be gone by then
+        const int submitted = io_uring_submit_and_wait(&fileRing.ring, static_cast<unsigned>(chunks.size()));
+        if (submitted != static_cast<int>(chunks.size()))
+            fileRing.ready = false;
+
+        for (int i = 0; i < submitted; ++i) {
+            io_uring_cqe* cqe;
+            if (io_uring_wait_cqe(&fileRing.ring, &cqe) < 0) {
+                fileRing.ready = false;
+                break;
+            }
+            const size_t index = io_uring_cqe_get_data64(cqe);
+            if (cqe->res > 0 && index < chunks.size())
+                done[index] = static_cast<size_t>(cqe->res);
+            io_uring_cqe_seen(&fileRing.ring, cqe);
+        }
+    }
+
+    size_t read = 0;
+    for (; read < chunks.size(); ++read) {
+        TransferPipeline::Chunk& chunk = *chunks[read];
+        while (done[read] < chunk.length) {
+            const ssize_t n = pread(fd, chunk.raw.data() + done[read], chunk.length - done[read],
+                                    static_cast<off_t>(chunk.offset + done[read]));
+            if (n <= 0)
+                break;
+            done[read] += static_cast<size_t>(n);
+        }
+        if (done[read] < chunk.length)
+            break;
+    }
+    return read;
+}
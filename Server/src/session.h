@@ -0,0 +1,222 @@
+/*
+ *  Filename: session.h
+ *
+ *  The `Session` struct holds everything that belongs to a single client connection, so command
+ *  handlers never have to touch state shared between connections or event loop threads.
+ *
+ *  Member variables:
+ *  - sock: The socket of the connection.
+ *  - user: Name of the user that authenticated on this connection, empty until `auth:` succeeded.
+ *  - cwd: Working directory of the session. Relative paths in commands are resolved against it.
+ *  - input: Buffer the event loop receives into and the frame decoder reads from. It holds the
+ *    frame that has not been received completely, and everything received while the session is
+ *    busy or throttled.
+ *  - busy: A command of the session is running on the worker pool. Further commands wait in
+ *    `input` until its result has been posted back, so replies keep their order.
+ *  - closed: The connection has been closed while a worker still held on to the session.
+ *  - out, outOffset, outBytes: Replies that have not been written to the socket yet, as a chain of
+ *    buffers (see OutBuffer). outOffset bytes of out.front() have already been sent, outBytes are
+ *    still queued.
+ *  - throttled: More than OUT_HIGH_WATERMARK bytes are queued. The session doesn't read or run
+ *    commands until the queue has been flushed below OUT_LOW_WATERMARK, so a client that doesn't
+ *    keep up only slows itself down.
+ *  - paused: dispatchInput can't go on, because the session is busy or throttled or its upload has no free
+ *    chunk. The event loop leaves what the client sends in the socket until it can, so the input never holds
+ *    more than the frames the session is working through.
+ *  - upload: A `copy_from` command receiving the File frames that carry the file. The loop copies
+ *    every chunk into the transfer pipeline (transfer_pipeline.h) of the upload, whose codec and
+ *    writer stages decompress and write it to a temporary file on the worker pool, while the loop
+ *    already receives the next one. The temporary file replaces the target once the last chunk is in. The chunks
+ *    of `copy_from -r` are the archive of a directory, whose files are extracted as they arrive (tree_archive.h).
+ *  - download: A `copy_to` or `cut` reply that is still being streamed through a transfer pipeline:
+ *    the worker pool reads and compresses the next chunks while the loop sends the current one. The
+ *    session stays busy until the last chunk has been queued. The loop only takes chunks from the
+ *    pipeline while the session isn't throttled and the pipeline holds a few chunks at most, so a
+ *    transfer holds a bounded amount of memory whatever the size of the file. On Linux uncompressed
+ *    chunks are queued as ranges of the file and never read into memory at all.
+ *  - codecs: The codecs the compression levels are sent with, agreed on in the `auth:` handshake (codec.h).
+ *    Sessions of clients that don't take part in it get the LZ4 ones, which every client decodes.
+ *  - compressResponses: The client took part in the handshake, so it decodes compressed Response frames as well.
+ *  - signature: The signature of the client's copy of a file (delta_transfer.h), sent in Signature frames in
+ *    front of the `copy_to -d` it belongs to, which takes it.
+ *  - dictionaryMode, dictionary, dictionaryStats: The client named zstd-dict, the dictionary it has received
+ *    (response_dictionary.h) and what compressing the short replies against it has saved.
+ *  - link: What the connection and the codec have achieved so far (compression_policy.h). Downloads
+ *    choose their compression level from it, the `stats` command shows it. The link is measured while the
+ *    socket refuses bytes: the kernel buffer is full then, so the queue drains at the speed of the link.
+ */
+
+#ifndef DATATRANSMISSION_SESSION_H
+#define DATATRANSMISSION_SESSION_H
+
+#include "platform.h"
+#include "recv_buffer.h"
+#include "transfer_pipeline.h"
+#include "compression_policy.h"
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+#ifdef __linux__
+// An open file that output buffers are sent from, closed together with the last buffer referring to it
+struct FileSource {
+    int fd;
+
+    explicit FileSource(int fd) : fd(fd) {}
+    ~FileSource() { close(fd); }
+
+    FileSource(const FileSource&) = delete;
+    FileSource& operator=(const FileSource&) = delete;
+};
+#endif
+
+// A buffer of the output queue. It either owns its bytes or shares them, like a chunk lent out by a transfer
+// pipeline, which is given back once it has been sent. On Linux it can also stand for `length` bytes of a file at
+// `offset`, which are sent from the page cache with sendfile and never copied into memory.
+struct OutBuffer {
+    std::string data;
+    std::shared_ptr<const std::string> shared;
+    size_t length = 0;
+#ifdef __linux__
+    std::shared_ptr<FileSource> file;
+    off_t offset = 0;
+#endif
+
+    OutBuffer(std::string data) : data(std::move(data)), length(this->data.size()) {}
+    OutBuffer(std::shared_ptr<const std::string> shared) : shared(std::move(shared)), length(this->shared->size()) {}
+#ifdef __linux__
+    static_assert(sizeof(off_t) >= sizeof(uint64_t), "ranges of files over 2 GB need a 64-bit off_t");
+
+    OutBuffer(std::shared_ptr<FileSource> file, off_t offset, size_t length)
+        : length(length), file(std::move(file)), offset(offset) {}
+
+    bool inMemory() const { return file == nullptr; }
+#else
+    bool inMemory() const { return true; }
+#endif
+
+    const char* bytes() const { return shared ? shared->data() : data.data(); }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+};
+
+struct Session : std::enable_shared_from_this<Session> {
+    static constexpr const int RECV_BUFLEN = 4096;    // least room offered to a single receive
+    static constexpr const size_t OUT_HIGH_WATERMARK = 4 << 20;
+    static constexpr const size_t OUT_LOW_WATERMARK = 1 << 20;
+    static constexpr const size_t LINK_SAMPLE = 4 << 20;        // bytes drained per sample of the link
+
+    // A `copy_from` upload whose File frames have not all been received yet
+    struct Upload {
+        bool active = false;
+        std::filesystem::path partPath;  // the chunks are written here, it is renamed to the target once complete
+        bool tree = false;               // `copy_from -r`: the chunks are the archive of a directory
+        std::shared_ptr<TransferPipeline> pipeline;
+    };
+
+    // A `copy_to` / `cut` reply that is streamed in chunks
+    struct Download {
+        std::shared_ptr<TransferPipeline> pipeline;
+        std::filesystem::path path;
+        const char* command = nullptr;  // named in the error reply when the file can't be opened
+        bool removeSource = false;      // `cut`: the file is removed once it has been sent
+        bool started = false;           // a chunk has been sent, a failure can only abort the stream now
+        bool stalled = false;           // chunks wait for the output queue to go down to OUT_LOW_WATERMARK
+        TransferStats stats;
+    };
+
+    SOCKET sock = INVALID_SOCKET;
+    std::string user;
+    std::filesystem::path cwd;
+    RecvBuffer input;
+    bool busy = false;
+    bool closed = false;
+    std::deque<OutBuffer> out;
+    size_t outOffset = 0;
+    size_t outBytes = 0;
+    bool throttled = false;
+    bool paused = false;
+    bool backlogged = false;        // the socket has refused bytes since the output queue was last empty
+    std::chrono::steady_clock::time_point backlogSince;
+    size_t backlogBytes = 0;
+    Upload upload;
+    std::unique_ptr<Download> download;
+    CodecChoice codecs;
+    bool compressResponses = false;
+    std::string signature;          // Signature frames the client sent in front of `copy_to -d`
+    bool signatureComplete = false;
+    bool dictionaryMode = false;
+    std::shared_ptr<const ZstdDictionary> dictionary;
+    TransferStats dictionaryStats;
+    std::shared_ptr<LinkEstimate> link = std::make_shared<LinkEstimate>();
+
+    Session(SOCKET sock, std::filesystem::path cwd) : sock(sock), cwd(std::move(cwd)) {}
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    // Appends a reply to the output queue
+    void queueOutput(OutBuffer&& data) {
+        outBytes += data.size();
+        out.push_back(std::move(data));
+        if (outBytes >= OUT_HIGH_WATERMARK)
+            throttled = true;
+    }
+
+#ifdef __linux__
+    // Points up to `max` iovecs at the front of the output queue, so one sendmsg writes several buffers.
+    // Stops at the first buffer that isn't in memory.
+    int gatherOutput(iovec* iov, int max) {
+        int count = 0;
+        size_t offset = outOffset;
+        for (auto it = out.begin(); it != out.end() && count < max && it->inMemory(); ++it, ++count) {
+            iov[count].iov_base = const_cast<char*>(it->bytes()) + offset;
+            iov[count].iov_len = it->size() - offset;
+            offset = 0;
+        }
+        return count;
+    }
+#endif
+
+    // The socket has refused bytes, the output queue drains at the speed of the link until it runs empty
+    void outputBlocked() {
+        if (!backlogged) {
+            backlogged = true;
+            backlogSince = std::chrono::steady_clock::now();
+            backlogBytes = 0;
+        }
+    }
+
+    // Drops `sent` bytes that have been written to the socket from the front of the output queue
+    void consumeOutput(size_t sent) {
+        if (backlogged) {
+            backlogBytes += sent;
+            auto now = std::chrono::steady_clock::now();
+            if (backlogBytes >= LINK_SAMPLE) {
+                link->addLink(backlogBytes, std::chrono::duration<double>(now - backlogSince).count());
+                backlogSince = now;
+                backlogBytes = 0;
+            }
+        }
+
+        outBytes -= sent;
+        outOffset += sent;
+        while (!out.empty() && outOffset >= out.front().size()) {
+            outOffset -= out.front().size();
+            out.pop_front();
+        }
+        if (throttled && outBytes <= OUT_LOW_WATERMARK)
+            throttled = false;
+        // The last bytes only went into the kernel buffer, a partial sample would overstate the link
+        if (out.empty())
+            backlogged = false;
+    }
+};
+
+#endif //DATATRANSMISSION_SESSION_H
@@ -0,0 +1,34 @@
+/*
+ *  Filename: sync_log.h
+ *
+ *  The `SyncLog` class is a drop-in replacement for the std::ofstream the server used to log into.
+ *  Every `log << a << b << std::endl;` statement is collected in a std::osyncstream and written
+ *  to the file in one piece when the statement ends, so lines coming from several event loop
+ *  threads never interleave.
+ */
+
+#ifndef DATATRANSMISSION_SYNC_LOG_H
+#define DATATRANSMISSION_SYNC_LOG_H
+
+#include <fstream>
+#include <string>
+#include <syncstream>
+
+class SyncLog {
+private:
+    std::ofstream file;
+
+public:
+    void open(const std::string& path) { file.open(path); }
+    void close() { file.close(); }
+    bool operator!() const { return !file; }
+
+    template<typename T>
+    std::osyncstream operator<<(const T& value) {
+        std::osyncstream line(file);
+        line << value;
+        return line;
+    }
+};
+
+#endif //DATATRANSMISSION_SYNC_LOG_H
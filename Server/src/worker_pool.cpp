@@ -0,0 +1,174 @@
+#include "worker_pool.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cstdint>
+#include <stdexcept>
+#endif
+
+thread_local int WorkerPool::self = -1;
+
+/**
+ * @brief Starts the worker threads.
+ *
+ * @param threads The number of worker threads, at least 1.
+ */
+WorkerPool::WorkerPool(unsigned threads) {
+    if (threads == 0)
+        threads = 1;
+
+    for (unsigned i = 0; i < threads; ++i)
+        queues.push_back(std::make_unique<Queue>());
+
+    for (unsigned i = 0; i < threads; ++i)
+        workers.emplace_back(&WorkerPool::work, this, i);
+}
+
+/**
+ * @brief Stops the worker threads.
+ *
+ * @details
+ * Every task that has been queued is still run: a worker only stops once it finds all queues empty.
+ */
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+
+    for (auto& worker : workers)
+        worker.join();
+}
+
+/**
+ * @brief Queues a task.
+ *
+ * @details
+ * A worker that submits a task keeps it on its own queue, every other thread spreads its tasks
+ * over the queues round-robin. One sleeping worker is woken up to run it.
+ *
+ * @param task The task to run on one of the workers.
+ */
+void WorkerPool::submit(Task task) {
+    unsigned index = self >= 0 ? static_cast<unsigned>(self) : next++ % queues.size();
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+    queued++;
+
+    // Taking the lock orders the notification after a worker that is about to sleep checked `queued`
+    { std::lock_guard<std::mutex> lock(sleepMutex); }
+    wakeup.notify_one();
+}
+
+/**
+ * @brief Takes the next task for a worker.
+ *
+ * @details
+ * The worker's own queue is served oldest first. If it is empty, the newest task of one of the
+ * other queues is stolen, starting with the queue next to the worker's own.
+ *
+ * @param index The index of the worker.
+ * @param task Receives the task.
+ * @return true if a task was taken, false if every queue is empty.
+ */
+bool WorkerPool::take(unsigned index, Task& task) {
+    {
+        Queue& own = *queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < queues.size(); ++i) {
+        Queue& victim = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            queued--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Main loop of a worker thread.
+ *
+ * @param index The index of the worker.
+ */
+void WorkerPool::work(unsigned index) {
+    self = static_cast<int>(index);
+
+    while (true) {
+        Task task;
+        if (take(index, task)) {
+            task();
+            continue;
+        }
+
+        // A task that is still queued, like one a running task submitted after the pool began stopping, is run first
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeup.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0)
+            return;
+    }
+}
+
+#ifdef __linux__
+/**
+ * @brief Creates the eventfd the owning event loop watches.
+ *
+ * @throws std::runtime_error if the eventfd can't be created.
+ */
+Mailbox::Mailbox() {
+    eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd == -1)
+        throw std::runtime_error("Failed to create the mailbox eventfd");
+}
+
+Mailbox::~Mailbox() {
+    close(eventFd);
+}
+
+/**
+ * @brief Posts a task to the owning event loop and wakes it up.
+ *
+ * @param task The task to run on the event loop.
+ */
+void Mailbox::post(WorkerPool::Task task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+
+    uint64_t one = 1;
+    (void)!write(eventFd, &one, sizeof(one));
+}
+
+/**
+ * @brief Runs every task that has been posted so far. Only called by the owning event loop.
+ */
+void Mailbox::drain() {
+    uint64_t count;
+    (void)!read(eventFd, &count, sizeof(count));
+
+    std::vector<WorkerPool::Task> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.swap(tasks);
+    }
+
+    for (auto& task : ready)
+        task();
+}
+#endif
@@ -0,0 +1,82 @@
+/*
+ *  Filename: worker_pool.h
+ *
+ *  The `WorkerPool` class runs command handlers that may block (find, grep, copy_to, run, the
+ *  Argon2 password check) away from the event loops, so a single slow command never freezes the
+ *  other sessions of a loop.
+ *
+ *  Every worker owns a task queue. Tasks submitted by a worker land on its own queue, tasks
+ *  submitted by an event loop are spread round-robin. An idle worker first takes the oldest task
+ *  of its own queue and then steals the newest task of another worker's queue.
+ *
+ *  The `Mailbox` class (Linux) is how results find their way back: every event loop owns one,
+ *  workers post a completion into it and the eventfd wakes the loop up to run it.
+ */
+
+#ifndef DATATRANSMISSION_WORKER_POOL_H
+#define DATATRANSMISSION_WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkerPool(unsigned threads);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void submit(Task task);
+    size_t size() const { return workers.size(); }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleepMutex;
+    std::condition_variable wakeup;
+    std::atomic<size_t> queued = 0;
+    std::atomic<unsigned> next = 0;
+    bool stopping = false;
+
+    // Index of the worker running on this thread, -1 on every other thread
+    static thread_local int self;
+
+    bool take(unsigned index, Task& task);
+    void work(unsigned index);
+};
+
+#ifdef __linux__
+class Mailbox {
+public:
+    Mailbox();
+    ~Mailbox();
+
+    Mailbox(const Mailbox&) = delete;
+    Mailbox& operator=(const Mailbox&) = delete;
+
+    int fd() const { return eventFd; }
+    void post(WorkerPool::Task task);
+    void drain();
+
+private:
+    int eventFd;
+    std::mutex mutex;
+    std::vector<WorkerPool::Task> tasks;
+};
+#endif
+
+#endif //DATATRANSMISSION_WORKER_POOL_H
@@ -0,0 +1,345 @@
+/*
+ *  Filename: codec.h
+ *
+ *  Codecs a compressed File frame can be encoded with, shared by the Server and the Client.
+ *
+ *  Every codec implements the Codec interface and is listed in the CodecRegistry under an id,
+ *  which travels in the FRAME_CODEC bits of the frame flags (protocol.h), and a name, which is
+ *  used when the peers agree on the codecs during the `auth:` handshake:
+ *
+ *  - lz4: LZ4 frames at the fast level (lz4_comp.h). Id 0, so the frames of peers that don't know
+ *    about codecs at all are LZ4 frames as before. Every peer can decode them.
+ *  - lz4hc: LZ4 frames at the LZ4-HC level 9. Slower to compress, decoded as fast as lz4 and by
+ *    the same decoder, so peers that predate the registry can decode them as well.
+ *  - zstd: zstd frames at level 3. A better ratio than LZ4-HC at a higher speed, decoding is
+ *    somewhat slower than LZ4. Every frame holds a single chunk of at most FRAME_CHUNK_MAX bytes
+ *    and is compressed on its own, so the chunks of a transfer are coded on several threads at once.
+ *
+ *  zstd-dict is a mode of zstd rather than a codec of its own: short replies (an `ls`, a "has
+ *  been moved" message) share little within themselves but a lot with each other, so the server
+ *  trains a dictionary from the replies it has sent (ZstdDictionary) and compresses them against
+ *  it. A peer that names zstd-dict receives the dictionary once, in a Dictionary frame in front of
+ *  the first short reply sent after it has been trained, and keeps that version. Its frames are
+ *  zstd frames whose header names the dictionary id.
+ *
+ *  A codec keeps its contexts between frames, so every thread gets codecs of its own (local).
+ *  A sender compresses the fast level with lz4 and the high level with the best codec both peers
+ *  support (CodecChoice in compression_policy.h), the receiver picks the decoder from the flags
+ *  of every frame.
+ */
+
+#ifndef DATATRANSMISSION_CODEC_H
+#define DATATRANSMISSION_CODEC_H
+
+#include "lz4_comp.h"
+#include <zstd.h>
+#include <zdict.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class CodecId : uint8_t { LZ4 = 0, LZ4HC = 1, Zstd = 2 };
+
+// Set on top of the level of a codec by the sender
+struct codec_options {
+    bool checksum = false;          // LZ4 block checksums, zstd content checksum
+};
+
+class Codec {
+public:
+    // Returned by compress when it fails
+    static constexpr const size_t FAILED = SIZE_MAX;
+
+    using Options = codec_options;
+
+    virtual ~Codec() = default;
+
+    virtual CodecId id() const = 0;
+
+    // Room a frame of srcSize bytes may need at most
+    virtual size_t compressBound(size_t srcSize, const Options& options) const = 0;
+
+    // Compresses src into a frame of its own, returns the size of the frame or FAILED if it doesn't fit into capacity
+    virtual size_t compress(char* dst, size_t capacity, const char* src, size_t srcSize, const Options& options) = 0;
+
+    // Decompresses one frame into out, which keeps its capacity between calls. Returns 0, or -1 if the frame is
+    // corrupt or its contents are larger than limit.
+    virtual int decompress(const char* src, size_t srcSize, std::string& out, size_t limit) = 0;
+};
+
+class Lz4Codec : public Codec {
+public:
+    static constexpr const int HIGH_LEVEL = 9;      // LZ4-HC level, the default of the lz4 tool
+
+    explicit Lz4Codec(bool high) : high(high) {}
+
+    CodecId id() const override { return high ? CodecId::LZ4HC : CodecId::LZ4; }
+
+    size_t compressBound(size_t srcSize, const Options& options) const override {
+        return lz4_comp::compressBound(srcSize, frameOptions(options));
+    }
+
+    size_t compress(char* dst, size_t capacity, const char* src, size_t srcSize, const Options& options) override {
+        return lz4_comp::local().compress(dst, capacity, src, srcSize, frameOptions(options));
+    }
+
+    int decompress(const char* src, size_t srcSize, std::string& out, size_t limit) override {
+        return lz4_comp::local().decompress(src, srcSize, out, limit);
+    }
+
+private:
+    bool high;
+
+    lz4_options frameOptions(const Options& options) const {
+        lz4_options frame;
+        frame.blockChecksum = options.checksum;
+        frame.level = high ? HIGH_LEVEL : 0;
+        return frame;
+    }
+};
+
+class ZstdCodec : public Codec {
+public:
+    static constexpr const int LEVEL = 3;                       // ZSTD_CLEVEL_DEFAULT
+
+    ZstdCodec() : cctx(ZSTD_createCCtx()), dctx(ZSTD_createDCtx()) {
+        if (cctx == nullptr || dctx == nullptr) {
+            ZSTD_freeCCtx(cctx);
+            ZSTD_freeDCtx(dctx);
+            throw std::runtime_error("Could not create the zstd contexts");
+        }
+    }
+
+    ~ZstdCodec() override {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+
+    ZstdCodec(const ZstdCodec&) = delete;
+    ZstdCodec& operator=(const ZstdCodec&) = delete;
+
+    CodecId id() const override { return CodecId::Zstd; }
+
+    // The codec of the calling thread
+    static ZstdCodec& local() {
+        static thread_local ZstdCodec codec;
+        return codec;
+    }
+
+    size_t compressBound(size_t srcSize, const Options&) const override {
+        return ZSTD_compressBound(srcSize);
+    }
+
+    size_t compress(char* dst, size_t capacity, const char* src, size_t srcSize, const Options& options) override {
+        ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, LEVEL);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, options.checksum ? 1 : 0);
+
+        size_t size = ZSTD_compress2(cctx, dst, capacity, src, srcSize);
+        return ZSTD_isError(size) ? FAILED : size;
+    }
+
+    int decompress(const char* src, size_t srcSize, std::string& out, size_t limit) override {
+        return decompress(src, srcSize, out, limit, nullptr);
+    }
+
+    // Compresses src against a dictionary, see compress
+    size_t compress(char* dst, size_t capacity, const char* src, size_t srcSize, const ZSTD_CDict* dictionary) {
+        size_t size = ZSTD_compress_usingCDict(cctx, dst, capacity, src, srcSize, dictionary);
+        return ZSTD_isError(size) ? FAILED : size;
+    }
+
+    // Decompresses a frame that may have been compressed against dictionary, see Codec::decompress
+    int decompress(const char* src, size_t srcSize, std::string& out, size_t limit, const ZSTD_DDict* dictionary) {
+        // Frames of this codec always state the size of their contents
+        unsigned long long contentSize = ZSTD_getFrameContentSize(src, srcSize);
+        if (contentSize == ZSTD_CONTENTSIZE_ERROR || contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize > limit)
+            return -1;
+
+        size_t size = 0;
+        out.resize_and_overwrite(static_cast<size_t>(contentSize), [&](char* dst, size_t n) {
+            size = dictionary ? ZSTD_decompress_usingDDict(dctx, dst, n, src, srcSize, dictionary)
+                              : ZSTD_decompressDCtx(dctx, dst, n, src, srcSize);
+            return ZSTD_isError(size) ? 0 : size;
+        });
+        return ZSTD_isError(size) || size != contentSize ? -1 : 0;
+    }
+
+    // Id of the dictionary a frame has been compressed against, 0 for none
+    static unsigned dictionaryId(const char* src, size_t srcSize) {
+        return ZSTD_getDictID_fromFrame(src, srcSize);
+    }
+
+private:
+    ZSTD_CCtx* cctx = nullptr;
+    ZSTD_DCtx* dctx = nullptr;
+};
+
+// A trained zstd dictionary, immutable once built so sessions and codec threads share it
+class ZstdDictionary {
+public:
+    ZstdDictionary(std::string bytes, uint32_t version) : bytes(std::move(bytes)), version(version) {
+        cdict = ZSTD_createCDict(this->bytes.data(), this->bytes.size(), ZstdCodec::LEVEL);
+        ddict = ZSTD_createDDict(this->bytes.data(), this->bytes.size());
+        if (cdict == nullptr || ddict == nullptr || ZSTD_getDictID_fromDict(this->bytes.data(), this->bytes.size()) == 0) {
+            ZSTD_freeCDict(cdict);
+            ZSTD_freeDDict(ddict);
+            throw std::runtime_error("Invalid zstd dictionary");
+        }
+    }
+
+    ~ZstdDictionary() {
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+    }
+
+    ZstdDictionary(const ZstdDictionary&) = delete;
+    ZstdDictionary& operator=(const ZstdDictionary&) = delete;
+
+    // Trains a dictionary of at most capacity bytes from samples that are stored back to back, returns nullptr if
+    // the samples are too few or too alike to train one
+    static std::shared_ptr<const ZstdDictionary> train(const std::string& samples, const std::vector<size_t>& sizes,
+                                                       size_t capacity, uint32_t version) {
+        std::string bytes(capacity, '\0');
+        size_t size = ZDICT_trainFromBuffer(bytes.data(), bytes.size(), samples.data(), sizes.data(), static_cast<unsigned>(sizes.size()));
+        if (ZDICT_isError(size))
+            return nullptr;
+        bytes.resize(size);
+        try {
+            return std::make_shared<const ZstdDictionary>(std::move(bytes), version);
+        }
+        catch (const std::runtime_error&) {
+            return nullptr;
+        }
+    }
+
+    const std::string& data() const { return bytes; }
+    uint32_t getVersion() const { return version; }
+    unsigned id() const { return ZSTD_getDictID_fromDict(bytes.data(), bytes.size()); }
+    const ZSTD_CDict* compression() const { return cdict; }
+    const ZSTD_DDict* decompression() const { return ddict; }
+
+private:
+    std::string bytes;
+    uint32_t version;
+    ZSTD_CDict* cdict = nullptr;
+    ZSTD_DDict* ddict = nullptr;
+};
+
+// A set of codecs, e.g. the ones a peer can decode
+struct CodecSet {
+    uint8_t mask = 0;
+    bool dictionary = false;        // zstd-dict, which needs zstd as well
+
+    static CodecSet of(std::initializer_list<CodecId> ids) {
+        CodecSet set;
+        for (CodecId id : ids)
+            set.add(id);
+        return set;
+    }
+
+    void add(CodecId id) { mask |= static_cast<uint8_t>(1u << static_cast<unsigned>(id)); }
+    bool has(CodecId id) const { return mask & (1u << static_cast<unsigned>(id)); }
+    CodecSet operator&(CodecSet other) const {
+        return CodecSet{static_cast<uint8_t>(mask & other.mask), dictionary && other.dictionary};
+    }
+    bool hasDictionary() const { return dictionary && has(CodecId::Zstd); }
+};
+
+class CodecRegistry {
+public:
+    struct Entry {
+        CodecId id;
+        const char* name;       // in the handshake, e.g. "zstd"
+        const char* label;      // in statistics, e.g. "zstd"
+    };
+
+    // Every codec, best ratio first
+    static constexpr const Entry ENTRIES[] = {
+        {CodecId::Zstd, "zstd", "zstd"},
+        {CodecId::LZ4HC, "lz4hc", "LZ4-HC"},
+        {CodecId::LZ4, "lz4", "LZ4"},
+    };
+
+    static constexpr const char* DICTIONARY_NAME = "zstd-dict";
+
+    // What peers that predate the registry decode
+    static CodecSet legacy() { return CodecSet::of({CodecId::LZ4, CodecId::LZ4HC}); }
+
+    // Every codec without the dictionary mode, which a server only uses when it's told to
+    static CodecSet defaults() { return CodecSet::of({CodecId::LZ4, CodecId::LZ4HC, CodecId::Zstd}); }
+
+    static CodecSet all() {
+        CodecSet set = defaults();
+        set.dictionary = true;
+        return set;
+    }
+
+    static const Entry* find(CodecId id) {
+        for (const Entry& entry : ENTRIES)
+            if (entry.id == id)
+                return &entry;
+        return nullptr;
+    }
+
+    static const char* label(CodecId id) {
+        const Entry* entry = find(id);
+        return entry ? entry->label : "unknown";
+    }
+
+    // The codec of the calling thread, nullptr for an id that isn't registered
+    static Codec* local(CodecId id) {
+        static thread_local Lz4Codec lz4(false);
+        static thread_local Lz4Codec lz4hc(true);
+        switch (id) {
+            case CodecId::LZ4: return &lz4;
+            case CodecId::LZ4HC: return &lz4hc;
+            case CodecId::Zstd: return &ZstdCodec::local();
+        }
+        return nullptr;
+    }
+
+    // Parses a comma separated list of names, e.g. "zstd,lz4". Names that aren't registered are skipped and set
+    // unknown, lz4 is always part of the set.
+    static CodecSet parse(std::string_view list, bool* unknown = nullptr) {
+        CodecSet set = CodecSet::of({CodecId::LZ4});
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            std::string_view name = list.substr(0, comma);
+            bool known = name == DICTIONARY_NAME;
+            if (known)
+                set.dictionary = true;
+            for (const Entry& entry : ENTRIES) {
+                if (name == entry.name) {
+                    set.add(entry.id);
+                    known = true;
+                }
+            }
+            if (!known && unknown)
+                *unknown = true;
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+        }
+        return set;
+    }
+
+    // The names of a set, best ratio first
+    static std::string format(CodecSet set) {
+        std::string list = set.dictionary ? DICTIONARY_NAME : "";
+        for (const Entry& entry : ENTRIES) {
+            if (!set.has(entry.id))
+                continue;
+            if (!list.empty())
+                list += ',';
+            list += entry.name;
+        }
+        return list;
+    }
+};
+
+#endif //DATATRANSMISSION_CODEC_H
@@ -0,0 +1,331 @@
+/*
+ *  Filename: compression_policy.h
+ *
+ *  Decides how the chunks of a file are compressed, shared by the Server and the Client, and
+ *  keeps the statistics of a transfer.
+ *
+ *  A file is judged from a few blocks sampled across it (forFile): data whose bytes are close
+ *  to uniformly distributed (zip, jpg, mp4, encrypted) is sent raw straight away, everything else
+ *  is compressed on trial, because LZ4 only finds repeated strings and a low byte entropy alone
+ *  doesn't promise any. A file that compresses is sent at the high level if it is small enough for
+ *  the extra CPU time not to matter, at the fast level otherwise. The fast level is LZ4, the high
+ *  one the best codec the peer supports (CodecChoice, codec.h).
+ *
+ *  Every block is checked again before it is compressed (forBlock), so an archive inside a log
+ *  or the media part of a document is sent raw without giving up on the rest of the file, and a
+ *  block that doesn't shrink is sent raw as well.
+ *
+ *  Whether compression pays off depends on the link as well: on a fast link LZ4 can take longer
+ *  than sending the raw bytes, on a slow one the high level wins. A LinkEstimate keeps running averages of
+ *  the throughput a connection has achieved and of the speed and ratio of every level, and picks
+ *  the level a compressible file is expected to arrive fastest with (choose). The stages of a
+ *  transfer overlap, so a level takes as long as the slower of its codec, running on all codec
+ *  threads, and the link carrying the compressed bytes.
+ */
+
+#ifndef DATATRANSMISSION_COMPRESSION_POLICY_H
+#define DATATRANSMISSION_COMPRESSION_POLICY_H
+
+#include "codec.h"
+#include "lz4_comp.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <format>
+#include <istream>
+#include <mutex>
+#include <string>
+
+enum class CompressionLevel : uint8_t { Raw, Fast, High };
+
+// The codec every compression level of a session is sent with
+struct CodecChoice {
+    CodecId fast = CodecId::LZ4;
+    CodecId high = CodecId::LZ4HC;
+
+    // The best codec for the high level out of the ones the peer can decode
+    static CodecChoice from(CodecSet peer) {
+        CodecChoice choice;
+        choice.high = peer.has(CodecId::Zstd) ? CodecId::Zstd : peer.has(CodecId::LZ4HC) ? CodecId::LZ4HC : CodecId::LZ4;
+        return choice;
+    }
+
+    CodecId forLevel(CompressionLevel level) const {
+        return level == CompressionLevel::High ? high : fast;
+    }
+
+    // Level a received frame counts as in the statistics
+    CompressionLevel levelOf(CodecId codec) const {
+        return codec == fast ? CompressionLevel::Fast : CompressionLevel::High;
+    }
+
+    const char* label(CompressionLevel level) const {
+        return level == CompressionLevel::Raw ? "raw" : CodecRegistry::label(forLevel(level));
+    }
+};
+
+class CompressionPolicy {
+public:
+    static constexpr const uint64_t MIN_SIZE = 4096;                // smaller files are sent raw
+    static constexpr const uint64_t HIGH_MAX_SIZE = 1 << 20;        // larger files are compressed with the fast level
+    static constexpr const double RAW_ENTROPY = 7.5;                // bits per byte from which data counts as compressed
+    static constexpr const double MIN_RATIO = 1.1;                  // samples that shrink less are sent raw
+    static constexpr const size_t SAMPLES = 4;
+    static constexpr const size_t SAMPLE_SIZE = 64 * 1024;
+    static constexpr const size_t BLOCK_STRIDE = 13;                // every 13th byte of a block is looked at
+
+    // Bits of information per byte, estimated from the byte frequencies of every stride-th byte
+    static double entropy(const char* data, size_t size, size_t stride = 1) {
+        uint32_t counts[256] = {};
+        size_t n = 0;
+        for (size_t i = 0; i < size; i += stride, n++)
+            counts[static_cast<unsigned char>(data[i])]++;
+        if (n == 0)
+            return 0.0;
+
+        double bits = 0.0;
+        for (uint32_t count : counts) {
+            if (count != 0) {
+                double p = static_cast<double>(count) / static_cast<double>(n);
+                bits -= p * std::log2(p);
+            }
+        }
+        return bits;
+    }
+
+    // Level for a file of size bytes, from SAMPLES blocks spread across it. The stream is rewound afterwards. ratio
+    // receives how much the samples shrank with the fast level, 1 for a file that is sent raw.
+    static CompressionLevel forFile(std::istream& in, uint64_t size, double* ratio = nullptr) {
+        if (ratio)
+            *ratio = 1.0;
+        if (size < MIN_SIZE)
+            return CompressionLevel::Raw;
+
+        // Small files are sampled as a whole
+        std::string samples(static_cast<size_t>(std::min<uint64_t>(size, SAMPLES * SAMPLE_SIZE)), '\0');
+        size_t read = 0;
+        if (size <= SAMPLES * SAMPLE_SIZE) {
+            in.read(samples.data(), static_cast<std::streamsize>(samples.size()));
+            read = static_cast<size_t>(in.gcount());
+        }
+        else {
+            for (size_t i = 0; i < SAMPLES; i++) {
+                in.seekg(static_cast<std::streamoff>((size - SAMPLE_SIZE) * i / (SAMPLES - 1)));
+                in.read(samples.data() + read, SAMPLE_SIZE);
+                read += static_cast<size_t>(in.gcount());
+            }
+        }
+        samples.resize(read);
+        in.clear();
+        in.seekg(0);
+
+        if (forSamples(samples.data(), samples.size(), ratio) == CompressionLevel::Raw)
+            return CompressionLevel::Raw;
+        return size <= HIGH_MAX_SIZE ? CompressionLevel::High : CompressionLevel::Fast;
+    }
+
+    // Fast if samples of some data compress on trial, Raw otherwise. ratio as for forFile, it also tells how well a
+    // stream whose size isn't known up front, like the archive of a tree (tree_archive.h), compresses from its first block.
+    static CompressionLevel forSamples(const char* samples, size_t size, double* ratio = nullptr) {
+        if (ratio)
+            *ratio = 1.0;
+        if (size == 0 || entropy(samples, size) >= RAW_ENTROPY)
+            return CompressionLevel::Raw;
+
+        std::string frame(lz4_comp::compressBound(size), '\0');
+        size_t frameSize = lz4_comp::local().compress(frame.data(), frame.size(), samples, size);
+        if (frameSize == lz4_comp::FAILED || static_cast<double>(size) < MIN_RATIO * static_cast<double>(frameSize))
+            return CompressionLevel::Raw;
+        if (ratio)
+            *ratio = static_cast<double>(size) / static_cast<double>(frameSize);
+        return CompressionLevel::Fast;
+    }
+
+    // Level for one block of a file compressed at fileLevel, blocks that look compressed already are sent raw
+    static CompressionLevel forBlock(CompressionLevel fileLevel, const char* data, size_t size) {
+        if (fileLevel == CompressionLevel::Raw || entropy(data, size, BLOCK_STRIDE) >= RAW_ENTROPY)
+            return CompressionLevel::Raw;
+        return fileLevel;
+    }
+};
+
+// What a transfer has sent or received, the levels are labelled with the codecs of the session
+struct TransferStats {
+    CodecChoice codecs;
+    uint64_t fileBytes = 0;         // bytes of the file
+    uint64_t wireBytes = 0;         // payload bytes of its File frames
+    uint32_t rawBlocks = 0;
+    uint32_t fastBlocks = 0;
+    uint32_t highBlocks = 0;
+    bool delta = false;             // sent as a delta (delta_transfer.h)
+    uint64_t deltaMatched = 0;      // bytes of the file taken from the receiver's copy
+    uint64_t files = 0;             // of a tree sent as an archive (tree_archive.h)
+
+    void add(CompressionLevel level, uint64_t length, uint64_t payload) {
+        fileBytes += length;
+        wireBytes += payload;
+        (level == CompressionLevel::Raw ? rawBlocks : level == CompressionLevel::Fast ? fastBlocks : highBlocks)++;
+    }
+
+    // Adds the statistics of another part of the same file, e.g. a range that went over another connection
+    void add(const TransferStats& other) {
+        fileBytes += other.fileBytes;
+        wireBytes += other.wireBytes;
+        rawBlocks += other.rawBlocks;
+        fastBlocks += other.fastBlocks;
+        highBlocks += other.highBlocks;
+        delta = delta || other.delta;
+        deltaMatched += other.deltaMatched;
+        files += other.files;
+    }
+
+    double ratio() const {
+        return wireBytes == 0 ? 1.0 : static_cast<double>(fileBytes) / static_cast<double>(wireBytes);
+    }
+
+    // e.g. "58.6 MB, 23.1 MB on the wire, ratio 2.54 (56 LZ4, 0 zstd, 0 raw blocks)", followed by
+    // ", delta matched 55.0 MB, saved 57.9 MB" for a delta; a tree starts with "20302 files, "
+    std::string summary() const {
+        std::string line = files == 0 ? std::string() : std::format("{} files, ", files);
+        line += std::format("{}, {} on the wire, ratio {:.2f} ({} {}, {} {}, {} raw blocks)",
+                            formatSize(fileBytes), formatSize(wireBytes), ratio(), fastBlocks, codecs.label(CompressionLevel::Fast),
+                            highBlocks, codecs.label(CompressionLevel::High), rawBlocks);
+        if (delta)
+            line += std::format(", delta matched {}, saved {}", formatSize(deltaMatched), formatSize(fileBytes > wireBytes ? fileBytes - wireBytes : 0));
+        return line;
+    }
+
+    static std::string formatSize(uint64_t bytes) {
+        if (bytes >= (1 << 20))
+            return std::format("{:.1f} MB", static_cast<double>(bytes) / (1 << 20));
+        if (bytes >= 1024)
+            return std::format("{:.1f} KB", static_cast<double>(bytes) / 1024);
+        return std::format("{} B", bytes);
+    }
+};
+
+// Exponentially weighted moving average, 0 until the first sample
+struct Ewma {
+    static constexpr const double WEIGHT = 0.25;    // of a new sample
+
+    double value = 0.0;
+    uint32_t samples = 0;
+
+    void add(double sample) {
+        value = samples++ == 0 ? sample : value + WEIGHT * (sample - value);
+    }
+};
+
+// Running estimates of a connection and the level choices made from them. Thread-safe, the codec updates it from
+// every thread it runs on.
+class LinkEstimate {
+public:
+    static constexpr const double PRIOR_SPEED[3] = {0.0, 400e6, 40e6};  // codec bytes/s per thread before measuring
+    static constexpr const double PRIOR_HIGH_GAIN = 1.15;               // high level ratio over the fast level ratio
+    static constexpr const size_t MAX_DECISIONS = 8;
+
+    struct Decision {
+        CompressionLevel level = CompressionLevel::Raw;
+        double seconds[3] = {};     // expected time per level, 0 where it hasn't been estimated
+        std::string reason;
+    };
+
+    // Throughput of the link while it was the bottleneck
+    void addLink(uint64_t bytes, double seconds) {
+        if (bytes == 0 || seconds <= 0.0)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        link.add(static_cast<double>(bytes) / seconds);
+    }
+
+    // A compressed block: input bytes, compressed bytes and the time one thread took
+    void addCodec(CompressionLevel level, uint64_t input, uint64_t output, double seconds) {
+        if (level == CompressionLevel::Raw || input == 0 || output == 0 || seconds <= 0.0)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        speed[static_cast<int>(level)].add(static_cast<double>(input) / seconds);
+        ratio[static_cast<int>(level)].add(static_cast<double>(input) / static_cast<double>(output));
+    }
+
+    // Level for a file of size bytes. content is what its samples allow (CompressionPolicy::forFile), sampleRatio
+    // how much they shrank with the fast level, threads the number of threads the codec runs on.
+    Decision choose(CompressionLevel content, double sampleRatio, uint64_t size, size_t threads) {
+        Decision decision;
+        decision.level = content;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (content == CompressionLevel::Raw)
+            decision.reason = "contents don't compress";
+        else if (link.samples == 0)
+            decision.reason = "no link estimate yet, chosen from the contents";
+        else {
+            const double bytes = static_cast<double>(size);
+            decision.seconds[0] = bytes / link.value;
+            decision.level = CompressionLevel::Raw;
+            for (CompressionLevel level : {CompressionLevel::Fast, CompressionLevel::High}) {
+                const int i = static_cast<int>(level);
+                const double codecSpeed = (speed[i].samples ? speed[i].value : PRIOR_SPEED[i]) * static_cast<double>(std::max<size_t>(threads, 1));
+                double levelRatio = sampleRatio;
+                if (level == CompressionLevel::High)
+                    levelRatio *= ratio[1].samples && ratio[2].samples ? ratio[2].value / ratio[1].value : PRIOR_HIGH_GAIN;
+                decision.seconds[i] = std::max(bytes / codecSpeed, bytes / (std::max(levelRatio, 1.0) * link.value));
+                if (decision.seconds[i] < decision.seconds[static_cast<int>(decision.level)])
+                    decision.level = level;
+            }
+            decision.reason = std::format("link {}/s, expected {:.3f} s raw, {:.3f} s {}, {:.3f} s {}",
+                                          TransferStats::formatSize(static_cast<uint64_t>(link.value)), decision.seconds[0],
+                                          decision.seconds[1], codecs.label(CompressionLevel::Fast),
+                                          decision.seconds[2], codecs.label(CompressionLevel::High));
+        }
+        return decision;
+    }
+
+    // Keeps a decision for describe, e.g. "copy_to big.log: LZ4 (link 11.2 MB/s, ...)"
+    void record(std::string line) {
+        std::lock_guard<std::mutex> lock(mutex);
+        decisions.push_back(std::move(line));
+        if (decisions.size() > MAX_DECISIONS)
+            decisions.pop_front();
+    }
+
+    // The estimates and the recent decisions, one per line
+    std::string describe() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string text = link.samples == 0 ? "Link: not measured yet\n"
+                                             : std::format("Link: {}/s ({} samples)\n", TransferStats::formatSize(static_cast<uint64_t>(link.value)), link.samples);
+        for (CompressionLevel level : {CompressionLevel::Fast, CompressionLevel::High}) {
+            const int i = static_cast<int>(level);
+            if (speed[i].samples == 0)
+                text += std::format("{}: not used yet\n", name(level));
+            else
+                text += std::format("{}: {}/s per thread, ratio {:.2f} ({} blocks)\n", name(level),
+                                    TransferStats::formatSize(static_cast<uint64_t>(speed[i].value)), ratio[i].value, speed[i].samples);
+        }
+        text += "Recent decisions:";
+        if (decisions.empty())
+            text += " none";
+        for (const auto& line : decisions)
+            text += "\n  " + line;
+        return text;
+    }
+
+    // Set once the peers have agreed on the codecs, before the first transfer
+    void setCodecs(CodecChoice choice) {
+        std::lock_guard<std::mutex> lock(mutex);
+        codecs = choice;
+    }
+
+    const char* name(CompressionLevel level) const {
+        return codecs.label(level);
+    }
+
+private:
+    mutable std::mutex mutex;
+    CodecChoice codecs;
+    Ewma link;          // bytes/s
+    Ewma speed[3];      // input bytes/s of one codec thread, per level
+    Ewma ratio[3];      // per level
+    std::deque<std::string> decisions;
+};
+
+#endif //DATATRANSMISSION_COMPRESSION_POLICY_H
@@ -0,0 +1,355 @@
+/*
+ *  Filename: delta_transfer.h
+ *
+ *  rsync-style delta transfer of a file the receiver has an older copy of, shared by the Server
+ *  and the Client.
+ *
+ *  The receiver splits its copy into blocks and sends their signature (Signature frames): the
+ *  Adler-32 (rolling_checksum.h) and a 128-bit BLAKE2b (libsodium crypto_generichash) of every
+ *  whole block. The sender moves the rolling checksum over its file one byte at a time; where the
+ *  checksum is the one of a block and the strong hash agrees as well, it refers to the block of
+ *  the copy and skips it, everything else is sent as literal bytes. The instructions travel in
+ *  File frames with FRAME_DELTA and are compressed like any other chunk. The receiver rebuilds the
+ *  file from its copy and the literals in the temporary file, so the copy stays intact until the
+ *  new file is complete.
+ *
+ *  Signature, integers little-endian:
+ *      blockSize:u32  count:u32  then count times  weak:u32  strong:16 bytes
+ *
+ *  Instructions:
+ *      0  length:u32  bytes        literal bytes
+ *      1  offset:u64  length:u64   bytes of the receiver's copy
+ *
+ *  A chunk of instructions never splits one, so every chunk is applied on its own.
+ */
+
+#ifndef DATATRANSMISSION_DELTA_TRANSFER_H
+#define DATATRANSMISSION_DELTA_TRANSFER_H
+
+#include "protocol.h"
+#include "rolling_checksum.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <sodium.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct DeltaSignature {
+    static constexpr const size_t STRONG_SIZE = 16;
+    static constexpr const uint32_t MIN_BLOCK = 2048;
+    static constexpr const uint32_t MAX_BLOCK = 128 * 1024;     // unless the file has more than MAX_BLOCKS of them
+    static constexpr const uint64_t MAX_BLOCKS = 1 << 21;       // keeps a signature below 40 MB
+    static constexpr const size_t BLOCK_SIZE = 4 + STRONG_SIZE;
+    static constexpr const size_t HEADER_SIZE = 8;
+    static constexpr const size_t MAX_ENCODED = HEADER_SIZE + MAX_BLOCKS * BLOCK_SIZE;
+    static constexpr const size_t FRAME_BYTES = 64 * 1024;      // of the encoded signature in one Signature frame
+
+    struct Block {
+        uint32_t weak = 0;
+        std::array<unsigned char, STRONG_SIZE> strong{};
+    };
+
+    uint32_t blockSize = MIN_BLOCK;
+    std::vector<Block> blocks;
+
+    // About the square root of the size, like rsync: the signature and the bytes a changed block costs grow alike
+    static uint32_t blockSizeFor(uint64_t size) {
+        uint64_t block = static_cast<uint64_t>(std::sqrt(static_cast<double>(size))) & ~uint64_t(1023);
+        block = std::clamp<uint64_t>(block, MIN_BLOCK, MAX_BLOCK);
+        return static_cast<uint32_t>(std::max<uint64_t>(block, (size + MAX_BLOCKS - 1) / MAX_BLOCKS));
+    }
+
+    static void strongHash(const char* data, size_t size, unsigned char* out) {
+        crypto_generichash(out, STRONG_SIZE, reinterpret_cast<const unsigned char*>(data), size, nullptr, 0);
+    }
+
+    // Computes the signature of a file. A file that doesn't exist has an empty one. Returns false on a read error.
+    bool compute(const std::filesystem::path& file) {
+        blocks.clear();
+        std::error_code ec;
+        const uint64_t size = std::filesystem::file_size(file, ec);
+        if (ec)
+            return !std::filesystem::exists(file, ec);
+
+        blockSize = blockSizeFor(size);
+        std::ifstream in(file, std::ios::in | std::ios::binary);
+        std::string block(blockSize, '\0');
+        blocks.reserve(static_cast<size_t>(size / blockSize));
+        for (uint64_t i = 0; i < size / blockSize; ++i) {
+            if (!in.read(block.data(), blockSize))
+                return false;
+            Block& entry = blocks.emplace_back();
+            RollingChecksum weak;
+            weak.update(block.data(), blockSize);
+            entry.weak = weak.value();
+            strongHash(block.data(), blockSize, entry.strong.data());
+        }
+        return true;
+    }
+
+    std::string encode() const {
+        std::string out(HEADER_SIZE + blocks.size() * BLOCK_SIZE, '\0');
+        char* p = out.data();
+        putU32(p, blockSize);
+        putU32(p + 4, static_cast<uint32_t>(blocks.size()));
+        p += HEADER_SIZE;
+        for (const Block& block : blocks) {
+            putU32(p, block.weak);
+            memcpy(p + 4, block.strong.data(), STRONG_SIZE);
+            p += BLOCK_SIZE;
+        }
+        return out;
+    }
+
+    bool decode(const std::string& in) {
+        if (in.size() < HEADER_SIZE)
+            return false;
+        blockSize = getU32(in.data());
+        const uint32_t count = getU32(in.data() + 4);
+        if (blockSize < MIN_BLOCK || blockSize > FRAME_CHUNK_MAX || count > MAX_BLOCKS || in.size() != HEADER_SIZE + count * BLOCK_SIZE)
+            return false;
+
+        blocks.resize(count);
+        const char* p = in.data() + HEADER_SIZE;
+        for (Block& block : blocks) {
+            block.weak = getU32(p);
+            memcpy(block.strong.data(), p + 4, STRONG_SIZE);
+            p += BLOCK_SIZE;
+        }
+        return true;
+    }
+
+    static void putU32(char* out, uint32_t value) {
+        for (int i = 0; i < 4; ++i)
+            out[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+
+    static uint32_t getU32(const char* in) {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i)
+            value |= static_cast<uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+        return value;
+    }
+};
+
+// Sending side: turns a file into instructions against the signature of the receiver's copy
+class DeltaEncoder {
+public:
+    static constexpr const size_t MAX_LITERAL = 256 * 1024;     // literal bytes in one instruction
+    static constexpr const size_t READ_SIZE = 4 << 20;
+
+    uint64_t matched = 0;       // bytes referred to in the receiver's copy
+    uint64_t literal = 0;       // bytes sent
+
+    DeltaEncoder(std::shared_ptr<const DeltaSignature> signature, std::istream& in)
+        : signature(std::move(signature)), in(in), blockSize(this->signature->blockSize) {
+        for (uint32_t i = 0; i < this->signature->blocks.size(); ++i) {
+            const uint32_t weak = this->signature->blocks[i].weak;
+            index[weak].push_back(i);
+            filter[(weak ^ (weak >> 16)) & 0xffff] = true;
+        }
+    }
+
+    // Appends the instructions for the next part of the file to out, until it holds about `target` bytes.
+    // Returns 1 if more of the file follows, 0 once it has been encoded completely and -1 on a read error.
+    int next(std::string& out, size_t target) {
+        const uint64_t limit = 16 * static_cast<uint64_t>(target);     // a long run of matches ends a chunk as well
+        const size_t begin = out.size();
+        uint64_t consumed = 0;
+        while (out.size() < target && consumed < limit) {
+            if (buffer.size() - pos < blockSize && !eof && fill() == -1)
+                return -1;
+
+            // The tail that is shorter than a block is sent as it is, in a chunk of its own if it doesn't fit anymore
+            if (buffer.size() - pos < blockSize) {
+                if (out.size() > begin && out.size() + pending.size() + (buffer.size() - pos) > target)
+                    break;
+                flushCopy(out);
+                pending.append(buffer, pos, std::string::npos);
+                literal += buffer.size() - pos;
+                pos = buffer.size();
+                flushLiterals(out);
+                return 0;
+            }
+
+            if (!rolling) {
+                sum.reset();
+                sum.update(buffer.data() + pos, blockSize);
+                rolling = true;
+            }
+
+            const int64_t block = find(sum.value(), buffer.data() + pos);
+            if (block >= 0) {
+                flushLiterals(out);
+                const uint64_t offset = static_cast<uint64_t>(block) * blockSize;
+                if (copyLength > 0 && offset == copyOffset + copyLength)
+                    copyLength += blockSize;
+                else {
+                    flushCopy(out);
+                    copyOffset = offset;
+                    copyLength = blockSize;
+                }
+                matched += blockSize;
+                consumed += blockSize;
+                pos += blockSize;
+                rolling = false;
+                continue;
+            }
+
+            flushCopy(out);
+            pending.push_back(buffer[pos]);
+            literal++;
+            consumed++;
+            if (pending.size() >= MAX_LITERAL)
+                flushLiterals(out);
+
+            // Moves the window on by a byte, the byte behind it has to be buffered for that
+            if (pos + blockSize >= buffer.size() && !eof && fill() == -1)
+                return -1;
+            if (pos + blockSize < buffer.size())
+                sum.roll(static_cast<unsigned char>(buffer[pos]), static_cast<unsigned char>(buffer[pos + blockSize]));
+            else
+                rolling = false;
+            pos++;
+        }
+
+        // A chunk stands on its own, the pending instructions go with it
+        flushLiterals(out);
+        flushCopy(out);
+        return 1;
+    }
+
+private:
+    std::shared_ptr<const DeltaSignature> signature;
+    std::istream& in;
+    const uint32_t blockSize;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> index;
+    std::vector<bool> filter = std::vector<bool>(1 << 16);
+
+    std::string buffer;         // the file from the window on
+    size_t pos = 0;             // start of the window in buffer
+    bool eof = false;
+    RollingChecksum sum;        // of the window
+    bool rolling = false;       // sum is the one of the window at pos
+    std::string pending;        // literal bytes not written yet
+    uint64_t copyOffset = 0;    // run of matched blocks not written yet
+    uint64_t copyLength = 0;
+
+    // Drops what is in front of the window and reads on
+    int fill() {
+        buffer.erase(0, pos);
+        pos = 0;
+        const size_t have = buffer.size();
+        const size_t want = std::max<size_t>(READ_SIZE, 2 * static_cast<size_t>(blockSize));
+        buffer.resize(have + want);
+        in.read(buffer.data() + have, static_cast<std::streamsize>(want));
+        buffer.resize(have + static_cast<size_t>(in.gcount()));
+        if (in.bad())
+            return -1;
+        eof = in.eof();
+        return 0;
+    }
+
+    // The block the window is a copy of, the one that continues the current run if there are several; -1 if none
+    int64_t find(uint32_t weak, const char* window) {
+        if (!filter[(weak ^ (weak >> 16)) & 0xffff])
+            return -1;
+        auto it = index.find(weak);
+        if (it == index.end())
+            return -1;
+
+        std::array<unsigned char, DeltaSignature::STRONG_SIZE> strong;
+        DeltaSignature::strongHash(window, blockSize, strong.data());
+        int64_t found = -1;
+        for (uint32_t block : it->second) {
+            if (signature->blocks[block].strong != strong)
+                continue;
+            if (copyLength > 0 && static_cast<uint64_t>(block) * blockSize == copyOffset + copyLength)
+                return block;
+            if (found < 0)
+                found = block;
+        }
+        return found;
+    }
+
+    void flushLiterals(std::string& out) {
+        if (pending.empty())
+            return;
+        char header[5] = {0};
+        DeltaSignature::putU32(header + 1, static_cast<uint32_t>(pending.size()));
+        out.append(header, sizeof(header));
+        out += pending;
+        pending.clear();
+    }
+
+    void flushCopy(std::string& out) {
+        if (copyLength == 0)
+            return;
+        char op[17] = {1};
+        encodeSize(op + 1, copyOffset);
+        encodeSize(op + 9, copyLength);
+        out.append(op, sizeof(op));
+        copyLength = 0;
+    }
+};
+
+// Receiving side: rebuilds the file from the instructions and the receiver's copy
+class DeltaDecoder {
+public:
+    uint64_t matched = 0;       // bytes taken from the copy
+
+    explicit DeltaDecoder(const std::filesystem::path& copy) : copy(copy, std::ios::in | std::ios::binary) {}
+
+    // Writes what a chunk of instructions stands for to out. Returns the number of bytes written, -1 if the chunk
+    // is malformed or refers to bytes the copy doesn't have.
+    int64_t apply(const char* data, size_t size, std::ostream& out) {
+        uint64_t written = 0;
+        while (size > 0) {
+            if (data[0] == 0 && size >= 5) {
+                const uint32_t length = DeltaSignature::getU32(data + 1);
+                if (size - 5 < length)
+                    return -1;
+                out.write(data + 5, length);
+                written += length;
+                data += 5 + length;
+                size -= 5 + length;
+            }
+            else if (data[0] == 1 && size >= 17) {
+                uint64_t offset = decodeSize(data + 1), length = decodeSize(data + 9);
+                copy.clear();
+                if (!copy.seekg(static_cast<std::streamoff>(offset)))
+                    return -1;
+                matched += length;
+                written += length;
+                while (length > 0) {
+                    const size_t piece = static_cast<size_t>(std::min<uint64_t>(length, FRAME_CHUNK_MAX));
+                    buffer.resize(piece);
+                    if (!copy.read(buffer.data(), static_cast<std::streamsize>(piece)))
+                        return -1;
+                    out.write(buffer.data(), static_cast<std::streamsize>(piece));
+                    length -= piece;
+                }
+                data += 17;
+                size -= 17;
+            }
+            else
+                return -1;
+        }
+        return out ? static_cast<int64_t>(written) : -1;
+    }
+
+private:
+    std::ifstream copy;
+    std::string buffer;
+};
+
+#endif //DATATRANSMISSION_DELTA_TRANSFER_H
@@ -1,10 +1,187 @@
+/*
+ *  Filename: lz4_comp.h
+ *
+ *  LZ4 frame codec shared by the Server and the Client. A compressed File frame carries one LZ4
+ *  frame (lz4_Frame_format.md of the LZ4 project): it starts with a magic number, may state the
+ *  size of its contents and may protect every block with a checksum, so a receiver can check what
+ *  it got without any extra framing of ours.
+ *
+ *  A codec owns an LZ4F compression and decompression context and reuses them for every frame,
+ *  so their state is set up once per thread (see local()) instead of once per chunk. The output
+ *  always goes into a buffer of the caller; compressBound tells how much room a frame may need.
+ *
+ *  Frames are encoded in one call (compress) or piece by piece (begin, update, end), and decoded
+ *  in one call (decompress) or as their bytes arrive (decompressStep).
+ */
+
 #ifndef DATATRANSMISSION_LZ4_COMP_H
 #define DATATRANSMISSION_LZ4_COMP_H
 
-// To be implemented
-class lz4_comp {
+#include <lz4frame.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
 
+// How a frame is encoded, a decoder reads it from the frame header
+struct lz4_options {
+    bool contentSize = true;        // the frame header states the size of the contents
+    bool blockChecksum = false;     // every block is followed by a checksum of its contents
+    int level = 0;                  // compression level, 0 is the fast default, 3 and above use LZ4-HC
 };
 
+class lz4_comp {
+public:
+    // Returned by the calls that produce a size when they fail
+    static constexpr const size_t FAILED = SIZE_MAX;
+
+    using Options = lz4_options;
+
+    lz4_comp() {
+        if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)) ||
+            LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+            LZ4F_freeCompressionContext(cctx);
+            LZ4F_freeDecompressionContext(dctx);
+            throw std::runtime_error("Could not create the LZ4 contexts");
+        }
+    }
+
+    ~lz4_comp() {
+        LZ4F_freeCompressionContext(cctx);
+        LZ4F_freeDecompressionContext(dctx);
+    }
+
+    lz4_comp(const lz4_comp&) = delete;
+    lz4_comp& operator=(const lz4_comp&) = delete;
+
+    // The codec of the calling thread, its contexts live as long as the thread
+    static lz4_comp& local() {
+        static thread_local lz4_comp codec;
+        return codec;
+    }
+
+    // Room a frame of srcSize bytes may need at most
+    static size_t compressBound(size_t srcSize, const Options& options = {}) {
+        LZ4F_preferences_t prefs = preferences(srcSize, options);
+        return LZ4F_compressFrameBound(srcSize, &prefs);
+    }
+
+    // Compresses src into a frame of its own, returns the size of the frame or FAILED if it doesn't fit into capacity
+    size_t compress(char* dst, size_t capacity, const char* src, size_t srcSize, const Options& options = {}) {
+        size_t header = begin(dst, capacity, srcSize, options);
+        if (header == FAILED)
+            return FAILED;
+        size_t body = update(dst + header, capacity - header, src, srcSize);
+        if (body == FAILED)
+            return FAILED;
+        size_t footer = end(dst + header + body, capacity - header - body);
+        if (footer == FAILED)
+            return FAILED;
+        return header + body + footer;
+    }
+
+    // Starts a frame of contentSize bytes in total, returns the size of its header (at most LZ4F_HEADER_SIZE_MAX)
+    size_t begin(char* dst, size_t capacity, uint64_t contentSize, const Options& options = {}) {
+        LZ4F_preferences_t prefs = preferences(contentSize, options);
+        return result(LZ4F_compressBegin(cctx, dst, capacity, &prefs));
+    }
+
+    // Room update and end may need for srcSize more bytes of a frame
+    static size_t updateBound(size_t srcSize, const Options& options = {}) {
+        LZ4F_preferences_t prefs = preferences(srcSize, options);
+        return LZ4F_compressBound(srcSize, &prefs);
+    }
+
+    // Compresses the next bytes of the frame started with begin, returns the number of bytes written
+    size_t update(char* dst, size_t capacity, const char* src, size_t srcSize) {
+        return result(LZ4F_compressUpdate(cctx, dst, capacity, src, srcSize, nullptr));
+    }
+
+    // Ends the frame, returns the size of its footer
+    size_t end(char* dst, size_t capacity) {
+        return result(LZ4F_compressEnd(cctx, dst, capacity, nullptr));
+    }
+
+    // Decompresses src, which must be exactly one frame, returns the size of its contents or FAILED if the frame is
+    // corrupt or its contents don't fit into capacity
+    size_t decompress(char* dst, size_t capacity, const char* src, size_t srcSize) {
+        LZ4F_resetDecompressionContext(dctx);
+        size_t produced = 0;
+        while (true) {
+            size_t dstSize = capacity - produced;
+            size_t consumed = srcSize;
+            size_t hint = decompressStep(dst + produced, dstSize, src, consumed);
+            if (hint == FAILED)
+                return FAILED;
+            produced += dstSize;
+            src += consumed;
+            srcSize -= consumed;
+            if (hint == 0)
+                return srcSize == 0 ? produced : FAILED;
+            // Truncated frame, or contents larger than capacity
+            if (consumed == 0 && dstSize == 0)
+                return FAILED;
+        }
+    }
+
+    // Decompresses one frame into out, which keeps its capacity between calls. Returns 0, or -1 if the frame is
+    // corrupt or its contents are larger than limit.
+    int decompress(const char* src, size_t srcSize, std::string& out, size_t limit) {
+        LZ4F_frameInfo_t info{};
+        size_t headerSize = srcSize;
+        LZ4F_resetDecompressionContext(dctx);
+        if (LZ4F_isError(LZ4F_getFrameInfo(dctx, &info, src, &headerSize)))
+            return -1;
+
+        // Without the size in the header the buffer grows until the contents fit
+        size_t capacity = info.contentSize != 0 ? info.contentSize : std::max<size_t>(srcSize * 2, 64 * 1024);
+        while (true) {
+            if (capacity > limit)
+                return -1;
+
+            size_t size = FAILED;
+            out.resize_and_overwrite(capacity, [&](char* dst, size_t n) {
+                size = decompress(dst, n, src, srcSize);
+                return size == FAILED ? 0 : size;
+            });
+            if (size != FAILED)
+                return 0;
+            if (info.contentSize != 0 || capacity == limit)
+                return -1;
+            capacity = std::min(capacity * 2, limit);
+        }
+    }
+
+    // Decodes the next bytes of a frame that arrives piece by piece. dstSize and srcSize are set to what has been
+    // produced and consumed. Returns 0 once the frame is complete, FAILED if it is corrupt, otherwise a hint of how
+    // many bytes to pass next.
+    size_t decompressStep(char* dst, size_t& dstSize, const char* src, size_t& srcSize) {
+        return result(LZ4F_decompress(dctx, dst, &dstSize, src, &srcSize, nullptr));
+    }
+
+    // Drops a frame that has only been decoded in part
+    void resetDecoder() { LZ4F_resetDecompressionContext(dctx); }
+
+private:
+    LZ4F_cctx* cctx = nullptr;
+    LZ4F_dctx* dctx = nullptr;
+
+    static LZ4F_preferences_t preferences(uint64_t contentSize, const Options& options) {
+        LZ4F_preferences_t prefs{};
+        // Independent blocks as large as a chunk, so a chunk is compressed straight from its buffer
+        prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+        prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+        prefs.frameInfo.contentSize = options.contentSize ? contentSize : 0;
+        prefs.frameInfo.blockChecksumFlag = options.blockChecksum ? LZ4F_blockChecksumEnabled : LZ4F_noBlockChecksum;
+        prefs.compressionLevel = options.level;
+        prefs.autoFlush = 1;
+        return prefs;
+    }
+
+    static size_t result(size_t code) {
+        return LZ4F_isError(code) ? FAILED : code;
+    }
+};
 
 #endif //DATATRANSMISSION_LZ4_COMP_H
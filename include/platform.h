@@ -0,0 +1,58 @@
+/*
+ *  Filename: platform.h
+ *
+ *  Thin socket compatibility layer shared by the Server and the Client.
+ *  On Windows it pulls in Winsock2; on POSIX systems it maps the handful of
+ *  Winsock names the code base relies on (SOCKET, INVALID_SOCKET, closesocket,
+ *  WSAGetLastError, ...) onto their BSD socket counterparts, so the rest of the
+ *  code can be written once against the Winsock vocabulary.
+ */
+
+#ifndef DATATRANSMISSION_PLATFORM_H
+#define DATATRANSMISSION_PLATFORM_H
+
+#ifdef _WIN32
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#else
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+
+using SOCKET = int;
+
+constexpr SOCKET INVALID_SOCKET = -1;
+constexpr int SOCKET_ERROR = -1;
+constexpr int SD_SEND = SHUT_WR;
+constexpr int SD_BOTH = SHUT_RDWR;
+
+struct WSADATA {};
+
+#define MAKEWORD(low, high) ((low) | ((high) << 8))
+#define ZeroMemory(dst, len) memset((dst), 0, (len))
+#define _cdecl
+
+inline int WSAStartup(int, WSADATA*) { return 0; }
+inline int WSACleanup() { return 0; }
+inline int WSAGetLastError() { return errno; }
+inline void WSASetLastError(int error) { errno = error; }
+inline int closesocket(SOCKET sock) { return close(sock); }
+
+#endif
+
+#endif //DATATRANSMISSION_PLATFORM_H
@@ -0,0 +1,134 @@
+/*
+ *  Filename: protocol.h
+ *
+ *  Wire format shared by the Server and the Client. Every message is a frame:
+ *
+ *      offset  size  field
+ *      0       1     version   FRAME_VERSION, a receiver drops the connection on any other value
+ *      1       1     type      FrameType
+ *      2       2     flags     FrameFlags, little-endian
+ *      4       4     length    payload length in bytes, little-endian
+ *      8       n     payload
+ *
+ *  The payload is never scanned for delimiters, so it can carry arbitrary binary data and a
+ *  receiver always knows how many bytes to read next.
+ *
+ *  Frame types:
+ *  - Command: A command typed into the client, as text.
+ *  - Response: A reply of the server, as text. A large reply to a client that named its codecs
+ *    in the handshake is split into several Response frames, every one but the last with
+ *    FRAME_MORE, and each may be compressed like a File frame.
+ *  - File: The contents of a file (copy_to and cut replies, copy_from uploads). With the
+ *    FRAME_COMPRESSED flag the payload is one frame of the codec in the FRAME_CODEC bits
+ *    (codec.h), otherwise it is the raw file contents. Codec 0 is LZ4, peers that don't set
+ *    the bits send LZ4 frames. A sender only uses the codecs the peer named in the handshake.
+ *
+ *  - Dictionary: The zstd dictionary short replies are compressed against (codec.h), sent to a
+ *    client that named zstd-dict in the handshake before the first reply that needs it. The
+ *    payload is the version of the dictionary as a little-endian uint64, then the dictionary.
+ *  - Signature: The signature of the receiver's copy of a file that is sent as a delta
+ *    (delta_transfer.h), split into frames like a large reply, every one but the last with
+ *    FRAME_MORE. The server sends it in reply to `copy_from -d`, the client in front of `copy_to -d`.
+ *
+ *  Files are streamed in both directions: the file is split into chunks that are sent as File
+ *  frames of their own, each compressed on its own. Every chunk but the last carries FRAME_MORE.
+ *  A stream may start with a FRAME_SIZE frame, whose payload is the size of the whole file as a
+ *  little-endian uint64, so the receiver can allocate the file up front. It may be followed by
+ *  the ID of the transfer and the offset the file is sent from, both uint64 as well, which let a
+ *  transfer that lost its connection be resumed (transfer_checkpoint.h). A byte range of a file
+ *  that is moved over several connections (range_transfer.h) is a stream of its own, which names
+ *  the offset of the range there. The chunks of a file that is sent as a delta carry FRAME_DELTA:
+ *  once decompressed they are instructions that rebuild the file from the receiver's copy, not the
+ *  contents. The chunks of a directory are blocks of the archive of its tree (tree_archive.h),
+ *  without a FRAME_SIZE frame. A stream whose source can't be read to the end is terminated by an
+ *  empty File frame with FRAME_ABORTED, and the receiver discards what it has written so far.
+ *
+ *  Sizes and offsets of files are 64-bit throughout, a file of any size is streamed. A chunk
+ *  holds at most FRAME_CHUNK_MAX bytes of the file, so a File frame is never longer than
+ *  FRAME_CHUNK_MAX_LENGTH, compressed or not. A receiver drops the connection on a longer File
+ *  frame and fails a chunk that decompresses to more than FRAME_CHUNK_MAX, which bounds the
+ *  memory a transfer takes on either side no matter how large the file is.
+ */
+
+#ifndef DATATRANSMISSION_PROTOCOL_H
+#define DATATRANSMISSION_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+constexpr uint8_t FRAME_VERSION = 1;
+constexpr size_t FRAME_HEADER_SIZE = 8;
+constexpr uint32_t FRAME_MAX_LENGTH = UINT32_MAX;
+constexpr size_t FRAME_CHUNK_MAX = 4 << 20;                                     // file bytes in one File frame
+constexpr uint32_t FRAME_CHUNK_MAX_LENGTH = FRAME_CHUNK_MAX + (FRAME_CHUNK_MAX >> 6); // leaves room for codec overhead
+
+enum class FrameType : uint8_t { Command = 1, Response = 2, File = 3, Dictionary = 4, Signature = 5 };
+
+enum FrameFlags : uint16_t {
+    FRAME_COMPRESSED = 1 << 0,
+    FRAME_MORE = 1 << 1,        // further File frames of the same file follow
+    FRAME_ABORTED = 1 << 2,     // the sender gave up on the file
+    FRAME_SIZE = 1 << 3,        // announces the size of the file, the chunks follow
+    FRAME_CODEC = 3 << 4,       // CodecId of a compressed payload
+    FRAME_DELTA = 1 << 6,       // the chunk holds delta instructions
+};
+
+constexpr unsigned FRAME_CODEC_SHIFT = 4;
+
+inline uint16_t codecFlags(uint8_t codec) {
+    return static_cast<uint16_t>((codec << FRAME_CODEC_SHIFT) & FRAME_CODEC);
+}
+
+inline uint8_t frameCodec(uint16_t flags) {
+    return static_cast<uint8_t>((flags & FRAME_CODEC) >> FRAME_CODEC_SHIFT);
+}
+
+struct FrameHeader {
+    FrameType type = FrameType::Response;
+    uint16_t flags = 0;
+    uint32_t length = 0;
+
+    // Writes the header into out, which must hold FRAME_HEADER_SIZE bytes
+    void encode(char* out) const {
+        out[0] = static_cast<char>(FRAME_VERSION);
+        out[1] = static_cast<char>(type);
+        out[2] = static_cast<char>(flags & 0xff);
+        out[3] = static_cast<char>(flags >> 8);
+        for (int i = 0; i < 4; ++i)
+            out[4 + i] = static_cast<char>((length >> (8 * i)) & 0xff);
+    }
+
+    std::string encode() const {
+        std::string out(FRAME_HEADER_SIZE, '\0');
+        encode(out.data());
+        return out;
+    }
+
+    // Reads a header from in, which must hold FRAME_HEADER_SIZE bytes. Returns false on an unknown version.
+    bool decode(const char* in) {
+        auto byte = [in](int i) { return static_cast<uint32_t>(static_cast<unsigned char>(in[i])); };
+        if (byte(0) != FRAME_VERSION)
+            return false;
+
+        type = static_cast<FrameType>(byte(1));
+        flags = static_cast<uint16_t>(byte(2) | (byte(3) << 8));
+        length = byte(4) | (byte(5) << 8) | (byte(6) << 16) | (byte(7) << 24);
+        return true;
+    }
+};
+
+// Little-endian uint64 used for sizes inside payloads
+inline void encodeSize(char* out, uint64_t size) {
+    for (int i = 0; i < 8; ++i)
+        out[i] = static_cast<char>((size >> (8 * i)) & 0xff);
+}
+
+inline uint64_t decodeSize(const char* in) {
+    uint64_t size = 0;
+    for (int i = 0; i < 8; ++i)
+        size |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    return size;
+}
+
+#endif //DATATRANSMISSION_PROTOCOL_H
@@ -0,0 +1,80 @@
+/*
+ *  Filename: range_transfer.h
+ *
+ *  Byte ranges of a file that is moved over several connections at once (`copy_to -p` /
+ *  `copy_from -p`), shared by the Server and the Client.
+ *
+ *  Next to the connection it runs commands on, the client keeps extra authenticated data
+ *  connections. The main connection only names the file; its ranges (split) are moved over the
+ *  data connections, every one taking the next range that hasn't been moved yet, so a faster
+ *  connection moves more of them. The receiver preallocates the whole file as a temporary file and
+ *  writes every range at its offset through a file handle of its own, and records the ranges that
+ *  have arrived completely in a RangeSet. The file replaces the target once they cover all of it;
+ *  a range whose connection failed is moved again over another one.
+ */
+
+#ifndef DATATRANSMISSION_RANGE_TRANSFER_H
+#define DATATRANSMISSION_RANGE_TRANSFER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <vector>
+
+struct ByteRange {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+
+    uint64_t end() const { return offset + length; }
+};
+
+class RangeSet {
+public:
+    static constexpr const uint64_t MIN_RANGE = 16 << 20;       // smaller ones aren't worth a round trip
+    static constexpr const uint64_t RANGES_PER_CONNECTION = 4;
+
+    // Splits a file into a few ranges per connection. An empty file is a single empty range.
+    static std::vector<ByteRange> split(uint64_t size, unsigned connections) {
+        const uint64_t count = std::max<uint64_t>(connections, 1) * RANGES_PER_CONNECTION;
+        const uint64_t length = std::max<uint64_t>(MIN_RANGE, (size + count - 1) / count);
+        std::vector<ByteRange> ranges;
+        for (uint64_t offset = 0; offset < size; offset += length)
+            ranges.push_back({offset, std::min(length, size - offset)});
+        if (ranges.empty())
+            ranges.push_back({0, 0});
+        return ranges;
+    }
+
+    // Records a range that has arrived, merged with the ones it overlaps or touches
+    void add(ByteRange range) {
+        uint64_t begin = range.offset, end = range.end();
+        if (begin == end)
+            return;
+
+        auto it = ranges.upper_bound(begin);
+        if (it != ranges.begin() && std::prev(it)->second >= begin) {
+            --it;
+            begin = it->first;
+            end = std::max(end, it->second);
+            it = ranges.erase(it);
+        }
+        while (it != ranges.end() && it->first <= end) {
+            end = std::max(end, it->second);
+            it = ranges.erase(it);
+        }
+        ranges.emplace(begin, end);
+    }
+
+    // All of a file of that size has arrived
+    bool covers(uint64_t size) const {
+        return size == 0 || (ranges.size() == 1 && ranges.begin()->first == 0 && ranges.begin()->second >= size);
+    }
+
+    void clear() { ranges.clear(); }
+
+private:
+    std::map<uint64_t, uint64_t> ranges;     // start -> end of the ranges that have arrived, disjoint
+};
+
+#endif //DATATRANSMISSION_RANGE_TRANSFER_H
@@ -0,0 +1,59 @@
+/*
+ *  Filename: rolling_checksum.h
+ *
+ *  Adler-32 checksum of a window of bytes, shared by the Server and the Client. Besides being
+ *  computed over a buffer (update), the window can be moved on by one byte (roll) in constant
+ *  time, which is what makes it cheap to compare a window at every offset of a file.
+ */
+
+#ifndef DATATRANSMISSION_ROLLING_CHECKSUM_H
+#define DATATRANSMISSION_ROLLING_CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+
+class RollingChecksum {
+public:
+    static constexpr const uint32_t MOD = 65521;     // largest prime below 2^16
+
+    // Adds bytes to the end of the window
+    void update(const char* data, size_t size) {
+        const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+        while (size > 0) {
+            // 5552 bytes are the most the sums can take before they overflow 32 bits
+            const size_t run = size < 5552 ? size : 5552;
+            for (size_t i = 0; i < run; ++i) {
+                a += bytes[i];
+                b += a;
+            }
+            a %= MOD;
+            b %= MOD;
+            bytes += run;
+            size -= run;
+            count += run;
+        }
+    }
+
+    // Moves the window on by one byte: out leaves it at the front, in enters at the end
+    void roll(unsigned char out, unsigned char in) {
+        a = (a + MOD - out + in) % MOD;
+        b = static_cast<uint32_t>((b + MOD * (count % MOD + 1) - (count % MOD) * out + a - 1) % MOD);
+    }
+
+    void reset() {
+        a = 1;
+        b = 0;
+        count = 0;
+    }
+
+    uint32_t value() const { return (b << 16) | a; }
+
+    size_t size() const { return count; }
+
+private:
+    uint32_t a = 1;
+    uint32_t b = 0;
+    size_t count = 0;
+};
+
+#endif //DATATRANSMISSION_ROLLING_CHECKSUM_H
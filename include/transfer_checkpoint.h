@@ -0,0 +1,118 @@
+/*
+ *  Filename: transfer_checkpoint.h
+ *
+ *  Checkpoints of resumable transfers, shared by the Server and the Client.
+ *
+ *  A transfer is identified by the sender's file: its ID is a hash of the absolute path, the size
+ *  and the modification time of the source (idOf), so a file that has changed since gets a new one
+ *  and isn't resumed. The receiver writes into a temporary file next to the target and, every
+ *  INTERVAL bytes, flushes it and records the ID and how far it got in a small file next to it
+ *  (`<part>.resume`). That offset is the acknowledged one: everything in front of it has reached
+ *  the file, whatever happened to the connection afterwards.
+ *
+ *  To resume, the side that holds the checkpoint names the offset together with the checksum
+ *  (rolling_checksum.h) of the WINDOW bytes in front of it. The other side compares it with the
+ *  same range of its own file; if both agree the file is sent from the offset on, the receiver
+ *  cuts its temporary file back to it and appends, otherwise the transfer starts over.
+ */
+
+#ifndef DATATRANSMISSION_TRANSFER_CHECKPOINT_H
+#define DATATRANSMISSION_TRANSFER_CHECKPOINT_H
+
+#include "rolling_checksum.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <string>
+#include <system_error>
+
+struct TransferCheckpoint {
+    static constexpr const uint64_t INTERVAL = 64 << 20;    // the receiver records its offset this often
+    static constexpr const size_t WINDOW = 1 << 20;         // bytes in front of the offset that are compared
+
+    uint64_t id = 0;
+    uint64_t offset = 0;
+
+    // ID of a transfer of the file, 0 if it can't be read
+    static uint64_t idOf(const std::filesystem::path& file) {
+        std::error_code ec;
+        const std::filesystem::path absolute = std::filesystem::absolute(file, ec);
+        const uint64_t size = std::filesystem::file_size(file, ec);
+        if (ec)
+            return 0;
+        const auto modified = std::filesystem::last_write_time(file, ec);
+        if (ec)
+            return 0;
+
+        // FNV-1a, the same on every platform and build
+        uint64_t hash = 14695981039346656037ull;
+        auto add = [&hash](const void* data, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                hash ^= static_cast<const unsigned char*>(data)[i];
+                hash *= 1099511628211ull;
+            }
+        };
+        const std::string name = absolute.generic_string();
+        const int64_t ticks = modified.time_since_epoch().count();
+        add(name.data(), name.size());
+        add(&size, sizeof(size));
+        add(&ticks, sizeof(ticks));
+        return hash == 0 ? 1 : hash;
+    }
+
+    // The file the checkpoint of a temporary file is kept in
+    static std::filesystem::path fileOf(const std::filesystem::path& part) {
+        std::filesystem::path file = part;
+        file += ".resume";
+        return file;
+    }
+
+    // Reads the checkpoint of a temporary file. Returns false if there is none.
+    bool load(const std::filesystem::path& part) {
+        std::ifstream in(fileOf(part));
+        std::string line;
+        if (!std::getline(in, line))
+            return false;
+        return std::sscanf(line.c_str(), "%llx %llu", reinterpret_cast<unsigned long long*>(&id),
+                           reinterpret_cast<unsigned long long*>(&offset)) == 2 && id != 0;
+    }
+
+    // Records the checkpoint of a temporary file, replacing the previous one in one step
+    bool save(const std::filesystem::path& part) const {
+        std::filesystem::path file = fileOf(part), next = file;
+        next += ".tmp";
+        {
+            std::ofstream out(next, std::ios::out | std::ios::trunc);
+            out << std::format("{:x} {}\n", id, offset);
+            if (!out.flush())
+                return false;
+        }
+        std::error_code ec;
+        std::filesystem::rename(next, file, ec);
+        return !ec;
+    }
+
+    static void remove(const std::filesystem::path& part) {
+        std::error_code ec;
+        std::filesystem::remove(fileOf(part), ec);
+    }
+
+    // Checksum of the WINDOW bytes in front of offset. Returns false if the file is shorter than offset.
+    static bool windowChecksum(const std::filesystem::path& file, uint64_t offset, uint32_t& checksum) {
+        std::ifstream in(file, std::ios::in | std::ios::binary);
+        const uint64_t start = offset - std::min<uint64_t>(offset, WINDOW);
+        std::string window(static_cast<size_t>(offset - start), '\0');
+        if (!in.seekg(static_cast<std::streamoff>(start)) || !in.read(window.data(), static_cast<std::streamsize>(window.size())))
+            return false;
+
+        RollingChecksum sum;
+        sum.update(window.data(), window.size());
+        checksum = sum.value();
+        return true;
+    }
+};
+
+#endif //DATATRANSMISSION_TRANSFER_CHECKPOINT_H
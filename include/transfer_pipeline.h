@@ -0,0 +1,409 @@
+/*
+ *  Filename: transfer_pipeline.h
+ *
+ *  Pipelined transfer engine shared by the Server and the Client. A file transfer is split into
+ *  three stages that work at the same time:
+ *
+ *      SOURCE  disk reads (sending side), or File frames coming off the socket (receiving side)
+ *      CODEC   LZ4 compression or decompression of the chunks
+ *      SINK    File frames going out on the socket (sending side), or disk writes (receiving side)
+ *
+ *  While the socket carries chunk n, chunk n+1 is compressed and chunk n+2 is read. The stages
+ *  hand a fixed pool of chunks around a ring of bounded lock-free single-producer/single-consumer
+ *  queues (free -> SOURCE -> filled -> CODEC -> coded -> SINK -> free), so a transfer never holds
+ *  more than `depth` chunks whichever stage is the slowest, and the buffers of a chunk are reused
+ *  for the whole transfer.
+ *
+ *  The buffers of a finished transfer go to the BufferPool, so the next transfer doesn't start on
+ *  fresh pages.
+ *
+ *  A stage is not a thread of its own but a step function that handles every chunk it can get
+ *  and returns. Handing a chunk to a stage wakes it up: the executor the stage was registered with
+ *  runs its step on the worker pool, the event loop of a session or StageThreads. A stage never
+ *  runs twice at the same time, which is what keeps the queues single-producer/single-consumer.
+ *
+ *  The codec may instead code every chunk in a task of its own (setParallelCodec), so the chunks
+ *  of one transfer are compressed or decompressed on as many threads as its executor has. The
+ *  chunks still enter the coded queue in order, and the sink only takes the oldest one once it
+ *  has been coded, so they leave the pipeline in the order they were read.
+ */
+
+#ifndef DATATRANSMISSION_TRANSFER_PIPELINE_H
+#define DATATRANSMISSION_TRANSFER_PIPELINE_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bounded lock-free queue between one producer and one consumer. The capacity is rounded up to a power of two.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : slots(std::bit_ceil(capacity)), mask(slots.size() - 1) {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer: appends a value, false if the queue is full
+    bool push(T value) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size())
+            return false;
+        slots[t & mask] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer: takes the oldest value, false if the queue is empty
+    bool pop(T& value) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        value = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer: the oldest value without taking it, nullptr if the queue is empty
+    T* front() {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return nullptr;
+        return &slots[h & mask];
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    size_t size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> slots;
+    const size_t mask;
+    alignas(64) std::atomic<size_t> head = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+};
+
+// Buffers of finished transfers, kept for the next ones up to a limit. Thread-safe.
+class BufferPool {
+public:
+    static constexpr const size_t MAX_BUFFERS = 32;
+    static constexpr const size_t MAX_CAPACITY = 4 << 20;  // larger buffers are freed
+
+    static BufferPool& shared() {
+        static BufferPool pool;
+        return pool;
+    }
+
+    // An empty string, with the capacity of a buffer given back before if there is one
+    std::string take() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (buffers.empty())
+            return {};
+        std::string buffer = std::move(buffers.back());
+        buffers.pop_back();
+        return buffer;
+    }
+
+    void give(std::string buffer) {
+        if (buffer.capacity() == 0 || buffer.capacity() > MAX_CAPACITY)
+            return;
+        buffer.clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (buffers.size() < MAX_BUFFERS)
+            buffers.push_back(std::move(buffer));
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::string> buffers;
+};
+
+class TransferPipeline : public std::enable_shared_from_this<TransferPipeline> {
+public:
+    // A chunk of the file on its way through the stages
+    struct Chunk {
+        std::string raw;        // file contents
+        std::string packed;     // the chunk as it travels on the wire: compressed, or raw as received
+        uint16_t flags = 0;     // FrameFlags of the File frame carrying the chunk
+        uint64_t offset = 0;    // position of the chunk in the file
+        size_t length = 0;      // size of the chunk in the file
+        bool inFile = false;    // the chunk hasn't been read, it is sent straight from the file (sendfile)
+        bool failed = false;    // a stage failed on the chunk, the transfer is given up
+        bool last = false;      // last chunk of the transfer
+        uint8_t level = 0;      // CompressionLevel the codec compressed the chunk with, for the statistics
+        std::atomic<bool> coded = false;    // the codec is done with the chunk, the sink may take it
+    };
+
+    enum Stage { SOURCE, CODEC, SINK, STAGES };
+    using Task = std::function<void()>;
+    using Executor = std::function<void(Task)>;
+    using Step = std::function<void(TransferPipeline&)>;
+    using ChunkStep = std::function<void(Chunk&)>;
+
+    static constexpr const size_t DEFAULT_DEPTH = 4;
+    static constexpr const size_t MAX_DEPTH = 16;
+
+    // Depth that keeps codecThreads threads of a parallel codec busy while the sink and the source hold a chunk each
+    static size_t depthFor(size_t codecThreads) {
+        return std::clamp<size_t>(2 * codecThreads, DEFAULT_DEPTH, MAX_DEPTH);
+    }
+
+    explicit TransferPipeline(size_t depth = DEFAULT_DEPTH)
+        : chunks(depth), freeChunks(depth), filled(depth), coded(depth) {
+        for (auto& chunk : chunks) {
+            chunk.raw = BufferPool::shared().take();
+            chunk.packed = BufferPool::shared().take();
+            freeChunks.push(&chunk);
+        }
+    }
+
+    ~TransferPipeline() {
+        for (auto& chunk : chunks) {
+            BufferPool::shared().give(std::move(chunk.raw));
+            BufferPool::shared().give(std::move(chunk.packed));
+        }
+    }
+
+    TransferPipeline(const TransferPipeline&) = delete;
+    TransferPipeline& operator=(const TransferPipeline&) = delete;
+
+    // Sets the step of a stage and where it runs. All stages are set before the pipeline is started.
+    void setStage(Stage stage, Executor executor, Step step) {
+        executors[stage] = std::move(executor);
+        steps[stage] = std::move(step);
+    }
+
+    // Codes every chunk in a task of its own on executor instead of running a CODEC step. code must not touch
+    // anything but the chunk it is given, several chunks are coded at the same time.
+    void setParallelCodec(Executor executor, ChunkStep code) {
+        codeChunk = std::move(code);
+        setStage(CODEC, std::move(executor), [](TransferPipeline& pipeline) { pipeline.dispatch(); });
+    }
+
+    void start() { wake(SOURCE); }
+
+    // Runs the step of a stage on its executor, unless it is already running; then it runs once more afterwards
+    void wake(Stage stage) {
+        if (pending[stage].fetch_add(1, std::memory_order_acq_rel) != 0)
+            return;
+        executors[stage]([self = shared_from_this(), stage] { self->run(stage); });
+    }
+
+    // Stops every stage, chunks that are still queued are dropped
+    void cancel() { stopped.store(true, std::memory_order_release); }
+    bool cancelled() const { return stopped.load(std::memory_order_acquire); }
+
+    // Marks the transfer as complete and releases wait()
+    void finish() {
+        done.store(true, std::memory_order_release);
+        done.notify_all();
+    }
+    void wait() const { done.wait(false, std::memory_order_acquire); }
+
+    // SOURCE: takes a free chunk, nullptr while all of them are on their way
+    Chunk* acquire() {
+        Chunk* chunk = nullptr;
+        freeChunks.pop(chunk);
+        return chunk;
+    }
+    bool canAcquire() { return freeChunks.front() != nullptr; }
+
+    // SOURCE: hands a chunk on to the codec
+    void submit(Chunk* chunk) {
+        filled.push(chunk);
+        wake(CODEC);
+    }
+
+    // CODEC: takes the next chunk to encode or decode, nullptr if there is none
+    Chunk* nextToCode() {
+        Chunk* chunk = nullptr;
+        filled.pop(chunk);
+        return chunk;
+    }
+
+    // CODEC: hands a chunk on to the sink
+    void encoded(Chunk* chunk) {
+        coded.push(chunk);
+        markCoded(chunk);
+    }
+
+    // SINK: the next chunk to send or write without taking it, nullptr if there is none or it is still being coded
+    Chunk* nextToSink() {
+        Chunk** chunk = coded.front();
+        return chunk && (*chunk)->coded.load(std::memory_order_acquire) ? *chunk : nullptr;
+    }
+
+    // SINK: takes the chunk returned by nextToSink and gives it back to the source. The source is only woken up once
+    // half of the chunks are free, so it refills them in one go instead of one handoff per chunk. The other half is
+    // on its way to the sink, which releases it without the source's help.
+    void release() {
+        Chunk* chunk = nullptr;
+        coded.pop(chunk);
+        codedCount.fetch_sub(1, std::memory_order_relaxed);
+        recycle(chunk);
+        if (refillDue)
+            refill();
+    }
+
+    // SINK: takes the chunk returned by nextToSink and lends one of its buffers out, so it can be sent without a copy.
+    // The chunk goes back to the source once the last copy of the returned pointer is gone, which has to happen on the
+    // thread the sink runs on; the source is woken up by the next refill() after that.
+    std::shared_ptr<const std::string> lend(std::string Chunk::* buffer) {
+        Chunk* chunk = nullptr;
+        coded.pop(chunk);
+        codedCount.fetch_sub(1, std::memory_order_relaxed);
+        std::shared_ptr<Chunk> lease(chunk, [self = shared_from_this()](Chunk* chunk) { self->recycle(chunk); });
+        return std::shared_ptr<const std::string>(std::move(lease), &(chunk->*buffer));
+    }
+
+    // SINK: wakes the source up if enough chunks have come back since it last ran
+    void refill() {
+        if (!refillDue)
+            return;
+        refillDue = false;
+        wake(SOURCE);
+    }
+
+private:
+    std::vector<Chunk> chunks;
+    SpscQueue<Chunk*> freeChunks;
+    SpscQueue<Chunk*> filled;
+    SpscQueue<Chunk*> coded;
+    Executor executors[STAGES];
+    Step steps[STAGES];
+    ChunkStep codeChunk;        // set for a parallel codec
+    std::atomic<size_t> codedCount = 0;     // coded chunks the sink hasn't taken yet
+    std::atomic<bool> lastCoded = false;
+    std::atomic<uint32_t> pending[STAGES] = {};
+    std::atomic<bool> stopped = false;
+    std::atomic<bool> done = false;
+    bool refillDue = false;     // owned by the sink
+
+    void recycle(Chunk* chunk) {
+        // A cancelled pipeline may be let go of anywhere, its chunks simply aren't reused anymore
+        if (cancelled())
+            return;
+
+        chunk->flags = 0;
+        chunk->inFile = false;
+        chunk->failed = false;
+        chunk->last = false;
+        chunk->level = 0;
+        chunk->coded.store(false, std::memory_order_relaxed);
+        freeChunks.push(chunk);
+        if (freeChunks.size() * 2 >= chunks.size())
+            refillDue = true;
+    }
+
+    // Like the source (see release), the sink is woken up once half of the chunks are ready for it. At the end of the
+    // transfer there may not be that many anymore: from the last chunk on, every coded chunk wakes it up. A parallel
+    // codec may finish the last chunk before the ones in front of it.
+    void markCoded(Chunk* chunk) {
+        // Read first, the sink may recycle the chunk as soon as it is marked
+        if (chunk->last)
+            lastCoded.store(true, std::memory_order_relaxed);
+        chunk->coded.store(true, std::memory_order_release);
+        const size_t ready = codedCount.fetch_add(1, std::memory_order_acq_rel) + 1;
+        if (lastCoded.load(std::memory_order_relaxed) || ready * 2 >= chunks.size())
+            wake(SINK);
+    }
+
+    // CODEC of a parallel codec: queues the chunks for the sink in the order they were read and codes each of them
+    // in a task of its own
+    void dispatch() {
+        while (Chunk* chunk = nextToCode()) {
+            coded.push(chunk);
+            executors[CODEC]([self = shared_from_this(), chunk] {
+                if (!self->cancelled())
+                    self->codeChunk(*chunk);
+                self->markCoded(chunk);
+            });
+        }
+    }
+
+    // Runs the step of a stage until nobody has woken it up while it was running
+    void run(Stage stage) {
+        uint32_t seen = pending[stage].load(std::memory_order_acquire);
+        while (true) {
+            if (!cancelled())
+                steps[stage](*this);
+            if (pending[stage].compare_exchange_strong(seen, 0, std::memory_order_acq_rel))
+                return;
+        }
+    }
+};
+
+// Threads that run the tasks posted to them, the executor of a stage that has threads of its own. With one thread the
+// tasks run one after another.
+class StageThreads {
+public:
+    explicit StageThreads(unsigned count = 1) {
+        for (unsigned i = 0; i < std::max(count, 1u); i++)
+            threads.emplace_back([this] { work(); });
+    }
+
+    ~StageThreads() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    StageThreads(const StageThreads&) = delete;
+    StageThreads& operator=(const StageThreads&) = delete;
+
+    size_t size() const { return threads.size(); }
+
+    void post(TransferPipeline::Task task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        wakeup.notify_one();
+    }
+
+    TransferPipeline::Executor executor() {
+        return [this](TransferPipeline::Task task) { post(std::move(task)); };
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<TransferPipeline::Task> tasks;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+
+    void work() {
+        while (true) {
+            TransferPipeline::Task task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeup.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+#endif //DATATRANSMISSION_TRANSFER_PIPELINE_H
@@ -0,0 +1,551 @@
+/*
+ *  Filename: tree_archive.h
+ *
+ *  Archive a directory tree is streamed as by `copy_to -r` / `copy_from -r`, shared by the Server
+ *  and the Client.
+ *
+ *  The sender walks the tree with several threads at once (TreeWalker): every thread lists a
+ *  directory of its own, hands the subdirectories it finds to the others and reads small files
+ *  right away, so the metadata lookups of a tree of many small files overlap instead of waiting on
+ *  each other. The entries go into one stream of headers, each followed by the contents of its file
+ *  (ArchiveWriter), in the order the walk finds them. The stream is cut into chunks like a file and
+ *  every chunk is compressed on its own, so many small files share one compression block and one
+ *  File frame instead of a command round trip each.
+ *
+ *  The receiver extracts the entries as the chunks arrive (ArchiveExtractor). Every file is written
+ *  to a temporary file next to it that replaces it once complete, like the file of a single
+ *  transfer, and gets the permissions and modification time it had. Directories are created when
+ *  they are first needed; their permissions and times are set once the whole tree is in, deepest
+ *  first, since writing into a directory changes its time. A path that would leave the root, or lead
+ *  through a symbolic link that is already under it, rejects the archive.
+ *
+ *  Entry header, integers little-endian:
+ *      type:u8  mode:u32  mtime:i64  size:u64  pathLength:u16  path
+ *
+ *  Type 1 is a directory, 2 a file followed by size bytes of contents, 0 ends the archive. mode holds
+ *  the permission bits, mtime the modification time in nanoseconds since the epoch. The path is
+ *  UTF-8 and relative to the root of the tree, '/' between its components; the root itself has an
+ *  empty one. Only regular files and directories are archived, symbolic links and special files
+ *  are skipped.
+ */
+
+#ifndef DATATRANSMISSION_TREE_ARCHIVE_H
+#define DATATRANSMISSION_TREE_ARCHIVE_H
+
+#include "protocol.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ArchiveEntry {
+    enum Type : uint8_t { End = 0, Directory = 1, File = 2 };
+
+    static constexpr const size_t HEADER_SIZE = 23;     // in front of the path
+
+    Type type = End;
+    std::string path;           // relative to the root, '/' between the components
+    uint32_t mode = 0;
+    int64_t mtime = 0;
+    uint64_t size = 0;          // of a file
+    std::string contents;       // of a small file, read by the walker
+    bool loaded = false;        // contents holds the whole file
+
+    void encode(std::string& out) const {
+        char header[HEADER_SIZE];
+        header[0] = static_cast<char>(type);
+        putU32(header + 1, mode);
+        encodeSize(header + 5, static_cast<uint64_t>(mtime));
+        encodeSize(header + 13, size);
+        putU16(header + 21, static_cast<uint16_t>(path.size()));
+        out.append(header, HEADER_SIZE);
+        out += path;
+    }
+
+    // Decodes the fixed part of a header, the path follows it
+    static ArchiveEntry decode(const char* header) {
+        ArchiveEntry entry;
+        entry.type = static_cast<Type>(header[0]);
+        entry.mode = getU32(header + 1);
+        entry.mtime = static_cast<int64_t>(decodeSize(header + 5));
+        entry.size = decodeSize(header + 13);
+        return entry;
+    }
+
+    static uint16_t pathLength(const char* header) { return getU16(header + 21); }
+
+    static int64_t timeOf(std::filesystem::file_time_type time) {
+        const auto system = std::chrono::file_clock::to_sys(time);
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(system.time_since_epoch()).count();
+    }
+
+    static std::filesystem::file_time_type fileTime(int64_t mtime) {
+        const std::chrono::sys_time<std::chrono::nanoseconds> system{std::chrono::nanoseconds(mtime)};
+        return std::chrono::file_clock::from_sys(system);
+    }
+
+    static std::string utf8(const std::filesystem::path& name) {
+        const std::u8string text = name.generic_u8string();
+        return {reinterpret_cast<const char*>(text.data()), text.size()};
+    }
+
+    static std::filesystem::path fromUtf8(const std::string& text) {
+        return std::u8string(reinterpret_cast<const char8_t*>(text.data()), text.size());
+    }
+
+private:
+    static void putU16(char* out, uint16_t value) {
+        out[0] = static_cast<char>(value & 0xff);
+        out[1] = static_cast<char>(value >> 8);
+    }
+
+    static uint16_t getU16(const char* in) {
+        return static_cast<uint16_t>(static_cast<unsigned char>(in[0]) | static_cast<unsigned char>(in[1]) << 8);
+    }
+
+    static void putU32(char* out, uint32_t value) {
+        for (int i = 0; i < 4; ++i)
+            out[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+
+    static uint32_t getU32(const char* in) {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i)
+            value |= static_cast<uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+        return value;
+    }
+};
+
+// Walks a tree with several threads, the entries are taken in the order they are found
+class TreeWalker {
+public:
+    static constexpr const unsigned THREADS = 8;
+    static constexpr const uint64_t PREFETCH_MAX = 64 * 1024;   // smaller files are read by the walker
+    static constexpr const size_t QUEUE_BYTES = 16 << 20;       // of entries found but not taken yet
+
+    std::atomic<uint64_t> skipped{0};   // entries that couldn't be read, or aren't regular files or directories
+
+    explicit TreeWalker(std::filesystem::path root, unsigned threads = THREADS) : root(std::move(root)) {
+        std::error_code ec;
+        ArchiveEntry entry;
+        entry.type = ArchiveEntry::Directory;
+        entry.mode = static_cast<uint32_t>(std::filesystem::status(this->root, ec).permissions()) & 07777;
+        entry.mtime = ArchiveEntry::timeOf(std::filesystem::last_write_time(this->root, ec));
+        queued = cost(entry);
+        ready.push_back(std::move(entry));
+        pending.emplace_back();
+
+        for (unsigned i = 0; i < std::max(threads, 1u); i++)
+            workers.emplace_back([this] { walk(); });
+    }
+
+    ~TreeWalker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work.notify_all();
+        room.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    TreeWalker(const TreeWalker&) = delete;
+    TreeWalker& operator=(const TreeWalker&) = delete;
+
+    // Takes the next entry, waits until one has been found. Returns false once the whole tree has been walked.
+    bool next(ArchiveEntry& entry) {
+        std::unique_lock<std::mutex> lock(mutex);
+        found.wait(lock, [this] { return !ready.empty() || walked(); });
+        if (ready.empty())
+            return false;
+
+        entry = std::move(ready.front());
+        ready.pop_front();
+        queued -= cost(entry);
+        room.notify_all();
+        return true;
+    }
+
+private:
+    std::filesystem::path root;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work;       // a directory is pending, or the walk is over
+    std::condition_variable found;      // an entry is ready, or the walk is over
+    std::condition_variable room;       // entries have been taken
+    std::deque<std::string> pending;    // directories nobody lists yet
+    unsigned listing = 0;               // directories being listed
+    std::deque<ArchiveEntry> ready;
+    size_t queued = 0;                  // cost of the ready entries
+    bool stopping = false;
+
+    static size_t cost(const ArchiveEntry& entry) {
+        return ArchiveEntry::HEADER_SIZE + entry.path.size() + entry.contents.size();
+    }
+
+    bool walked() const { return pending.empty() && listing == 0; }
+
+    void walk() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work.wait(lock, [this] { return stopping || !pending.empty() || walked(); });
+            if (stopping || pending.empty())
+                return;
+
+            std::string directory = std::move(pending.front());
+            pending.pop_front();
+            listing++;
+            lock.unlock();
+            list(directory);
+            lock.lock();
+
+            if (--listing == 0 && pending.empty()) {
+                work.notify_all();
+                found.notify_all();
+            }
+        }
+    }
+
+    // Finds the entries of a directory, queues its subdirectories for the walk
+    void list(const std::string& directory) {
+        std::error_code ec;
+        std::filesystem::directory_iterator it(root / ArchiveEntry::fromUtf8(directory), ec);
+        if (ec) {
+            skipped++;
+            return;
+        }
+
+        for (const std::filesystem::directory_iterator end; it != end; it.increment(ec)) {
+            if (ec) {
+                skipped++;
+                return;
+            }
+
+            ArchiveEntry entry;
+            entry.path = (directory.empty() ? "" : directory + "/") + ArchiveEntry::utf8(it->path().filename());
+            const std::filesystem::file_status status = it->symlink_status(ec);
+            if (!ec && std::filesystem::is_directory(status))
+                entry.type = ArchiveEntry::Directory;
+            else if (!ec && std::filesystem::is_regular_file(status)) {
+                entry.type = ArchiveEntry::File;
+                entry.size = it->file_size(ec);
+            }
+            if (ec || entry.type == ArchiveEntry::End || entry.path.size() > UINT16_MAX) {
+                skipped++;
+                continue;
+            }
+            entry.mode = static_cast<uint32_t>(status.permissions()) & 07777;
+            entry.mtime = ArchiveEntry::timeOf(it->last_write_time(ec));
+
+            // Reading a small file here overlaps its open with the ones of the other threads
+            if (entry.type == ArchiveEntry::File && entry.size <= PREFETCH_MAX) {
+                std::ifstream in(it->path(), std::ios::in | std::ios::binary);
+                entry.contents.resize(static_cast<size_t>(entry.size));
+                in.read(entry.contents.data(), static_cast<std::streamsize>(entry.size));
+                if (!in || static_cast<uint64_t>(in.gcount()) != entry.size) {
+                    skipped++;
+                    continue;
+                }
+                entry.loaded = true;
+            }
+
+            const bool subdirectory = entry.type == ArchiveEntry::Directory;
+            std::string path = entry.path;
+            if (!add(std::move(entry)))
+                return;
+            if (subdirectory) {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.push_back(std::move(path));
+                work.notify_one();
+            }
+        }
+    }
+
+    // Hands an entry to the taker, waits while too much is queued. Returns false once the walker is stopped.
+    bool add(ArchiveEntry&& entry) {
+        std::unique_lock<std::mutex> lock(mutex);
+        room.wait(lock, [this] { return stopping || queued < QUEUE_BYTES; });
+        if (stopping)
+            return false;
+        queued += cost(entry);
+        ready.push_back(std::move(entry));
+        found.notify_one();
+        return true;
+    }
+};
+
+// Sending side: the archive of a tree, block by block
+class ArchiveWriter {
+public:
+    uint64_t files = 0;
+    uint64_t directories = 0;
+    uint64_t bytes = 0;         // contents of the files
+
+    explicit ArchiveWriter(const std::filesystem::path& root, unsigned threads = TreeWalker::THREADS)
+        : root(root), walker(root, threads) {}
+
+    // Entries that have been left out
+    uint64_t skipped() const { return walker.skipped + unreadable; }
+
+    // Appends the next part of the archive to out, until it holds `target` bytes. Returns 1 if more follows, 0 once
+    // the end of the archive has been appended and -1 if a file couldn't be read to the end.
+    int next(std::string& out, size_t target) {
+        while (out.size() < target) {
+            if (offset < pending.size()) {
+                const size_t length = std::min(target - out.size(), pending.size() - offset);
+                out.append(pending, offset, length);
+                offset += length;
+                continue;
+            }
+
+            if (left > 0) {
+                const size_t length = static_cast<size_t>(std::min<uint64_t>(target - out.size(), left));
+                const size_t have = out.size();
+                out.resize(have + length);
+                input.read(out.data() + have, static_cast<std::streamsize>(length));
+                if (static_cast<size_t>(input.gcount()) != length)
+                    return -1;
+                left -= length;
+                if (left == 0)
+                    input.close();
+                continue;
+            }
+
+            if (ended)
+                return 0;
+
+            pending.clear();
+            offset = 0;
+            ArchiveEntry entry;
+            if (!walker.next(entry)) {
+                ArchiveEntry{}.encode(pending);
+                ended = true;
+                continue;
+            }
+
+            // A file the walker didn't read is opened now, one that can't be is left out
+            if (entry.type == ArchiveEntry::File && !entry.loaded) {
+                input.open(root / ArchiveEntry::fromUtf8(entry.path), std::ios::in | std::ios::binary);
+                if (!input) {
+                    input.clear();
+                    unreadable++;
+                    continue;
+                }
+                left = entry.size;
+            }
+
+            entry.encode(pending);
+            pending += entry.contents;
+            (entry.type == ArchiveEntry::File ? files : directories)++;
+            bytes += entry.size;
+        }
+        return ended && offset == pending.size() ? 0 : 1;
+    }
+
+private:
+    std::filesystem::path root;
+    TreeWalker walker;
+    std::string pending;        // header and contents of the current entry
+    size_t offset = 0;          // of pending, appended so far
+    std::ifstream input;        // a larger file, read as it is appended
+    uint64_t left = 0;          // bytes of it still to append
+    uint64_t unreadable = 0;
+    bool ended = false;
+};
+
+// Receiving side: extracts the archive of a tree into a directory as it arrives
+class ArchiveExtractor {
+public:
+    uint64_t files = 0;
+    uint64_t directories = 0;
+    uint64_t bytes = 0;
+    std::string error;          // why the archive has been rejected
+
+    explicit ArchiveExtractor(std::filesystem::path root) : root(std::move(root)) {}
+
+    // A file that is still being written is removed
+    ~ArchiveExtractor() {
+        if (output.is_open()) {
+            output.close();
+            std::error_code ec;
+            std::filesystem::remove(part, ec);
+        }
+    }
+
+    ArchiveExtractor(const ArchiveExtractor&) = delete;
+    ArchiveExtractor& operator=(const ArchiveExtractor&) = delete;
+
+    // The end of the archive has been extracted
+    bool finished() const { return ended; }
+
+    // Extracts the next part of the archive. Returns 0, or -1 if it is malformed or an entry can't be written.
+    int apply(const char* data, size_t size) {
+        while (size > 0) {
+            if (ended)
+                return fail("Data follows the end of the archive");
+
+            if (left > 0) {
+                const size_t length = static_cast<size_t>(std::min<uint64_t>(size, left));
+                output.write(data, static_cast<std::streamsize>(length));
+                left -= length;
+                bytes += length;
+                data += length;
+                size -= length;
+                if (left == 0 && finishFile() == -1)
+                    return -1;
+                continue;
+            }
+
+            // Headers may be split across chunks
+            const size_t want = header.size() < ArchiveEntry::HEADER_SIZE ? ArchiveEntry::HEADER_SIZE
+                                                                          : ArchiveEntry::HEADER_SIZE + ArchiveEntry::pathLength(header.data());
+            const size_t length = std::min(size, want - header.size());
+            header.append(data, length);
+            data += length;
+            size -= length;
+            if (header.size() >= ArchiveEntry::HEADER_SIZE && header.size() == ArchiveEntry::HEADER_SIZE + ArchiveEntry::pathLength(header.data())) {
+                if (begin() == -1)
+                    return -1;
+                header.clear();
+            }
+        }
+        return 0;
+    }
+
+private:
+    struct DirectoryTimes {
+        std::filesystem::path path;
+        uint32_t mode;
+        int64_t mtime;
+    };
+
+    std::filesystem::path root;
+    std::string header;         // of the next entry, received so far
+    ArchiveEntry current;       // file being written
+    std::filesystem::path target;
+    std::filesystem::path part;
+    std::ofstream output;
+    uint64_t left = 0;          // bytes of the file still to come
+    std::vector<DirectoryTimes> created;
+    bool ended = false;
+
+    int fail(std::string why) {
+        error = std::move(why);
+        return -1;
+    }
+
+    // Where an entry goes. Paths that would leave the root are refused, and so are the ones that lead through a
+    // symbolic link under it: every component in front of the last one that exists already must be a directory.
+    bool resolve(const std::string& path, std::filesystem::path& out) const {
+        out = root;
+        bool exists = true;     // out, the components in front of a missing one are missing as well
+        size_t start = 0;
+        while (start < path.size()) {
+            size_t end = path.find('/', start);
+            if (end == std::string::npos)
+                end = path.size();
+            const std::string component = path.substr(start, end - start);
+            if (component.empty() || component == "." || component == "..")
+                return false;
+#ifdef _WIN32
+            // Separators and drive letters of their own
+            if (component.find_first_of("\\:") != std::string::npos)
+                return false;
+#endif
+            if (start > 0 && exists) {
+                const std::filesystem::file_type type = typeOf(out);
+                exists = type != std::filesystem::file_type::not_found;
+                if (exists && type != std::filesystem::file_type::directory)
+                    return false;
+            }
+            out /= ArchiveEntry::fromUtf8(component);
+            start = end + 1;
+        }
+        return path.empty() || path.back() != '/';
+    }
+
+    // The type of the entry itself, a symbolic link isn't followed
+    static std::filesystem::file_type typeOf(const std::filesystem::path& path) {
+        std::error_code ec;
+        return std::filesystem::symlink_status(path, ec).type();
+    }
+
+    // Starts the entry whose header has been received
+    int begin() {
+        current = ArchiveEntry::decode(header.data());
+        current.path.assign(header, ArchiveEntry::HEADER_SIZE, std::string::npos);
+        if (current.type == ArchiveEntry::End) {
+            finishTree();
+            ended = true;
+            return 0;
+        }
+        if (!resolve(current.path, target))
+            return fail("The archive names an invalid path: " + current.path);
+
+        std::error_code ec;
+        if (current.type == ArchiveEntry::Directory) {
+            std::filesystem::create_directories(target, ec);
+            if (typeOf(target) != std::filesystem::file_type::directory)
+                return fail("Failed to create directory " + current.path);
+            created.push_back({target, current.mode, current.mtime});
+            directories++;
+            return 0;
+        }
+        if (current.type != ArchiveEntry::File || current.path.empty())
+            return fail("The archive holds an invalid entry");
+
+        std::filesystem::create_directories(target.parent_path(), ec);
+        part = target;
+        part += ".part";
+        // A link in place of the temporary file would be written through
+        if (typeOf(part) == std::filesystem::file_type::symlink)
+            std::filesystem::remove(part, ec);
+        output.open(part, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!output)
+            return fail("Failed to write file " + current.path);
+        left = current.size;
+        return left == 0 ? finishFile() : 0;
+    }
+
+    // The file is complete, it replaces the target with its permissions and time
+    int finishFile() {
+        output.close();
+        std::error_code ec;
+        if (!output) {
+            std::filesystem::remove(part, ec);
+            return fail("Failed to write file " + current.path);
+        }
+        std::filesystem::permissions(part, static_cast<std::filesystem::perms>(current.mode & 07777), ec);
+        std::filesystem::rename(part, target, ec);
+        if (ec) {
+            std::filesystem::remove(part, ec);
+            return fail("Failed to write file " + current.path);
+        }
+        std::filesystem::last_write_time(target, ArchiveEntry::fileTime(current.mtime), ec);
+        files++;
+        return 0;
+    }
+
+    // Subdirectories before the directories they are in, so setting their times doesn't change the outer ones
+    void finishTree() {
+        std::sort(created.begin(), created.end(), [](const DirectoryTimes& a, const DirectoryTimes& b) {
+            return a.path.native().size() > b.path.native().size();
+        });
+        std::error_code ec;
+        for (const DirectoryTimes& directory : created) {
+            std::filesystem::last_write_time(directory.path, ArchiveEntry::fileTime(directory.mtime), ec);
+            std::filesystem::permissions(directory.path, static_cast<std::filesystem::perms>(directory.mode & 07777), ec);
+        }
+    }
+};
+
+#endif //DATATRANSMISSION_TREE_ARCHIVE_H
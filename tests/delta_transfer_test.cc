@@ -0,0 +1,196 @@
+#include "catch2/catch.hpp"
+#include "delta_transfer.h"
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+
+namespace {
+    struct TempDir {
+        std::filesystem::path path;
+
+        TempDir() {
+            std::random_device random;
+            path = std::filesystem::temp_directory_path() / ("datatransmission-test-" + std::to_string(random()));
+            std::filesystem::create_directories(path);
+        }
+
+        ~TempDir() {
+            std::error_code ec;
+            std::filesystem::remove_all(path, ec);
+        }
+    };
+
+    std::string randomBytes(size_t size, unsigned seed) {
+        std::mt19937 random(seed);
+        std::string bytes(size, '\0');
+        for (char& byte : bytes)
+            byte = static_cast<char>(random());
+        return bytes;
+    }
+
+    void writeFile(const std::filesystem::path& path, const std::string& contents) {
+        std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        out.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+    }
+
+    // Sends `file` as a delta against the signature of `copy` in chunks of about `target` bytes and rebuilds it
+    struct DeltaRun {
+        std::string rebuilt;
+        uint64_t matched = 0;
+        uint64_t literal = 0;
+        uint64_t decoded = 0;
+        size_t chunks = 0;
+        bool failed = false;
+
+        DeltaRun(const std::filesystem::path& file, const std::filesystem::path& copy, size_t target) {
+            auto signature = std::make_shared<DeltaSignature>();
+            REQUIRE(signature->compute(copy));
+
+            std::ifstream in(file, std::ios::in | std::ios::binary);
+            DeltaEncoder encoder(signature, in);
+            DeltaDecoder decoder(copy);
+            std::ostringstream out;
+
+            int more = 1;
+            while (more == 1) {
+                std::string chunk;
+                more = encoder.next(chunk, target);
+                if (more == -1 || decoder.apply(chunk.data(), chunk.size(), out) == -1) {
+                    failed = true;
+                    break;
+                }
+                ++chunks;
+            }
+
+            rebuilt = out.str();
+            matched = encoder.matched;
+            literal = encoder.literal;
+            decoded = decoder.matched;
+        }
+    };
+}
+
+TEST_CASE("DeltaSignature survives an encode/decode round trip", "[delta]") {
+    REQUIRE(sodium_init() >= 0);
+    TempDir dir;
+    const std::filesystem::path copy = dir.path / "copy.bin";
+    writeFile(copy, randomBytes(100000, 1));
+
+    DeltaSignature signature;
+    REQUIRE(signature.compute(copy));
+    CHECK(signature.blockSize == DeltaSignature::blockSizeFor(100000));
+    CHECK(signature.blocks.size() == 100000 / signature.blockSize);
+
+    const std::string encoded = signature.encode();
+    CHECK(encoded.size() == DeltaSignature::HEADER_SIZE + signature.blocks.size() * DeltaSignature::BLOCK_SIZE);
+
+    DeltaSignature decoded;
+    REQUIRE(decoded.decode(encoded));
+    CHECK(decoded.blockSize == signature.blockSize);
+    REQUIRE(decoded.blocks.size() == signature.blocks.size());
+    for (size_t i = 0; i < decoded.blocks.size(); ++i) {
+        CHECK(decoded.blocks[i].weak == signature.blocks[i].weak);
+        CHECK(decoded.blocks[i].strong == signature.blocks[i].strong);
+    }
+}
+
+TEST_CASE("DeltaSignature refuses malformed signatures", "[delta]") {
+    DeltaSignature signature;
+    signature.blockSize = DeltaSignature::MIN_BLOCK;
+    signature.blocks.resize(3);
+    const std::string encoded = signature.encode();
+
+    DeltaSignature decoded;
+    CHECK_FALSE(decoded.decode(encoded.substr(0, 4)));
+    CHECK_FALSE(decoded.decode(encoded.substr(0, encoded.size() - 1)));
+    CHECK_FALSE(decoded.decode(encoded + "x"));
+
+    std::string small = encoded;
+    DeltaSignature::putU32(small.data(), DeltaSignature::MIN_BLOCK - 1);
+    CHECK_FALSE(decoded.decode(small));
+
+    std::string large = encoded;
+    DeltaSignature::putU32(large.data(), FRAME_CHUNK_MAX + 1);
+    CHECK_FALSE(decoded.decode(large));
+}
+
+TEST_CASE("DeltaSignature of a file that doesn't exist is empty", "[delta]") {
+    TempDir dir;
+    DeltaSignature signature;
+    CHECK(signature.compute(dir.path / "missing.bin"));
+    CHECK(signature.blocks.empty());
+}
+
+TEST_CASE("DeltaEncoder and DeltaDecoder rebuild a modified file", "[delta]") {
+    REQUIRE(sodium_init() >= 0);
+    TempDir dir;
+    const std::filesystem::path copy = dir.path / "copy.bin";
+    const std::filesystem::path file = dir.path / "file.bin";
+
+    const std::string old = randomBytes(400000, 2);
+    std::string changed = old.substr(0, 50000)
+        + "inserted in front of the second block" + old.substr(50000, 100000)   // insertion
+        + old.substr(170000, 130000)                                            // 20000 bytes deleted
+        + randomBytes(3000, 3)                                                  // replaced
+        + old.substr(303000, 90000)
+        + "short tail";                                                         // shorter than a block
+    writeFile(copy, old);
+    writeFile(file, changed);
+
+    for (size_t target : {size_t{4096}, size_t{64 * 1024}, size_t{1 << 20}}) {
+        DeltaRun run(file, copy, target);
+        REQUIRE_FALSE(run.failed);
+        CHECK(run.rebuilt == changed);
+        CHECK(run.matched > 0);
+        CHECK(run.decoded == run.matched);
+        CHECK(run.matched + run.literal == changed.size());
+        // Only the changes and the blocks they touch go as literals
+        CHECK(run.literal < changed.size() / 10);
+    }
+}
+
+TEST_CASE("DeltaEncoder sends everything as literals without a copy", "[delta]") {
+    REQUIRE(sodium_init() >= 0);
+    TempDir dir;
+    const std::filesystem::path file = dir.path / "file.bin";
+    const std::string contents = randomBytes(DeltaEncoder::MAX_LITERAL + 12345, 4);
+    writeFile(file, contents);
+
+    DeltaRun run(file, dir.path / "missing.bin", 64 * 1024);
+    REQUIRE_FALSE(run.failed);
+    CHECK(run.rebuilt == contents);
+    CHECK(run.matched == 0);
+    CHECK(run.literal == contents.size());
+    CHECK(run.chunks > 1);
+}
+
+TEST_CASE("DeltaDecoder refuses malformed instructions", "[delta]") {
+    TempDir dir;
+    const std::filesystem::path copy = dir.path / "copy.bin";
+    writeFile(copy, std::string(100, 'c'));
+    DeltaDecoder decoder(copy);
+    std::ostringstream out;
+
+    const char truncatedLiteral[] = {0, 10, 0, 0, 0, 'a', 'b'};
+    CHECK(decoder.apply(truncatedLiteral, sizeof(truncatedLiteral), out) == -1);
+
+    const char unknown[] = {7, 0, 0, 0, 0};
+    CHECK(decoder.apply(unknown, sizeof(unknown), out) == -1);
+
+    // Bytes the copy doesn't have
+    char copyPastEnd[17] = {1};
+    encodeSize(copyPastEnd + 1, 90);
+    encodeSize(copyPastEnd + 9, 20);
+    CHECK(decoder.apply(copyPastEnd, sizeof(copyPastEnd), out) == -1);
+
+    char copyInside[17] = {1};
+    encodeSize(copyInside + 1, 90);
+    encodeSize(copyInside + 9, 10);
+    std::ostringstream rebuilt;
+    CHECK(decoder.apply(copyInside, sizeof(copyInside), rebuilt) == 10);
+    CHECK(rebuilt.str() == std::string(10, 'c'));
+}
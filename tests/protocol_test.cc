@@ -0,0 +1,77 @@
+#include "catch2/catch.hpp"
+#include "protocol.h"
+
+#include <string>
+
+TEST_CASE("FrameHeader survives an encode/decode round trip", "[protocol]") {
+    FrameHeader header;
+    header.type = FrameType::File;
+    header.flags = FRAME_COMPRESSED | FRAME_MORE | codecFlags(2);
+    header.length = 0xdeadbeef;
+
+    std::string encoded = header.encode();
+    REQUIRE(encoded.size() == FRAME_HEADER_SIZE);
+
+    FrameHeader decoded;
+    REQUIRE(decoded.decode(encoded.data()));
+    CHECK(decoded.type == header.type);
+    CHECK(decoded.flags == header.flags);
+    CHECK(decoded.length == header.length);
+}
+
+TEST_CASE("FrameHeader is laid out little-endian", "[protocol]") {
+    FrameHeader header{FrameType::Signature, 0x0102, 0x03040506};
+
+    char out[FRAME_HEADER_SIZE];
+    header.encode(out);
+
+    const unsigned char expected[FRAME_HEADER_SIZE] = {FRAME_VERSION, 5, 0x02, 0x01, 0x06, 0x05, 0x04, 0x03};
+    for (size_t i = 0; i < FRAME_HEADER_SIZE; ++i)
+        CHECK(static_cast<unsigned char>(out[i]) == expected[i]);
+}
+
+TEST_CASE("FrameHeader keeps the largest length", "[protocol]") {
+    FrameHeader header{FrameType::Command, 0xffff, FRAME_MAX_LENGTH};
+
+    FrameHeader decoded;
+    REQUIRE(decoded.decode(header.encode().data()));
+    CHECK(decoded.length == FRAME_MAX_LENGTH);
+    CHECK(decoded.flags == 0xffff);
+}
+
+TEST_CASE("FrameHeader rejects other versions", "[protocol]") {
+    std::string encoded = FrameHeader{FrameType::Command, 0, 4}.encode();
+
+    for (int version : {0, FRAME_VERSION + 1, 0xff}) {
+        encoded[0] = static_cast<char>(version);
+        FrameHeader decoded;
+        CHECK_FALSE(decoded.decode(encoded.data()));
+    }
+}
+
+TEST_CASE("Codec ids are packed into the flags", "[protocol]") {
+    for (uint8_t codec = 0; codec < 4; ++codec) {
+        const uint16_t flags = FRAME_COMPRESSED | FRAME_MORE | FRAME_DELTA | codecFlags(codec);
+        CHECK(frameCodec(flags) == codec);
+        CHECK((flags & FRAME_COMPRESSED));
+        CHECK((flags & FRAME_MORE));
+        CHECK((flags & FRAME_DELTA));
+        CHECK_FALSE((flags & (FRAME_ABORTED | FRAME_SIZE)));
+    }
+
+    // Ids that don't fit the codec bits never spill into the other flags
+    CHECK((codecFlags(0xff) & ~FRAME_CODEC) == 0);
+    CHECK(frameCodec(0) == 0);
+}
+
+TEST_CASE("Sizes are encoded as little-endian uint64", "[protocol]") {
+    char out[8];
+    for (uint64_t size : {uint64_t{0}, uint64_t{1}, uint64_t{0x0102030405060708}, UINT64_MAX}) {
+        encodeSize(out, size);
+        CHECK(decodeSize(out) == size);
+    }
+
+    encodeSize(out, 0x0102030405060708);
+    CHECK(static_cast<unsigned char>(out[0]) == 0x08);
+    CHECK(static_cast<unsigned char>(out[7]) == 0x01);
+}
@@ -0,0 +1,116 @@
+#include "catch2/catch.hpp"
+#include "range_transfer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace {
+
+// The ranges cover [0, size) without gaps or overlaps
+bool tiles(const std::vector<ByteRange>& ranges, uint64_t size) {
+    uint64_t offset = 0;
+    for (const ByteRange& range : ranges) {
+        if (range.offset != offset)
+            return false;
+        offset = range.end();
+    }
+    return offset == size;
+}
+
+}
+
+TEST_CASE("RangeSet::split tiles the file", "[ranges]") {
+    SECTION("an empty file is a single empty range") {
+        const auto ranges = RangeSet::split(0, 4);
+        REQUIRE(ranges.size() == 1);
+        CHECK(ranges[0].offset == 0);
+        CHECK(ranges[0].length == 0);
+    }
+
+    SECTION("a small file is a single range") {
+        const auto ranges = RangeSet::split(1000, 4);
+        REQUIRE(ranges.size() == 1);
+        CHECK(ranges[0].length == 1000);
+    }
+
+    SECTION("ranges are never smaller than MIN_RANGE but the last") {
+        const uint64_t size = 3 * RangeSet::MIN_RANGE + 5;
+        const auto ranges = RangeSet::split(size, 8);
+        REQUIRE(ranges.size() == 4);
+        CHECK(tiles(ranges, size));
+        for (size_t i = 0; i + 1 < ranges.size(); ++i)
+            CHECK(ranges[i].length == RangeSet::MIN_RANGE);
+        CHECK(ranges.back().length == 5);
+    }
+
+    SECTION("a large file is a few ranges per connection") {
+        const uint64_t size = 64 * RangeSet::MIN_RANGE + 1;
+        for (unsigned connections : {0u, 1u, 3u, 4u}) {
+            const auto ranges = RangeSet::split(size, connections);
+            CHECK(tiles(ranges, size));
+            CHECK(ranges.size() <= std::max(connections, 1u) * RangeSet::RANGES_PER_CONNECTION);
+        }
+    }
+}
+
+TEST_CASE("RangeSet merges the ranges that have arrived", "[ranges]") {
+    RangeSet set;
+
+    SECTION("nothing covers only an empty file") {
+        CHECK(set.covers(0));
+        CHECK_FALSE(set.covers(1));
+        set.add({5, 0});
+        CHECK_FALSE(set.covers(1));
+    }
+
+    SECTION("touching ranges out of order") {
+        set.add({20, 10});
+        set.add({0, 10});
+        CHECK_FALSE(set.covers(30));
+        set.add({10, 10});
+        CHECK(set.covers(30));
+        CHECK_FALSE(set.covers(31));
+    }
+
+    SECTION("overlapping ranges") {
+        set.add({0, 15});
+        set.add({10, 15});
+        CHECK(set.covers(25));
+        set.add({5, 5});
+        CHECK(set.covers(25));
+        CHECK_FALSE(set.covers(26));
+    }
+
+    SECTION("a range that spans several others") {
+        set.add({10, 5});
+        set.add({30, 5});
+        set.add({50, 5});
+        CHECK_FALSE(set.covers(55));
+        set.add({0, 60});
+        CHECK(set.covers(60));
+    }
+
+    SECTION("a gap at the start is not covered") {
+        set.add({1, 99});
+        CHECK_FALSE(set.covers(100));
+        set.add({0, 1});
+        CHECK(set.covers(100));
+    }
+
+    SECTION("a split file arrives in any order") {
+        const uint64_t size = 10 * RangeSet::MIN_RANGE + 3;
+        auto ranges = RangeSet::split(size, 2);
+        for (size_t i = ranges.size(); i-- > 1;)
+            set.add(ranges[i]);
+        CHECK_FALSE(set.covers(size));
+        set.add(ranges[0]);
+        CHECK(set.covers(size));
+    }
+
+    SECTION("clear forgets everything") {
+        set.add({0, 10});
+        set.clear();
+        CHECK_FALSE(set.covers(10));
+    }
+}
@@ -0,0 +1,103 @@
+#include "catch2/catch.hpp"
+#include "recv_buffer.h"
+
+#include <cstring>
+#include <string>
+
+namespace {
+    // Receives `bytes` as the event loop does: into the room prepare() made
+    void receive(RecvBuffer& buffer, const std::string& bytes) {
+        char* space = buffer.prepare(bytes.size());
+        REQUIRE(buffer.spaceSize() >= bytes.size());
+        memcpy(space, bytes.data(), bytes.size());
+        buffer.commit(bytes.size());
+    }
+
+    std::string unread(RecvBuffer& buffer) {
+        return std::string(buffer.data(), buffer.size());
+    }
+}
+
+TEST_CASE("RecvBuffer allocates on the first prepare and grows for larger receives", "[recv_buffer]") {
+    RecvBuffer buffer;
+    CHECK(buffer.empty());
+    CHECK(buffer.spaceSize() == 0);
+
+    buffer.prepare(100);
+    CHECK(buffer.spaceSize() == RecvBuffer::MIN_CAPACITY - 1);
+
+    receive(buffer, std::string(100, 'a'));
+    receive(buffer, std::string(3 * RecvBuffer::MIN_CAPACITY, 'b'));
+    CHECK(buffer.size() == 100 + 3 * RecvBuffer::MIN_CAPACITY);
+    CHECK(unread(buffer) == std::string(100, 'a') + std::string(3 * RecvBuffer::MIN_CAPACITY, 'b'));
+}
+
+TEST_CASE("RecvBuffer makes room for the whole frame announced by expect", "[recv_buffer]") {
+    RecvBuffer buffer;
+    receive(buffer, "header");
+
+    const size_t frame = 10 * RecvBuffer::MIN_CAPACITY;
+    buffer.expect(frame);
+    buffer.prepare(1);
+    CHECK(buffer.size() + buffer.spaceSize() >= frame);
+    CHECK(unread(buffer) == "header");
+}
+
+TEST_CASE("RecvBuffer moves the unread bytes to the front when the tail runs out of room", "[recv_buffer]") {
+    RecvBuffer buffer;
+    const size_t capacity = RecvBuffer::MIN_CAPACITY;
+
+    receive(buffer, std::string(capacity - 1 - 10, 'x') + std::string(10, 'y'));
+    buffer.consume(capacity - 1 - 10);
+    CHECK(unread(buffer) == std::string(10, 'y'));
+
+    // Fits the allocation once the ten bytes are at the front, so it is compacted rather than grown
+    char* space = buffer.prepare(1000);
+    CHECK(buffer.data() + 10 == space);
+    CHECK(buffer.size() + buffer.spaceSize() == capacity - 1);
+    CHECK(unread(buffer) == std::string(10, 'y'));
+}
+
+TEST_CASE("RecvBuffer gives a large allocation back once the frame has been consumed", "[recv_buffer]") {
+    RecvBuffer buffer;
+    const size_t frame = 4 << 20;
+
+    receive(buffer, "hd");
+    buffer.expect(frame);
+    receive(buffer, std::string(frame - 2, 'z'));
+    REQUIRE(buffer.size() == frame);
+    CHECK(buffer.spaceSize() >= 1);
+
+    buffer.consume(frame);
+    CHECK(buffer.empty());
+
+    buffer.prepare(100);
+    CHECK(buffer.spaceSize() == RecvBuffer::MIN_CAPACITY - 1);
+}
+
+TEST_CASE("RecvBuffer keeps the room it prepared in place while frames are consumed", "[recv_buffer]") {
+    RecvBuffer buffer;
+    receive(buffer, "first frame");
+
+    // A receive request is in flight at `space` when the decoder consumes everything before it
+    char* space = buffer.prepare(64);
+    char* const data = buffer.data();
+    buffer.consume(5);
+    buffer.consume(buffer.size());
+    CHECK(buffer.empty());
+    CHECK(buffer.space() == space);
+
+    memcpy(space, "second", 6);
+    buffer.commit(6);
+    CHECK(unread(buffer) == "second");
+    CHECK(buffer.data() == data + 11);
+
+    // clear() leaves the room where it is as well
+    space = buffer.prepare(64);
+    buffer.clear();
+    CHECK(buffer.space() == space);
+
+    // The next prepare moves the write position back to the front
+    buffer.prepare(64);
+    CHECK(buffer.data() == data);
+}
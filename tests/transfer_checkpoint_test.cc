@@ -0,0 +1,158 @@
+#include "catch2/catch.hpp"
+#include "transfer_checkpoint.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+
+namespace {
+    // A directory of its own under the temporary directory, removed with everything in it
+    struct TempDir {
+        std::filesystem::path path;
+
+        TempDir() {
+            std::random_device random;
+            path = std::filesystem::temp_directory_path() / ("datatransmission-test-" + std::to_string(random()));
+            std::filesystem::create_directories(path);
+        }
+
+        ~TempDir() {
+            std::error_code ec;
+            std::filesystem::remove_all(path, ec);
+        }
+    };
+
+    std::string randomBytes(size_t size, unsigned seed) {
+        std::mt19937 random(seed);
+        std::string bytes(size, '\0');
+        for (char& byte : bytes)
+            byte = static_cast<char>(random());
+        return bytes;
+    }
+
+    void writeFile(const std::filesystem::path& path, const std::string& contents) {
+        std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        out.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+    }
+
+    uint32_t checksumOf(const char* data, size_t size) {
+        RollingChecksum sum;
+        sum.update(data, size);
+        return sum.value();
+    }
+}
+
+TEST_CASE("RollingChecksum computes Adler-32", "[checkpoint]") {
+    CHECK(checksumOf("", 0) == 1);
+    CHECK(checksumOf("Wikipedia", 9) == 0x11E60398);
+
+    // Long runs of large bytes make the sums wrap, updating in pieces gives the same result
+    const std::string bytes = std::string(20000, '\xff') + randomBytes(20000, 1);
+    RollingChecksum pieces;
+    for (size_t offset = 0; offset < bytes.size(); offset += 777)
+        pieces.update(bytes.data() + offset, std::min<size_t>(777, bytes.size() - offset));
+    CHECK(pieces.value() == checksumOf(bytes.data(), bytes.size()));
+    CHECK(pieces.size() == bytes.size());
+}
+
+TEST_CASE("RollingChecksum::roll matches the checksum of the window at every offset", "[checkpoint]") {
+    const std::string bytes = randomBytes(12000, 2) + std::string(7000, '\xff') + std::string(3000, '\0') + randomBytes(3000, 3);
+
+    for (size_t window : {size_t{1}, size_t{16}, size_t{5552}, size_t{6000}}) {
+        RollingChecksum sum;
+        sum.update(bytes.data(), window);
+
+        bool matches = true;
+        for (size_t offset = 1; offset + window <= bytes.size(); ++offset) {
+            sum.roll(static_cast<unsigned char>(bytes[offset - 1]), static_cast<unsigned char>(bytes[offset + window - 1]));
+            if (sum.value() != checksumOf(bytes.data() + offset, window)) {
+                matches = false;
+                FAIL_CHECK("window " << window << " differs at offset " << offset);
+                break;
+            }
+        }
+        CHECK(matches);
+        CHECK(sum.size() == window);
+    }
+}
+
+TEST_CASE("TransferCheckpoint is saved next to the temporary file and loaded back", "[checkpoint]") {
+    TempDir dir;
+    const std::filesystem::path part = dir.path / "file.bin.part";
+    CHECK(TransferCheckpoint::fileOf(part) == dir.path / "file.bin.part.resume");
+
+    TransferCheckpoint missing;
+    CHECK_FALSE(missing.load(part));
+
+    TransferCheckpoint checkpoint{0xfedcba9876543210ull, 5ull << 32};
+    REQUIRE(checkpoint.save(part));
+    CHECK_FALSE(std::filesystem::exists(TransferCheckpoint::fileOf(part).string() + ".tmp"));
+
+    TransferCheckpoint loaded;
+    REQUIRE(loaded.load(part));
+    CHECK(loaded.id == checkpoint.id);
+    CHECK(loaded.offset == checkpoint.offset);
+
+    // A later checkpoint replaces the earlier one
+    checkpoint.offset += TransferCheckpoint::INTERVAL;
+    REQUIRE(checkpoint.save(part));
+    REQUIRE(loaded.load(part));
+    CHECK(loaded.offset == checkpoint.offset);
+
+    TransferCheckpoint::remove(part);
+    CHECK_FALSE(std::filesystem::exists(TransferCheckpoint::fileOf(part)));
+    CHECK_FALSE(loaded.load(part));
+}
+
+TEST_CASE("TransferCheckpoint refuses checkpoints that can't be parsed", "[checkpoint]") {
+    TempDir dir;
+    const std::filesystem::path part = dir.path / "file.bin.part";
+    TransferCheckpoint loaded;
+
+    writeFile(TransferCheckpoint::fileOf(part), "not a checkpoint\n");
+    CHECK_FALSE(loaded.load(part));
+
+    writeFile(TransferCheckpoint::fileOf(part), "0 100\n");
+    CHECK_FALSE(loaded.load(part));
+}
+
+TEST_CASE("TransferCheckpoint::idOf changes with the file", "[checkpoint]") {
+    TempDir dir;
+    const std::filesystem::path file = dir.path / "source.bin";
+    CHECK(TransferCheckpoint::idOf(file) == 0);
+
+    writeFile(file, "contents");
+    const uint64_t id = TransferCheckpoint::idOf(file);
+    CHECK(id != 0);
+    CHECK(TransferCheckpoint::idOf(file) == id);
+
+    writeFile(file, "longer contents");
+    std::filesystem::last_write_time(file, std::filesystem::last_write_time(file) + std::chrono::seconds(10));
+    CHECK(TransferCheckpoint::idOf(file) != id);
+}
+
+TEST_CASE("TransferCheckpoint::windowChecksum covers the WINDOW bytes in front of the offset", "[checkpoint]") {
+    TempDir dir;
+    const std::filesystem::path file = dir.path / "window.bin";
+    const std::string bytes = randomBytes(TransferCheckpoint::WINDOW + 4096, 4);
+    writeFile(file, bytes);
+
+    uint32_t checksum = 0;
+    REQUIRE(TransferCheckpoint::windowChecksum(file, 0, checksum));
+    CHECK(checksum == 1);
+
+    // Offsets closer to the start than WINDOW take everything in front of them
+    REQUIRE(TransferCheckpoint::windowChecksum(file, 1000, checksum));
+    CHECK(checksum == checksumOf(bytes.data(), 1000));
+
+    REQUIRE(TransferCheckpoint::windowChecksum(file, bytes.size(), checksum));
+    CHECK(checksum == checksumOf(bytes.data() + 4096, TransferCheckpoint::WINDOW));
+
+    REQUIRE(TransferCheckpoint::windowChecksum(file, TransferCheckpoint::WINDOW + 100, checksum));
+    CHECK(checksum == checksumOf(bytes.data() + 100, TransferCheckpoint::WINDOW));
+
+    CHECK_FALSE(TransferCheckpoint::windowChecksum(file, bytes.size() + 1, checksum));
+    CHECK_FALSE(TransferCheckpoint::windowChecksum(dir.path / "missing.bin", 10, checksum));
+}
@@ -0,0 +1,158 @@
+#include "catch2/catch.hpp"
+#include "transfer_pipeline.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST_CASE("SpscQueue rounds its capacity up and keeps the order", "[pipeline]") {
+    SpscQueue<int> queue(3);
+
+    for (int i = 0; i < 4; ++i)
+        REQUIRE(queue.push(i));
+    CHECK_FALSE(queue.push(4));
+    CHECK(queue.size() == 4);
+    CHECK(*queue.front() == 0);
+
+    int value = -1;
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(queue.pop(value));
+        CHECK(value == i);
+    }
+    CHECK_FALSE(queue.pop(value));
+    CHECK(queue.front() == nullptr);
+    CHECK(queue.empty());
+}
+
+TEST_CASE("SpscQueue hands values from one thread to another in order", "[pipeline]") {
+    constexpr int COUNT = 200000;
+    SpscQueue<int> queue(16);
+
+    std::thread producer([&queue] {
+        for (int i = 0; i < COUNT; ++i)
+            while (!queue.push(i))
+                std::this_thread::yield();
+    });
+
+    int expected = 0;
+    bool ordered = true;
+    while (expected < COUNT) {
+        int value;
+        if (!queue.pop(value)) {
+            std::this_thread::yield();
+            continue;
+        }
+        ordered = ordered && value == expected;
+        ++expected;
+    }
+    producer.join();
+
+    CHECK(ordered);
+    CHECK(queue.empty());
+}
+
+TEST_CASE("BufferPool keeps buffers for reuse up to its limits", "[pipeline]") {
+    constexpr size_t SIZE = 1000;
+    BufferPool pool;
+    CHECK(pool.take().capacity() < SIZE);
+
+    std::string buffer(SIZE, 'x');
+    const size_t capacity = buffer.capacity();
+    pool.give(std::move(buffer));
+
+    std::string reused = pool.take();
+    CHECK(reused.empty());
+    CHECK(reused.capacity() == capacity);
+
+    // Oversized buffers are freed
+    pool.give(std::string(BufferPool::MAX_CAPACITY + 1, 'y'));
+    CHECK(pool.take().capacity() < SIZE);
+
+    for (size_t i = 0; i < BufferPool::MAX_BUFFERS + 4; ++i)
+        pool.give(std::string(SIZE, 'z'));
+    for (size_t i = 0; i < BufferPool::MAX_BUFFERS; ++i)
+        CHECK(pool.take().capacity() >= SIZE);
+    CHECK(pool.take().capacity() < SIZE);
+}
+
+namespace {
+    // Runs chunks 0 .. count-1 through a pipeline. The codec wraps each chunk in brackets, on several threads at once
+    // and taking longer for some chunks than others. The sink cancels the transfer after cancelAfter chunks.
+    struct Transfer {
+        size_t count;
+        size_t cancelAfter;
+        std::atomic<size_t> read = 0;
+        std::vector<std::string> received;
+
+        StageThreads source{1};
+        StageThreads codec{4};
+        StageThreads sink{1};
+        std::shared_ptr<TransferPipeline> pipeline = std::make_shared<TransferPipeline>(TransferPipeline::depthFor(4));
+
+        Transfer(size_t count, size_t cancelAfter) : count(count), cancelAfter(cancelAfter) {
+            pipeline->setStage(TransferPipeline::SOURCE, source.executor(), [this](TransferPipeline& pipeline) {
+                while (read < this->count) {
+                    TransferPipeline::Chunk* chunk = pipeline.acquire();
+                    if (chunk == nullptr)
+                        return;
+                    chunk->raw = std::to_string(read);
+                    chunk->last = read + 1 == this->count;
+                    ++read;
+                    pipeline.submit(chunk);
+                }
+            });
+
+            pipeline->setParallelCodec(codec.executor(), [](TransferPipeline::Chunk& chunk) {
+                if (chunk.raw.back() % 3 == 0)
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                chunk.packed = "[" + chunk.raw + "]";
+            });
+
+            pipeline->setStage(TransferPipeline::SINK, sink.executor(), [this](TransferPipeline& pipeline) {
+                while (TransferPipeline::Chunk* chunk = pipeline.nextToSink()) {
+                    received.push_back(chunk->packed);
+                    const bool last = chunk->last;
+                    pipeline.release();
+                    if (last || received.size() == this->cancelAfter) {
+                        if (!last)
+                            pipeline.cancel();
+                        pipeline.finish();
+                        return;
+                    }
+                }
+            });
+        }
+    };
+}
+
+TEST_CASE("TransferPipeline delivers the chunks of a parallel codec in order", "[pipeline]") {
+    constexpr size_t COUNT = 2000;
+    Transfer transfer(COUNT, 0);
+
+    transfer.pipeline->start();
+    transfer.pipeline->wait();
+
+    REQUIRE(transfer.received.size() == COUNT);
+    for (size_t i = 0; i < COUNT; ++i)
+        REQUIRE(transfer.received[i] == "[" + std::to_string(i) + "]");
+}
+
+TEST_CASE("TransferPipeline stops every stage once it is cancelled", "[pipeline]") {
+    constexpr size_t COUNT = 2000;
+    constexpr size_t CANCEL_AFTER = 100;
+    Transfer transfer(COUNT, CANCEL_AFTER);
+
+    transfer.pipeline->start();
+    transfer.pipeline->wait();
+    CHECK(transfer.pipeline->cancelled());
+
+    // Chunks of a cancelled pipeline don't come back, so the source can't read on
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(transfer.read <= CANCEL_AFTER + TransferPipeline::depthFor(4));
+    REQUIRE(transfer.received.size() == CANCEL_AFTER);
+    for (size_t i = 0; i < CANCEL_AFTER; ++i)
+        CHECK(transfer.received[i] == "[" + std::to_string(i) + "]");
+}
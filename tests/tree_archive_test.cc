@@ -0,0 +1,184 @@
+#include "catch2/catch.hpp"
+#include "tree_archive.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+
+namespace {
+    struct TempDir {
+        std::filesystem::path path;
+
+        TempDir() {
+            std::random_device random;
+            path = std::filesystem::temp_directory_path() / ("datatransmission-test-" + std::to_string(random()));
+            std::filesystem::create_directories(path);
+        }
+
+        ~TempDir() {
+            std::error_code ec;
+            std::filesystem::remove_all(path, ec);
+        }
+    };
+
+    std::string randomBytes(size_t size, unsigned seed) {
+        std::mt19937 random(seed);
+        std::string bytes(size, '\0');
+        for (char& byte : bytes)
+            byte = static_cast<char>(random());
+        return bytes;
+    }
+
+    void writeFile(const std::filesystem::path& path, const std::string& contents) {
+        std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        out.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+    }
+
+    std::string readFile(const std::filesystem::path& path) {
+        std::ifstream in(path, std::ios::in | std::ios::binary);
+        return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    }
+
+    // The whole archive of a tree, taken in chunks of `target` bytes
+    std::string archiveOf(const std::filesystem::path& root, size_t target) {
+        ArchiveWriter writer(root, 3);
+        std::string archive;
+        int more = 1;
+        while (more == 1) {
+            std::string chunk;
+            more = writer.next(chunk, target);
+            REQUIRE(more != -1);
+            REQUIRE(chunk.size() <= target);
+            archive += chunk;
+        }
+        return archive;
+    }
+
+    // Extracts an archive in pieces of `piece` bytes, so the headers are split across them
+    int extract(ArchiveExtractor& extractor, const std::string& archive, size_t piece) {
+        for (size_t offset = 0; offset < archive.size(); offset += piece) {
+            if (extractor.apply(archive.data() + offset, std::min(piece, archive.size() - offset)) == -1)
+                return -1;
+        }
+        return 0;
+    }
+
+    std::string entry(ArchiveEntry::Type type, const std::string& path, const std::string& contents = "") {
+        ArchiveEntry entry;
+        entry.type = type;
+        entry.path = path;
+        entry.mode = type == ArchiveEntry::Directory ? 0755 : 0644;
+        entry.size = contents.size();
+        std::string out;
+        entry.encode(out);
+        return out + contents;
+    }
+
+    std::string end() {
+        std::string out;
+        ArchiveEntry{}.encode(out);
+        return out;
+    }
+}
+
+TEST_CASE("A tree survives the archive whatever the chunks", "[archive]") {
+    TempDir source;
+    std::filesystem::create_directories(source.path / "a" / "b" / "c");
+    std::filesystem::create_directories(source.path / "empty");
+    writeFile(source.path / "top.txt", "top");
+    writeFile(source.path / "nothing", "");
+    writeFile(source.path / "a" / "small.bin", randomBytes(1000, 1));
+    writeFile(source.path / "a" / "b" / "none", "");
+    writeFile(source.path / "a" / "b" / "c" / "large.bin", randomBytes(3 * TreeWalker::PREFETCH_MAX + 17, 2));
+
+    for (size_t target : {size_t(1000), size_t(1) << 20}) {
+        const std::string archive = archiveOf(source.path, target);
+        for (size_t piece : {size_t(1), size_t(7), ArchiveEntry::HEADER_SIZE + 1, size_t(4096), archive.size()}) {
+            TempDir copy;
+            ArchiveExtractor extractor(copy.path / "tree");
+            REQUIRE(extract(extractor, archive, piece) == 0);
+            INFO("target " << target << ", piece " << piece << ": " << extractor.error);
+            CHECK(extractor.finished());
+            CHECK(extractor.files == 5);
+            CHECK(extractor.directories == 5);     // and the root
+
+            for (const auto& it : std::filesystem::recursive_directory_iterator(source.path)) {
+                const std::filesystem::path relative = std::filesystem::relative(it.path(), source.path);
+                const std::filesystem::path extracted = copy.path / "tree" / relative;
+                if (it.is_directory())
+                    CHECK(std::filesystem::is_directory(extracted));
+                else {
+                    REQUIRE(std::filesystem::is_regular_file(extracted));
+                    CHECK(readFile(extracted) == readFile(it.path()));
+                }
+            }
+            CHECK(std::filesystem::file_size(copy.path / "tree" / "nothing") == 0);
+            CHECK(std::filesystem::file_size(copy.path / "tree" / "a" / "b" / "none") == 0);
+            CHECK_FALSE(std::filesystem::exists(copy.path / "tree" / "nothing.part"));
+        }
+    }
+}
+
+TEST_CASE("ArchiveExtractor refuses paths that leave the root", "[archive]") {
+    TempDir copy;
+    const std::filesystem::path root = copy.path / "tree";
+    std::filesystem::create_directories(root);
+
+    for (const char* path : {"..", "../escape", "a/../../escape", "a//b", "/escape", "a/", "./a", "a/."}) {
+        for (ArchiveEntry::Type type : {ArchiveEntry::Directory, ArchiveEntry::File}) {
+            INFO(path);
+            ArchiveExtractor extractor(root);
+            CHECK(extractor.apply(entry(type, path, "x").data(), entry(type, path, "x").size()) == -1);
+            CHECK_FALSE(extractor.error.empty());
+            CHECK_FALSE(extractor.finished());
+        }
+    }
+    CHECK_FALSE(std::filesystem::exists(copy.path / "escape"));
+    CHECK(std::filesystem::is_empty(root));
+}
+
+TEST_CASE("ArchiveExtractor doesn't write through symbolic links", "[archive]") {
+    TempDir copy;
+    const std::filesystem::path root = copy.path / "tree";
+    const std::filesystem::path outside = copy.path / "outside";
+    std::filesystem::create_directories(root / "real");
+    std::filesystem::create_directories(outside);
+    std::filesystem::create_directory_symlink(outside, root / "link");
+    std::filesystem::create_directory_symlink(outside, root / "real" / "link");
+
+    SECTION("a directory on the way") {
+        for (const char* path : {"link/file", "real/link/file", "link/sub/file"}) {
+            INFO(path);
+            ArchiveExtractor extractor(root);
+            const std::string archive = entry(ArchiveEntry::File, path, "contents") + end();
+            CHECK(extractor.apply(archive.data(), archive.size()) == -1);
+        }
+        CHECK(std::filesystem::is_empty(outside));
+    }
+
+    SECTION("a directory entry") {
+        ArchiveExtractor extractor(root);
+        const std::string archive = entry(ArchiveEntry::Directory, "link") + end();
+        CHECK(extractor.apply(archive.data(), archive.size()) == -1);
+    }
+
+    SECTION("the temporary file of a file") {
+        writeFile(outside / "victim", "untouched");
+        std::filesystem::create_symlink(outside / "victim", root / "file.part");
+        ArchiveExtractor extractor(root);
+        const std::string archive = entry(ArchiveEntry::File, "file", "contents") + end();
+        CHECK(extractor.apply(archive.data(), archive.size()) == 0);
+        CHECK(extractor.finished());
+        CHECK(readFile(outside / "victim") == "untouched");
+        CHECK(readFile(root / "file") == "contents");
+    }
+
+    SECTION("real directories that exist already") {
+        ArchiveExtractor extractor(root);
+        const std::string archive = entry(ArchiveEntry::Directory, "real") + entry(ArchiveEntry::File, "real/new/file", "x") + end();
+        CHECK(extractor.apply(archive.data(), archive.size()) == 0);
+        CHECK(readFile(root / "real" / "new" / "file") == "x");
+    }
+}